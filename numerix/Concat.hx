@@ -4,19 +4,46 @@ class Concat extends Layer
 {
    static var concatId = 0;
 
+   // Convolutions or reorgs run by this layer, in place of the inputs they were fed by
+   public var fusedInputs(default,null):Array<Layer>;
+
    public function new(config:Dynamic, input0:Layer,input1:Layer)
    {
       super(config,input0,input1);
       if (name==null)
          name = "concat_" + (concatId++);
 
+      fusedInputs = [null, null];
       handle = layCreateConcat();
    }
 
    override public function setActivation(inActication:Int)
    {
-      for( i in inputs)
-         i.setActivation(inActication);
+      for(i in 0...inputs.length)
+         if (fusedInputs[i]!=null)
+            fusedInputs[i].setActivation(inActication);
+         else
+            inputs[i].setActivation(inActication);
+   }
+
+   // Run the layer making input 'index' from its own input, writing its result straight
+   //  into a slice of this one.  The layers are relinked by the caller (see Model.optimizeLayers).
+   public function fuseInput(index:Int, layer:Layer) : Bool
+   {
+      if (!layConcatSetFusedInput(handle, index, layer.handle))
+         return false;
+      fusedInputs[index] = layer;
+      if (Std.is(layer,Conv2D))
+         (cast layer:Conv2D).setFusedInto(this);
+      return true;
+   }
+
+   // After a fused convolution gets a new handle
+   public function updateFusedInputs()
+   {
+      for(i in 0...fusedInputs.length)
+         if (fusedInputs[i]!=null)
+            layConcatSetFusedInput(handle, i, fusedInputs[i].handle);
    }
 
 
@@ -38,6 +65,7 @@ class Concat extends Layer
    override public function toString() return 'Concat($name)';
 
    static var layCreateConcat = Loader.load("layCreateConcat","o");
+   static var layConcatSetFusedInput = Loader.load("layConcatSetFusedInput","oiob");
 
 
 }
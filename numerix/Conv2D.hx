@@ -6,6 +6,11 @@ class Conv2D extends Layer
 {
    static var conv2DId = 0;
    public static var defaultAllowTransform = true;
+   public static var defaultHalfWeights = false;
+   // Loaders leave the weights as the file has them, to be read on the first run - see setLazyWeights
+   public static var defaultLazyWeights = false;
+   // Compiled weights for the convolutions about to be created, in order - see Model.loadCompiled
+   public static var compiledWeights:Array<Dynamic> = null;
 
    public var kernelSize(default,null):Array<Int>;
    public var dilation(default,null):Array<Int>;
@@ -24,6 +29,21 @@ class Conv2D extends Layer
    public var means(default,null):Tensor;
    public var vars(default,null):Tensor;
 
+   // Input range the int8 path was set up for - 0 runs in Float32
+   public var quantizeRange(default,null):Float;
+   // Weights held by the native gemm as fp16
+   public var halfWeights(default,null):Bool;
+
+   // Layers folded into this one by Model.optimizeLayers
+   public var fusedPool(default,null):Padding;
+   public var fusedSum(default,null):Bool;
+   public var sumActivation(default,null):Int;
+   public var fusedInto(default,null):Concat;
+   // Started from compiled weights, see Model.loadCompiled
+   public var compiled(default,null):Bool;
+   // Set by setLazyWeights - 'weights' is then [filters][inputs][h][w], as in the file
+   public var lazy(default,null):Bool;
+
 
    public function new(config:Dynamic, input:Layer)
    {
@@ -40,6 +60,12 @@ class Conv2D extends Layer
       useBias = config.useBias;
       isDeconvolution = config.deconvolution == true;
       inputChannels = 0;
+      quantizeRange = 0;
+      compiled = false;
+      lazy = false;
+      halfWeights = defaultHalfWeights;
+      fusedSum = false;
+      sumActivation = Layer.ACT_LINEAR;
       if (config.allowTransform==null)
          allowTransform = defaultAllowTransform;
       else
@@ -90,6 +116,71 @@ class Conv2D extends Layer
          layConv2DSetNorm(handle, scales, means, vars);
    }
 
+   // While calibrating, runs record the largest input magnitude, for getInputRange
+   public function setCalibrate(inCalibrate:Bool)
+   {
+      layConv2DSetCalibrate(handle, inCalibrate);
+   }
+
+   public function getInputRange() : Float
+   {
+      return layConv2DGetInputRange(handle);
+   }
+
+   // Run the convolution in int8, for inputs up to inRange, or in Float32 again for 0.
+   // The weights get a scale per output channel.  Returns false if there is no int8 version.
+   public function quantize(inRange:Float) : Bool
+   {
+      if (!layConv2DSetQuantize(handle, inRange))
+         return false;
+      quantizeRange = inRange;
+      return true;
+   }
+
+   // Store the packed weights as fp16, halving the weight traffic, with Float32 arithmetic.
+   // The int8 path takes precedence.  Returns false if this convolution has no fp16 version.
+   public function setHalfWeights(inHalf:Bool) : Bool
+   {
+      halfWeights = inHalf;
+      return handle!=null && layConv2DSetHalfWeights(handle, inHalf);
+   }
+
+   // Do the following 2x2 stride-2 max pool as the result is written
+   public function fusePool(inPadding:Padding) : Bool
+   {
+      if (handle==null || !layConv2DSetFusedPool(handle, true, Layer.encodePadding(inPadding)))
+         return false;
+      fusedPool = inPadding;
+      return true;
+   }
+
+   // Add a second input to the result, then apply inActivation - the second input is passed
+   //  along with the first when running
+   public function fuseSum(inActivation:Int) : Bool
+   {
+      if (handle==null || !layConv2DSetFusedSum(handle, true, inActivation))
+         return false;
+      fusedSum = true;
+      sumActivation = inActivation;
+      return true;
+   }
+
+   // Run by a Concat, straight into its channels of the concat result
+   public function setFusedInto(inConcat:Concat)
+   {
+      fusedInto = inConcat;
+   }
+
+   function applyFusion()
+   {
+      if (fusedPool!=null)
+         layConv2DSetFusedPool(handle, true, Layer.encodePadding(fusedPool));
+      if (fusedSum)
+         layConv2DSetFusedSum(handle, true, sumActivation);
+      if (fusedInto!=null)
+         fusedInto.updateFusedInputs();
+   }
+
 
    override public function setWeights(inWeights:Array<Tensor>)
    {
@@ -101,10 +192,85 @@ class Conv2D extends Layer
 
       bias = inWeights[1];
       release();
+      lazy = false;
+
+      compiled = setCompiled();
+      if (compiled)
+         return;
 
       handle = layCreateConv2D(strides, activation, Layer.encodePadding(padding), weights, null, bias, allowTransform, isDeconvolution);
+      applySettings();
+   }
+
+   // Weights as darknet and caffe store them, [filters][inputs][h][w], usually mapped from the
+   //  file.  They are reordered, and the normalization applied, when the layer first runs, so
+   //  layers an output never reaches are never read.
+   // Queued compiled weights are checked against the reordered weights, so take them now.
+   public function setLazyWeights(inWeights:Array<Tensor>)
+   {
+      if (isDeconvolution || Type.getClass(this)!=Conv2D)
+         throw "Lazy weights are only for plain convolutions";
+      if (compiledWeights!=null && compiledWeights.length>0)
+      {
+         setWeights([ inWeights[0].reorder([0,2,3,1]), inWeights[1] ]);
+         return;
+      }
+      weights = inWeights[0];
+      var s = weights.shape;
+      kernelSize = [ s[3], s[2] ];
+      filters = s[0];
+      inputChannels = s[1];
+
+      bias = inWeights[1];
+      release();
+      compiled = false;
+      lazy = true;
+
+      handle = layCreateConv2DLazy(strides, activation, Layer.encodePadding(padding), weights, bias, allowTransform);
+      applySettings();
+   }
+
+   function applySettings()
+   {
       if (scales!=null)
          layConv2DSetNorm(handle, scales, means, vars);
+      if (halfWeights)
+         layConv2DSetHalfWeights(handle, true);
+      if (quantizeRange>0)
+         layConv2DSetQuantize(handle, quantizeRange);
+      applyFusion();
+   }
+
+
+   // Use the next compiled entry, already normalized and packed, if it fits these weights
+   function setCompiled() : Bool
+   {
+      if (compiledWeights==null || compiledWeights.length==0 || Type.getClass(this)!=Conv2D)
+         return false;
+      var compiled:Dynamic = compiledWeights.shift();
+      if (compiled==null || compiled.weights==null)
+         return false;
+      var folded:Tensor = compiled.weights;
+      var s = folded.shape;
+      var w = weights.shape;
+      if (s[0]!=w[0] || s[1]!=w[1] || s[2]!=w[2] || s[3]>w[3])
+         return false;
+
+      handle = layCreateConv2D(strides, activation, Layer.encodePadding(padding), folded, null, compiled.bias, allowTransform, isDeconvolution);
+      if (!layConv2DSetCompiled(handle, compiled))
+      {
+         release();
+         return false;
+      }
+      halfWeights = compiled.algo=="gemm16";
+      quantizeRange = compiled.algo=="int8" ? compiled.range : 0;
+      applyFusion();
+      return true;
+   }
+
+   public function getCompiled() : Dynamic
+   {
+      return handle==null ? null : layConv2DGetCompiled(handle);
    }
 
 
@@ -127,9 +293,18 @@ class Conv2D extends Layer
 
 
    static var layCreateConv2D = Loader.load("layCreateConv2D","oiiooobbo");
+   static var layCreateConv2DLazy = Loader.load("layCreateConv2DLazy","oiioobo");
    static var layConv2DSetNorm = Loader.load("layConv2DSetNorm","oooov");
    static var layConv2DRemoveMean = Loader.load("layConv2DRemoveMean","oov");
    static var layConv2DSetActication = Loader.load("layConv2DSetActication","oiv");
+   static var layConv2DSetCalibrate = Loader.load("layConv2DSetCalibrate","obv");
+   static var layConv2DGetInputRange = Loader.load("layConv2DGetInputRange","od");
+   static var layConv2DSetQuantize = Loader.load("layConv2DSetQuantize","odb");
+   static var layConv2DSetHalfWeights = Loader.load("layConv2DSetHalfWeights","obb");
+   static var layConv2DSetFusedPool = Loader.load("layConv2DSetFusedPool","obib");
+   static var layConv2DSetFusedSum = Loader.load("layConv2DSetFusedSum","obib");
+   static var layConv2DGetCompiled = Loader.load("layConv2DGetCompiled","oo");
+   static var layConv2DSetCompiled = Loader.load("layConv2DSetCompiled","oob");
 
 
 }
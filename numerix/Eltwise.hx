@@ -8,7 +8,8 @@ class Eltwise extends Layer
    public static var opNames  = ["product", "sum", "max"];
 
    static var id = 0;
-   var op(default,null):Int;
+   public var op(default,null):Int;
+   public var activation(default,null):Int;
    var opName(default,null):String;
    var cropIndex:Int;
    var cropX:Int;
@@ -30,13 +31,22 @@ class Eltwise extends Layer
       }
       opName = opNames[op];
 
-      cropIndex = 0;
+      cropIndex = -1;
       cropX = 0;
       cropY = 0;
+      activation = Layer.ACT_LINEAR;
 
       handle = layCreateEltwise(op);
    }
 
+   override public function setActivation(inActivation:Int)
+   {
+      activation = inActivation;
+      layEltwiseSetActivation(handle, inActivation);
+   }
+
+   public function isCropped() return cropIndex>=0;
+
    public function setCropIndex(inIndex:Int, inDx:Int, inDy:Int)
    {
       cropIndex = inIndex;
@@ -49,6 +59,7 @@ class Eltwise extends Layer
 
    static var layCreateEltwise = Loader.load("layCreateEltwise","io");
    static var laySetCropIndex = Loader.load("laySetCropIndex","oiiiv");
+   static var layEltwiseSetActivation = Loader.load("layEltwiseSetActivation","oiv");
 
 
 }
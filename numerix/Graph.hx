@@ -0,0 +1,50 @@
+package numerix;
+
+// The model lowered to a list of native layer calls, so a run is one native call.
+// The layers keep their handles; slots start with their current result buffers.
+@:access(numerix.Layer)
+class Graph
+{
+   var handle:Dynamic;
+   var layers:Array<Layer>;
+
+   public function new(inputLayer:Layer, outputLayer:Layer)
+   {
+      handle = grCreate();
+      layers = Model.getRunOrder(outputLayer);
+
+      var slotOf = new Map<Layer,Int>();
+      for(layer in layers)
+      {
+         var slot = 0;
+         if (layer==inputLayer)
+            slot = 0;
+         else if (layer.handle==null)
+            slot = grAddConstant(handle, layer.resultBuffer);
+         else
+         {
+            if (layer.inputs.length>2)
+               throw "Graph - too many inputs to " + layer;
+            var src0 = layer.inputs.length>0 ? slotOf.get(layer.inputs[0]) : -1;
+            var src1 = layer.inputs.length>1 ? slotOf.get(layer.inputs[1]) : -1;
+            slot = grAddLayer(handle, layer.handle, src0, src1, layer.resultBuffer);
+         }
+         slotOf.set(layer, slot);
+      }
+      grSetOutput(handle, slotOf.get(outputLayer));
+   }
+
+   // The result is also stored in outputLayer.resultBuffer - other layers' buffers are not updated
+   public function run(input:Tensor, outputLayer:Layer) : Tensor
+   {
+      return Tensor.fromHandle( grRun(handle, input, outputLayer) );
+   }
+
+   public function toString() return 'Graph(${layers.length} layers)';
+
+   static var grCreate = Loader.load("grCreate","o");
+   static var grAddConstant = Loader.load("grAddConstant","ooi");
+   static var grAddLayer = Loader.load("grAddLayer","oooiioi");
+   static var grSetOutput = Loader.load("grSetOutput","oiv");
+   static var grRun = Loader.load("grRun","oooo");
+}
@@ -4,39 +4,86 @@ import haxe.io.Input;
 import haxe.io.Bytes;
 using Reflect;
 
+/*
+ A json value holding tensors, with the tensors' data after it:
+
+    "nxio" version jsonLength json 0 "nxxd" blockCount  + a table entry per block, then the blocks
+
+ In version 1 each entry is flags and length, and the blocks follow in order.  Version 2 adds
+ each block's offset in the file (low, high), with the blocks on 64 byte boundaries, so
+ readFile can map the file and let the tensors use their data in place.
+*/
+typedef IoBlock = { flags:Int, length:Int, offset:Float };
+typedef IoHeader = { version:Int, json:Dynamic, size:Float, blocks:Array<IoBlock> };
+
 class Io
 {
-   static public inline var version = 1;
+   static public inline var version = 2;
+   static inline var blockAlign = 64;
 
    public static function decode(input:Input) : Dynamic
+   {
+      var header = readHeader(input);
+      var extras = readBlocks(input, header);
+      return remapTensors(header.json, function(id,type,shape) return Tensor.fromBytes(extras[id], type, shape) );
+   }
+
+   static function readHeader(input:Input) : IoHeader
    {
       var magic = input.readString(4);
       input.bigEndian = false;
       if (magic!="nxio")
          throw "Bad magic";
       var ver = input.readInt32();
+      if (ver<1 || ver>version)
+         throw "Unknown nxio version " + ver;
       var strLen = input.readInt32();
       var str = input.readString(strLen);
       var zero = input.readInt32();
       if (input.readString(4)!="nxxd")
          throw "Bad data magic";
       var count = input.readInt32();
-      var extras = new Array<Bytes>();
+      var size = 24.0 + strLen + count*(ver>=2 ? 16 : 8);
+
+      var blocks = new Array<IoBlock>();
+      var offset = size;
       for(i in 0...count)
       {
          var flags = input.readInt32();
          var blen = input.readInt32();
-         var bytes = Bytes.alloc(blen);
-         input.readBytes(bytes, 0, blen);
-         extras.push(bytes);
+         if (ver>=2)
+         {
+            var low = input.readInt32();
+            var high = input.readInt32();
+            offset = high*4294967296.0 + (low<0 ? low+4294967296.0 : low);
+         }
+         blocks.push( { flags:flags, length:blen, offset:offset } );
+         offset += blen;
       }
 
-      var json = haxe.Json.parse(str);
-      json = remapTensors(json, extras);
-      return json;
+      return { version:ver, json:haxe.Json.parse(str), size:size, blocks:blocks };
+   }
+
+   static function readBlocks(input:Input, header:IoHeader) : Array<Bytes>
+   {
+      var extras = new Array<Bytes>();
+      var pos = header.size;
+      for(block in header.blocks)
+      {
+         if (block.offset>pos)
+         {
+            input.read( Std.int(block.offset-pos) );
+            pos = block.offset;
+         }
+         var bytes = Bytes.alloc(block.length);
+         input.readFullBytes(bytes, 0, block.length);
+         pos += block.length;
+         extras.push(bytes);
+      }
+      return extras;
    }
 
-   static function remapTensors(value:Dynamic, extras:Array<Bytes>)
+   static function remapTensors(value:Dynamic, makeTensor:Int->Int->Array<Int>->Tensor)
    {
       if ( value.isObject())
       {
@@ -45,18 +92,18 @@ class Io
             var typename:String = value.type;
             var dataId:Int = value.dataId;
             var shape:Array<Int> = value.shape;
-            return Tensor.fromBytes( extras[dataId], DataType.fromString(typename), shape);
+            return makeTensor(dataId, DataType.fromString(typename), shape);
          }
 
          if (Std.is(value,Array))
          {
             var len = value.length;
             for(i in 0...len)
-               value[i] = remapTensors(value[i], extras);
+               value[i] = remapTensors(value[i], makeTensor);
          }
          else
             for(field in value.fields())
-               value.setField(field, remapTensors( value.field(field), extras)  );
+               value.setField(field, remapTensors( value.field(field), makeTensor)  );
       }
 
       return value;
@@ -67,12 +114,23 @@ class Io
       return decode(new haxe.io.BytesInput(input) );
    }
 
-   public static function readFile(filename:String) : Dynamic
+   // Version 2 files are mapped, unless mapData is false, so the tensors share the file's
+   //  pages instead of being read in - writing to them copies just the pages written
+   public static function readFile(filename:String, mapData = true) : Dynamic
    {
       var file = sys.io.File.read(filename);
-      var result = decode(file);
+      var header = readHeader(file);
+      if (header.version<2 || !mapData)
+      {
+         var extras = readBlocks(file, header);
+         file.close();
+         return remapTensors(header.json, function(id,type,shape) return Tensor.fromBytes(extras[id], type, shape) );
+      }
       file.close();
-      return result;
+
+      var mapping = ioMapFile(filename);
+      var blocks = header.blocks;
+      return remapTensors(header.json, function(id,type,shape) return Tensor.fromMapping(mapping, blocks[id].offset, type, shape) );
    }
 
 
@@ -84,24 +142,39 @@ class Io
       output.writeInt32(version);
 
       var extra = new Array<Tensor>();
-      var stringData = haxe.Json.stringify( value,
-         function(_, value) return replace(value,extra), " " );
+      var stringData = haxe.io.Bytes.ofString( haxe.Json.stringify( value,
+         function(_, value) return replace(value,extra), " " ) );
 
       output.writeInt32(stringData.length);
-      output.writeString(stringData);
+      output.writeBytes(stringData, 0, stringData.length);
       output.writeInt32(0);
       output.writeString("nxxd");
       output.writeInt32(extra.length);
+
+      var pos = 24 + stringData.length + extra.length*16;
+      var offsets = new Array<Int>();
+      var offset = pos;
       for(tensor in extra)
       {
+         offset = (offset + blockAlign-1) & ~(blockAlign-1);
+         offsets.push(offset);
          var flags = 0;
          output.writeInt32(flags);
          output.writeInt32(tensor.dataSize);
+         output.writeInt32(offset);
+         output.writeInt32(0);
+         offset += tensor.dataSize;
+         // The file is built in memory, so the offsets' high words stay 0
+         if (offset<0 || offset>0x7fffffc0)
+            throw "Io.encode - data is too big for one file";
       }
-      for(tensor in extra)
+      for(i in 0...extra.length)
       {
-         var buffer = tensor.getBytes();
+         for(p in pos...offsets[i])
+            output.writeByte(0);
+         var buffer = extra[i].getBytes();
          output.writeBytes(buffer, 0, buffer.length);
+         pos = offsets[i] + buffer.length;
       }
 
       return output.getBytes();
@@ -135,6 +208,8 @@ class Io
       }
       return value;
    }
+
+   static var ioMapFile = Loader.load("ioMapFile","so");
 }
 
 
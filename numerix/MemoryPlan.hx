@@ -0,0 +1,163 @@
+package numerix;
+
+/*
+ Places the layer results in a few shared arenas, so the memory used is the peak working set
+ rather than the sum of all the activations.
+
+ The layers are ordered as Model.run computes them, and each result lives from the layer that
+ makes it to the last layer that reads it - or to the end, for the output and for any layer
+ nothing reads.  The results are then packed in that order: each takes the smallest free arena
+ it fits in, or else the largest free arena grows to fit it, or else a new arena is made.
+ A result that shares its input's data (a pass-through layer) just extends the input's life.
+
+ The plan is made from the buffers of a completed run, so the sizes are known.  If a layer
+ later reallocates its buffer (eg, the input size changed) the plan is no longer current.
+*/
+class MemoryPlan
+{
+   public var arenas(default,null):Array<Tensor>;
+   public var arenaBytes(default,null):Int;
+   public var activationBytes(default,null):Int;
+
+   var layers:Array<Layer>;
+   var buffers:Array<Tensor>;
+
+   public function new(outputLayer:Layer)
+   {
+      arenas = [];
+      layers = [];
+      buffers = [];
+      arenaBytes = 0;
+      activationBytes = 0;
+
+      var order = Model.getRunOrder(outputLayer);
+      var end = order.length;
+
+      // Each result that owns its data, and its life in 'order'
+      var owners = new Array<Layer>();
+      var bytes = new Array<Int>();
+      var first = new Array<Int>();
+      var last = new Array<Int>();
+      var valueOf = new Map<Layer,Int>();
+
+      for(i in 0...end)
+      {
+         var layer = order[i];
+         var result = layer.resultBuffer;
+         var value = -1;
+         if (!Std.is(layer,InputLayer) && result!=null)
+         {
+            var alias = false;
+            for(input in layer.inputs)
+               if (result.sharesData(input.resultBuffer))
+               {
+                  value = valueOf.get(input);
+                  alias = true;
+                  break;
+               }
+            if (!alias)
+            {
+               value = owners.length;
+               owners.push(layer);
+               bytes.push( (result.dataSize + 63) & ~63 );
+               first.push(i);
+               last.push(i);
+            }
+         }
+         valueOf.set(layer, value);
+
+         for(input in layer.inputs)
+         {
+            var v = valueOf.get(input);
+            if (v!=null && v>=0 && last[v]<i)
+               last[v] = i;
+         }
+
+         if (value>=0 && (layer==outputLayer || layer.outputs.length==0))
+            last[value] = end;
+      }
+
+      // Pack
+      var arenaSize = new Array<Int>();
+      var arenaOf = new Array<Int>();
+      var active = new Array<Int>();
+      var free = new Array<Int>();
+      for(v in 0...owners.length)
+      {
+         var idx = active.length;
+         while(idx>0)
+         {
+            idx--;
+            var a = active[idx];
+            if (last[a] < first[v])
+            {
+               active.splice(idx,1);
+               free.push(arenaOf[a]);
+            }
+         }
+
+         var best = -1;
+         for(f in free)
+            if (arenaSize[f]>=bytes[v] && (best<0 || arenaSize[f]<arenaSize[best]))
+               best = f;
+         if (best<0)
+            for(f in free)
+               if (best<0 || arenaSize[f]>arenaSize[best])
+                  best = f;
+
+         if (best<0)
+         {
+            best = arenaSize.length;
+            arenaSize.push(bytes[v]);
+         }
+         else
+         {
+            free.remove(best);
+            if (arenaSize[best]<bytes[v])
+               arenaSize[best] = bytes[v];
+         }
+         arenaOf.push(best);
+         active.push(v);
+         activationBytes += bytes[v];
+      }
+
+      for(size in arenaSize)
+      {
+         arenas.push( Tensor.empty(DataType.UInt8, [size]) );
+         arenaBytes += size;
+      }
+
+      // Move the results into the arenas - only those still live at the end need their data
+      for(v in 0...owners.length)
+      {
+         var layer = owners[v];
+         var old = layer.resultBuffer;
+         layer.resultBuffer = old.viewIn(arenas[arenaOf[v]], last[v]==end);
+         // The caller may still hold the output from the last run
+         if (layer!=outputLayer)
+            old.release();
+         layers.push(layer);
+         buffers.push(layer.resultBuffer);
+      }
+   }
+
+   // False once any layer has replaced its planned buffer
+   public function isCurrent() : Bool
+   {
+      for(i in 0...layers.length)
+         if (layers[i].resultBuffer!=buffers[i])
+            return false;
+      return true;
+   }
+
+   public function release()
+   {
+      for(arena in arenas)
+         arena.release();
+      arenas = [];
+      layers = [];
+      buffers = [];
+   }
+
+   public function toString() return 'MemoryPlan(${arenas.length} arenas, ${arenaBytes>>10}k for ${activationBytes>>10}k of results)';
+}
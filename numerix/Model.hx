@@ -5,6 +5,15 @@ using StringTools;
 
 class Model
 {
+   // Share activation memory between layers that are not live at the same time - see MemoryPlan.
+   // Intermediate layer results are then only valid until a later layer reuses the memory.
+   public static var defaultPlanMemory = false;
+   // After the first run at a size, run the model as one native Graph call rather than
+   //  walking the layers - only the output layer's resultBuffer is then updated.
+   public static var defaultUseGraph = true;
+   // optimizeLayers folds pools, sums and concats into the convolutions - see fuseConvolutions
+   public static var defaultFuseLayers = true;
+
    public var inputLayer:InputLayer;
    public var outputLayer:Layer;
    public var layers:Array<Layer>;
@@ -12,34 +21,84 @@ class Model
    public var height:Null<Int>;
    public var channels:Null<Int>;
 
+   public var planMemory:Bool;
+   public var memoryPlan(default,null):MemoryPlan;
+   public var useGraph:Bool;
+   public var fuseLayers:Bool;
+
+   var graph:Graph;
+   var graphShape:Array<Int>;
+
    var resizeBuffer:Tensor;
+   var batchBuffer:Tensor;
 
    public function new()
    {
       layers = [];
+      planMemory = defaultPlanMemory;
+      useGraph = defaultUseGraph;
+      fuseLayers = defaultFuseLayers;
    }
 
    public function run(input:Tensor,inAllowResize=true) : Tensor
    {
-      if (outputLayer==null && layers.length>0)
-         outputLayer = layers[layers.length-1];
+      if (input.shape.length==4)
+      {
+         checkImage(input.shape.slice(1));
+         return runInput(input);
+      }
+      return runInput( fitImage(input,inAllowResize) );
+   }
 
-      if (inputLayer==null || outputLayer==null)
-         trace("Incomplete model specification");
+   /*
+    Run several images as one N*H*W*C batch, so each layer handles them all in one call -
+     the weights are loaded once for the batch, and small images give the workers more to do.
+    The images must end up the same size, after any resize.  Returns a result per image.
+    Yolo regions work on single images, so detectors still need run.
+   */
+   public function runBatch(images:Array<Tensor>,inAllowResize=true) : Array<Tensor>
+   {
+      if (images.length==0)
+         return [];
 
-      if (channels!=null)
+      for(i in 0...images.length)
+      {
+         var image = fitImage(images[i],inAllowResize);
+         if (i==0)
+         {
+            var shape = [images.length].concat(image.shape);
+            if (batchBuffer==null || !sameShape(batchBuffer.shape,shape) || batchBuffer.type!=image.type)
+            {
+               if (batchBuffer!=null)
+                  batchBuffer.release();
+               batchBuffer = Tensor.empty(image.type, shape);
+            }
+         }
+         batchBuffer.setImage(i, image);
+      }
+
+      var result = runInput(batchBuffer);
+      return [ for(i in 0...images.length) result.getImage(i) ];
+   }
+
+   function checkImage(shape:Array<Int>)
+   {
+      if (channels!=null || (width!=null && height!=null))
       {
-         var shape = input.shape;
          if (shape.length!=3)
             throw 'This model only supports images with 3 dimensions';
-         if (shape[2]!=channels)
+         if (channels!=null && shape[2]!=channels)
             throw 'This model only supports images with $channels channels';
       }
+   }
+
+   // Check the channels, and scale to the model size if allowed
+   function fitImage(input:Tensor,inAllowResize:Bool) : Tensor
+   {
+      checkImage(input.shape);
       if (width!=null && height!=null)
       {
          var shape = input.shape;
-         if (shape.length!=3)
-            throw "This model only supports images with 3 dimensions";
          var h = shape[0];
          var w = shape[1];
          if ( (width!=w || height!=h) && inAllowResize)
@@ -48,10 +107,73 @@ class Model
             input = resizeBuffer;
          }
       }
+      return input;
+   }
+
+   function runInput(input:Tensor) : Tensor
+   {
+      if (outputLayer==null && layers.length>0)
+         outputLayer = layers[layers.length-1];
+
+      if (inputLayer==null || outputLayer==null)
+         trace("Incomplete model specification");
 
       //println("Set input " + input + "=" + input[0]);
       inputLayer.set(input);
-      return outputLayer.getOutput();
+
+      // Per-layer timing needs the layer-by-layer run
+      if (graph!=null && !Layer.showTimes)
+      {
+         if (useGraph && sameShape(input.shape, graphShape))
+            return graph.run(input, outputLayer);
+         graph = null;
+      }
+
+      var result = outputLayer.getOutput();
+
+      if (planMemory && (memoryPlan==null || !memoryPlan.isCurrent()))
+      {
+         if (memoryPlan!=null)
+            memoryPlan.release();
+         memoryPlan = new MemoryPlan(outputLayer);
+         result = outputLayer.resultBuffer;
+      }
+
+      if (useGraph && graph==null && !Layer.showTimes)
+      {
+         graph = new Graph(inputLayer, outputLayer);
+         graphShape = input.shape;
+      }
+
+      return result;
+   }
+
+   static function sameShape(a:Array<Int>, b:Array<Int>)
+   {
+      if (a.length!=b.length)
+         return false;
+      for(i in 0...a.length)
+         if (a[i]!=b[i])
+            return false;
+      return true;
+   }
+
+   // The layers that make outputLayer, in the order they run
+   public static function getRunOrder(outputLayer:Layer) : Array<Layer>
+   {
+      var order = new Array<Layer>();
+      addToRunOrder(outputLayer, order, new Map<Layer,Bool>());
+      return order;
+   }
+
+   static function addToRunOrder(layer:Layer, order:Array<Layer>, visited:Map<Layer,Bool>)
+   {
+      if (layer==null || visited.exists(layer))
+         return;
+      visited.set(layer,true);
+      for(input in layer.inputs)
+         addToRunOrder(input, order, visited);
+      order.push(layer);
    }
 
    public function makeInputLayer() : InputLayer
@@ -64,6 +186,7 @@ class Model
 
    public function addLayer(layer:Layer)
    {
+      graph = null;
       if (layers.length>0 && layers[layers.length-1]==layer)
          throw "Double layer " + layers + "+" + layer;
       layers.push(layer);
@@ -89,6 +212,144 @@ class Model
       return null;
    }
 
+   /*
+    Post-training int8 quantization of the convolutions.  The samples, which should be typical
+     inputs, are run to find the range of each convolution's input.  The convolutions then
+     quantize their inputs to that range and their weights per output channel, and run the
+     gemm in int8.  Results between layers stay Float32.
+    Returns the number of layers quantized - the others (eg, separable) stay in Float32.
+   */
+   public function quantizeInt8(samples:Array<Tensor>) : Int
+   {
+      if (samples.length==0)
+         throw "quantizeInt8 needs some samples";
+
+      var convs = getConvs();
+      // Calibrate on the Float32 results
+      for(conv in convs)
+      {
+         conv.quantize(0);
+         conv.setCalibrate(true);
+      }
+      for(sample in samples)
+         run(sample);
+
+      var count = 0;
+      for(conv in convs)
+      {
+         conv.setCalibrate(false);
+         var range = conv.getInputRange();
+         if (range>0 && conv.quantize(range))
+            count++;
+      }
+      return count;
+   }
+
+   // Back to Float32
+   public function clearQuantization()
+   {
+      for(conv in getConvs())
+         if (conv.quantizeRange>0)
+            conv.quantize(0);
+   }
+
+   // fp16 weights for the convolutions, see Conv2D.setHalfWeights.  Returns the number set.
+   public function setHalfWeights(inHalf:Bool) : Int
+   {
+      var count = 0;
+      for(conv in getConvs())
+         if (conv.setHalfWeights(inHalf))
+            count++;
+      return count;
+   }
+
+   function getConvs() : Array<Conv2D>
+   {
+      if (outputLayer==null && layers.length>0)
+         outputLayer = layers[layers.length-1];
+      var convs = new Array<Conv2D>();
+      for(layer in getRunOrder(outputLayer))
+      {
+         if (Std.is(layer,Conv2D))
+            convs.push(cast layer);
+         else if (Std.is(layer,Concat))
+         {
+            var concat:Concat = cast layer;
+            for(input in concat.fusedInputs)
+               if (Std.is(input,Conv2D))
+                  convs.push(cast input);
+         }
+      }
+      return convs;
+   }
+
+   /*
+    Compiled weights - the convolutions' weights after normalization (and any mean removal,
+     int8 or fp16), in the packed or Winograd-transformed layout the kernels run, along with
+     the algorithm chosen for the input size.  loadCompiled hands them to the convolutions as
+     the model is created, so they start from the mapped file with no folding, packing or
+     transforms, and no tuning.
+    The layouts belong to the kernels, so the file is only used with the same getKernelIsa().
+    Save once the model is fully set up - it is run on 'sample' (zeros at the model size by
+     default) first, so each convolution has made its choice.
+   */
+   public function saveCompiled(filename:String, ?sample:Tensor)
+   {
+      if (sample==null)
+      {
+         if (width==null || height==null)
+            throw "saveCompiled - model has no fixed size, so needs a sample input";
+         sample = Tensor.empty(DataType.Float32, [height, width, channels==null ? 3 : channels]);
+      }
+      run(sample);
+
+      var convs = new Array<Dynamic>();
+      for(layer in layers)
+         if (Type.getClass(layer)==Conv2D)
+         {
+            var conv:Conv2D = cast layer;
+            convs.push( conv.getCompiled() );
+         }
+      Io.writeFile(filename, { isa:getKernelIsa(), convs:convs } );
+   }
+
+   // Loads as 'load', with the convolutions taking their weights from compiledName where it
+   //  fits.  A missing file, or one from other kernels, loads normally - see compiledCount.
+   public static function loadCompiled(modelname:String, compiledName:String) : Model
+   {
+      var data:Dynamic = null;
+      if (sys.FileSystem.exists(compiledName))
+      {
+         data = Io.readFile(compiledName);
+         if (data.isa!=getKernelIsa())
+            data = null;
+      }
+
+      Conv2D.compiledWeights = data==null ? null : data.convs;
+      var model:Model = null;
+      try
+      {
+         model = load(modelname);
+      }
+      catch(e:Dynamic)
+      {
+         Conv2D.compiledWeights = null;
+         throw e;
+      }
+      Conv2D.compiledWeights = null;
+      return model;
+   }
+
+   // The convolutions started from compiled weights
+   public function compiledCount() : Int
+   {
+      var count = 0;
+      for(layer in layers)
+         if (Std.is(layer,Conv2D) && (cast layer:Conv2D).compiled)
+            count++;
+      return count;
+   }
+
    public function removeMean(mean:Array<Float>)
    {
       var layer = makeInputLayer();
@@ -100,6 +361,7 @@ class Model
 
    public function optimizeLayers()
    {
+      graph = null;
       for(layer in layers)
       {
          if (Std.is(layer,Crop))
@@ -129,6 +391,96 @@ class Model
             }
          }
       }
+
+      if (fuseLayers)
+         fuseConvolutions();
+   }
+
+   /*
+    Folds the layers that follow a convolution into it, so its result is not written out and
+     read back by the next layer:
+      - an Eltwise sum, and its activation - the other input becomes the convolution's second
+      - a 2x2 stride-2 MaxPool, which may follow a folded sum
+    Then a Concat runs the convolutions and reorgs making its inputs itself, and they write
+     straight into channel slices of the concat result, so there is nothing left to copy.
+    The folded layers are unlinked, and stay in 'layers'.
+   */
+   function fuseConvolutions()
+   {
+      if (outputLayer==null && layers.length>0)
+         outputLayer = layers[layers.length-1];
+
+      for(layer in getRunOrder(outputLayer))
+      {
+         if (layer.inputs.length!=1)
+            continue;
+
+         if (Std.is(layer,Conv2D))
+         {
+            var conv:Conv2D = cast layer;
+            if (conv.isDeconvolution)
+               continue;
+
+            if (conv.outputs.length==1 && Std.is(conv.outputs[0],Eltwise))
+            {
+               var eltwise:Eltwise = cast conv.outputs[0];
+               var other = eltwise.inputs[0]==conv ? eltwise.inputs[1] : eltwise.inputs[0];
+               if (eltwise.op==Eltwise.SUM && !eltwise.isCropped() && other!=conv &&
+                     conv.fuseSum(eltwise.activation))
+               {
+                  conv.inputs.push(other);
+                  other.outputs[ other.outputs.indexOf(eltwise) ] = conv;
+                  eltwise.inputs.remove(other);
+                  foldInto(eltwise, conv);
+               }
+            }
+
+            if (conv.outputs.length==1 && Std.is(conv.outputs[0],MaxPool))
+            {
+               var pool:MaxPool = cast conv.outputs[0];
+               var pad = pool.padding;
+               if (pool.kernelSize[0]==2 && pool.kernelSize[1]==2 && pool.strides[0]==2 &&
+                     pool.strides[1]==2 && pad!=null && pad.match(PadSame|PadValid) &&
+                     conv.fusePool(pad))
+                  foldInto(pool, conv);
+            }
+
+            if (conv.fusedSum)
+               continue;
+         }
+         else if (!Std.is(layer,Reorg))
+            continue;
+
+         if (layer.inputs.length==1 && layer.outputs.length==1 && Std.is(layer.outputs[0],Concat))
+         {
+            var concat:Concat = cast layer.outputs[0];
+            var index = concat.inputs.indexOf(layer);
+            if (concat.inputs.lastIndexOf(layer)==index && concat.fuseInput(index, layer))
+            {
+               var input = layer.inputs[0];
+               concat.inputs[index] = input;
+               input.outputs[ input.outputs.indexOf(layer) ] = concat;
+               layer.inputs = [];
+               layer.outputs = [];
+               concat.invalidateAll();
+            }
+         }
+      }
+   }
+
+   // 'into', whose only output is 'layer', takes over the outputs of 'layer'
+   function foldInto(layer:Layer, into:Layer)
+   {
+      into.outputs = layer.outputs;
+      for(output in layer.outputs)
+         for(i in 0...output.inputs.length)
+            if (output.inputs[i]==layer)
+               output.inputs[i] = into;
+      layer.inputs = [];
+      layer.outputs = [];
+      if (outputLayer==layer)
+         outputLayer = into;
+      into.invalidateAll();
    }
 
    public static function  enableGpu(inEnable:Bool)
@@ -136,7 +488,93 @@ class Model
       nxEnableGpu(inEnable);
    }
 
+   // Must be called before the first model runs - returns the count actually used
+   public static function setWorkerCount(inCount:Int) : Int
+   {
+      return nxSetWorkerCount(inCount);
+   }
+
+   public static function getWorkerCount() : Int
+   {
+      return nxGetWorkerCount();
+   }
+
+   public static function setWorkerAffinity(inPin:Bool)
+   {
+      nxSetWorkerAffinity(inPin);
+   }
+
+   // Time idle workers spin before sleeping - trades cpu for per-layer latency
+   public static function setWorkerSpin(inMicroseconds:Int)
+   {
+      nxSetWorkerSpin(inMicroseconds);
+   }
+
+   // Run independent branches of the graph, and the two sides of a concat, at the same time
+   //  on shares of the workers.  On by default.
+   public static function setWorkerBranches(inEnable:Bool)
+   {
+      nxSetWorkerBranches(inEnable);
+   }
+
+   // Freed cpu buffers are kept, by size class, for reuse - up to maxCachedMb of them.
+   // hugePages backs large buffers with huge pages where the system has them, and
+   //  checkSentinels checks the guard bytes either side of each buffer when it is freed.
+   public static function setCpuPool(maxCachedMb = 256.0, hugePages = false, checkSentinels = false)
+   {
+      nxSetCpuPool(maxCachedMb, hugePages, checkSentinels);
+   }
+
+   public static function getCpuMemoryStats() : { inUseMb:Float, peakMb:Float, cachedMb:Float, reservedMb:Float, systemAllocs:Int, poolHits:Int }
+   {
+      return nxGetCpuMemoryStats();
+   }
+
+   // Force the cpu kernels to "sse", "avx2", "avx512" etc, for benchmarking.  null restores the best.
+   // Returns false if this cpu can not run them.
+   public static function setKernelIsa(inIsa:String) : Bool
+   {
+      return nxSetKernelIsa(inIsa==null ? "" : inIsa);
+   }
+
+   public static function getKernelIsa() : String
+   {
+      return nxGetKernelIsa();
+   }
+
+   public static function getCpuName() : String
+   {
+      return nxGetCpuName();
+   }
+
+   // Time each eligible convolution algorithm on the first run at a size, and keep the fastest.
+   // Set before the layers are created.  The choices are saved to, and loaded from, inCacheFile if given,
+   //  so later runs on the same cpu skip the tuning.  Also NX_AUTOTUNE=1 or NX_AUTOTUNE=<cache file>.
+   public static function setAutotune(inAutotune:Bool, ?inCacheFile:String)
+   {
+      nxSetAutotune(inAutotune, inCacheFile==null ? "" : inCacheFile);
+   }
+
+   // Force "direct", "wino2", "wino4" or "wino6" where a convolution can use it, for testing.
+   // Layers choose on their first run at a size.  null restores the cost model.
+   public static function setConvAlgo(inAlgo:String) : Bool
+   {
+      return nxSetConvAlgo(inAlgo==null ? "" : inAlgo);
+   }
+
    static var nxEnableGpu = Loader.load("nxEnableGpu","bv");
+   static var nxSetWorkerCount = Loader.load("nxSetWorkerCount","ii");
+   static var nxGetWorkerCount = Loader.load("nxGetWorkerCount","i");
+   static var nxSetWorkerAffinity = Loader.load("nxSetWorkerAffinity","bv");
+   static var nxSetWorkerSpin = Loader.load("nxSetWorkerSpin","iv");
+   static var nxSetWorkerBranches = Loader.load("nxSetWorkerBranches","bv");
+   static var nxSetCpuPool = Loader.load("nxSetCpuPool","dbbv");
+   static var nxGetCpuMemoryStats = Loader.load("nxGetCpuMemoryStats","o");
+   static var nxSetKernelIsa = Loader.load("nxSetKernelIsa","sb");
+   static var nxGetKernelIsa = Loader.load("nxGetKernelIsa","s");
+   static var nxGetCpuName = Loader.load("nxGetCpuName","s");
+   static var nxSetAutotune = Loader.load("nxSetAutotune","bsv");
+   static var nxSetConvAlgo = Loader.load("nxSetConvAlgo","sb");
 
 }
 
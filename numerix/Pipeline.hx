@@ -0,0 +1,119 @@
+package numerix;
+
+import cpp.vm.Thread;
+import cpp.vm.Lock;
+
+typedef PipelineFrame =
+{
+   id:Int,
+   failed:Bool,
+   result:Tensor,
+   boxes:Array<Box>,
+   latencyMs:Float,
+}
+
+/*
+ Runs a stream of images, such as camera frames, through a model as a pipeline.
+
+ The layers are split into stages of about equal time, each with its own thread, so the next
+ frame starts the early layers while the last is still in the later ones - throughput then
+ approaches one frame per slowest stage, rather than one per whole model.  At most 'depth'
+ frames are in flight: push blocks until the oldest has been popped.  Layers on a device,
+ such as a Movidius stick, all go in one stage, since only one thread may drive it.
+ The model runs natively, as a Graph, and must not be run from haxe while the pipeline is going.
+ See project/include/Pipeline.h.
+*/
+@:access(numerix.Model)
+@:access(numerix.Graph)
+@:access(numerix.YoloRegions)
+class Pipeline
+{
+   public var stages(default,null):Int;
+   public var depth(default,null):Int;
+
+   var handle:Dynamic;
+   var model:Model;
+   var graph:Graph;
+   var finished:Lock;
+   var running:Int;
+
+   // 'sample' is run once to size the layers and time them for the split - it defaults to
+   //  zeros at the model's size.  stages and depth of 0 choose from the worker count.
+   public function new(inModel:Model, inStages = 0, inDepth = 0, ?sample:Tensor)
+   {
+      model = inModel;
+      if (sample==null)
+      {
+         if (model.width==null || model.height==null)
+            throw "Pipeline - model has no fixed size, so needs a sample input";
+         var channels = model.channels==null ? 3 : model.channels;
+         sample = Tensor.empty(DataType.Float32, [model.height, model.width, channels]);
+      }
+      model.run(sample);
+
+      graph = new Graph(model.inputLayer, model.outputLayer);
+      handle = plCreate(graph.handle, inStages, inDepth);
+      stages = plGetStageCount(handle);
+      depth = plGetDepth(handle);
+
+      finished = new Lock();
+      running = 0;
+      for(stage in 0...stages)
+      {
+         running++;
+         Thread.create( function() {
+            plServe(handle, stage);
+            finished.release();
+         } );
+      }
+   }
+
+   // The image is copied (after any resize to the model's size), so it can be refilled
+   //  straight away.  Returns the frame id, or -1 once stopped.
+   public function push(image:Tensor) : Int
+   {
+      return plPush(handle, model.fitImage(image,true));
+   }
+
+   // The oldest finished frame, in the order pushed, or null if none is ready and !wait
+   public function pop(wait = true) : PipelineFrame
+   {
+      var frame:PipelineFrame = plPop(handle, wait);
+      if (frame!=null)
+      {
+         frame.result = Tensor.fromHandle(frame.result);
+         var yolo = Std.instance(model.outputLayer, YoloRegions);
+         if (yolo!=null)
+            for(box in frame.boxes)
+               box.className = yolo.classNames[ box.classId ];
+      }
+      return frame;
+   }
+
+   // Returns once the stage threads have finished their current frames
+   public function stop()
+   {
+      plStop(handle);
+      while(running>0)
+      {
+         finished.wait();
+         running--;
+      }
+   }
+
+   public function getStats() : { frames:Int, errors:Int, stageMs:Array<Float> }
+   {
+      return plGetStats(handle);
+   }
+
+   public function toString() return 'Pipeline($stages stages, depth $depth)';
+
+   static var plCreate = Loader.load("plCreate","oiio");
+   static var plGetStageCount = Loader.load("plGetStageCount","oi");
+   static var plGetDepth = Loader.load("plGetDepth","oi");
+   static var plServe = Loader.load("plServe","oiv");
+   static var plPush = Loader.load("plPush","ooi");
+   static var plPop = Loader.load("plPop","obo");
+   static var plStop = Loader.load("plStop","ov");
+   static var plGetStats = Loader.load("plGetStats","oo");
+}
@@ -14,6 +14,7 @@ class SeparableConv2D extends Conv2D
       release();
 
       handle = Conv2D.layCreateConv2D(strides, activation, Layer.encodePadding(padding), weights,pweights,bias,false,isDeconvolution);
+      applyFusion();
    }
 
    override public function toString() return 'SeparableConv2D($name:$kernelSize x $filters $activation $weights %pweights $bias)';
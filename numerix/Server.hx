@@ -0,0 +1,94 @@
+package numerix;
+
+import cpp.vm.Thread;
+import cpp.vm.Lock;
+
+/*
+ Serves models over a local unix socket, batching requests that arrive close together.
+
+ Each added model is an instance with its own serving thread, so for several batches at once
+ add several Model objects (eg, load the same file twice).  The instances run natively, as a
+ Graph, and must not be run from haxe while the server is going.
+ See project/include/Server.h for the wire format, and test/server for a load generator.
+*/
+@:access(numerix.Model)
+@:access(numerix.Graph)
+class Server
+{
+   var handle:Dynamic;
+   var instances:Array<{ model:Model, graph:Graph, width:Int, height:Int }>;
+   var finished:Lock;
+   var running:Int;
+
+   // Up to maxBatch requests run together, and a request waits at most maxDelayMs for others.
+   // Models with a layer that only takes one image (eg, Yolo) still gather requests this way,
+   //  but run them one at a time, so only the queueing is shared.
+   public function new(socketPath:String, maxBatch = 8, maxDelayMs = 2.0)
+   {
+      handle = svCreate(socketPath, maxBatch, maxDelayMs*0.001);
+      instances = [];
+      finished = new Lock();
+      running = 0;
+   }
+
+   // 'sample' is run once to size the layers - it defaults to zeros at the model's size
+   public function addModel(model:Model, ?sample:Tensor)
+   {
+      if (running>0)
+         throw "Server - add models before starting";
+      if (sample==null)
+      {
+         if (model.width==null || model.height==null)
+            throw "Server - model has no fixed size, so needs a sample input";
+         var channels = model.channels==null ? 3 : model.channels;
+         sample = Tensor.empty(DataType.Float32, [model.height, model.width, channels]);
+      }
+      model.run(sample);
+
+      var width = model.width==null ? 0 : model.width;
+      var height = model.height==null ? 0 : model.height;
+      instances.push({ model:model, graph:new Graph(model.inputLayer, model.outputLayer), width:width, height:height });
+   }
+
+   public function start()
+   {
+      if (instances.length==0)
+         throw "Server - no models";
+      if (running>0)
+         return;
+
+      svStart(handle);
+      for(instance in instances)
+      {
+         running++;
+         Thread.create( function() {
+            svServe(handle, instance.graph.handle, instance.width, instance.height);
+            finished.release();
+         } );
+      }
+   }
+
+   // Returns once the serving threads have finished their current batches
+   public function stop()
+   {
+      svStop(handle);
+      while(running>0)
+      {
+         finished.wait();
+         running--;
+      }
+   }
+
+   public function getStats() : { requests:Int, batches:Int, errors:Int, meanBatch:Float, meanQueueMs:Float, meanRunMs:Float }
+   {
+      return svGetStats(handle);
+   }
+
+   public function toString() return 'Server(${instances.length} instances)';
+
+   static var svCreate = Loader.load("svCreate","sido");
+   static var svStart = Loader.load("svStart","ov");
+   static var svStop = Loader.load("svStop","ov");
+   static var svServe = Loader.load("svServe","ooiiv");
+   static var svGetStats = Loader.load("svGetStats","oo");
+}
@@ -38,6 +38,12 @@ abstract Tensor(Dynamic)
    }
 
 
+   // Uses the data in place, at inOffset bytes into a file mapped by Io.readFile
+   public static function fromMapping(inFile:Dynamic, inOffset:Float, inStoreType:Int, inShape:Array<Int>)
+   {
+      return new Tensor( tdFromMapping(inFile, inOffset, inStoreType, inShape) );
+   }
+
    public static function fromHandle(inHandle:Dynamic) return new Tensor(inHandle);
 
    public function release()
@@ -152,6 +158,29 @@ abstract Tensor(Dynamic)
    }
 
 
+   // A tensor with the same type and shape as this one, placed in the memory of 'storage',
+   //  which must be at least dataSize bytes
+   public function viewIn(storage:Tensor, copyData=false) : Tensor
+   {
+      return new Tensor(tdMakeView(storage, this, copyData));
+   }
+
+   public function sharesData(other:Tensor) : Bool
+   {
+      return other!=null && tdSharesData(this, other);
+   }
+
+   // For an N*H*W*C batch, copy an H*W*C image in or out of slot 'index'
+   public function setImage(index:Int, image:Tensor) : Void
+   {
+      tdSetImage(this, index, image);
+   }
+
+   public function getImage(index:Int, ?buffer:Tensor) : Tensor
+   {
+      return new Tensor(tdGetImage(this, index, buffer));
+   }
+
    public function getBytes():haxe.io.Bytes
    {
       var size = dataSize;
@@ -222,6 +251,7 @@ abstract Tensor(Dynamic)
    }
 
    static var tdFromDynamic = Loader.load("tdFromDynamic","oioo");
+   static var tdFromMapping = Loader.load("tdFromMapping","odioo");
    static var tdGetDimCount = Loader.load("tdGetDimCount","oi");
    static var tdGetDimAt = Loader.load("tdGetDimAt","oii");
    static var tdGetElementCount = Loader.load("tdGetElementCount","oi");
@@ -240,6 +270,10 @@ abstract Tensor(Dynamic)
    static var tdGetAt = Loader.load("tdGetAt","oiooood");
    static var tdSetAt = Loader.load("tdSetAt","oidiv");
    static var tdResizeAxis = Loader.load("tdResizeAxis","oiiio");
+   static var tdMakeView = Loader.load("tdMakeView","oobo");
+   static var tdSharesData = Loader.load("tdSharesData","oob");
+   static var tdSetImage = Loader.load("tdSetImage","oiov");
+   static var tdGetImage = Loader.load("tdGetImage","oioo");
    //static var tdGetMinAxis = Loader.load("tdGetMin","ooo");
    //static var tdGetMaxAxis = Loader.load("tdGetMax","oio");
 
@@ -139,17 +139,25 @@ class Model extends numerix.Model
 
                var weights:Array<Dynamic> = layer.weights;
                var tensors:Array<Tensor> = weights.map( Tensor.fromHandle );
-               if (tensors[0]!=null)
+               if (tensors[0]!=null && Conv2D.defaultLazyWeights && !layer.deconvolution)
                {
-                  //trace("Reorder weights " + tensors[0].shape );
-                  if (layer.deconvolution)
-                     // C-O-H-W ->  O-H-W-C
-                     tensors[0] = tensors[0].reorder([1,2,3,0]);
-                  else
-                     // O-C-H-W ->  O-H-W-C
-                     tensors[0] = tensors[0].reorder([0,2,3,1]);
+                  // O-C-H-W, reordered when it first runs
+                  lay.setLazyWeights(tensors);
+               }
+               else
+               {
+                  if (tensors[0]!=null)
+                  {
+                     //trace("Reorder weights " + tensors[0].shape );
+                     if (layer.deconvolution)
+                        // C-O-H-W ->  O-H-W-C
+                        tensors[0] = tensors[0].reorder([1,2,3,0]);
+                     else
+                        // O-C-H-W ->  O-H-W-C
+                        tensors[0] = tensors[0].reorder([0,2,3,1]);
+                  }
+                  lay.setWeights(tensors);
                }
-               lay.setWeights(tensors);
 
                //trace(tensors[0]);
                //tensors[0].print();
@@ -1,7 +1,6 @@
 package numerix.darknet;
 
 import Sys.println;
-import haxe.io.Bytes;
 import numerix.Tensor;
 import numerix.Nx;
 import numerix.Padding;
@@ -31,10 +30,19 @@ class Model extends numerix.Model
    var filename:String;
    var weightName:String;
 
+   // Reading the .weights file - its size, the time spent in the reads themselves, and
+   //  the whole load including creating the layers
+   public var weightsMb(default,null):Float = 0;
+   public var weightsReadMs(default,null):Float = 0;
+   public var loadMs(default,null):Float = 0;
+   // Left mapped in the file by lazy weights, not yet read
+   public var weightsMappedMb(default,null):Float = 0;
+
    public function new(inFilename:String, removeReorg = false)
    {
       super();
 
+      var t0 = haxe.Timer.stamp();
       filename = inFilename;
       var cfg = sys.io.File.getContent(filename);
       var lines = cfg.split("\r").join("").split("\n");
@@ -65,30 +73,15 @@ class Model extends numerix.Model
       if (section!=null)
          sections.push(section);
 
-      var weightName = filename.substr(0,filename.length-3) + "weights";
-      var weights:sys.io.FileInput = null;
+      weightName = filename.substr(0,filename.length-3) + "weights";
+      var weights:WeightsReader = null;
       try {
-         weights = sys.io.File.read(weightName);
-         weights.bigEndian = false;
-         var major = weights.readInt32();
-         var minor = weights.readInt32();
-         var revision = weights.readInt32();
-         //println('version: $major.$minor.$revision');
-         if (major*10+minor>=2)
-         {
-            // Skip 64
-            weights.readInt32();
-            weights.readInt32();
-         }
-         else
-         {
-            var seen = weights.readInt32();
-         }
-         transpose = (major > 1000) || (minor > 1000);
+         weights = new WeightsReader(weightName);
+         transpose = weights.transpose;
       }
       catch(e:Dynamic)
       {
-         //throw "Could not open associated weights file '"+weightName+"'";
+         // Only an error if a layer needs weights
       }
 
 
@@ -103,7 +96,13 @@ class Model extends numerix.Model
       }
 
       if (weights!=null)
+      {
+         var stats = weights.getStats();
+         weightsMb = stats.mb;
+         weightsReadMs = stats.readMs;
+         weightsMappedMb = stats.mappedMb;
          weights.close();
+      }
 
       if (removeReorg && reorgLayer!=null )
       {
@@ -117,6 +116,14 @@ class Model extends numerix.Model
          }
       }
       outputLayer = current.layer;
+      optimizeLayers();
+      loadMs = (haxe.Timer.stamp()-t0)*1000.0;
+   }
+
+   // Weights read per second, in MB
+   public function getLoadThroughput() : Float
+   {
+      return weightsReadMs>0 ? weightsMb*1000.0/weightsReadMs : 0.0;
    }
 
    function checkData(w)
@@ -125,7 +132,7 @@ class Model extends numerix.Model
          throw "Could not open associated weights file '"+weightName+"'";
    }
 
-   function createLayer(file:haxe.io.Input, config:Dynamic, params:Params) : Params
+   function createLayer(file:WeightsReader, config:Dynamic, params:Params) : Params
    {
       var name = config.class_name;
       switch(name)
@@ -154,31 +161,34 @@ class Model extends numerix.Model
             var c = params.channels;
             //println('Convolutional $w,$h,$c');
 
-            var buffer = Bytes.alloc(n*4);
             checkData(file);
-            file.readBytes(buffer,0,n*4);
-            var bias = Tensor.fromBytes(buffer,Nx.float32,[n]);
+            var lazy = Conv2D.defaultLazyWeights;
+            var read = lazy ? file.mapFloats : file.readFloats;
+            var bias = read([n]);
 
             if (config.batch_normalize)
             {
                // output scales, mean, variance
-               file.readBytes(buffer,0,n*4);
-               var scales = Tensor.fromBytes(buffer,Nx.float32,[n]);
-               file.readBytes(buffer,0,n*4);
-               var means = Tensor.fromBytes(buffer,Nx.float32,[n]);
-               file.readBytes(buffer,0,n*4);
-               var vars = Tensor.fromBytes(buffer,Nx.float32,[n]);
+               var scales = read([n]);
+               var means = read([n]);
+               var vars = read([n]);
 
                conv2D.setNormalization(scales, means, vars);
             }
-            var buffer = Bytes.alloc(n*c*size*size*4);
-            file.readBytes(buffer,0,buffer.length);
-            var weights = Tensor.fromBytes(buffer,Nx.float32,[n,c,size,size]);
-            weights = weights.reorder([0,2,3,1],true);
-            //println(" weight " + weights.min + "..." + weights.max );
-            //println('Conv2D $weights $bias');
-
-            conv2D.setWeights([weights,bias]);
+            if (lazy)
+            {
+               // Left as stored, [n,c,size,size], until the layer runs
+               conv2D.setLazyWeights([file.mapFloats([n,c,size,size]),bias]);
+            }
+            else
+            {
+               // Stored [n,c,size,size], read as [n,size,size,c]
+               var weights = file.readConvWeights(n,c,size);
+               //println(" weight " + weights.min + "..." + weights.max );
+               //println('Conv2D $weights $bias');
+
+               conv2D.setWeights([weights,bias]);
+            }
             if (conv2D.padding==PadSame)
             {
                return new Params(
@@ -0,0 +1,78 @@
+package numerix.darknet;
+
+import numerix.Tensor;
+import numerix.Loader;
+
+/*
+ Reads a darknet .weights file natively - the file is mapped, and each read copies the next
+ floats straight into a new tensor.  See project/include/Darknet.h.
+*/
+class WeightsReader
+{
+   public var major(default,null):Int;
+   public var minor(default,null):Int;
+   public var revision(default,null):Int;
+   public var seen(default,null):Float;
+   // Connected-layer weights were saved transposed - readMatrix undoes it
+   public var transpose(default,null):Bool;
+
+   var handle:Dynamic;
+
+   // Throws if the file can not be opened
+   public function new(filename:String)
+   {
+      handle = dnOpen(filename);
+      if (handle==null)
+         throw "Could not open weights file '" + filename + "'";
+      var header = dnGetHeader(handle);
+      major = header.major;
+      minor = header.minor;
+      revision = header.revision;
+      seen = header.seen;
+      transpose = header.transpose;
+   }
+
+   public function readFloats(shape:Array<Int>) : Tensor
+   {
+      return Tensor.fromHandle( dnReadFloats(handle, shape) );
+   }
+
+   // n x c x size x size in the file, as [n,size,size,c]
+   public function readConvWeights(n:Int, c:Int, size:Int) : Tensor
+   {
+      return Tensor.fromHandle( dnReadConvWeights(handle, n, c, size) );
+   }
+
+   public function readMatrix(rows:Int, cols:Int) : Tensor
+   {
+      return Tensor.fromHandle( dnReadMatrix(handle, rows, cols) );
+   }
+
+   // The next floats, using the file in place - nothing is read until the tensor is used, and
+   //  it keeps the file mapped after close
+   public function mapFloats(shape:Array<Int>) : Tensor
+   {
+      return Tensor.fromHandle( dnMapFloats(handle, shape) );
+   }
+
+   // The data read so far, the time spent reading it, and the data mapped for later
+   public function getStats() : { mb:Float, readMs:Float, mappedMb:Float }
+   {
+      return dnGetStats(handle);
+   }
+
+   public function close()
+   {
+      dnClose(handle);
+      handle = null;
+   }
+
+   static var dnOpen = Loader.load("dnOpen","so");
+   static var dnGetHeader = Loader.load("dnGetHeader","oo");
+   static var dnReadFloats = Loader.load("dnReadFloats","ooo");
+   static var dnReadConvWeights = Loader.load("dnReadConvWeights","oiiio");
+   static var dnReadMatrix = Loader.load("dnReadMatrix","oiio");
+   static var dnMapFloats = Loader.load("dnMapFloats","ooo");
+   static var dnGetStats = Loader.load("dnGetStats","oo");
+   static var dnClose = Loader.load("dnClose","ov");
+}
@@ -30,6 +30,7 @@ class Model extends numerix.Model
             layers.push(layer);
          }
          outputLayer = prev;
+         optimizeLayers();
       }
       catch(e:Dynamic)
       {
@@ -75,9 +76,9 @@ class Model extends numerix.Model
 
             var conv2D = new SeparableConv2D(cfg, prev);
             var dweights = file.read('model_weights/$data/$data/depthwise_kernel:0');
-            dweights = dweights.reorder([3,2,0,1],true);
-            var s = dweights.shape;
-            dweights.setShape([s[1],s[2],s[3]]);
+            // [kh,kw,in,multiplier] -> [in,multiplier,kh,kw], so channel in*multiplier+m
+            //  lines up with the pointwise inputs
+            dweights = dweights.reorder([2,3,0,1],true);
             trace(dweights);
             var pweights = file.read('model_weights/$data/$data/pointwise_kernel:0');
             pweights = pweights.reorder([0,1,3,2],true);
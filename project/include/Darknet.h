@@ -0,0 +1,67 @@
+#ifndef DARKNET_H_INCLUDED
+#define DARKNET_H_INCLUDED
+
+#include "Tensor.h"
+
+namespace numerix
+{
+
+/*
+ Reads a darknet .weights file - a header, then each layer's floats in the order the .cfg
+ lists the layers.
+
+ The header is major, minor and revision, then the number of images seen in training, which
+ is 64 bits from version 0.2 and 32 before.  A major or minor over 1000 marks a file whose
+ connected-layer weights were saved transposed, and its count is 32 bits whatever the version.
+
+ The file is mapped, and each read copies the next floats straight into a new tensor -
+ convolution weights are reordered from darknet's [n][c][fy][fx] to [n][fy][fx][c] as they
+ are copied, so there is no separate pass.  The floats are little-endian, as the host.
+*/
+
+class DarknetWeights
+{
+public:
+   // Returns null if the file can not be mapped, and throws if the header is short
+   static DarknetWeights *open(const char *inFilename);
+   ~DarknetWeights();
+
+   int    major;
+   int    minor;
+   int    revision;
+   double seen;
+   bool   transpose;
+
+   // The next floats, as a tensor of inShape
+   Tensor *readFloats(const Shape &inShape);
+   // The next inN*inC*inSize*inSize floats, as [n][size][size][c]
+   Tensor *readConvWeights(int inN, int inC, int inSize);
+   // The next inRows*inCols floats, as [rows][cols] - stored [cols][rows] when 'transpose'
+   Tensor *readMatrix(int inRows, int inCols);
+   // The next floats as a tensor of inShape using the file in place, for weights read later
+   //  (see Layer::createConv2DLazy).  The tensors keep the file mapped.
+   Tensor *mapFloats(const Shape &inShape);
+
+   size_t getPosition() const { return position; }
+   size_t getSize() const { return file->getSize(); }
+
+   // For the load throughput - the bytes read so far, and the time spent reading them
+   size_t bytesRead;
+   double readTime;
+   // Mapped for later, rather than read
+   size_t bytesMapped;
+
+private:
+   DarknetWeights(MappedFile *inFile);
+   DarknetWeights(const DarknetWeights &);
+   void operator=(const DarknetWeights &);
+
+   const float *next(size_t inCount);
+
+   MappedFile *file;
+   size_t     position;
+};
+
+}
+
+#endif
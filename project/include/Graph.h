@@ -0,0 +1,83 @@
+#ifndef GRAPH_H_INCLUDED
+#define GRAPH_H_INCLUDED
+
+#include "Layer.h"
+
+namespace numerix
+{
+
+/*
+ A model lowered to an ordered list of layer calls, so a whole inference is one native call.
+
+ Each step reads one or two slots and writes its own; slot 0 is the model input.
+ The slots keep their tensors between runs, so layers reuse them while the shapes match.
+ The layers are not owned - the caller keeps them alive.
+
+ Independent branches - the steps between a fork and the step that joins them again, when
+  each depends on just one side - run at the same time on shares of the worker pool, sized by
+  the branches' last run times (see RunBranches).  This starts from the second run at an input
+  shape, once the first has sized the buffers and checked the layers on the calling thread.
+ A stage whose branches share any result memory (see MemoryPlan) runs in step order instead.
+*/
+class Graph
+{
+   struct Step
+   {
+      Layer *layer;
+      int   src0;
+      int   src1;
+      int   dest;
+   };
+
+   // A single step, or the branches that can run at the same time
+   struct Stage
+   {
+      int step;
+      std::vector< std::vector<int> > branches;
+   };
+
+   std::vector<Step>     steps;
+   std::vector<Tensor *> slots;
+   int                   output;
+   std::vector<Stage>    stages;
+   bool                  staged;
+   Shape                 warmShape;
+
+   void makeStages();
+   void runStep(int inStep, std::vector<Tensor *> &ioSlots);
+   void runStage(const Stage &inStage, bool inParallel);
+   bool branchesShareData(const Stage &inStage);
+
+public:
+   enum { InputSlot = 0 };
+
+   Graph();
+   ~Graph();
+
+   // Tensors are referenced, and may be replaced when a layer reallocates
+   int addConstant(Tensor *inTensor);
+   // inSrc1 may be -1 for single-input layers, and both for layers without inputs
+   int addLayer(Layer *inLayer, int inSrc0, int inSrc1, Tensor *inBuffer);
+   void setOutput(int inSlot);
+
+   int  getStepCount() const { return steps.size(); }
+   int  getBranchStageCount();
+   Tensor *getSlot(int inSlot) { return slots[inSlot]; }
+   Layer  *getStepLayer(int inStep) { return steps[inStep].layer; }
+   int     getOutput() const { return output; }
+   // The step writing the output, or null if it is the input or a constant
+   Layer  *getOutputLayer();
+
+   // For running several inputs at once, each part-way through the graph (see Pipeline).
+   // copySlots references the constants and leaves the input and layer results empty, and
+   //  runSteps runs steps [inFirst,inEnd) in order against those slots.
+   void copySlots(std::vector<Tensor *> &outSlots);
+   void runSteps(int inFirst, int inEnd, std::vector<Tensor *> &ioSlots);
+
+   // The result belongs to the graph
+   Tensor *run(Tensor *inInput);
+};
+
+}
+
+#endif
@@ -42,6 +42,36 @@ typedef std::vector<BBox> Boxes;
 void SortBoxes(Boxes &ioBoxes);
 
 
+// A convolution's weights as its kernels run them (see Model.saveCompiled).
+// algo names the layout - "gemm", "gemm16", "int8", or "wino2".."wino6" - and packed holds
+//  the buffers for it.  weights and bias are after normalization, for anything that has to
+//  rebuild later.  The rest records the choice made for the input size.
+struct CompiledWeights
+{
+   std::string algo;
+   int         block;
+   int         srcW;
+   int         srcH;
+   int         batch;
+   float       range;
+   Tensor      *weights;
+   Tensor      *bias;
+   std::vector<Tensor *> packed;
+
+   CompiledWeights();
+   ~CompiledWeights();
+
+   void setWeights(Tensor *inWeights, Tensor *inBias);
+   void addPacked(DataType inType, int inCount, const void *inData);
+   // The data of packed[inIndex], if it has the type and count and is aligned for the kernels
+   const void *getPacked(int inIndex, DataType inType, int inCount) const;
+
+private:
+   CompiledWeights(const CompiledWeights &);
+   void operator=(const CompiledWeights &);
+};
+
+
 
 class Layer
 {
@@ -65,6 +95,13 @@ public:
                               Tensor *weights, Tensor *pweights, Tensor *bias,
                               bool inAllowTransform);
 
+   // As createConv2D, with the weights as a file stores them - [outputs][inputs][fy][fx], as
+   //  darknet and caffe save them - usually mapped in place.  Nothing is read or reordered
+   //  until the first run, so layers that never run cost neither the time nor the memory.
+   static Layer *createConv2DLazy(int inStrideY, int inStrideX,
+                                  Activation activation, Padding padding,
+                                  Tensor *fileWeights, Tensor *bias, bool inAllowTransform);
+
    static Layer *createMaxPool(int inSizeX, int inSizeY,
                                int inStrideY, int inStrideX,
                                Padding padding);
@@ -103,6 +140,37 @@ public:
 
    virtual void setActivation(Activation inActivation) { }
 
+   // Int8 quantization (convolutions).  While calibrating, the layer records the largest
+   //  input magnitude it sees.  setQuantize runs it in int8 for inputs up to inRange, or back in
+   //  Float32 for 0, and returns false if the layer has no int8 path.
+   virtual void setCalibrate(bool inCalibrate) { }
+   virtual float getInputRange() { return 0; }
+   virtual bool setQuantize(float inRange) { return false; }
+   // Keep the packed weights as fp16, converted as the kernels load them.  False if not supported.
+   virtual bool setHalfWeights(bool inHalf) { return false; }
+
+   // Fusion (see Model.optimizeLayers).  A convolution can take on a following 2x2 stride-2 max
+   //  pool, and a following sum with a second input (then passed to run as inSrc1) along with
+   //  the sum's activation.  The sum comes before the pool.  False if the layer can not.
+   virtual bool setFusedPool(bool inFuse, Padding inPadding) { return false; }
+   virtual bool setFusedSum(bool inFuse, Activation inActivation) { return false; }
+   // A concat can run the layer making one of its inputs, which then writes its result straight
+   //  into its channels of the concat result.  inSrc is then that layer's input.
+   virtual bool setFusedInput(int inIndex, Layer *inProducer) { return false; }
+   // Writes the result into inSlice, a channel slice (see Tensor::sliceChannels) the size of
+   //  the result.  False if the layer can not, so the caller should copy.
+   virtual bool runInto(Tensor *inSrc0, Tensor *inSlice) { return false; }
+   // The result size for an input, for layers that can tell before running
+   virtual bool getOutputSize(Tensor *inSrc0, int &outW, int &outH, int &outChannels) { return false; }
+   // False for layers driving a device, which are not run from pool workers (see RunBranches)
+   virtual bool runsOnCpu() { return true; }
+   // False for layers that only take one image at a time, so a batch must be run image by image
+   virtual bool canBatch() { return true; }
+   // The weights as they run, once a run has chosen the algorithm.  setCompiled uses them in
+   //  place of building its own, and returns false if they do not fit, or have no layout here.
+   virtual bool getCompiled(CompiledWeights &outWeights) { return false; }
+   virtual bool setCompiled(const CompiledWeights &inWeights) { return false; }
+
    virtual double getRunTime();
 
    static Layer *createYolo(const std::vector<float> &inAnchors,int inBoxCount, int inClassCount, float inThresh);
@@ -112,6 +180,8 @@ public:
    void endRun();
 
    float *allocFloats(int count,bool inZero=false);
+   // One zeroed buffer per worker, allocated and first-touched by that worker
+   void   allocWorkerFloats(std::vector<float *> &outBuffers, int count);
    void   releaseFloats();
 
 
@@ -134,9 +204,12 @@ protected:
    int        inputs;
    int        outputs;
    int        diSize;
+   int        depthMultiplier;
    bool       padInputsWithZero;
    bool       isDeconvolution;
 
+   // Images in the current run - the tensors are N*H*W*C, or H*W*C for 1
+   int        batch;
    int        srcW;
    int        srcH;
    int        destW;
@@ -155,9 +228,50 @@ protected:
    Tensor     *pweights;
    Tensor     *bias;
 
-   bool       is1x1Aligned;
    bool       is1x1;
-
+   bool       calibrating;
+   float      inputRange;
+   // Inputs are scaled by 127/quantRange into int8 when this is set
+   float      quantRange;
+   bool       halfWeights;
+
+   // Fused epilogue - the result plus residual through sumActivation, then the 2x2 max pool,
+   //  written to pixels outStride floats apart, which is more than 'outputs' into a slice
+   bool       fusePool;
+   Padding    poolPadding;
+   bool       fuseSum;
+   Activation sumActivation;
+   Tensor     *residual;
+   bool       intoSlice;
+   int        outStride;
+   int        poolW;
+   int        poolH;
+   // The result before the epilogue, for algorithms that can not fuse it
+   Tensor     *unfused;
+   class ConvEpilogue *epilogue;
+
+   // Caps the pixels (or tiles) handled per job - 0 uses the cache-budget default
+   int        blockLimit;
+
+   // Changes to the weights only set this, and rebuildWeights runs before the next run, so a
+   //  model set up in several steps builds once, and compiled weights not at all
+   bool       weightsChanged;
+   // Compiled buffers the packed weights point into
+   std::vector<Tensor *> compiledTensors;
+
+   bool fitsCompiled(const CompiledWeights &inWeights);
+   void holdCompiled(const CompiledWeights &inWeights);
+   void releaseCompiled();
+
+   // From createConv2DLazy - 'weights' is a view of the file data, still in its order, and
+   //  'bias' may be mapped too.  loadWeights copies them, and applies the normalization held here.
+   bool       weightsInFile;
+   Tensor     *heldScales;
+   Tensor     *heldMeans;
+   Tensor     *heldVars;
+
+   void loadWeights();
+   void releaseHeldNormalization();
 
 
 public:
@@ -169,23 +283,61 @@ public:
 
    void setPadInput() { padInputsWithZero = true; }
 
+   void setWeightsInFile() { weightsInFile = true; weightsChanged = true; }
+   bool isWeightsInFile() const { return weightsInFile; }
+
    virtual void rebuildWeights() { };
 
    void setNormalization(Tensor *inScales, Tensor *inMeans, Tensor *inVars);
 
    void setActivation(Activation inActivation) { activation=inActivation; }
 
+   void setBlockLimit(int inLimit) { blockLimit = inLimit; }
+
+   void setCalibrate(bool inCalibrate);
+   float getInputRange() { return inputRange; }
+
+   bool setFusedPool(bool inFuse, Padding inPadding);
+   bool setFusedSum(bool inFuse, Activation inActivation);
+   bool getOutputSize(Tensor *inSrc0, int &outW, int &outH, int &outChannels);
+   bool runInto(Tensor *inSrc0, Tensor *inSlice);
+
    void reduceInputs(int inCount);
 
    void removeMean( const std::vector<float> &inMean );
 
 
    Tensor *run(Tensor *inSrc0, Tensor *inBuffer);
+   Tensor *run(Tensor *inSrc0, Tensor *inSrc1, Tensor *inBuffer);
+   // With inSlice, inBuffer is a channel slice to write, rather than a buffer to reuse
+   Tensor *runFused(Tensor *inSrc0, Tensor *inResidual, Tensor *inBuffer, bool inSlice);
 
    virtual void doRun(Tensor *input, Tensor *output) = 0;
+   // Runs with the epilogue into the final output, or returns false to have it done in a
+   //  separate pass over the plain result
+   virtual bool doRunFused(Tensor *input, Tensor *output) { return false; }
+
+protected:
+   void setSizes(Tensor *inSrc0);
 };
 
 
+// When autotuning, convolutions time each eligible algorithm and blocking on their first
+//  run at a new size, and keep the fastest.  Results are remembered by layer geometry, cpu
+//  model, kernels and worker count, and kept in inCacheFile if it is not empty.
+void SetConvAutotune(bool inAutotune, const std::string &inCacheFile);
+bool GetConvAutotune();
+// Forces "direct", "wino2", "wino4" or "wino6" on the convolutions that can use it (also
+//  NX_CONV_ALGO=...), for testing and benchmarking.  Null or "" restores the cost model.
+// Layers choose on their first run at a size.  Returns false for an unknown name.
+bool SetConvAlgo(const char *inAlgo);
+bool FindTuning(const std::string &inKey, std::string &outChoice);
+void StoreTuning(const std::string &inKey, const std::string &inChoice);
+
+// Weights [outputs][inputs][filters] as [outputs][filters][inputs], across the workers
+void ReorderFileWeights(float *outDest, const float *inSrc, int inOutputs, int inInputs, int inFilters);
+
+
 
 
 
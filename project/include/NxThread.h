@@ -25,8 +25,17 @@ ThreadId GetThreadId();
 bool IsMainThread();
 void SetMainThread();
 
+// Seconds, from the finest clock the platform has - defined in Layer.cpp
+double GetTimeStamp();
+
 typedef HxMutex NxMutex;
 
+// For settings other threads read without a lock - stores with a full barrier
+inline void NxAtomicSet(volatile int *outValue, int inValue)
+{
+   while(!HxAtomicExchangeIf(*outValue, inValue, outValue)) { }
+}
+
 struct NxAutoMutex
 {
    NxMutex &mutex;
@@ -41,9 +50,44 @@ struct NxAutoMutex
 };
 
 
+// Includes the calling thread, so size thread-indexed scratch with this
 extern int GetWorkerCount();
+// Defaults to one worker per available core, or the NX_THREADS environment variable.
+// Only takes effect before the pool starts - returns the count that will be used.
+// The pool may end up smaller if the system will not create that many threads.
+int SetWorkerCount(int inCount);
+// Pin each worker to its own core (also NX_AFFINITY=1), filling one numa node first
+void SetWorkerAffinity(bool inPin);
+int GetWorkerNode(int inThreadId);
+// How long idle workers, and callers waiting for a task, spin before sleeping.
+// Defaults to 50us when there are spare cores, or the NX_SPIN_US environment variable.
+// 0 sleeps straight away.  May be changed while the pool is running.
+void SetWorkerSpin(int inMicroseconds);
+
+// The calling thread runs inFunc as thread 0, and the pool as 1..GetWorkerCount()-1.
+// inFunc must pull its jobs from a shared counter (eg, Layer::getNextJob) - once the
+//  caller's own call returns, pool slots that have not started yet are dropped.
 typedef void (*WorkerFunc)(int inThreadId, void *inData);
 void RunWorkerTask( WorkerFunc inFunc, void *inData );
+// Runs inFunc exactly once on every worker, eg to first-touch per-thread memory
+void RunOnEachWorker( WorkerFunc inFunc, void *inData );
+
+// Calls inFunc over [0,inCount) in chunks of inGrain, spread over the workers.
+// Several tasks may be in flight at once, from different threads.
+typedef void (*RangeFunc)(int inThreadId, int inBegin, int inEnd, void *inData);
+void ParallelFor( int inCount, int inGrain, RangeFunc inFunc, void *inData );
+
+// Runs inFunc for branches [0,inCount) at the same time, each on its own share of the
+//  workers - branch 0 on the calling thread, the others on the first worker of their share.
+// Tasks a branch starts (RunWorkerTask, ParallelFor, or RunBranches again) stay on its share.
+// inWeights, if given, sizes the shares.  The branches run one after the other when there are
+//  fewer workers than branches, or when branches are disabled.
+// Returns false if a branch on a worker threw - it should be run again on the calling thread.
+typedef void (*BranchFunc)(int inBranch, void *inData);
+bool RunBranches( int inCount, BranchFunc inFunc, void *inData, const double *inWeights=0 );
+// On by default, or the NX_BRANCHES environment variable.  May be changed while the pool is
+//  running - RunBranches calls already started keep their split.
+void SetWorkerBranches(bool inEnable);
 
 
 }
@@ -19,6 +19,14 @@
   #endif
 #endif
 
+// Inlined whatever the optimiser thinks, so templates used from the wider kernels are compiled
+//  for the caller's instruction set
+#ifdef _MSC_VER
+  #define NX_INLINE __forceinline
+#else
+  #define NX_INLINE inline __attribute__((always_inline))
+#endif
+
 namespace numerix
 {
 
@@ -34,6 +42,9 @@ typedef float AlignedFloat __attribute__((aligned(sizeof(float32x4_t))));
 #define Const4f32(c) vdupq_n_f32(c)
 #define Max4f32(a,b) vmaxq_f32(a,b)
 #define Store4f32(ptr, value)  vst1q_f32( (AlignedFloat *) (ptr) , (value) )
+#define LoadU4f32(ptr) vld1q_f32( (const float *) (ptr) )
+#define StoreU4f32(ptr, value)  vst1q_f32( (float *) (ptr) , (value) )
+#define Splat4f32(ptr) vld1q_dup_f32( (const float *) (ptr) )
 #define LaneF32(val, lane)  vgetq_lane_f32( val , lane )
 
 inline float Accumulate4f32(float32x4_t v)
@@ -75,7 +86,10 @@ typedef __m128 float32x4_t;
 #define Const4f32(c) _mm_set1_ps(c)
 #define Max4f32(a,b) _mm_max_ps(a,b)
 #define Store4f32(ptr, value)  _mm_store_ps(ptr, value)
-#define LaneF32(a, lane)  (a).m128_f32[lane]
+#define LoadU4f32(ptr) _mm_loadu_ps(ptr)
+#define StoreU4f32(ptr, value)  _mm_storeu_ps(ptr, value)
+#define Splat4f32(ptr) _mm_load1_ps(ptr)
+#define LaneF32(a, lane)  ((const float *)&(a))[lane]
 
 inline float Accumulate4f32(float32x4_t v) {
      // v : abcd
@@ -127,159 +141,24 @@ struct psimd_f32
    inline psimd_f32 &operator-=(const psimd_f32 &o) { val = Sub4f32(val,o.val); return *this;  }
    //inline psimd_f32 operator-() const { return _mm_xor_ps(val, Const4f32(-0.f));  }
    
-   inline float operator[](int lane) { return LaneF32(val, lane); }
+   inline float operator[](int lane) { return ((const float *)&val)[lane]; }
+
+   static inline psimd_f32 splat(float c) { return Const4f32(c); }
+   inline void store(float *outPtr) const { Store4f32(outPtr, val); }
 };
-inline psimd_f32 psimd_splat_f32(float c) { return Const4f32(c); }
-inline void psimd_f32_store(float *outPtr, const psimd_f32 &inVal) { Store4f32(outPtr, inVal.val); }
 
 #endif
 
-/*
- Here we attempt to re-use the same 4 source channels with 4 consecutive outputs.
- The weights have been pre-arranged to have 4 outputs grouped into blocks of 4, like:
-  W :   A0 A1 A2 A3 B0 B1 B2 B3 C0 C1 C2 C3 D0 D1 D2 D3 A4 A5 A6 A7 B4 .....
-Src :   S0 S1 S2 S3  S4 S5 S6 ....
-
-We want outputA = S0*A0 + S1*A1 + S2*A2 + S3*A3 + S4*A4 + ...
-        outputB = S0*B0 + S1*B1 + S2*B2 + S3*B3 + S4*B4 + ...
-        outputC = S0*C0 + S1*C1 + S2*C2 + S3*C3 + S4*C4 + ...
-        outputD = S0*D0 + S1*D1 + S2*D2 + S3*D3 + S4*D4 + ...
-
-The inputs have been padded to be multiples of 4, and n is the input count/4
-
-*/
-
-inline void dot4Interlaced(float *dest, const float *alignedBias, const float *wABCD, const float *inSrc, int n, Activation activation)
+inline float activate(float inVal, Activation inActivation)
 {
-   #ifdef NUMERIX_SIMD
-   if (true)
+   switch(inActivation)
    {
-      int eights = n>>1;
-
-      float32x4_t src;
-      float32x4_t sum0;
-      float32x4_t sum1;
-      float32x4_t sum2;
-      float32x4_t sum3;
-      float32x4_t wa;
-
-      const float *w = wABCD;
-      const float *srcPtr = inSrc;
-
-      #define AccumulateF32x4 \
-         src = Load4f32(srcPtr); \
-         srcPtr += 4; \
-         wa = Load4f32(w); \
-         wa = Mul4f32(src,wa); \
-         sum0 = Add4f32(sum0,wa); \
-    \
-         wa = Load4f32(w+4); \
-         wa = Mul4f32(src,wa); \
-         sum1 = Add4f32(sum1,wa); \
-   \
-         wa = Load4f32(w+8); \
-         wa = Mul4f32(src,wa); \
-         sum2 = Add4f32(sum2,wa); \
-    \
-         wa = Load4f32(w+12); \
-         w+=16; \
-         wa = Mul4f32(src,wa); \
-         sum3 = Add4f32(sum3,wa);
-
-
-      // First one - no 'add', just 'mul'
-      src = Load4f32(srcPtr);
-      srcPtr += 4;
-      wa = Load4f32(w);
-      sum0 = Mul4f32(src,wa);
-
-      wa = Load4f32(w+4);
-      sum1 = Mul4f32(src,wa);
-
-      wa = Load4f32(w+8);
-      sum2 = Mul4f32(src,wa);
-
-      wa = Load4f32(w+12);
-      w+=16;
-      sum3 = Mul4f32(src,wa);
-
-      int fours = n-1;
-
-      if (fours&1)
-      {
-         AccumulateF32x4;
-      }
-
-      if (fours&2)
-      {
-         AccumulateF32x4;
-         AccumulateF32x4;
-      }
-
-      int sixteens = fours>>2;
-      for(int i=0;i<sixteens;i++)
-      {
-         AccumulateF32x4;
-         AccumulateF32x4;
-         AccumulateF32x4;
-         AccumulateF32x4;
-      }
-
-      SumRows4x4f32(sum0, sum1, sum2, sum3)
-
-      float32x4_t bias = Load4f32(alignedBias);
-
-
-      sum0 = Add4f32(sum0,bias);
-      if (activation==actRelu)
-         sum0 = Max4f32(sum0, Zero4f32);
-      else if (activation==actLeaky)
-         sum0 = Max4f32( sum0, Mul4f32(sum0, Const4f32(0.1f)) );
-      Store4f32(dest, sum0);
-   }
-   else
-   #endif
-   {
-      const float *src = inSrc;
-      float sum0 = alignedBias[0];
-      float sum1 = alignedBias[1];
-      float sum2 = alignedBias[2];
-      float sum3 = alignedBias[3];
-      for(int i=0;i<n;i++)
-      {
-         sum0 += src[0]*wABCD[0] + src[1]*wABCD[1] + src[2]*wABCD[2] + src[3]*wABCD[3];
-         wABCD += 4;
-         sum1 += src[0]*wABCD[0] + src[1]*wABCD[1] + src[2]*wABCD[2] + src[3]*wABCD[3];
-         wABCD += 4;
-         sum2 += src[0]*wABCD[0] + src[1]*wABCD[1] + src[2]*wABCD[2] + src[3]*wABCD[3];
-         wABCD += 4;
-         sum3 += src[0]*wABCD[0] + src[1]*wABCD[1] + src[2]*wABCD[2] + src[3]*wABCD[3];
-         wABCD += 4;
-         src+=4;
-      }
-
-      if (activation==actRelu)
-      {
-         dest[0] = sum0 < 0 ? 0 : sum0;
-         dest[1] = sum1 < 0 ? 0 : sum1;
-         dest[2] = sum2 < 0 ? 0 : sum2;
-         dest[3] = sum3 < 0 ? 0 : sum3;
-      }
-      else if (activation==actLeaky)
-      {
-         dest[0] = sum0 < 0 ? sum0*0.1f : sum0;
-         dest[1] = sum1 < 0 ? sum1*0.1f : sum1;
-         dest[2] = sum2 < 0 ? sum2*0.1f : sum2;
-         dest[3] = sum3 < 0 ? sum3*0.1f : sum3;
-      }
-      else
-      {
-         dest[0] = sum0;
-         dest[1] = sum1;
-         dest[2] = sum2;
-         dest[3] = sum3;
-      }
+      case actRelu: return inVal<0 ? 0 : inVal;
+      case actLeaky: return inVal<0 ? inVal*0.1f : inVal;
+      case actSigmoid: return 1.0 / (1.0 + exp(-inVal));
+      default: ;
    }
+   return inVal;
 }
 
 /*
@@ -413,8 +292,391 @@ inline float dotSkip(const float *w, const float *s, int n, int inSkip)
    return sum;
 }
 
+/*
+ Depthwise filter on NHWC data, for one output pixel:
+
+   dest[d] = Sum_t src[t][d] * w[t][d]
+
+ where each of the 'taps' (valid filter positions) points at the input pixel channels and the
+ matching filter weights, which are stored [fy][fx][d] so they are also contiguous.
+*/
+inline void depthwise(float *dest, const float *const *src, const float *const *w, int taps, int n)
+{
+   int d = 0;
+   #ifdef NUMERIX_SIMD
+   for(;d+8<=n;d+=8)
+   {
+      float32x4_t sum0 = Zero4f32;
+      float32x4_t sum1 = Zero4f32;
+      for(int t=0;t<taps;t++)
+      {
+         sum0 = Add4f32(sum0, Mul4f32(LoadU4f32(src[t]+d), LoadU4f32(w[t]+d)));
+         sum1 = Add4f32(sum1, Mul4f32(LoadU4f32(src[t]+d+4), LoadU4f32(w[t]+d+4)));
+      }
+      StoreU4f32(dest+d, sum0);
+      StoreU4f32(dest+d+4, sum1);
+   }
+   #endif
+   for(;d<n;d++)
+   {
+      float sum = 0;
+      for(int t=0;t<taps;t++)
+         sum += src[t][d] * w[t][d];
+      dest[d] = sum;
+   }
+}
+
+
+/*
+ Packed GEMM, used by Conv2D:
+
+   dest[m][n] = act( bias[n] + Sum_k src[m][k] * W[n][k] )
+
+ W is packed into panels of GEMM_NR outputs, k-major, zero-padded past the last output:
+   panel p :  W[8p+0][0] W[8p+1][0] ... W[8p+7][0]  W[8p+0][1] W[8p+1][1] ...
+
+ so each k step loads one row of 8 weights, and the GEMM_MR source values are
+ broadcast.  The source rows therefore need no packing - they can be im2col rows or
+ pixels read straight from the input tensor.
+*/
+#define GEMM_MR 4
+#define GEMM_NR 8
+
+inline int gemmPanelCount(int inOutputs) { return (inOutputs + GEMM_NR-1)/GEMM_NR; }
+
+// outPanels needs gemmPanelCount(inOutputs)*GEMM_NR*inK floats
+void packGemmWeights(float *outPanels, const float *inWeights, int inOutputs, int inK, int inWeightStride);
+
+// Computes a rows x cols (<= GEMM_MR x GEMM_NR) tile of dest, over k values.
+// src holds GEMM_MR row pointers - unused ones may repeat a valid row.
+// When 'accumulate' is set the tile adds to dest, otherwise it starts from bias[0..7].
+// Only pass an activation with the last block of k.
+void gemmKernel(float *dest, int destStride, const float *const *src, const float *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols);
+
+
+/*
+ Int8 GEMM, used by quantized Conv2D:
+
+   dest[m][n] = act( bias[n] + scale[n] * Sum_k src[m][k] * W[n][k] )
+
+ src and W are symmetric int8, limited to [-127,127], and the sum is kept in int32 - so
+ the whole of k is done in one call.  k is zero-padded to a multiple of 4, and the panels
+ hold 4 consecutive k for each output, so one 32-bit broadcast of a source row lines up
+ with a whole row of the panel for the widening multiply-adds:
+   panel p :  W[8p+0][0..3] W[8p+1][0..3] ... W[8p+7][0..3]  W[8p+0][4..7] ...
+*/
+inline int gemmInt8K(int inK) { return (inK + 3) & ~3; }
+
+// outPanels needs gemmPanelCount(inOutputs)*GEMM_NR*gemmInt8K(inK) bytes
+void packGemmWeightsInt8(signed char *outPanels, const signed char *inWeights, int inOutputs, int inK, int inWeightStride);
+
+// As gemmKernel, but k must be a multiple of 4 and there is no accumulate
+void gemmKernelInt8(float *dest, int destStride, const signed char *const *src, const signed char *panel, int k,
+                    const float *scale, const float *bias, Activation activation, int rows, int cols);
+
+// dest[i] = round(src[i]*scale), clamped to [-127,127]
+void quantizeInt8(signed char *dest, const float *src, int n, float scale);
+
+
+// gemmKernel with the panel stored as fp16, converted as it is loaded.  Only the kernel sets
+//  with a hardware conversion have one - otherwise convert a block of the panel with
+//  halfToFloat and use gemm.
+typedef void (*GemmF16Func)(float *dest, int destStride, const float *const *src, const unsigned short *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols);
+
+
+
+#ifdef NUMERIX_SIMD
+/*
+ 
+ Winograd transform taken from 'nnpack':
+
+Copyright (c) 2017 Facebook Inc.
+Copyright (c) 2015-2017, Georgia Institute of Technology
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ The 1D transforms of Winograd F(m x m, 3x3) - see Conv2DWinograd.  They read values 'is' floats
+  apart and write them 'os' floats apart, one vector V of channels at a time, so the same code
+  runs 4 channels with psimd_f32, or 8 and 16 in the wider kernels.
+*/
+template<int M> struct WinoTransform { };
+
+template<> struct WinoTransform<2>
+{
+   template<typename V>
+   static NX_INLINE void input(const float *in, int is, float *out, int os)
+   {
+      V d0(in);
+      V d1(in+is);
+      V d2(in+is*2);
+      V d3(in+is*3);
+      (d0 - d2).store(out);
+      (d1 + d2).store(out+os);
+      (d2 - d1).store(out+os*2);
+      (d1 - d3).store(out+os*3);
+   }
+
+   template<typename V>
+   static NX_INLINE void output(const float *in, int is, float *out, int os)
+   {
+      V m0(in);
+      V m1(in+is);
+      V m2(in+is*2);
+      V m3(in+is*3);
+      (m0 + m1 + m2).store(out);
+      (m1 - m2 - m3).store(out+os);
+   }
+};
+
+template<> struct WinoTransform<4>
+{
+   template<typename V>
+   static NX_INLINE void input(const float *in, int is, float *out, int os)
+   {
+      V d0(in);
+      V d1(in+is);
+      V d2(in+is*2);
+      V d3(in+is*3);
+      V d4(in+is*4);
+      V d5(in+is*5);
+      const V const_4 = V::splat(4.0f);
+      const V const_5 = V::splat(5.0f);
+      const V const_2 = V::splat(2.0f);
+
+      // o1,o2 = (d4 - 4 d2) -+ (4 d1 - d3)
+      V a = d4 - const_4*d2;
+      V b = const_4*d1 - d3;
+      // o3,o4 = (d4 - d2) -+ 2 (d1 - d3)
+      V c = d4 - d2;
+      V e = const_2*(d1 - d3);
+
+      (const_4*d0 - const_5*d2 + d4).store(out);
+      (a - b).store(out+os);
+      (a + b).store(out+os*2);
+      (c - e).store(out+os*3);
+      (c + e).store(out+os*4);
+      (const_4*d1 - const_5*d3 + d5).store(out+os*5);
+   }
+
+   template<typename V>
+   static NX_INLINE void output(const float *in, int is, float *out, int os)
+   {
+      V m0(in);
+      V m1(in+is);
+      V m2(in+is*2);
+      V m3(in+is*3);
+      V m4(in+is*4);
+      V m5(in+is*5);
+      V add12 = m1 + m2;
+      V sub12 = m1 - m2;
+      V add34 = m3 + m4;
+      V sub34 = m3 - m4;
+      (m0 + add12 + add34).store(out);
+      (sub12 + V::splat(2.0f)*sub34).store(out+os);
+      (add12 + V::splat(4.0f)*add34).store(out+os*2);
+      (sub12 + V::splat(8.0f)*sub34 + m5).store(out+os*3);
+   }
+};
+
+// From nnpack
+template<> struct WinoTransform<6>
+{
+   template<typename V>
+   static NX_INLINE void input(const float *in, int is, float *out, int os)
+   {
+      V d0(in);
+      V d1(in+is);
+      V d2(in+is*2);
+      V d3(in+is*3);
+      V d4(in+is*4);
+      V d5(in+is*5);
+      V d6(in+is*6);
+      V d7(in+is*7);
+      /*  Compute wd0 := d0 - d6  */
+      V wd0 = d0 - d6;
+      const V d4_sub_d2 = d4 - d2;
+      /*  Compute wd7 := d7 - d1  */
+      V wd7 = d7 - d1;
+      const V d3_sub_d5 = d3 - d5;
+      /*  Compute wd1 := d2 + d6  */
+      V wd1 = d2 + d6;
+      /*  Compute wd2 := d1 + d5  */
+      V wd2 = d1 + d5;
+      /*  Compute wd4 := d5 + 0.25 * d1  */
+      const V const_0_25 = V::splat(0.25f);
+      V wd4 = d5 + const_0_25 * d1;
+      /*  Compute wd5 := d6 - 5.0 * d4  */
+      V wd5 = d6 - V::splat(5.0f) * d4;
+      /*  Compute wd3 := d6 + 0.25 * d2  */
+      V wd3 = d6 + const_0_25 * d2;
+      /*  Compute wd6 := d1 + 0.25 * d5  */
+      V wd6 = d1 + const_0_25 * d5;
+
+      const V const_5_25 = V::splat(5.25f);
+      /*  Compute wd0 := (d0 - d6) + 5.25 * (d4 - d2)  */
+      wd0 += const_5_25 * d4_sub_d2;
+      /*  Compute wd7 := (d7 - d1) + 5.25 * (d3 - d5)  */
+      wd7 += const_5_25 * d3_sub_d5;
+
+      const V const_4_25 = V::splat(4.25f);
+      /*  Compute  */
+      /*    wd1 := (d6 + d2) - 4.25 * d4  */
+      /*    wd2 := (d1 + d5) - 4.25 * d3  */
+      wd1 -= const_4_25 * d4;
+      wd2 -= const_4_25 * d3;
+
+      const V const_1_25 = V::splat(1.25f);
+      /*  Compute  */
+      /*    wd3 := (d6 + 0.25 * d2) - 1.25 * d4  */
+      /*    wd4 := (d5 + 0.25 * d1) - 1.25 * d3  */
+      /*    wd6 := (d1 + 0.25 * d5) - 1.25 * d3  */
+      /*    wd5 := (d6 - 5.0 * d4) + 4.0 * d2  */
+      wd3 -= const_1_25 * d4;
+      const V d3_times_1_25 = d3 * const_1_25;
+      wd5 += V::splat(4.0f) * d2;
+      wd4 -= d3_times_1_25;
+      wd6 -= d3_times_1_25;
+
+      const V const_2 = V::splat(2.0f);
+      wd4 *= const_2;
+      wd6 *= const_2;
+      wd0.store(out);
+      (wd1 + wd2).store(out+os);
+      (wd1 - wd2).store(out+os*2);
+      (wd3 + wd4).store(out+os*3);
+      (wd3 - wd4).store(out+os*4);
+      (wd5 + wd6).store(out+os*5);
+      (wd5 - wd6).store(out+os*6);
+      wd7.store(out+os*7);
+   }
+
+   /*
+    * s0 = m0 + (m1 + m2) +      (m3 + m4) + 32 * (m5 + m6)
+    * s1 =      (m1 - m2) +  2 * (m3 - m4) + 16 * (m5 - m6)
+    * s2 =      (m1 + m2) +  4 * (m3 + m4) +  8 * (m5 + m6)
+    * s3 =      (m1 - m2) +  8 * (m3 - m4) +  4 * (m5 - m6)
+    * s4 =      (m1 + m2) + 16 * (m3 + m4) +  2 * (m5 + m6)
+    * s5 =      (m1 - m2) + 32 * (m3 - m4) +      (m5 - m6) + m7
+    */
+   template<typename V>
+   static NX_INLINE void output(const float *in, int is, float *out, int os)
+   {
+      V m0(in);
+      V m1(in+is);
+      V m2(in+is*2);
+      V m3(in+is*3);
+      V m4(in+is*4);
+      V m5(in+is*5);
+      V m6(in+is*6);
+      V m7(in+is*7);
+
+      const V m1_add_m2 = m1 + m2;
+      const V m1_sub_m2 = m1 - m2;
+      const V m3_add_m4 = m3 + m4;
+      const V m3_sub_m4 = m3 - m4;
+      const V m5_add_m6 = m5 + m6;
+      const V m5_sub_m6 = m5 - m6;
+
+      V s0 = m0 + m1_add_m2;
+      V s5 = m7 + m1_sub_m2;
+
+      const V const_16 = V::splat(16.0f);
+      V s1 = m1_sub_m2 + const_16 * m5_sub_m6;
+      V s4 = m1_add_m2 + const_16 * m3_add_m4;
+
+      const V const_8 = V::splat(8.0f);
+      V s2 = m1_add_m2 + const_8 * m5_add_m6;
+      V s3 = m1_sub_m2 + const_8 * m3_sub_m4;
+
+      const V const_32 = V::splat(32.0f);
+      s0 += const_32 * m5_add_m6;
+      s5 += const_32 * m3_sub_m4;
+
+      s0 += m3_add_m4;
+      s5 += m5_sub_m6;
+
+      const V const_2 = V::splat(2.0f);
+      s1 += m3_sub_m4 * const_2;
+      s4 += m5_add_m6 * const_2;
+
+      const V const_4 = V::splat(4.0f);
+      s2 += m3_add_m4 * const_4;
+      s3 += m5_sub_m6 * const_4;
+
+      s0.store(out);
+      s1.store(out+os);
+      s2.store(out+os*2);
+      s3.store(out+os*3);
+      s4.store(out+os*4);
+      s5.store(out+os*5);
+   }
+};
+
+#endif
+
+// A 1D Winograd transform over n channels (a multiple of 4)
+typedef void (*WinoFunc)(const float *in, int is, float *out, int os, int n);
+
+
+/*
+ dot, gemmKernel, gemmKernelInt8, depthwise, fp16 conversions and Winograd transforms also come in wider
+ versions (AVX2+FMA+F16C, AVX-512, with VNNI for int8 - see OpsX86.cpp).  The best set for the cpu is picked once at startup, so layers should call
+ through GetKernels() rather than the inline versions above.
+*/
+struct OpKernels
+{
+   const char *isa;
+   float (*dot)(float s0,const float *w, const float *s, int n, Activation activation);
+   void (*gemm)(float *dest, int destStride, const float *const *src, const float *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols);
+   void (*gemmInt8)(float *dest, int destStride, const signed char *const *src, const signed char *panel, int k,
+                    const float *scale, const float *bias, Activation activation, int rows, int cols);
+   GemmF16Func gemmF16;
+   void (*depthwise)(float *dest, const float *const *src, const float *const *w, int taps, int n);
+   void (*floatToHalf)(unsigned short *dest, const float *src, int n);
+   void (*halfToFloat)(float *dest, const unsigned short *src, int n);
+   // F(2x2), F(4x4) and F(6x6), at m/2-1 - null without NUMERIX_SIMD
+   WinoFunc winoInput[3];
+   WinoFunc winoOutput[3];
+};
+
+const OpKernels &GetKernels();
+// Force "generic", "sse", "neon", "avx2" or "avx512" (also NX_ISA=...) for benchmarking.
+// Null or "" restores the best choice.  Returns false if this cpu can not run the set.
+bool SetKernelIsa(const char *inIsa);
+const char *GetCpuName();
+
+// OpsX86.cpp - null if the cpu or compiler can not run them
+const OpKernels *GetAvx2Kernels();
+const OpKernels *GetAvx512Kernels();
+const char *GetX86CpuName();
 
 
+// Bulk conversions, through the best kernels for the cpu
 void floattofp16(unsigned char *dst, const float *src, unsigned nelem);
 void fp16tofloat(float *dst, const unsigned char *src, unsigned nelem);
 
@@ -0,0 +1,92 @@
+#ifndef PIPELINE_H_INCLUDED
+#define PIPELINE_H_INCLUDED
+
+#include "Graph.h"
+#include "NxThread.h"
+#include <deque>
+
+namespace numerix
+{
+
+/*
+ Runs a stream of inputs (eg, video frames) through a graph as a pipeline.
+
+ The steps are split into contiguous stages of about equal run time, from the layers' last
+ run times, so the graph should have been run once first.  Each stage has its own thread
+ (see serve), and a frame moves from one stage's queue to the next, so frame N+1 runs the
+ early layers while frame N is in the later ones.  The stages share the worker pool, and
+ throughput approaches one frame per slowest stage.  Layers that drive a device (see
+ Layer::runsOnCpu) are all kept in one stage, so only one thread talks to the device.
+
+ Each frame in flight has its own set of slots - at most 'depth' frames are in flight, and
+ push blocks until one is free.  Frames finish in the order they were pushed.
+ push and pop should each be called from one thread at a time.
+*/
+
+class Pipeline
+{
+public:
+   struct Frame
+   {
+      int     id;
+      bool    busy;
+      bool    failed;
+      Tensor  *input;
+      Tensor  *result;
+      Boxes   boxes;
+      double  pushed;
+      double  finished;
+      std::vector<Tensor *> slots;
+   };
+
+   // inStages of 0 picks 2 to 4 from the worker count, and inDepth of 0 allows one frame
+   //  per stage plus one being filled
+   Pipeline(Graph *inGraph, int inStages, int inDepth);
+   ~Pipeline();
+
+   int getStageCount() const { return stageCount; }
+   int getDepth() const { return frames.size(); }
+   int getStageFirstStep(int inStage) const { return stageFirst[inStage]; }
+
+   // Blocks until a frame is free and queues a copy of inInput, returning its id,
+   //  or -1 once stopped.  Frames are freed by popping them, so with 'depth' in flight
+   //  pop first, or pop from another thread.
+   int push(Tensor *inInput);
+   // The oldest finished frame, waiting for one if inWait.  Null if none, or once stopped.
+   // The caller may take the result tensor (clearing it), and must release the frame.
+   Frame *pop(bool inWait);
+   void release(Frame *inFrame);
+   // Wakes the stage threads and any push or pop waiting
+   void stop();
+   bool isRunning() const { return running; }
+
+   // Runs frames through one stage until stopped - one thread per stage
+   void serve(int inStage);
+   // For callers that must not block while running layers (see plServe)
+   Frame *nextFrame(int inStage);
+   void runFrame(int inStage, Frame *inFrame);
+
+   int    frameCount;
+   int    errorCount;
+   std::vector<double> stageTime;
+
+private:
+   Graph       *graph;
+   int         stageCount;
+   bool        running;
+   int         nextId;
+   std::vector<int>   stageFirst;
+   std::vector<Frame> frames;
+
+   NxMutex     lock;
+   // queues[stage], with queues[stageCount] holding the finished frames
+   std::vector< std::deque<Frame *> > queues;
+   // One waiter each - the stage threads, then the popper, then the pusher
+   HxSemaphore *signals;
+
+   void split(const std::vector<double> &inTimes, int inKeepFirst, int inKeepLast);
+};
+
+}
+
+#endif
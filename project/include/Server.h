@@ -0,0 +1,94 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include "Graph.h"
+#include "NxThread.h"
+#include <deque>
+#include <string>
+
+namespace numerix
+{
+
+/*
+ An inference server on a local (unix domain) socket, with a dynamic batcher.
+
+ Requests are queued by an io thread as they arrive.  Each model instance has its own
+ serving thread, which takes up to maxBatch queued requests of the same image size -
+ waiting at most maxDelay after the oldest arrived for more to turn up - and runs them as
+ one N*H*W*C batch.  Graphs with a layer that can not batch (Layer::canBatch, eg Yolo) run
+ the requests one after another instead.  Instances run at the same time, sharing the worker pool.
+
+ All values are little-endian 32 bit.  A request is
+
+    'NXRQ' id height width channels   + height*width*channels floats
+
+ and its reply
+
+    'NXRS' id status batchSize queueUs runUs dimCount dims[dimCount]   + result floats
+
+ where status is 0 for success, queueUs is the time from arriving to starting its batch, and
+ runUs is the time to run and reply.  A connection may have many requests in flight, and the
+ replies can arrive in a different order.
+*/
+
+class Server
+{
+public:
+   struct Connection;
+   struct Request;
+
+   // The requests for one run, all with the same shape
+   struct Batch
+   {
+      std::vector<Request *> requests;
+      double                 started;
+   };
+
+   Server(const std::string &inPath, int inMaxBatch, double inMaxDelay);
+   ~Server();
+
+   // Creates the socket and starts the io thread
+   void start();
+   // Wakes the serving threads, closes the socket and drops anything still queued
+   void stop();
+   bool isRunning() const { return running; }
+
+   // Blocks until there is a batch to run, or returns null once stopped
+   Batch *nextBatch();
+   // Runs the batch through the graph (scaling each image to inWidth x inHeight if non-zero),
+   //  replies to each request and deletes the batch
+   void runBatch(Batch *inBatch, Graph *inGraph, int inWidth, int inHeight);
+
+   int    requestCount;
+   int    batchCount;
+   int    errorCount;
+   double queueTime;
+   double runTime;
+
+private:
+   std::string path;
+   int         maxBatch;
+   double      maxDelay;
+   bool        running;
+   int         listenFd;
+   int         wakeFd[2];
+
+   NxMutex     lock;
+   std::deque<Request *> queue;
+   std::vector<Connection *> connections;
+
+   #ifdef NX_PTHREADS
+   pthread_cond_t  queued;
+   pthread_t       ioThread;
+   #endif
+
+   friend void *SServerIoLoop(void *inServer);
+   void ioLoop();
+   bool readRequests(Connection *inConnection);
+   void reply(Request *inRequest, int inStatus, const Batch *inBatch, double inFinished, Tensor *inResult, int inImage);
+   void release(Connection *inConnection);
+};
+
+}
+
+#endif
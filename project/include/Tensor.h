@@ -166,9 +166,48 @@ typedef unsigned char u8;
   #define NX_EXTERN_BUFFERS
 #endif
 
+// Cpu buffers come from a pool of size classes, 64-byte aligned.  Freed buffers are kept
+//  for reuse, up to a limit, so layers resizing or rebuilding weights do not go back to the
+//  system each time.
+struct CpuMemoryStats
+{
+   double inUse;        // bytes requested by live buffers
+   double peak;         // most inUse has been
+   double cached;       // free buffers kept for reuse
+   double reserved;     // held from the system, live or cached, including rounding
+   int    systemAllocs;
+   int    poolHits;
+};
+
+// A file mapped copy-on-write, so tensors can use its data in place (see Io.hx).
+// Processes mapping the same file share its pages until they write to them.
+class MappedFile
+{
+public:
+   // Returns null if the file can not be mapped
+   static MappedFile *open(const char *inFilename);
+
+   MappedFile *incRef();
+   void decRef();
+   u8     *getData() { return data; }
+   size_t getSize() const { return size; }
+
+private:
+   MappedFile() { }
+   ~MappedFile();
+   MappedFile(const MappedFile &);
+   void operator =(const MappedFile &);
+
+   u8           *data;
+   size_t       size;
+   volatile int refCount;
+   void         *mapHandle;
+};
+
 class TensorData
 {
    u8  *cpu;
+   MappedFile *mapping;
 
    #ifdef NX_GPU
    GpuData *gpu;
@@ -190,7 +229,7 @@ class TensorData
 
  public:
    inline TensorData(int inSize) :
-       size(inSize), cpu(0), refCount(1)
+       size(inSize), cpu(0), mapping(0), refCount(1)
    {
       #ifdef NX_GPU
       gpu = 0;
@@ -211,6 +250,9 @@ class TensorData
       #endif
    }
 
+   // Uses inSize bytes of the file in place
+   TensorData(MappedFile *inFile, size_t inOffset, int inSize);
+
    #ifdef NX_GPU
    bool isGpuNchw()
    {
@@ -341,8 +383,15 @@ class TensorData
 
 
 
+   inline int getSize() const { return size; }
+
    static u8 *allocCpuAligned(int inSize);
    static void freeCpuAligned(void *inPtr);
+   // inMaxCached of 0 frees buffers straight away.  Large buffers can be backed by huge pages,
+   //  and the guard bytes around each buffer checked on free (also NX_POOL_MB, NX_HUGE_PAGES
+   //  and NX_CHECK_MEMORY).  Returns cached buffers to the system if over the new limit.
+   static void setCpuPool(double inMaxCached, bool inHugePages, bool inCheckSentinels);
+   static void getCpuMemoryStats(CpuMemoryStats &outStats);
 
    void decRef();
    TensorData *incRef();
@@ -363,14 +412,31 @@ class Tensor
       int   type;
       int   elementSize;
       unsigned int elementCount;
+      // Channel slices start part way into the data, and skip the other channels
+      int   offset;
+      bool  contiguous;
 
       Tensor(int inType, const Shape &inShape);
+      // A view onto the storage of inStorage, which must be at least as big.
+      // Used to place several activations in the same memory.
+      Tensor(int inType, const Shape &inShape, Tensor *inStorage);
+      // Data read from a mapped file, at inOffset bytes
+      Tensor(int inType, const Shape &inShape, MappedFile *inFile, size_t inOffset);
+
+      bool sharesData(const Tensor *inOther) const { return data==inOther->data; }
+
+      // A view of channels [inChannel,inChannel+inChannels) of this image or batch.  The pixels
+      //  keep this tensor's strides, so they are further apart than the view's channel count.
+      // A layer writes its result into one by following imageStrides - the cpu pointers include
+      //  the offset.  Only zero and the layers' runInto understand the gaps.
+      Tensor *sliceChannels(int inChannel, int inChannels);
+      bool isContiguous() const { return contiguous; }
 
       #ifdef NX_EXTERN_BUFFERS
          const inline bool isGpuNchw() { return data->isGpuNchw(); }
-         const inline u8 *cpuRead(bool inNchw=false) { return data->getCpu(true,false,inNchw,this); }
-         inline       u8 *cpuWrite(bool inNchw=false) { return data->getCpu(false,true,inNchw,this); }
-         inline       u8 *cpuWritePart(bool inNchw=false) { return data->getCpu(true,true,inNchw,this); }
+         const inline u8 *cpuRead(bool inNchw=false) { return data->getCpu(true,false,inNchw,this) + offset*elementSize; }
+         inline       u8 *cpuWrite(bool inNchw=false) { return data->getCpu(!contiguous,true,inNchw,this) + offset*elementSize; }
+         inline       u8 *cpuWritePart(bool inNchw=false) { return data->getCpu(true,true,inNchw,this) + offset*elementSize; }
 
          #ifdef NX_GPU
             const inline u8 *gpuRead(bool inNchw=false) { return data->getGpu(true,false,inNchw,this); }
@@ -386,9 +452,9 @@ class Tensor
 
       #else
       const inline bool isGpuNchw() { return false; }
-      const inline u8 *cpuRead(bool x=false) { return data->getCpu(); }
-      inline       u8 *cpuWrite(bool x=false) { return data->getCpu(); }
-      inline       u8 *cpuWritePart(bool x=false) { return data->getCpu(); }
+      const inline u8 *cpuRead(bool x=false) { return data->getCpu() + offset*elementSize; }
+      inline       u8 *cpuWrite(bool x=false) { return data->getCpu() + offset*elementSize; }
+      inline       u8 *cpuWritePart(bool x=false) { return data->getCpu() + offset*elementSize; }
 
       const inline u8 *gpuRead(bool x=false) { return 0; }
       inline       u8 *gpuWrite(bool x=false) { return 0; }
@@ -411,6 +477,15 @@ class Tensor
 
       int   getByteCount() const { return elementCount * elementSize; }
 
+      // Images are H*W*C, or N*H*W*C for a batch - imageBatch is 0 for a single image
+      bool isImage() const { return shape.size()==3 || shape.size()==4; }
+      int  imageBatch() const { return shape.size()==4 ? shape[0] : 0; }
+      int  imageHeight() const { return shape[shape.size()-3]; }
+      int  imageWidth() const { return shape[shape.size()-2]; }
+      int  imageChannels() const { return shape[shape.size()-1]; }
+      // Row and pixel strides
+      const int *imageStrides() const { return &strides[strides.size()-3]; }
+
       int    getIntAt(int inIndex);
       double getFloatAt(int inIndex);
       double getFloat(int inIdx0) {
@@ -458,6 +533,8 @@ class Tensor
       int decRef();
 
       static Tensor *makeBuffer(Tensor *inBuffer, int inW, int inH, int inChannels, int inType);
+      // As above, with a leading batch dimension unless inBatch is 0
+      static Tensor *makeBuffer(Tensor *inBuffer, int inBatch, int inW, int inH, int inChannels, int inType);
 
       void convertToNchw(u8 *outData, const u8 *inData) const;
       void convertToNhwc(u8 *outData, const u8 *inData) const;
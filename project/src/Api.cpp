@@ -5,6 +5,12 @@
 #include <algorithm>
 #include <Tensor.h>
 #include <Layer.h>
+#include <Graph.h>
+#include <Server.h>
+#include <Pipeline.h>
+#include <Darknet.h>
+#include <NxThread.h>
+#include <Ops.h>
 
 #include <OCL.h>
 
@@ -33,6 +39,11 @@ namespace numerix
 vkind dataKind;
 vkind tensorKind;
 vkind layerKind;
+vkind graphKind;
+vkind serverKind;
+vkind pipelineKind;
+vkind mappedFileKind;
+vkind darknetKind;
 vkind oclDeviceKind;
 vkind oclPlatformKind;
 vkind oclContextKind;
@@ -54,12 +65,52 @@ static int _id_h;
 static int _id_prob;
 static int _id_classId;
 static int _id_id;
+static int _id_requests;
+static int _id_batches;
+static int _id_errors;
+static int _id_meanBatch;
+static int _id_meanQueueMs;
+static int _id_meanRunMs;
+static int _id_result;
+static int _id_boxes;
+static int _id_failed;
+static int _id_latencyMs;
+static int _id_frames;
+static int _id_stageMs;
+static int _id_inUseMb;
+static int _id_peakMb;
+static int _id_cachedMb;
+static int _id_reservedMb;
+static int _id_systemAllocs;
+static int _id_poolHits;
+static int _id_algo;
+static int _id_block;
+static int _id_srcW;
+static int _id_srcH;
+static int _id_batch;
+static int _id_range;
+static int _id_weights;
+static int _id_bias;
+static int _id_packed;
+static int _id_major;
+static int _id_minor;
+static int _id_revision;
+static int _id_seen;
+static int _id_transpose;
+static int _id_mb;
+static int _id_readMs;
+static int _id_mappedMb;
 
 extern "C" void InitIDs()
 {
    kind_share(&dataKind,"data");
    kind_share(&tensorKind,"Tensor");
    kind_share(&layerKind,"Layer");
+   kind_share(&graphKind,"Graph");
+   kind_share(&serverKind,"Server");
+   kind_share(&pipelineKind,"Pipeline");
+   kind_share(&mappedFileKind,"MappedFile");
+   kind_share(&darknetKind,"DarknetWeights");
    kind_share(&oclDeviceKind,"oclDevice");
    kind_share(&oclPlatformKind,"oclPlatform");
    kind_share(&oclContextKind,"oclContext");
@@ -78,6 +129,41 @@ extern "C" void InitIDs()
    _id_classId = val_id("classId");
    _id_prob = val_id("prob");
    _id_id = val_id("id");
+   _id_requests = val_id("requests");
+   _id_batches = val_id("batches");
+   _id_errors = val_id("errors");
+   _id_meanBatch = val_id("meanBatch");
+   _id_meanQueueMs = val_id("meanQueueMs");
+   _id_meanRunMs = val_id("meanRunMs");
+   _id_result = val_id("result");
+   _id_boxes = val_id("boxes");
+   _id_failed = val_id("failed");
+   _id_latencyMs = val_id("latencyMs");
+   _id_frames = val_id("frames");
+   _id_stageMs = val_id("stageMs");
+   _id_inUseMb = val_id("inUseMb");
+   _id_peakMb = val_id("peakMb");
+   _id_cachedMb = val_id("cachedMb");
+   _id_reservedMb = val_id("reservedMb");
+   _id_systemAllocs = val_id("systemAllocs");
+   _id_poolHits = val_id("poolHits");
+   _id_algo = val_id("algo");
+   _id_block = val_id("block");
+   _id_srcW = val_id("srcW");
+   _id_srcH = val_id("srcH");
+   _id_batch = val_id("batch");
+   _id_range = val_id("range");
+   _id_weights = val_id("weights");
+   _id_bias = val_id("bias");
+   _id_packed = val_id("packed");
+   _id_major = val_id("major");
+   _id_minor = val_id("minor");
+   _id_revision = val_id("revision");
+   _id_seen = val_id("seen");
+   _id_transpose = val_id("transpose");
+   _id_mb = val_id("mb");
+   _id_readMs = val_id("readMs");
+   _id_mappedMb = val_id("mappedMb");
 }
 
 
@@ -447,6 +533,125 @@ value tdFromDynamic(value inFrom, int inType, value inShape)
 }
 DEFINE_PRIME3(tdFromDynamic)
 
+
+void destroyMappedFile(value inFile)
+{
+   if (val_kind(inFile)==mappedFileKind)
+      ((MappedFile *)val_data(inFile))->decRef();
+}
+
+value ioMapFile(HxString inFilename)
+{
+   MappedFile *file = MappedFile::open(inFilename.c_str());
+   if (!file)
+      val_throw(alloc_string("Could not map file"));
+   value result = alloc_abstract(mappedFileKind, file);
+   val_gc(result, destroyMappedFile);
+   return result;
+}
+DEFINE_PRIME1(ioMapFile);
+
+// The tensor keeps the mapping alive
+value tdFromMapping(value inFile, double inOffset, int inType, value inShape)
+{
+   if (val_kind(inFile)!=mappedFileKind)
+      val_throw(alloc_string("object not a mapped file"));
+   MappedFile *file = (MappedFile *)val_data(inFile);
+   if (inOffset<0)
+      val_throw(alloc_string("tdFromMapping - bad offset"));
+   return allocTensor( new Tensor(inType, shapeFromVal(inShape), file, (size_t)inOffset) );
+}
+DEFINE_PRIME4(tdFromMapping)
+
+
+// Darknet .weights ...
+
+#define TO_DARKNET \
+   if (val_kind(inWeights)!=darknetKind) val_throw(alloc_string("object not darknet weights")); \
+   DarknetWeights *weights = (DarknetWeights *)val_data(inWeights);
+
+void destroyDarknet(value inWeights)
+{
+   TO_DARKNET
+   delete weights;
+}
+
+// Null if the file can not be opened
+value dnOpen(HxString inFilename)
+{
+   DarknetWeights *weights = DarknetWeights::open(inFilename.c_str());
+   if (!weights)
+      return alloc_null();
+   value result = alloc_abstract(darknetKind, weights);
+   val_gc(result, destroyDarknet);
+   return result;
+}
+DEFINE_PRIME1(dnOpen);
+
+value dnGetHeader(value inWeights)
+{
+   TO_DARKNET
+   value result = alloc_empty_object();
+   alloc_field(result, _id_major, alloc_int(weights->major) );
+   alloc_field(result, _id_minor, alloc_int(weights->minor) );
+   alloc_field(result, _id_revision, alloc_int(weights->revision) );
+   alloc_field(result, _id_seen, alloc_float(weights->seen) );
+   alloc_field(result, _id_transpose, alloc_bool(weights->transpose) );
+   return result;
+}
+DEFINE_PRIME1(dnGetHeader);
+
+value dnReadFloats(value inWeights, value inShape)
+{
+   TO_DARKNET
+   return allocTensor( weights->readFloats(shapeFromVal(inShape)) );
+}
+DEFINE_PRIME2(dnReadFloats);
+
+value dnReadConvWeights(value inWeights, int inN, int inC, int inSize)
+{
+   TO_DARKNET
+   return allocTensor( weights->readConvWeights(inN, inC, inSize) );
+}
+DEFINE_PRIME4(dnReadConvWeights);
+
+value dnReadMatrix(value inWeights, int inRows, int inCols)
+{
+   TO_DARKNET
+   return allocTensor( weights->readMatrix(inRows, inCols) );
+}
+DEFINE_PRIME3(dnReadMatrix);
+
+value dnMapFloats(value inWeights, value inShape)
+{
+   TO_DARKNET
+   return allocTensor( weights->mapFloats(shapeFromVal(inShape)) );
+}
+DEFINE_PRIME2(dnMapFloats);
+
+value dnGetStats(value inWeights)
+{
+   TO_DARKNET
+   value result = alloc_empty_object();
+   alloc_field(result, _id_mb, alloc_float(weights->bytesRead/(1024.0*1024.0)) );
+   alloc_field(result, _id_readMs, alloc_float(weights->readTime*1000.0) );
+   alloc_field(result, _id_mappedMb, alloc_float(weights->bytesMapped/(1024.0*1024.0)) );
+   return result;
+}
+DEFINE_PRIME1(dnGetStats);
+
+// Unmaps the file now, rather than when collected
+void dnClose(value inWeights)
+{
+   if (!val_is_null(inWeights))
+   {
+      TO_DARKNET
+      delete weights;
+      ClearGc(inWeights);
+   }
+}
+DEFINE_PRIME1v(dnClose);
+
 int tdGetDimCount(value inTensor)
 {
    TO_TENSOR
@@ -563,6 +768,70 @@ DEFINE_PRIME4(tdResizeAxis)
 
 
 
+value tdMakeView(value inStorage, value inLike, bool inCopy)
+{
+   TO_TENSOR_NAME(inStorage, storage);
+   TO_TENSOR_NAME(inLike, like);
+   if (!storage || !like)
+      TensorThrow("makeView - invalid tensor");
+
+   Tensor *result = new Tensor(like->type, like->shape, storage);
+   if (inCopy)
+      memcpy( result->cpuWrite(), like->cpuRead(), like->getByteCount() );
+   return allocTensor(result);
+}
+DEFINE_PRIME3(tdMakeView)
+
+
+bool tdSharesData(value inTensor, value inOther)
+{
+   TO_TENSOR
+   TO_TENSOR_NAME(inOther, other);
+   return other && tensor->sharesData(other);
+}
+DEFINE_PRIME2(tdSharesData)
+
+
+// Copy an H*W*C image into slot inIndex of an N*H*W*C batch
+void tdSetImage(value inTensor, int inIndex, value inImage)
+{
+   TO_TENSOR
+   TO_TENSOR_NAME(inImage, image);
+   if (!image || tensor->shape.size()!=4 || image->type!=tensor->type ||
+         inIndex<0 || inIndex>=tensor->shape[0] ||
+         image->shape!=Shape3(tensor->shape[1], tensor->shape[2], tensor->shape[3]) )
+      TensorThrow("setImage - image does not match the batch");
+   if (!tensor->isContiguous() || !image->isContiguous())
+      TensorThrow("setImage - channel slices are not supported");
+
+   // Only one slot is written, so keep the rest of the batch
+   int bytes = image->getByteCount();
+   memcpy( tensor->cpuWritePart() + inIndex*bytes, image->cpuRead(), bytes );
+}
+DEFINE_PRIME3v(tdSetImage)
+
+
+// Copy slot inIndex of an N*H*W*C batch into an H*W*C image, reusing inBuffer if it fits
+value tdGetImage(value inTensor, int inIndex, value inBuffer)
+{
+   TO_TENSOR
+   TO_TENSOR_NAME(inBuffer, buffer);
+   if (tensor->shape.size()!=4 || inIndex<0 || inIndex>=tensor->shape[0])
+      TensorThrow("getImage - bad batch index");
+   if (!tensor->isContiguous())
+      TensorThrow("getImage - channel slices are not supported");
+
+   Tensor *result = Tensor::makeBuffer(buffer, tensor->shape[2], tensor->shape[1], tensor->shape[3], tensor->type);
+   int bytes = result->getByteCount();
+   memcpy( result->cpuWrite(), tensor->cpuRead() + inIndex*bytes, bytes );
+
+   if (result==buffer)
+      return inBuffer;
+   return allocTensor(result);
+}
+DEFINE_PRIME3(tdGetImage)
+
+
 void tdFillData(value inTensor, value outBuffer)
 {
    TO_TENSOR
@@ -627,6 +896,89 @@ void nxEnableGpu(bool inEnable)
 DEFINE_PRIME1v(nxEnableGpu);
 
 
+int nxSetWorkerCount(int inCount)
+{
+   return SetWorkerCount(inCount);
+}
+DEFINE_PRIME1(nxSetWorkerCount);
+
+int nxGetWorkerCount()
+{
+   return GetWorkerCount();
+}
+DEFINE_PRIME0(nxGetWorkerCount);
+
+void nxSetWorkerAffinity(bool inPin)
+{
+   SetWorkerAffinity(inPin);
+}
+DEFINE_PRIME1v(nxSetWorkerAffinity);
+
+void nxSetWorkerSpin(int inMicroseconds)
+{
+   SetWorkerSpin(inMicroseconds);
+}
+DEFINE_PRIME1v(nxSetWorkerSpin);
+
+void nxSetWorkerBranches(bool inEnable)
+{
+   SetWorkerBranches(inEnable);
+}
+DEFINE_PRIME1v(nxSetWorkerBranches);
+
+void nxSetCpuPool(double inMaxCachedMb, bool inHugePages, bool inCheckSentinels)
+{
+   TensorData::setCpuPool(inMaxCachedMb*1024*1024, inHugePages, inCheckSentinels);
+}
+DEFINE_PRIME3v(nxSetCpuPool);
+
+value nxGetCpuMemoryStats()
+{
+   CpuMemoryStats stats;
+   TensorData::getCpuMemoryStats(stats);
+   double mb = 1.0/(1024*1024);
+   value result = alloc_empty_object();
+   alloc_field(result, _id_inUseMb, alloc_float(stats.inUse*mb) );
+   alloc_field(result, _id_peakMb, alloc_float(stats.peak*mb) );
+   alloc_field(result, _id_cachedMb, alloc_float(stats.cached*mb) );
+   alloc_field(result, _id_reservedMb, alloc_float(stats.reserved*mb) );
+   alloc_field(result, _id_systemAllocs, alloc_int(stats.systemAllocs) );
+   alloc_field(result, _id_poolHits, alloc_int(stats.poolHits) );
+   return result;
+}
+DEFINE_PRIME0(nxGetCpuMemoryStats);
+
+bool nxSetKernelIsa(HxString inIsa)
+{
+   return SetKernelIsa(inIsa.c_str());
+}
+DEFINE_PRIME1(nxSetKernelIsa);
+
+HxString nxGetKernelIsa()
+{
+   return GetKernels().isa;
+}
+DEFINE_PRIME0(nxGetKernelIsa);
+
+HxString nxGetCpuName()
+{
+   return GetCpuName();
+}
+DEFINE_PRIME0(nxGetCpuName);
+
+void nxSetAutotune(bool inAutotune, HxString inCacheFile)
+{
+   SetConvAutotune(inAutotune, inCacheFile.c_str());
+}
+DEFINE_PRIME2v(nxSetAutotune);
+
+bool nxSetConvAlgo(HxString inAlgo)
+{
+   return SetConvAlgo(inAlgo.c_str());
+}
+DEFINE_PRIME1(nxSetConvAlgo);
+
+
 // ----------- Layer
 
 
@@ -692,6 +1044,65 @@ value layCreateConv2D(value inStrides, int inActivation, int inPadding, value in
 DEFINE_PRIME8(layCreateConv2D);
 
 
+// Weights [outputs][inputs][fy][fx], read on the first run (see Layer::createConv2DLazy)
+value layCreateConv2DLazy(value inStrides, int inActivation, int inPadding, value inWeights, value inBias, bool inAllowTransform)
+{
+   TO_TENSOR_NAME(inWeights, fileWeights);
+   if (!fileWeights || fileWeights->shape.size()!=4)
+      TensorThrow("Conv2D - invalid weights");
+
+   TO_TENSOR_NAME(inBias, bias);
+
+   int sx = 1;
+   int sy = 1;
+   if (val_is_int(inStrides))
+      sx = sy = val_int(inStrides);
+   else if (!val_is_null(inStrides))
+   {
+      Shape strides;
+      fromValue(strides, inStrides);
+      sy = strides.size() > 0 ? strides[0] : 1;
+      sx = strides.size() > 1 ? strides[1] : sy;
+   }
+
+   Layer *layer = 0;
+   Activation activation = (Activation)inActivation;
+   Padding padding(inPadding);
+
+   // The device layers take their weights up front, so they are reordered now
+   #if defined(NX_OPENCL) || defined(NX_GPU)
+   bool onDevice = false;
+   #ifdef NX_OPENCL
+   onDevice = onDevice || OclContext::hasCurrent();
+   #endif
+   #ifdef NX_GPU
+   onDevice = onDevice || (enableGpu && gpuInit());
+   #endif
+   if (onDevice)
+   {
+      CShape s = fileWeights->shape;
+      Tensor *weights = new Tensor(Float32, Shape4(s[0], s[2], s[3], s[1]));
+      ReorderFileWeights((float *)weights->cpuWrite(), (const float *)fileWeights->cpuRead(), s[0], s[1], s[2]*s[3]);
+      #ifdef NX_OPENCL
+      if (!layer && OclContext::hasCurrent())
+         layer = oclCreateConv2D(sx,sy, false, activation, padding, weights, bias);
+      #endif
+      #ifdef NX_GPU
+      if (!layer && enableGpu && gpuInit())
+         layer = gpuCreateConv2D(sx,sy, false, activation, padding, weights, bias);
+      #endif
+      weights->decRef();
+   }
+   #endif
+
+   if (!layer)
+      layer = Layer::createConv2DLazy(sx, sy, activation, padding, fileWeights, bias, inAllowTransform);
+
+   return allocLayer(layer);
+}
+DEFINE_PRIME6(layCreateConv2DLazy);
+
+
 
 void layConv2DSetNorm(value inLayer, value inScales, value inMeans, value inVars)
 {
@@ -728,6 +1139,108 @@ void layConv2DRemoveMean(value inLayer, value inMean)
 DEFINE_PRIME2v(layConv2DRemoveMean)
 
 
+void layConv2DSetCalibrate(value inLayer, bool inCalibrate)
+{
+   TO_LAYER
+   layer->setCalibrate(inCalibrate);
+}
+DEFINE_PRIME2v(layConv2DSetCalibrate)
+
+
+double layConv2DGetInputRange(value inLayer)
+{
+   TO_LAYER
+   return layer->getInputRange();
+}
+DEFINE_PRIME1(layConv2DGetInputRange)
+
+
+bool layConv2DSetQuantize(value inLayer, double inRange)
+{
+   TO_LAYER
+   return layer->setQuantize(inRange);
+}
+DEFINE_PRIME2(layConv2DSetQuantize)
+
+bool layConv2DSetHalfWeights(value inLayer, bool inHalf)
+{
+   TO_LAYER
+   return layer->setHalfWeights(inHalf);
+}
+DEFINE_PRIME2(layConv2DSetHalfWeights)
+
+bool layConv2DSetFusedPool(value inLayer, bool inFuse, int inPadding)
+{
+   TO_LAYER
+   return layer->setFusedPool(inFuse, Padding(inPadding));
+}
+DEFINE_PRIME3(layConv2DSetFusedPool)
+
+bool layConv2DSetFusedSum(value inLayer, bool inFuse, int inActivation)
+{
+   TO_LAYER
+   return layer->setFusedSum(inFuse, (Activation)inActivation);
+}
+DEFINE_PRIME3(layConv2DSetFusedSum)
+
+
+// { algo, block, srcW, srcH, batch, range, weights, bias, packed:Array<Tensor> }, see CompiledWeights
+value layConv2DGetCompiled(value inLayer)
+{
+   TO_LAYER
+   CompiledWeights compiled;
+   if (!layer->getCompiled(compiled))
+      return alloc_null();
+
+   value packed = alloc_array(compiled.packed.size());
+   for(int i=0;i<compiled.packed.size();i++)
+      val_array_set_i(packed, i, allocTensor(compiled.packed[i]->incRef()) );
+
+   value result = alloc_empty_object();
+   alloc_field(result, _id_algo, alloc_string(compiled.algo.c_str()) );
+   alloc_field(result, _id_block, alloc_int(compiled.block) );
+   alloc_field(result, _id_srcW, alloc_int(compiled.srcW) );
+   alloc_field(result, _id_srcH, alloc_int(compiled.srcH) );
+   alloc_field(result, _id_batch, alloc_int(compiled.batch) );
+   alloc_field(result, _id_range, alloc_float(compiled.range) );
+   alloc_field(result, _id_weights, allocTensor(compiled.weights->incRef()) );
+   alloc_field(result, _id_bias, compiled.bias ? allocTensor(compiled.bias->incRef()) : alloc_null() );
+   alloc_field(result, _id_packed, packed );
+   return result;
+}
+DEFINE_PRIME1(layConv2DGetCompiled)
+
+
+bool layConv2DSetCompiled(value inLayer, value inCompiled)
+{
+   TO_LAYER
+   value algo = val_field(inCompiled, _id_algo);
+   value packed = val_field(inCompiled, _id_packed);
+   if (!val_is_string(algo) || !val_is_array(packed))
+      return false;
+
+   CompiledWeights compiled;
+   compiled.algo = val_string(algo);
+   compiled.block = (int)val_field_numeric(inCompiled, _id_block);
+   compiled.srcW = (int)val_field_numeric(inCompiled, _id_srcW);
+   compiled.srcH = (int)val_field_numeric(inCompiled, _id_srcH);
+   compiled.batch = (int)val_field_numeric(inCompiled, _id_batch);
+   compiled.range = val_field_numeric(inCompiled, _id_range);
+   TO_TENSOR_NAME(val_field(inCompiled,_id_weights), weights);
+   TO_TENSOR_NAME(val_field(inCompiled,_id_bias), bias);
+   compiled.setWeights(weights, bias);
+   for(int i=0;i<val_array_size(packed);i++)
+   {
+      TO_TENSOR_NAME(val_array_i(packed,i), tensor);
+      if (!tensor)
+         return false;
+      compiled.packed.push_back(tensor->incRef());
+   }
+   return layer->setCompiled(compiled);
+}
+DEFINE_PRIME2(layConv2DSetCompiled)
+
+
 
 value layCreateMaxPool(value inSize, value inStrides, int inPadding)
 {
@@ -824,6 +1337,21 @@ value layCreateConcat()
 DEFINE_PRIME0(layCreateConcat);
 
 
+bool layConcatSetFusedInput(value inLayer, int inIndex, value inProducer)
+{
+   TO_LAYER
+   Layer *producer = 0;
+   if (!val_is_null(inProducer))
+   {
+      if (val_kind(inProducer)!=layerKind)
+         val_throw(alloc_string("producer not a layer"));
+      producer = (Layer *)val_data(inProducer);
+   }
+   return layer->setFusedInput(inIndex, producer);
+}
+DEFINE_PRIME3(layConcatSetFusedInput);
+
+
 
 value layCreateCrop(int offX, int offY)
 {
@@ -867,6 +1395,14 @@ value layCreateEltwise(int inOperation)
 DEFINE_PRIME1(layCreateEltwise);
 
 
+void layEltwiseSetActivation(value inLayer, int inActivation)
+{
+   TO_LAYER
+   layer->setActivation((Activation)inActivation);
+}
+DEFINE_PRIME2v(layEltwiseSetActivation);
+
+
 void laySetCropIndex(value inLayer, int inIndex, int inX, int inY)
 {
    TO_LAYER;
@@ -908,17 +1444,12 @@ value layCreateYolo(value inAnchors, int inNum, int inClassCount)
 DEFINE_PRIME3(layCreateYolo);
 
 
-value layGetBoxes(value inLayer)
+value allocBoxes(const Boxes &boxes)
 {
-   TO_LAYER;
-
-   Boxes boxes;
-   layer->getBoxes(boxes);
-
    value result = alloc_array( boxes.size() );
    for(int i=0;i<boxes.size();i++)
    {
-      BBox &b = boxes[i];
+      const BBox &b = boxes[i];
       value v = alloc_empty_object();
       alloc_field(v, _id_x, alloc_float(b.x) );
       alloc_field(v, _id_y, alloc_float(b.y) );
@@ -931,6 +1462,16 @@ value layGetBoxes(value inLayer)
 
    return result;
 }
+
+value layGetBoxes(value inLayer)
+{
+   TO_LAYER;
+
+   Boxes boxes;
+   layer->getBoxes(boxes);
+
+   return allocBoxes(boxes);
+}
 DEFINE_PRIME1(layGetBoxes);
 
 void layAccurateTimes(bool inAccurate)
@@ -1007,6 +1548,269 @@ DEFINE_PRIME1v(layRelease);
 
 
 
+// ----------- Graph
+
+#define TO_GRAPH \
+   if (val_kind(inGraph)!=graphKind) val_throw(alloc_string("object not a graph")); \
+   Graph *graph = (Graph *)val_data(inGraph);
+
+void destroyGraph(value inGraph)
+{
+   TO_GRAPH
+   delete graph;
+}
+
+value grCreate()
+{
+   value result = alloc_abstract(graphKind, new Graph());
+   val_gc(result, destroyGraph);
+   return result;
+}
+DEFINE_PRIME0(grCreate);
+
+int grAddConstant(value inGraph, value inTensor)
+{
+   TO_GRAPH
+   TO_TENSOR_NAME(inTensor, tensor);
+   return graph->addConstant(tensor);
+}
+DEFINE_PRIME2(grAddConstant);
+
+int grAddLayer(value inGraph, value inLayer, int inSrc0, int inSrc1, value inBuffer)
+{
+   TO_GRAPH
+   TO_LAYER
+   TO_TENSOR_NAME(inBuffer, buffer);
+   return graph->addLayer(layer, inSrc0, inSrc1, buffer);
+}
+DEFINE_PRIME5(grAddLayer);
+
+void grSetOutput(value inGraph, int inSlot)
+{
+   TO_GRAPH
+   graph->setOutput(inSlot);
+}
+DEFINE_PRIME2v(grSetOutput);
+
+// Runs the whole graph, and stores the output in inOwner.resultBuffer, like layRun
+value grRun(value inGraph, value inInput, value inOwner)
+{
+   TO_GRAPH
+   TO_TENSOR_NAME(inInput, input);
+   if (!input)
+      TensorThrow("Graph - invalid input");
+
+   Tensor *result = graph->run(input);
+
+   value valBuf = val_field(inOwner, _id_resultBuffer);
+   TO_TENSOR_NAME(valBuf, buffer);
+   if (result!=buffer)
+   {
+      if (buffer)
+         tdRelease(valBuf);
+
+      if (result)
+         valBuf = allocTensor(result->incRef());
+      else
+         valBuf = alloc_null();
+
+      alloc_field(inOwner, _id_resultBuffer, valBuf);
+   }
+
+   return valBuf;
+}
+DEFINE_PRIME3(grRun);
+
+
+
+// ----------- Server
+
+#define TO_SERVER \
+   if (val_kind(inServer)!=serverKind) val_throw(alloc_string("object not a server")); \
+   Server *server = (Server *)val_data(inServer);
+
+void destroyServer(value inServer)
+{
+   TO_SERVER
+   delete server;
+}
+
+value svCreate(HxString inPath, int inMaxBatch, double inMaxDelay)
+{
+   value result = alloc_abstract(serverKind, new Server(inPath.c_str(), inMaxBatch, inMaxDelay));
+   val_gc(result, destroyServer);
+   return result;
+}
+DEFINE_PRIME3(svCreate);
+
+void svStart(value inServer)
+{
+   TO_SERVER
+   server->start();
+}
+DEFINE_PRIME1v(svStart);
+
+void svStop(value inServer)
+{
+   TO_SERVER
+   gc_enter_blocking();
+   server->stop();
+   gc_exit_blocking();
+}
+DEFINE_PRIME1v(svStop);
+
+// Serves batches with the graph until the server stops - one thread per graph
+void svServe(value inServer, value inGraph, int inWidth, int inHeight)
+{
+   TO_SERVER
+   TO_GRAPH
+   while(true)
+   {
+      gc_enter_blocking();
+      Server::Batch *batch = server->nextBatch();
+      gc_exit_blocking();
+      if (!batch)
+         break;
+      // Errors are caught and counted inside, so nothing throws while blocking
+      gc_enter_blocking();
+      server->runBatch(batch, graph, inWidth, inHeight);
+      gc_exit_blocking();
+   }
+}
+DEFINE_PRIME4v(svServe);
+
+value svGetStats(value inServer)
+{
+   TO_SERVER
+   int requests = server->requestCount;
+   int batches = server->batchCount;
+   value result = alloc_empty_object();
+   alloc_field(result, _id_requests, alloc_int(requests) );
+   alloc_field(result, _id_batches, alloc_int(batches) );
+   alloc_field(result, _id_errors, alloc_int(server->errorCount) );
+   alloc_field(result, _id_meanBatch, alloc_float(batches ? (double)requests/batches : 0.0) );
+   alloc_field(result, _id_meanQueueMs, alloc_float(requests ? server->queueTime*1000.0/requests : 0.0) );
+   alloc_field(result, _id_meanRunMs, alloc_float(batches ? server->runTime*1000.0/batches : 0.0) );
+   return result;
+}
+DEFINE_PRIME1(svGetStats);
+
+
+
+// ----------- Pipeline
+
+#define TO_PIPELINE \
+   if (val_kind(inPipeline)!=pipelineKind) val_throw(alloc_string("object not a pipeline")); \
+   Pipeline *pipeline = (Pipeline *)val_data(inPipeline);
+
+void destroyPipeline(value inPipeline)
+{
+   TO_PIPELINE
+   delete pipeline;
+}
+
+value plCreate(value inGraph, int inStages, int inDepth)
+{
+   TO_GRAPH
+   value result = alloc_abstract(pipelineKind, new Pipeline(graph, inStages, inDepth));
+   val_gc(result, destroyPipeline);
+   return result;
+}
+DEFINE_PRIME3(plCreate);
+
+int plGetStageCount(value inPipeline)
+{
+   TO_PIPELINE
+   return pipeline->getStageCount();
+}
+DEFINE_PRIME1(plGetStageCount);
+
+int plGetDepth(value inPipeline)
+{
+   TO_PIPELINE
+   return pipeline->getDepth();
+}
+DEFINE_PRIME1(plGetDepth);
+
+// Runs frames through the stage until the pipeline stops - one thread per stage
+void plServe(value inPipeline, int inStage)
+{
+   TO_PIPELINE
+   if (inStage<0 || inStage>=pipeline->getStageCount())
+      val_throw(alloc_string("invalid pipeline stage"));
+   while(true)
+   {
+      gc_enter_blocking();
+      Pipeline::Frame *frame = pipeline->nextFrame(inStage);
+      gc_exit_blocking();
+      if (!frame)
+         break;
+      // As svServe - a stage's errors are kept with the frame, not thrown
+      gc_enter_blocking();
+      pipeline->runFrame(inStage, frame);
+      gc_exit_blocking();
+   }
+}
+DEFINE_PRIME2v(plServe);
+
+int plPush(value inPipeline, value inTensor)
+{
+   TO_PIPELINE
+   TO_TENSOR_NAME(inTensor, tensor);
+   if (!tensor || !tensor->isContiguous())
+      val_throw(alloc_string("invalid pipeline input"));
+   gc_enter_blocking();
+   int id = pipeline->push(tensor);
+   gc_exit_blocking();
+   return id;
+}
+DEFINE_PRIME2(plPush);
+
+value plPop(value inPipeline, bool inWait)
+{
+   TO_PIPELINE
+   gc_enter_blocking();
+   Pipeline::Frame *frame = pipeline->pop(inWait);
+   gc_exit_blocking();
+   if (!frame)
+      return alloc_null();
+
+   value result = alloc_empty_object();
+   alloc_field(result, _id_id, alloc_int(frame->id) );
+   alloc_field(result, _id_failed, alloc_bool(frame->failed) );
+   alloc_field(result, _id_result, frame->result ? allocTensor(frame->result) : alloc_null() );
+   frame->result = 0;
+   alloc_field(result, _id_boxes, allocBoxes(frame->boxes) );
+   alloc_field(result, _id_latencyMs, alloc_float( (frame->finished - frame->pushed)*1000.0 ) );
+   pipeline->release(frame);
+   return result;
+}
+DEFINE_PRIME2(plPop);
+
+void plStop(value inPipeline)
+{
+   TO_PIPELINE
+   pipeline->stop();
+}
+DEFINE_PRIME1v(plStop);
+
+value plGetStats(value inPipeline)
+{
+   TO_PIPELINE
+   int frames = pipeline->frameCount;
+   value stageMs = alloc_array(pipeline->getStageCount());
+   for(int s=0;s<pipeline->getStageCount();s++)
+      val_array_set_i(stageMs, s, alloc_float(frames ? pipeline->stageTime[s]*1000.0/frames : 0.0) );
+   value result = alloc_empty_object();
+   alloc_field(result, _id_frames, alloc_int(frames) );
+   alloc_field(result, _id_errors, alloc_int(pipeline->errorCount) );
+   alloc_field(result, _id_stageMs, stageMs );
+   return result;
+}
+DEFINE_PRIME1(plGetStats);
+
+
+
 void layEnablePerLayerTiming(bool inLayer)
 {
    Layer::openCLTimingEvents = inLayer;
@@ -266,6 +266,8 @@ class CudaConv2D : public Conv2DBase
 
 
 public:
+   bool runsOnCpu() { return false; }
+
    CudaConv2D(int inStrideY, int inStrideX, bool inIsDeconvolution,
           Activation inActivation, Padding inPadding,
           Tensor *inWeights, Tensor *inBias)
@@ -319,8 +321,16 @@ public:
    }
 
 
+   // The fused epilogues are cpu code, so stay as separate layers
+   bool setFusedPool(bool inFuse, Padding inPadding) { return false; }
+   bool setFusedSum(bool inFuse, Activation inActivation) { return false; }
+   bool runInto(Tensor *inSrc0, Tensor *inSlice) { return false; }
+
    void doRun(Tensor *input, Tensor *output)
    {
+      if (input->shape.size()!=3)
+         TensorThrow("CudaConv2D only supports H*W*C tensors");
+
       CShape sin = input->shape;
 
       int srcH = sin[0];
@@ -459,6 +469,8 @@ class CudaMaxPool : public Layer
    cudnnPoolingDescriptor_t poolingDesc;
 
 public:
+   bool runsOnCpu() { return false; }
+
    CudaMaxPool(int inSizeX, int inSizeY,
            int inStepX, int inStepY,
            Padding inPadding )
@@ -558,6 +570,8 @@ Layer *gpuCreateMaxPool(int sizeX, int sizeY,
 class CudaConcat : public Layer
 {
 public:
+   bool runsOnCpu() { return false; }
+
    CudaConcat( ) { }
 
 
@@ -621,6 +635,8 @@ class CudaYoloLayer : public Layer
 
 
 public:
+   bool runsOnCpu() { return false; }
+
    CudaYoloLayer(const std::vector<float> &inAnchors,int inBoxCount, int inClassCount, float inThresh) :
       anchors(inAnchors), boxCount(inBoxCount), classCount(inClassCount)
    {
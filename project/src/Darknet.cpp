@@ -0,0 +1,140 @@
+#include <Tensor.h>
+#include <Darknet.h>
+#include <Layer.h>
+#include <NxThread.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+namespace numerix
+{
+
+
+DarknetWeights *DarknetWeights::open(const char *inFilename)
+{
+   MappedFile *file = MappedFile::open(inFilename);
+   if (!file)
+      return 0;
+   DarknetWeights *result = new DarknetWeights(file);
+   file->decRef();
+
+   try
+   {
+      const int *version = (const int *)result->next(3);
+      result->major = version[0];
+      result->minor = version[1];
+      result->revision = version[2];
+      // As darknet reads it - transposed files keep a 32 bit count
+      if (result->major*10 + result->minor >= 2 && result->major<1000 && result->minor<1000)
+      {
+         int64_t seen;
+         memcpy(&seen, result->next(2), sizeof(seen));
+         result->seen = (double)seen;
+      }
+      else
+         result->seen = *(const int *)result->next(1);
+      result->transpose = result->major>1000 || result->minor>1000;
+   }
+   catch(...)
+   {
+      delete result;
+      throw;
+   }
+   // The header is not part of the throughput
+   result->bytesRead = 0;
+   result->readTime = 0;
+   return result;
+}
+
+
+DarknetWeights::DarknetWeights(MappedFile *inFile)
+{
+   file = inFile->incRef();
+   position = 0;
+   major = minor = revision = 0;
+   seen = 0;
+   transpose = false;
+   bytesRead = 0;
+   bytesMapped = 0;
+   readTime = 0;
+}
+
+
+DarknetWeights::~DarknetWeights()
+{
+   file->decRef();
+}
+
+
+const float *DarknetWeights::next(size_t inCount)
+{
+   size_t bytes = inCount*sizeof(float);
+   if (position + bytes > file->getSize())
+      TensorThrow("Darknet weights - unexpected end of file");
+   const float *result = (const float *)(file->getData() + position);
+   position += bytes;
+   bytesRead += bytes;
+   return result;
+}
+
+
+Tensor *DarknetWeights::readFloats(const Shape &inShape)
+{
+   double t0 = GetTimeStamp();
+   Tensor *result = new Tensor(Float32, inShape);
+   try
+   {
+      memcpy(result->cpuWrite(), next(result->elementCount), result->elementCount*sizeof(float));
+   }
+   catch(...)
+   {
+      result->decRef();
+      throw;
+   }
+   readTime += GetTimeStamp() - t0;
+   return result;
+}
+
+
+Tensor *DarknetWeights::readConvWeights(int inN, int inC, int inSize)
+{
+   if (inN<1 || inC<1 || inSize<1)
+      TensorThrow("Darknet weights - bad convolution size");
+
+   double t0 = GetTimeStamp();
+   const float *src = next((size_t)inN*inC*inSize*inSize);
+   Tensor *result = new Tensor(Float32, Shape4(inN, inSize, inSize, inC));
+   ReorderFileWeights((float *)result->cpuWrite(), src, inN, inC, inSize*inSize);
+   readTime += GetTimeStamp() - t0;
+   return result;
+}
+
+
+Tensor *DarknetWeights::mapFloats(const Shape &inShape)
+{
+   // Throws if it runs past the end, without touching the data
+   Tensor *result = new Tensor(Float32, inShape, file, position);
+   size_t bytes = (size_t)result->elementCount*sizeof(float);
+   position += bytes;
+   bytesMapped += bytes;
+   return result;
+}
+
+
+Tensor *DarknetWeights::readMatrix(int inRows, int inCols)
+{
+   if (!transpose)
+      return readFloats(Shape2(inRows, inCols));
+
+   double t0 = GetTimeStamp();
+   const float *src = next((size_t)inRows*inCols);
+   Tensor *result = new Tensor(Float32, Shape2(inRows, inCols));
+   float *dest = (float *)result->cpuWrite();
+   for(int r=0;r<inRows;r++)
+      for(int c=0;c<inCols;c++)
+         dest[(size_t)r*inCols + c] = src[(size_t)c*inRows + r];
+   readTime += GetTimeStamp() - t0;
+   return result;
+}
+
+}
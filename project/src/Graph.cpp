@@ -0,0 +1,292 @@
+#include <Tensor.h>
+#include <Layer.h>
+#include <Graph.h>
+#include <NxThread.h>
+#include <algorithm>
+
+namespace numerix
+{
+
+Graph::Graph()
+{
+   slots.push_back(0);
+   output = InputSlot;
+   staged = false;
+}
+
+
+Graph::~Graph()
+{
+   for(int i=1;i<slots.size();i++)
+      if (slots[i])
+         slots[i]->decRef();
+}
+
+
+int Graph::addConstant(Tensor *inTensor)
+{
+   slots.push_back(inTensor ? inTensor->incRef() : 0);
+   return slots.size()-1;
+}
+
+
+int Graph::addLayer(Layer *inLayer, int inSrc0, int inSrc1, Tensor *inBuffer)
+{
+   if (!inLayer)
+      TensorThrow("Graph - invalid layer");
+   if (inSrc0>=(int)slots.size() || inSrc1>=(int)slots.size() || (inSrc0<0 && inSrc1>=0))
+      TensorThrow("Graph - invalid layer input");
+
+   Step step;
+   step.layer = inLayer;
+   step.src0 = inSrc0;
+   step.src1 = inSrc1;
+   step.dest = addConstant(inBuffer);
+   steps.push_back(step);
+   staged = false;
+   return step.dest;
+}
+
+
+void Graph::setOutput(int inSlot)
+{
+   if (inSlot<0 || inSlot>=slots.size())
+      TensorThrow("Graph - invalid output");
+   output = inSlot;
+}
+
+
+// Slots are written by at most one step - the others are the input and constants
+void Graph::makeStages()
+{
+   stages.clear();
+   warmShape.clear();
+   staged = true;
+
+   int n = steps.size();
+   std::vector<int> stepOf(slots.size(), -1);
+   for(int s=0;s<n;s++)
+      stepOf[ steps[s].dest ] = s;
+
+   for(int s=0;s<n; /* */ )
+   {
+      // The steps reading this one's result
+      std::vector<int> readers;
+      for(int r=s+1;r<n;r++)
+         if (steps[r].src0==steps[s].dest || steps[r].src1==steps[s].dest)
+            readers.push_back(r);
+
+      Stage single;
+      single.step = s;
+      stages.push_back(single);
+      s++;
+      if (readers.size()<2 || readers.size()>16)
+         continue;
+
+      // Which readers each following step depends on, until one depends on several
+      std::vector<int> mask(n,0);
+      for(int i=0;i<readers.size();i++)
+         mask[readers[i]] = 1<<i;
+      int join = s;
+      bool split = true;
+      for( ; join<n; join++)
+      {
+         const Step &step = steps[join];
+         int srcs[2] = { step.src0, step.src1 };
+         for(int i=0;i<2;i++)
+            if (srcs[i]>=0 && stepOf[srcs[i]]>=s)
+               mask[join] |= mask[ stepOf[srcs[i]] ];
+         int m = mask[join];
+         if (m & (m-1))
+            break;
+         // A step between that does not follow the fork could be needed by either side
+         if (!m || !step.layer->runsOnCpu())
+            split = false;
+      }
+
+      if (!split || join-s<2)
+         continue;
+
+      Stage branches;
+      branches.step = -1;
+      for(int i=0;i<readers.size();i++)
+      {
+         std::vector<int> branch;
+         for(int b=s;b<join;b++)
+            if (mask[b]==(1<<i))
+               branch.push_back(b);
+         if (!branch.empty())
+            branches.branches.push_back(branch);
+      }
+      if (branches.branches.size()<2)
+         continue;
+      stages.push_back(branches);
+      s = join;
+   }
+}
+
+
+int Graph::getBranchStageCount()
+{
+   if (!staged)
+      makeStages();
+   int count = 0;
+   for(int i=0;i<stages.size();i++)
+      if (stages[i].step<0)
+         count++;
+   return count;
+}
+
+
+Layer *Graph::getOutputLayer()
+{
+   for(int s=0;s<steps.size();s++)
+      if (steps[s].dest==output)
+         return steps[s].layer;
+   return 0;
+}
+
+
+void Graph::copySlots(std::vector<Tensor *> &outSlots)
+{
+   outSlots.assign(slots.size(), 0);
+   std::vector<bool> written(slots.size(), false);
+   for(int s=0;s<steps.size();s++)
+      written[ steps[s].dest ] = true;
+   for(int i=1;i<slots.size();i++)
+      if (!written[i] && slots[i])
+         outSlots[i] = slots[i]->incRef();
+}
+
+
+void Graph::runSteps(int inFirst, int inEnd, std::vector<Tensor *> &ioSlots)
+{
+   if (ioSlots.size()!=slots.size())
+      TensorThrow("Graph - slots do not match");
+   for(int s=inFirst;s<inEnd;s++)
+      runStep(s, ioSlots);
+}
+
+
+void Graph::runStep(int inStep, std::vector<Tensor *> &ioSlots)
+{
+   const Step &step = steps[inStep];
+   Tensor *buffer = ioSlots[step.dest];
+   Tensor *result = 0;
+   if (step.src1>=0)
+      result = step.layer->run(ioSlots[step.src0], ioSlots[step.src1], buffer);
+   else if (step.src0>=0)
+      result = step.layer->run(ioSlots[step.src0], buffer);
+   else
+      result = step.layer->run(0, buffer);
+
+   if (result!=buffer)
+   {
+      if (buffer)
+         buffer->decRef();
+      ioSlots[step.dest] = result;
+   }
+}
+
+
+// A planned result can use the memory of one that is not live at that point in step order
+//  (see MemoryPlan), which another branch may still be reading or writing.
+bool Graph::branchesShareData(const Stage &inStage)
+{
+   const std::vector< std::vector<int> > &branches = inStage.branches;
+   for(int a=0;a<branches.size();a++)
+      for(int b=0;b<branches.size();b++)
+      {
+         if (a==b)
+            continue;
+         for(int i=0;i<branches[a].size();i++)
+         {
+            Tensor *dest = slots[ steps[branches[a][i]].dest ];
+            if (!dest)
+               continue;
+            for(int j=0;j<branches[b].size();j++)
+            {
+               const Step &step = steps[ branches[b][j] ];
+               int touched[3] = { step.src0, step.src1, step.dest };
+               for(int t=0;t<3;t++)
+                  if (touched[t]>=0 && slots[touched[t]] && dest->sharesData(slots[touched[t]]))
+                     return true;
+            }
+         }
+      }
+   return false;
+}
+
+
+struct GraphBranches
+{
+   Graph *graph;
+   const std::vector< std::vector<int> > *branches;
+};
+
+
+void Graph::runStage(const Stage &inStage, bool inParallel)
+{
+   if (inStage.step>=0)
+   {
+      runStep(inStage.step, slots);
+      return;
+   }
+
+   const std::vector< std::vector<int> > &branches = inStage.branches;
+   if (inParallel && !branchesShareData(inStage))
+   {
+      std::vector<double> weights(branches.size());
+      for(int b=0;b<branches.size();b++)
+      {
+         weights[b] = 0;
+         for(int i=0;i<branches[b].size();i++)
+            weights[b] += steps[ branches[b][i] ].layer->getRunTime();
+      }
+
+      struct Runner
+      {
+         static void run(int inBranch, void *inData)
+         {
+            GraphBranches *info = (GraphBranches *)inData;
+            const std::vector<int> &branch = (*info->branches)[inBranch];
+            for(int i=0;i<branch.size();i++)
+               info->graph->runStep(branch[i], info->graph->slots);
+         }
+      };
+      GraphBranches info = { this, &branches };
+      if (RunBranches(branches.size(), Runner::run, &info, &weights[0]))
+         return;
+   }
+
+   // In step order, which the memory plan was made for
+   std::vector<int> order;
+   for(int b=0;b<branches.size();b++)
+      order.insert(order.end(), branches[b].begin(), branches[b].end());
+   std::sort(order.begin(), order.end());
+   for(int i=0;i<order.size();i++)
+      runStep(order[i], slots);
+}
+
+
+Tensor *Graph::run(Tensor *inInput)
+{
+   slots[InputSlot] = inInput;
+
+   if (!staged)
+      makeStages();
+
+   // Parallel once a run at this shape has gone through in order
+   bool parallel = inInput && inInput->shape==warmShape;
+   warmShape.clear();
+   for(int s=0;s<stages.size();s++)
+      runStage(stages[s], parallel);
+   if (inInput)
+      warmShape = inInput->shape;
+
+   Tensor *result = slots[output];
+   slots[InputSlot] = 0;
+   return result;
+}
+
+}
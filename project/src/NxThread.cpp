@@ -1,4 +1,23 @@
+
 #include <NxThread.h>
+#include <deque>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(HX_LINUX) || defined(HX_ANDROID)
+#include <sched.h>
+#endif
+#ifdef NX_PTHREADS
+#include <unistd.h>
+#include <sched.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Upper limit only - the pool defaults to one worker per available core
+#define MAX_NX_THREADS 256
 
 namespace numerix
 {
@@ -30,101 +49,475 @@ bool IsMainThread()
 
 
 
-volatile int gTaskId = 0;
-
-int sWorkerCount = 0;
-volatile int gActiveThreads = 0;
 
-#ifdef __arm__
-   #define MAX_NX_THREADS 4
+#ifdef NX_PTHREADS
+typedef pthread_cond_t ThreadPoolSignal;
 #else
-   #define MAX_NX_THREADS 8
+typedef HxSemaphore ThreadPoolSignal;
 #endif
 
-#ifdef NX_PTHREADS
-static NxMutex sThreadPoolLock;
-typedef pthread_cond_t ThreadPoolSignal;
-inline void WaitThreadLocked(ThreadPoolSignal &ioSignal)
+
+// One RunWorkerTask call.  It is queued as several slots (pointers to the
+//  same task) spread across the worker deques - each slot runs 'func' once
+//  on whichever worker pops or steals it.
+enum TaskState { tsRunning, tsCallerBlocked, tsDone };
+
+struct WorkerTask
 {
-   pthread_cond_wait(&ioSignal, &sThreadPoolLock.mMutex);
-}
+   WorkerFunc       func;
+   void             *data;
+   volatile int     pending;
+   // tsRunning -> tsDone when the caller is still spinning, or
+   //  tsRunning -> tsCallerBlocked, then 'finished' + 'done' signal
+   volatile int     state;
+   bool             finished;
+   ThreadPoolSignal done;
+};
+
+struct Worker
+{
+   NxMutex                  lock;
+   // Slots any worker may steal
+   std::deque<WorkerTask *> slots;
+   volatile int             size;
+   // Slots that must run on this worker (RunOnEachWorker)
+   std::deque<WorkerTask *> owned;
+   volatile int             ownedSize;
+
+   bool                     sleeping;
+   ThreadPoolSignal         wake;
+   ThreadId                 thread;
+   int                      cpu;
+   int                      node;
+};
+
+
+static int sWorkerCount = 0;
+static volatile int sPoolReady = 0;
+static int sRequestedWorkers = 0;
+static bool sPinWorkers = false;
+static NxMutex sInitLock;
+
+// Protects the sleeping flags and task completion
+static NxMutex sThreadPoolLock;
+
+// Total stealable slots sitting in the queues - workers only sleep when this is 0
+static volatile int gQueuedSlots = 0;
+static volatile int sNextQueue = 0;
+
+static Worker *sWorkers = 0;
+
+static volatile int sBranches = 1;
+
+// The workers the current thread may use, from its own id - a branch of RunBranches.
+// A count of 0 is the whole pool for a caller, or just itself for a worker.
+#ifdef HX_WINDOWS
+#define NX_THREAD_LOCAL __declspec(thread)
 #else
-typedef HxSemaphore ThreadPoolSignal;
+#define NX_THREAD_LOCAL __thread
 #endif
+static NX_THREAD_LOCAL int tPartFirst = 0;
+static NX_THREAD_LOCAL int tPartCount = 0;
+
 
-bool sThreadActive[MAX_NX_THREADS];
-ThreadPoolSignal sThreadWake[MAX_NX_THREADS];
-ThreadPoolSignal sThreadJobDone;
+static WorkerTask *popSlot(int inThreadId)
+{
+   Worker &self = sWorkers[inThreadId];
+   if (self.ownedSize)
+   {
+      NxAutoMutex lock(self.lock);
+      if (!self.owned.empty())
+      {
+         WorkerTask *task = self.owned.front();
+         self.owned.pop_front();
+         self.ownedSize--;
+         return task;
+      }
+   }
+
+   // Own queue from the back, then steal from the front of the others
+   for(int i=0;i<sWorkerCount;i++)
+   {
+      int q = inThreadId + i;
+      if (q>=sWorkerCount)
+         q -= sWorkerCount;
+      Worker &queue = sWorkers[q];
+      if (!queue.size)
+         continue;
+
+      NxAutoMutex lock(queue.lock);
+      if (!queue.slots.empty())
+      {
+         WorkerTask *task;
+         if (i==0)
+         {
+            task = queue.slots.back();
+            queue.slots.pop_back();
+         }
+         else
+         {
+            task = queue.slots.front();
+            queue.slots.pop_front();
+         }
+         queue.size--;
+         HxAtomicDec(&gQueuedSlots);
+         return task;
+      }
+   }
+   return 0;
+}
+
+
+// Microseconds, -1 until the pool picks a default
+static volatile int sSpinUs = -1;
+
+static inline void spinPause(int inSpins)
+{
+   // Give up the core once the quick spins are used, in case the thread we
+   //  are waiting for is sharing it
+   if (inSpins>256)
+   {
+      #ifdef HX_WINDOWS
+      SwitchToThread();
+      #elif defined(NX_PTHREADS)
+      sched_yield();
+      #endif
+   }
+   #if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+   else
+      _mm_pause();
+   #endif
+}
+
+
+static void finishSlot(WorkerTask *task)
+{
+   if (HxAtomicDec(&task->pending)==1)
+   {
+      // Caller still spinning - it owns the task again after this
+      if (HxAtomicExchangeIf(tsRunning, tsDone, &task->state))
+         return;
+
+      // The caller may destroy the task as soon as it sees 'finished', so
+      //  signal under the lock it checks with
+      NxAutoMutex lock(sThreadPoolLock);
+      task->finished = true;
+      #ifdef NX_PTHREADS
+      pthread_cond_signal(&task->done);
+      #else
+      task->done.Set();
+      #endif
+   }
+}
+
+
+static void pinThread(int inCpu)
+{
+   if (inCpu<0)
+      return;
+   #if defined(HX_LINUX) || defined(HX_ANDROID)
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(inCpu, &set);
+   sched_setaffinity(0, sizeof(set), &set);
+   #elif defined(HX_WINDOWS)
+   if (inCpu < (int)sizeof(DWORD_PTR)*8)
+      SetThreadAffinityMask(GetCurrentThread(), ((DWORD_PTR)1)<<inCpu);
+   #endif
+}
 
-static WorkerFunc sThreadJob = 0;
-static void *sThreadData = 0;
 
 static THREAD_FUNC_TYPE SThreadLoop( void *inInfo )
 {
    int threadId = (int)(size_t)inInfo;
+   // Wait for initWorkers to finish, since the pool shrinks if a later thread can not start
+   sInitLock.Lock();
+   sInitLock.Unlock();
+
+   Worker &self = sWorkers[threadId];
+   self.thread = GetThreadId();
+   if (sPinWorkers)
+      pinThread(self.cpu);
+
    while(true)
    {
+      WorkerTask *task = popSlot(threadId);
+      if (task)
+      {
+         task->func( threadId, task->data );
+         finishSlot(task);
+         continue;
+      }
+
+      // Another layer usually follows within a few microseconds, so spin
+      //  for a while before paying for a sleep and wake
+      int spinUs = sSpinUs;
+      if (spinUs>0)
+      {
+         double until = GetTimeStamp() + spinUs*1e-6;
+         for(int spins=1; !gQueuedSlots && !self.ownedSize; spins++)
+         {
+            if ( (spins & 0x3f)==0 && GetTimeStamp()>until)
+               break;
+            spinPause(spins);
+         }
+         if (gQueuedSlots || self.ownedSize)
+            continue;
+      }
+
       // Wait ....
       #ifdef NX_PTHREADS
+      NxAutoMutex lock(sThreadPoolLock);
+      if (!gQueuedSlots && !self.ownedSize)
       {
-         NxAutoMutex l(sThreadPoolLock);
-         while( !sThreadActive[threadId] )
-            WaitThreadLocked(sThreadWake[threadId]);
+         self.sleeping = true;
+         while( self.sleeping && !gQueuedSlots && !self.ownedSize )
+            pthread_cond_wait(&self.wake, &sThreadPoolLock.mMutex);
+         self.sleeping = false;
       }
       #else
-      while( !sThreadActive[threadId] )
-         sThreadWake[threadId].Wait();
+      sThreadPoolLock.Lock();
+      bool sleep = !gQueuedSlots && !self.ownedSize;
+      self.sleeping = sleep;
+      sThreadPoolLock.Unlock();
+      if (sleep)
+         self.wake.Wait();
       #endif
+   }
+   THREAD_FUNC_RET;
+}
 
-      // Run
-      sThreadJob( threadId, sThreadData );
 
-      // Signal
-      sThreadActive[threadId] = false;
-      if (HxAtomicDec(&gActiveThreads)==1)
+
+// Cpus this process may run on, with the numa node of each
+static void getCpus(std::vector<int> &outCpus, std::vector<int> &outNodes)
+{
+   #if defined(HX_LINUX) || defined(HX_ANDROID)
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   if (sched_getaffinity(0, sizeof(set), &set)==0)
+   {
+      for(int c=0;c<CPU_SETSIZE;c++)
+         if (CPU_ISSET(c,&set))
+            outCpus.push_back(c);
+   }
+   outNodes.resize(outCpus.size(),0);
+
+   for(int node=0; node<64; node++)
+   {
+      char name[256];
+      sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+      FILE *file = fopen(name,"r");
+      if (!file)
+      {
+         if (node>0)
+            break;
+         continue;
+      }
+      // eg, "0-15,32-47"
+      int first, last;
+      while(fscanf(file,"%d",&first)==1)
       {
-         #ifdef NX_PTHREADS
-         NxAutoMutex lock(sThreadPoolLock);
-         pthread_cond_signal(&sThreadJobDone);
-         #else
-         sThreadJobDone.Set();
-         #endif
+         last = first;
+         int sep = fgetc(file);
+         if (sep=='-')
+         {
+            if (fscanf(file,"%d",&last)!=1)
+               break;
+            sep = fgetc(file);
+         }
+         for(int i=0;i<outCpus.size();i++)
+            if (outCpus[i]>=first && outCpus[i]<=last)
+               outNodes[i] = node;
+         if (sep!=',')
+            break;
       }
+      fclose(file);
    }
-   THREAD_FUNC_RET;
+   #elif defined(HX_WINDOWS)
+   DWORD_PTR processMask = 0, systemMask = 0;
+   GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+   for(int c=0;c<(int)sizeof(DWORD_PTR)*8;c++)
+      if (processMask & (((DWORD_PTR)1)<<c))
+      {
+         UCHAR node = 0;
+         GetNumaProcessorNode((UCHAR)c, &node);
+         outCpus.push_back(c);
+         outNodes.push_back(node==0xff ? 0 : node);
+      }
+   #elif defined(NX_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+   int count = sysconf(_SC_NPROCESSORS_ONLN);
+   for(int c=0;c<count;c++)
+      outCpus.push_back(c);
+   outNodes.resize(outCpus.size(),0);
+   #endif
 }
 
 
-
-void initWorkers()
+static void initWorkers()
 {
-   sWorkerCount = MAX_NX_THREADS;
+   NxAutoMutex lock(sInitLock);
+   if (sWorkerCount)
+      return;
+
+   std::vector<int> cpus;
+   std::vector<int> nodes;
+   getCpus(cpus,nodes);
+
+   // Fill one node before the next, so a small pool stays local
+   std::vector<int> order;
+   for(int node=0; order.size()<cpus.size(); node++)
+      for(int i=0;i<cpus.size();i++)
+         if (nodes[i]==node)
+            order.push_back(i);
+
+   int count = sRequestedWorkers;
+   const char *env = getenv("NX_THREADS");
+   if (env && atoi(env)>0)
+      count = atoi(env);
+   if (count<1)
+      count = cpus.size();
+   if (count<1)
+      count = 4;
+   if (count>MAX_NX_THREADS)
+      count = MAX_NX_THREADS;
+
+   env = getenv("NX_SPIN_US");
+   if (env)
+      NxAtomicSet(&sSpinUs, atoi(env));
+   else if (sSpinUs<0)
+      // Spinning only helps when the workers have cores to themselves
+      NxAtomicSet(&sSpinUs, count <= (int)cpus.size() ? 50 : 0);
+
+   env = getenv("NX_AFFINITY");
+   if (env)
+      sPinWorkers = atoi(env)!=0;
+
+   env = getenv("NX_BRANCHES");
+   if (env)
+      NxAtomicSet(&sBranches, atoi(env)!=0);
+
+   sWorkers = new Worker[count];
+   for(int t=0;t<count;t++)
+   {
+      Worker &w = sWorkers[t];
+      w.size = 0;
+      w.ownedSize = 0;
+      w.sleeping = false;
+      w.thread = 0;
+      w.cpu = order.empty() ? -1 : cpus[ order[t % order.size()] ];
+      w.node = order.empty() ? 0 : nodes[ order[t % order.size()] ];
+      #ifdef NX_PTHREADS
+      pthread_cond_init(&w.wake,0);
+      #endif
+   }
 
-   #ifdef NX_PTHREADS
-   pthread_cond_init(&sThreadJobDone,0);
-   #endif
+   // Workers look at sWorkerCount when stealing
+   sWorkerCount = count;
 
-   for(int t=0;t<sWorkerCount;t++)
+   // Worker 0 is whichever thread calls RunWorkerTask.  The threads wait on sInitLock,
+   //  so if one can not be created, the pool is cut to those that were before any run.
+   for(int t=1;t<count;t++)
    {
-      sThreadActive[t] = false;
       #ifdef NX_PTHREADS
-      pthread_cond_init(&sThreadWake[t],0);
       pthread_t result = 0;
-      int created = pthread_create(&result,0,SThreadLoop, (void *)(size_t)(int)t);
-      bool ok = created==0;
+      bool ok = pthread_create(&result,0,SThreadLoop, (void *)(size_t)(int)t)==0;
       #else
       bool ok = HxCreateDetachedThread(SThreadLoop, (void *)(size_t)(int)t);
       #endif
+      if (!ok)
+      {
+         fprintf(stderr,"Could only start %d of %d worker threads\n", t, count);
+         sWorkerCount = t;
+         break;
+      }
    }
+
+   HxAtomicInc(&sPoolReady);
+}
+
+// Full barrier, so the pool set up by another thread is visible
+static inline bool poolReady()
+{
+   return HxAtomicExchangeIf(1, 1, &sPoolReady);
 }
 
 int GetWorkerCount()
 {
-   if (!sWorkerCount)
+   if (!poolReady())
       initWorkers();
    return sWorkerCount;
 }
 
+int SetWorkerCount(int inCount)
+{
+   NxAutoMutex lock(sInitLock);
+   // Layers size their per-thread scratch from GetWorkerCount, so the
+   //  pool can not change once it is running
+   if (!sWorkerCount)
+      sRequestedWorkers = inCount;
+   return sWorkerCount ? sWorkerCount : inCount;
+}
+
+void SetWorkerAffinity(bool inPin)
+{
+   NxAutoMutex lock(sInitLock);
+   if (!sWorkerCount)
+      sPinWorkers = inPin;
+}
+
+void SetWorkerSpin(int inMicroseconds)
+{
+   NxAtomicSet(&sSpinUs, inMicroseconds);
+}
+
+void SetWorkerBranches(bool inEnable)
+{
+   NxAtomicSet(&sBranches, inEnable);
+}
+
+int GetWorkerNode(int inThreadId)
+{
+   if (!poolReady())
+      initWorkers();
+   if (inThreadId<0 || inThreadId>=sWorkerCount)
+      return 0;
+   return sWorkers[inThreadId].node;
+}
+
+
+static int getWorkerId()
+{
+   ThreadId self = GetThreadId();
+   for(int t=0;t<sWorkerCount;t++)
+      #ifdef NX_PTHREADS
+      if (pthread_equal(sWorkers[t].thread,self))
+      #else
+      if (sWorkers[t].thread==self)
+      #endif
+         return t;
+   return -1;
+}
+
+static void getPartition(int inWorker, int &outFirst, int &outCount)
+{
+   if (tPartCount>0)
+   {
+      outFirst = tPartFirst;
+      outCount = tPartCount;
+   }
+   else if (inWorker>=0)
+   {
+      outFirst = inWorker;
+      outCount = 1;
+   }
+   else
+   {
+      outFirst = 0;
+      outCount = sWorkerCount;
+   }
+}
+
 
 extern "C" {
 size_t pthreadpool_get_threads_count(struct pthreadpool *)
@@ -134,45 +527,342 @@ size_t pthreadpool_get_threads_count(struct pthreadpool *)
 }
 
 
-
-void RunWorkerTask( WorkerFunc inFunc, void *inData )
+// Returns true if this removed the last outstanding slot
+static bool cancelSlots(WorkerTask *inTask)
 {
-   gTaskId = 0;
-   if (!sWorkerCount)
-      initWorkers();
+   int removed = 0;
+   for(int t=1;t<sWorkerCount;t++)
+   {
+      Worker &queue = sWorkers[t];
+      if (!queue.size)
+         continue;
+      NxAutoMutex lock(queue.lock);
+      for(int i=0;i<queue.slots.size(); /* */ )
+         if (queue.slots[i]==inTask)
+         {
+            queue.slots.erase( queue.slots.begin()+i );
+            queue.size--;
+            HxAtomicDec(&gQueuedSlots);
+            removed++;
+         }
+         else
+            i++;
+   }
 
-   gActiveThreads = sWorkerCount;
-   sThreadJob = inFunc;
-   sThreadData = inData;
+   for(int r=0;r<removed;r++)
+      if (HxAtomicDec(&inTask->pending)==1)
+         return true;
+   return false;
+}
 
 
+static void wakeWorker(Worker &w)
+{
+   w.sleeping = false;
    #ifdef NX_PTHREADS
-   NxAutoMutex lock(sThreadPoolLock);
+   pthread_cond_signal(&w.wake);
+   #else
+   w.wake.Set();
    #endif
+}
 
-   for(int t=0;t<sWorkerCount;t++)
+
+// Waits for the pool's slots of a task whose caller has finished its own part
+static void waitForTask(WorkerTask &task)
+{
+   int spinUs = sSpinUs;
+   if (spinUs>0)
    {
-      sThreadActive[t] = true;
-      #ifdef NX_PTHREADS
-      pthread_cond_signal(&sThreadWake[t]);
-      #else
-      sThreadWake[t].Set();
-      #endif
+      double until = GetTimeStamp() + spinUs*1e-6;
+      for(int spins=1; task.state!=tsDone; spins++)
+      {
+         if ( (spins & 0x3f)==0 && GetTimeStamp()>until)
+            break;
+         spinPause(spins);
+      }
    }
+   if (HxAtomicExchangeIf(tsDone, tsDone, &task.state))
+      return;
 
    #ifdef NX_PTHREADS
-   while(gActiveThreads)
-      WaitThreadLocked(sThreadJobDone);
+   pthread_cond_init(&task.done,0);
+   {
+      NxAutoMutex lock(sThreadPoolLock);
+      if (HxAtomicExchangeIf(tsRunning, tsCallerBlocked, &task.state))
+         while(!task.finished)
+            pthread_cond_wait(&task.done, &sThreadPoolLock.mMutex);
+   }
+   pthread_cond_destroy(&task.done);
    #else
-   while(gActiveThreads)
-      sThreadJobDone.Wait();
+   if (HxAtomicExchangeIf(tsRunning, tsCallerBlocked, &task.state))
+   {
+      task.done.Wait();
+      // Make sure the finishing worker has let go of the task
+      NxAutoMutex lock(sThreadPoolLock);
+   }
    #endif
+}
+
+
+static void runWorkerSlots( WorkerFunc inFunc, void *inData, int inSlots, bool inEachWorker=false )
+{
+   if (!poolReady())
+      initWorkers();
+
+   // A task started from inside a worker can't block waiting for the pool
+   //  it is part of - it owns the worker's scratch for now, so just run it here.
+   // The same goes for every-worker tasks from a branch, since the other shares are busy.
+   int worker = getWorkerId();
+   if (inEachWorker && (worker>=0 || tPartCount>0))
+   {
+      for(int t=0;t<sWorkerCount;t++)
+         inFunc(t, inData);
+      return;
+   }
 
-   sThreadJob = 0;
-   sThreadData = 0;
+   // The calling thread runs as the first worker of its share, so the pool gets one slot less
+   int first, count;
+   getPartition(worker, first, count);
+   int poolThreads = count-1;
+   int poolSlots = (inEachWorker ? sWorkerCount : inSlots) - 1;
+   if (poolSlots>poolThreads)
+      poolSlots = poolThreads;
+   if (poolSlots<1)
+   {
+      inFunc(first, inData);
+      return;
+   }
+
+   WorkerTask task;
+   task.func = inFunc;
+   task.data = inData;
+   task.pending = poolSlots;
+   task.state = tsRunning;
+   task.finished = false;
+
+   // Spread the slots round-robin so concurrent callers start on different workers
+   int rr = inEachWorker ? 0 : (int)( (unsigned int)HxAtomicInc(&sNextQueue) % poolThreads );
+   for(int s=0;s<poolSlots;s++)
+   {
+      Worker &queue = sWorkers[ first + 1 + (rr+s) % poolThreads ];
+      NxAutoMutex lock(queue.lock);
+      if (inEachWorker)
+      {
+         queue.owned.push_back(&task);
+         queue.ownedSize++;
+      }
+      else
+      {
+         queue.slots.push_back(&task);
+         queue.size++;
+         HxAtomicInc(&gQueuedSlots);
+      }
+   }
+
+   {
+      NxAutoMutex lock(sThreadPoolLock);
+      // Only sleeping workers need a signal - running ones will find the slots
+      int toWake = poolSlots;
+      for(int t=0;t<poolThreads && toWake>0;t++)
+      {
+         Worker &w = sWorkers[ first + 1 + (rr+t) % poolThreads ];
+         if (w.sleeping)
+         {
+            wakeWorker(w);
+            if (!inEachWorker)
+               toWake--;
+         }
+      }
+   }
+
+   inFunc(first, inData);
+
+   // The jobs are pulled from a shared counter, so by now there is nothing
+   //  left for slots that have not started - take them back
+   if (!inEachWorker && cancelSlots(&task))
+      return;
+
+   waitForTask(task);
 }
 
 
+void RunWorkerTask( WorkerFunc inFunc, void *inData )
+{
+   runWorkerSlots(inFunc, inData, GetWorkerCount());
+}
 
-} // end namespace numerix
+void RunOnEachWorker( WorkerFunc inFunc, void *inData )
+{
+   runWorkerSlots(inFunc, inData, GetWorkerCount(), true);
+}
+
+
+
+struct ParallelForJob
+{
+   RangeFunc    func;
+   void         *data;
+   int          count;
+   int          grain;
+   volatile int nextChunk;
+};
+
+static void SRunParallelFor(int inThreadId, void *inJob)
+{
+   ParallelForJob *job = (ParallelForJob *)inJob;
+   while(true)
+   {
+      int begin = HxAtomicInc(&job->nextChunk) * job->grain;
+      if (begin>=job->count)
+         break;
+      int end = begin + job->grain;
+      if (end>job->count)
+         end = job->count;
+      job->func(inThreadId, begin, end, job->data);
+   }
+}
+
+void ParallelFor( int inCount, int inGrain, RangeFunc inFunc, void *inData )
+{
+   if (inCount<=0)
+      return;
+   if (inGrain<1)
+      inGrain = 1;
+
+   ParallelForJob job;
+   job.func = inFunc;
+   job.data = inData;
+   job.count = inCount;
+   job.grain = inGrain;
+   job.nextChunk = 0;
+
+   // No point waking more workers than there are chunks
+   int chunks = (inCount + inGrain - 1)/inGrain;
+   runWorkerSlots(SRunParallelFor, &job, chunks);
+}
+
+
+
+
+struct BranchSlot
+{
+   BranchFunc  func;
+   void        *data;
+   int         branch;
+   int         first;
+   int         count;
+   bool        failed;
+   WorkerTask  task;
+};
+
+static void SRunBranch(int inThreadId, void *inData)
+{
+   BranchSlot *slot = (BranchSlot *)inData;
+   tPartFirst = slot->first;
+   tPartCount = slot->count;
+   // Nothing can be thrown from a worker, so the caller runs the branch again to report it
+   try
+   {
+      slot->func(slot->branch, slot->data);
+   }
+   catch(...)
+   {
+      slot->failed = true;
+   }
+   tPartFirst = 0;
+   tPartCount = 0;
+}
 
+bool RunBranches( int inCount, BranchFunc inFunc, void *inData, const double *inWeights )
+{
+   if (!poolReady())
+      initWorkers();
+
+   int first, count;
+   getPartition(getWorkerId(), first, count);
+   if (!sBranches || inCount<2 || count<inCount)
+   {
+      for(int b=0;b<inCount;b++)
+         inFunc(b, inData);
+      return true;
+   }
+
+   // Share out the workers by weight, at least one each
+   std::vector<int> shares(inCount,1);
+   double total = 0;
+   for(int b=0;b<inCount;b++)
+      total += inWeights && inWeights[b]>0 ? inWeights[b] : 1.0;
+   int spare = count - inCount;
+   int given = 0;
+   for(int b=0;b<inCount;b++)
+   {
+      double w = inWeights && inWeights[b]>0 ? inWeights[b] : 1.0;
+      int extra = (int)(spare*w/total);
+      shares[b] += extra;
+      given += extra;
+   }
+   for(int b=0; given<spare; b=(b+1)%inCount, given++)
+      shares[b]++;
+
+   std::vector<BranchSlot> slots(inCount);
+   int start = first + shares[0];
+   for(int b=1;b<inCount;b++)
+   {
+      BranchSlot &slot = slots[b];
+      slot.func = inFunc;
+      slot.data = inData;
+      slot.branch = b;
+      slot.first = start;
+      slot.count = shares[b];
+      slot.failed = false;
+      slot.task.func = SRunBranch;
+      slot.task.data = &slot;
+      slot.task.pending = 1;
+      slot.task.state = tsRunning;
+      slot.task.finished = false;
+      start += shares[b];
+
+      // The branch must run on the first worker of its share
+      Worker &w = sWorkers[slot.first];
+      {
+         NxAutoMutex lock(w.lock);
+         w.owned.push_back(&slot.task);
+         w.ownedSize++;
+      }
+      NxAutoMutex lock(sThreadPoolLock);
+      if (w.sleeping)
+         wakeWorker(w);
+   }
+
+   int oldFirst = tPartFirst;
+   int oldCount = tPartCount;
+   tPartFirst = first;
+   tPartCount = shares[0];
+   bool ok = true;
+   try
+   {
+      inFunc(0, inData);
+   }
+   catch(...)
+   {
+      tPartFirst = oldFirst;
+      tPartCount = oldCount;
+      // The other branches use the caller's data, so they must finish first
+      for(int b=1;b<inCount;b++)
+         waitForTask(slots[b].task);
+      throw;
+   }
+   tPartFirst = oldFirst;
+   tPartCount = oldCount;
+
+   for(int b=1;b<inCount;b++)
+   {
+      waitForTask(slots[b].task);
+      if (slots[b].failed)
+         ok = false;
+   }
+   return ok;
+}
+
+
+} // end namespace numerix
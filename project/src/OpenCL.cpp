@@ -505,6 +505,8 @@ public:
 class OpenCLLayer : public Layer
 {
 public:
+   bool runsOnCpu() { return false; }
+
    OpenCLLayerData data;
 
    cl_event *startKernel() { return data.startKernel(); }
@@ -835,6 +837,12 @@ public:
       cropY = inDy;
    }
 
+   void setActivation(Activation inActivation)
+   {
+      if (inActivation!=actLinear)
+         TensorThrow("OpenCL Eltwise does not support activations");
+   }
+
 
 
    void initKernel(OpenCLContext *ctx, int inChannels)
@@ -989,6 +997,8 @@ class OpenCLConv2D : public Conv2DBase
 
 
 public:
+   bool runsOnCpu() { return false; }
+
    OpenCLConv2D(int inStrideY, int inStrideX, bool inIsDeconvolution,
           Activation inActivation, Padding inPadding,
           Tensor *inWeights, Tensor *inBias)
@@ -1184,8 +1194,16 @@ public:
    }
 
 
+   // The fused epilogues are cpu code, so stay as separate layers
+   bool setFusedPool(bool inFuse, Padding inPadding) { return false; }
+   bool setFusedSum(bool inFuse, Activation inActivation) { return false; }
+   bool runInto(Tensor *inSrc0, Tensor *inSlice) { return false; }
+
    void doRun(Tensor *input, Tensor *output)
    {
+      if (input->shape.size()!=3)
+         TensorThrow("OpenCLConv2D only supports H*W*C tensors");
+
       if (kernel && kernelShape!=input->shape)
          kernel = 0;
 
@@ -1,8 +1,407 @@
 #include "Ops.h"
+#include "NxThread.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
 
 namespace numerix
 {
 
+void packGemmWeights(float *outPanels, const float *inWeights, int inOutputs, int inK, int inWeightStride)
+{
+   int panels = gemmPanelCount(inOutputs);
+   float *dest = outPanels;
+   for(int p=0;p<panels;p++)
+   {
+      int o0 = p*GEMM_NR;
+      for(int k=0;k<inK;k++)
+         for(int j=0;j<GEMM_NR;j++)
+            *dest++ = o0+j<inOutputs ? inWeights[ (o0+j)*inWeightStride + k ] : 0.0f;
+   }
+}
+
+void gemmKernel(float *dest, int destStride, const float *const *src, const float *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols)
+{
+   bool full = rows==GEMM_MR && cols==GEMM_NR;
+
+   // Partial tiles go through here
+   float tile[GEMM_MR*GEMM_NR];
+   float *d = full ? dest : tile;
+   int dStride = full ? destStride : GEMM_NR;
+   if (!full && accumulate)
+      for(int r=0;r<rows;r++)
+         memcpy(tile + r*GEMM_NR, dest + r*destStride, cols*sizeof(float));
+
+   const float *s0 = src[0];
+   const float *s1 = src[1];
+   const float *s2 = src[2];
+   const float *s3 = src[3];
+
+   #ifdef NUMERIX_SIMD
+   float32x4_t a0, a1, b0, b1, c0, c1, d0, d1;
+   if (accumulate)
+   {
+      a0 = LoadU4f32(d);             a1 = LoadU4f32(d+4);
+      b0 = LoadU4f32(d+dStride);     b1 = LoadU4f32(d+dStride+4);
+      c0 = LoadU4f32(d+dStride*2);   c1 = LoadU4f32(d+dStride*2+4);
+      d0 = LoadU4f32(d+dStride*3);   d1 = LoadU4f32(d+dStride*3+4);
+   }
+   else
+   {
+      a0 = bias ? Load4f32(bias) : Zero4f32;
+      a1 = bias ? Load4f32(bias+4) : Zero4f32;
+      b0 = c0 = d0 = a0;
+      b1 = c1 = d1 = a1;
+   }
+
+   const float *w = panel;
+   for(int i=0;i<k;i++)
+   {
+      float32x4_t w0 = Load4f32(w);
+      float32x4_t w1 = Load4f32(w+4);
+      w += GEMM_NR;
+
+      float32x4_t s = Splat4f32(s0+i);
+      a0 = Add4f32(a0, Mul4f32(s,w0));
+      a1 = Add4f32(a1, Mul4f32(s,w1));
+      s = Splat4f32(s1+i);
+      b0 = Add4f32(b0, Mul4f32(s,w0));
+      b1 = Add4f32(b1, Mul4f32(s,w1));
+      s = Splat4f32(s2+i);
+      c0 = Add4f32(c0, Mul4f32(s,w0));
+      c1 = Add4f32(c1, Mul4f32(s,w1));
+      s = Splat4f32(s3+i);
+      d0 = Add4f32(d0, Mul4f32(s,w0));
+      d1 = Add4f32(d1, Mul4f32(s,w1));
+   }
+
+   if (activation==actRelu)
+   {
+      float32x4_t zero = Zero4f32;
+      a0 = Max4f32(a0,zero); a1 = Max4f32(a1,zero);
+      b0 = Max4f32(b0,zero); b1 = Max4f32(b1,zero);
+      c0 = Max4f32(c0,zero); c1 = Max4f32(c1,zero);
+      d0 = Max4f32(d0,zero); d1 = Max4f32(d1,zero);
+   }
+   else if (activation==actLeaky)
+   {
+      float32x4_t leak = Const4f32(0.1f);
+      a0 = Max4f32(a0,Mul4f32(a0,leak)); a1 = Max4f32(a1,Mul4f32(a1,leak));
+      b0 = Max4f32(b0,Mul4f32(b0,leak)); b1 = Max4f32(b1,Mul4f32(b1,leak));
+      c0 = Max4f32(c0,Mul4f32(c0,leak)); c1 = Max4f32(c1,Mul4f32(c1,leak));
+      d0 = Max4f32(d0,Mul4f32(d0,leak)); d1 = Max4f32(d1,Mul4f32(d1,leak));
+   }
+
+   StoreU4f32(d, a0);             StoreU4f32(d+4, a1);
+   StoreU4f32(d+dStride, b0);     StoreU4f32(d+dStride+4, b1);
+   StoreU4f32(d+dStride*2, c0);   StoreU4f32(d+dStride*2+4, c1);
+   StoreU4f32(d+dStride*3, d0);   StoreU4f32(d+dStride*3+4, d1);
+
+   if (activation==actSigmoid)
+      for(int r=0;r<GEMM_MR;r++)
+         for(int c=0;c<GEMM_NR;c++)
+            d[r*dStride+c] = activate(d[r*dStride+c], actSigmoid);
+   #else
+   const float *rowSrc[GEMM_MR] = { s0, s1, s2, s3 };
+   for(int r=0;r<GEMM_MR;r++)
+   {
+      float *dr = d + r*dStride;
+      const float *sr = rowSrc[r];
+      for(int c=0;c<GEMM_NR;c++)
+      {
+         float sum = accumulate ? dr[c] : bias ? bias[c] : 0.0f;
+         const float *w = panel + c;
+         for(int i=0;i<k;i++)
+            sum += sr[i] * w[i*GEMM_NR];
+         dr[c] = activate(sum, activation);
+      }
+   }
+   #endif
+
+   if (!full)
+      for(int r=0;r<rows;r++)
+         memcpy(dest + r*destStride, tile + r*GEMM_NR, cols*sizeof(float));
+}
+
+void packGemmWeightsInt8(signed char *outPanels, const signed char *inWeights, int inOutputs, int inK, int inWeightStride)
+{
+   int panels = gemmPanelCount(inOutputs);
+   int kPad = gemmInt8K(inK);
+   signed char *dest = outPanels;
+   for(int p=0;p<panels;p++)
+   {
+      int o0 = p*GEMM_NR;
+      for(int k0=0;k0<kPad;k0+=4)
+         for(int j=0;j<GEMM_NR;j++)
+            for(int k=k0;k<k0+4;k++)
+               *dest++ = o0+j<inOutputs && k<inK ? inWeights[ (o0+j)*inWeightStride + k ] : 0;
+   }
+}
+
+void gemmKernelInt8(float *dest, int destStride, const signed char *const *src, const signed char *panel, int k,
+                    const float *scale, const float *bias, Activation activation, int rows, int cols)
+{
+   int sum[GEMM_MR][GEMM_NR];
+
+   #if defined(NUMERIX_SIMD) && defined(NUMERIX_NEON)
+   // Widening multiplies of 8 bytes (2 outputs x 4 k), pairwise added into int32.
+   // A row at a time keeps the accumulators within the armv7 registers.
+   for(int r=0;r<GEMM_MR;r++)
+   {
+      const signed char *s = src[r];
+      const signed char *w = panel;
+      int32x4_t acc0 = vdupq_n_s32(0);
+      int32x4_t acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      for(int i=0;i<k;i+=4)
+      {
+         int8x8_t a = vreinterpret_s8_s32( vld1_dup_s32( (const int32_t *)(s+i) ) );
+         int8x16_t w01 = vld1q_s8(w);
+         int8x16_t w23 = vld1q_s8(w+16);
+         w += GEMM_NR*4;
+         acc0 = vpadalq_s16(acc0, vmull_s8(a, vget_low_s8(w01)));
+         acc1 = vpadalq_s16(acc1, vmull_s8(a, vget_high_s8(w01)));
+         acc2 = vpadalq_s16(acc2, vmull_s8(a, vget_low_s8(w23)));
+         acc3 = vpadalq_s16(acc3, vmull_s8(a, vget_high_s8(w23)));
+      }
+      // acc0 : out0 k01, out0 k23, out1 k01, out1 k23 ...
+      int32x2_t s0 = vpadd_s32(vget_low_s32(acc0), vget_high_s32(acc0));
+      int32x2_t s1 = vpadd_s32(vget_low_s32(acc1), vget_high_s32(acc1));
+      int32x2_t s2 = vpadd_s32(vget_low_s32(acc2), vget_high_s32(acc2));
+      int32x2_t s3 = vpadd_s32(vget_low_s32(acc3), vget_high_s32(acc3));
+      vst1q_s32(sum[r], vcombine_s32(s0,s1));
+      vst1q_s32(sum[r]+4, vcombine_s32(s2,s3));
+   }
+   #elif defined(NUMERIX_SIMD)
+   // SSE2 has no byte multiplies, so the weights are widened to 16 bits once per k step,
+   //  and madd gives pairs of k, which are summed at the end.  Rows go in pairs to fit the registers.
+   for(int r=0;r<GEMM_MR;r+=2)
+   {
+      const signed char *sA = src[r];
+      const signed char *sB = src[r+1];
+      const signed char *w = panel;
+      __m128i a0 = _mm_setzero_si128();
+      __m128i a1 = a0, a2 = a0, a3 = a0, b0 = a0, b1 = a0, b2 = a0, b3 = a0;
+      for(int i=0;i<k;i+=4)
+      {
+         __m128i wLo = _mm_loadu_si128((const __m128i *)w);
+         __m128i wHi = _mm_loadu_si128((const __m128i *)(w+16));
+         w += GEMM_NR*4;
+         __m128i signLo = _mm_cmpgt_epi8(_mm_setzero_si128(), wLo);
+         __m128i signHi = _mm_cmpgt_epi8(_mm_setzero_si128(), wHi);
+         __m128i w0 = _mm_unpacklo_epi8(wLo, signLo);
+         __m128i w1 = _mm_unpackhi_epi8(wLo, signLo);
+         __m128i w2 = _mm_unpacklo_epi8(wHi, signHi);
+         __m128i w3 = _mm_unpackhi_epi8(wHi, signHi);
+
+         // 4 k, as 16 bits, in both halves
+         __m128i s = _mm_cvtsi32_si128( *(const int *)(sA+i) );
+         s = _mm_unpacklo_epi8(s, _mm_cmpgt_epi8(_mm_setzero_si128(), s));
+         s = _mm_unpacklo_epi64(s, s);
+         a0 = _mm_add_epi32(a0, _mm_madd_epi16(s, w0));
+         a1 = _mm_add_epi32(a1, _mm_madd_epi16(s, w1));
+         a2 = _mm_add_epi32(a2, _mm_madd_epi16(s, w2));
+         a3 = _mm_add_epi32(a3, _mm_madd_epi16(s, w3));
+
+         s = _mm_cvtsi32_si128( *(const int *)(sB+i) );
+         s = _mm_unpacklo_epi8(s, _mm_cmpgt_epi8(_mm_setzero_si128(), s));
+         s = _mm_unpacklo_epi64(s, s);
+         b0 = _mm_add_epi32(b0, _mm_madd_epi16(s, w0));
+         b1 = _mm_add_epi32(b1, _mm_madd_epi16(s, w1));
+         b2 = _mm_add_epi32(b2, _mm_madd_epi16(s, w2));
+         b3 = _mm_add_epi32(b3, _mm_madd_epi16(s, w3));
+      }
+      // a0 : out0 k01, out0 k23, out1 k01, out1 k23 - add the pairs
+      #define SumPairs(x,y) _mm_add_epi32( \
+          _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(x),_mm_castsi128_ps(y),_MM_SHUFFLE(2,0,2,0))), \
+          _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(x),_mm_castsi128_ps(y),_MM_SHUFFLE(3,1,3,1))) )
+      _mm_storeu_si128((__m128i *)sum[r], SumPairs(a0,a1));
+      _mm_storeu_si128((__m128i *)(sum[r]+4), SumPairs(a2,a3));
+      _mm_storeu_si128((__m128i *)sum[r+1], SumPairs(b0,b1));
+      _mm_storeu_si128((__m128i *)(sum[r+1]+4), SumPairs(b2,b3));
+      #undef SumPairs
+   }
+   #else
+   for(int r=0;r<GEMM_MR;r++)
+   {
+      const signed char *s = src[r];
+      for(int c=0;c<GEMM_NR;c++)
+      {
+         const signed char *w = panel + c*4;
+         int total = 0;
+         for(int i=0;i<k;i+=4)
+         {
+            total += s[i]*w[0] + s[i+1]*w[1] + s[i+2]*w[2] + s[i+3]*w[3];
+            w += GEMM_NR*4;
+         }
+         sum[r][c] = total;
+      }
+   }
+   #endif
+
+   for(int r=0;r<rows;r++)
+   {
+      float *d = dest + r*destStride;
+      for(int c=0;c<cols;c++)
+         d[c] = activate(bias[c] + scale[c]*sum[r][c], activation);
+   }
+}
+
+void quantizeInt8(signed char *dest, const float *src, int n, float scale)
+{
+   int i = 0;
+   #if defined(NUMERIX_SIMD) && !defined(NUMERIX_NEON)
+   __m128 s = _mm_set1_ps(scale);
+   __m128 lo = _mm_set1_ps(-127.0f);
+   __m128 hi = _mm_set1_ps(127.0f);
+   for(;i+16<=n;i+=16)
+   {
+      // cvtps rounds to nearest
+      __m128i q0 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i   ),s),lo),hi));
+      __m128i q1 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+4 ),s),lo),hi));
+      __m128i q2 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+8 ),s),lo),hi));
+      __m128i q3 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+12),s),lo),hi));
+      _mm_storeu_si128((__m128i *)(dest+i), _mm_packs_epi16(_mm_packs_epi32(q0,q1),_mm_packs_epi32(q2,q3)));
+   }
+   #endif
+   for(;i<n;i++)
+   {
+      float v = src[i]*scale;
+      v = v<-127.0f ? -127.0f : v>127.0f ? 127.0f : v;
+      dest[i] = (signed char)(v<0 ? v-0.5f : v+0.5f);
+   }
+}
+
+static void floatToHalf(unsigned short *dest, const float *src, int n);
+static void halfToFloat(float *dest, const unsigned short *src, int n);
+
+#ifdef NUMERIX_SIMD
+template<int M>
+static void winoInput(const float *in, int is, float *out, int os, int n)
+{
+   for(int c=0;c<n;c+=4)
+      WinoTransform<M>::template input<psimd_f32>(in+c, is, out+c, os);
+}
+
+template<int M>
+static void winoOutput(const float *in, int is, float *out, int os, int n)
+{
+   for(int c=0;c<n;c+=4)
+      WinoTransform<M>::template output<psimd_f32>(in+c, is, out+c, os);
+}
+#endif
+
+static OpKernels sBaseKernels = {
+   #if defined(NUMERIX_SIMD) && defined(NUMERIX_NEON)
+   "neon",
+   #elif defined(NUMERIX_SIMD)
+   "sse",
+   #else
+   "generic",
+   #endif
+   dot, gemmKernel, gemmKernelInt8, 0, depthwise, floatToHalf, halfToFloat,
+   #ifdef NUMERIX_SIMD
+   { winoInput<2>, winoInput<4>, winoInput<6> },
+   { winoOutput<2>, winoOutput<4>, winoOutput<6> },
+   #endif
+   };
+
+// Which set GetKernels returns, -1 until chosen - an int, so SetKernelIsa may change it
+//  while other threads are running layers
+enum { ksBase, ksAvx2, ksAvx512 };
+static volatile int sKernelSet = -1;
+
+static const OpKernels *kernelSet(int inSet)
+{
+   if (inSet==ksAvx2)
+      return GetAvx2Kernels();
+   if (inSet==ksAvx512)
+      return GetAvx512Kernels();
+   return &sBaseKernels;
+}
+
+// -1 if the cpu can not run it
+static int findKernels(const char *inIsa)
+{
+   if (!inIsa || !*inIsa)
+   {
+      if (GetAvx512Kernels())
+         return ksAvx512;
+      if (GetAvx2Kernels())
+         return ksAvx2;
+      return ksBase;
+   }
+   if (!strcmp(inIsa,sBaseKernels.isa))
+      return ksBase;
+   if (!strcmp(inIsa,"avx2"))
+      return GetAvx2Kernels() ? ksAvx2 : -1;
+   if (!strcmp(inIsa,"avx512"))
+      return GetAvx512Kernels() ? ksAvx512 : -1;
+   return -1;
+}
+
+const OpKernels &GetKernels()
+{
+   int set = sKernelSet;
+   if (set<0)
+   {
+      set = findKernels( getenv("NX_ISA") );
+      if (set<0)
+      {
+         fprintf(stderr,"NX_ISA=%s is not supported here\n", getenv("NX_ISA"));
+         set = findKernels(0);
+      }
+      NxAtomicSet(&sKernelSet, set);
+   }
+   return *kernelSet(set);
+}
+
+bool SetKernelIsa(const char *inIsa)
+{
+   int set = findKernels(inIsa);
+   if (set<0)
+      return false;
+   NxAtomicSet(&sKernelSet, set);
+   return true;
+}
+
+const char *GetCpuName()
+{
+   static std::string name;
+   if (name.empty())
+   {
+      const char *x86 = GetX86CpuName();
+      if (x86)
+         name = x86;
+      else
+      {
+         FILE *file = fopen("/proc/cpuinfo","r");
+         if (file)
+         {
+            char line[256];
+            while(fgets(line, sizeof(line), file))
+               if (!strncmp(line,"model name",10) || !strncmp(line,"Hardware",8))
+               {
+                  const char *colon = strchr(line,':');
+                  if (colon)
+                  {
+                     name = colon+1 + strspn(colon+1," \t");
+                     while(!name.empty() && (name[name.size()-1]=='\n' || name[name.size()-1]==' '))
+                        name.resize(name.size()-1);
+                  }
+                  break;
+               }
+            fclose(file);
+         }
+         if (name.empty())
+            name = sBaseKernels.isa;
+      }
+   }
+   return name.c_str();
+}
+
+
 // Copied from Numpy
 
 static unsigned half2float(unsigned short h)
@@ -152,24 +551,43 @@ unsigned short float2half(unsigned f)
 #endif
 }
 
+// NEON can convert 4 at a time when the fpu has the half-precision extension (eg, neon-vfpv4)
+#if defined(NUMERIX_SIMD) && defined(NUMERIX_NEON) && defined(__ARM_FP16_FORMAT_IEEE) && defined(__ARM_FP) && (__ARM_FP & 2)
+   #define NX_NEON_FP16
+#endif
+
+static void floatToHalf(unsigned short *dest, const float *src, int n)
+{
+   int i = 0;
+   #ifdef NX_NEON_FP16
+   for(;i+4<=n;i+=4)
+      vst1_u16(dest+i, vreinterpret_u16_f16( vcvt_f16_f32( vld1q_f32(src+i) ) ) );
+   #endif
+   const unsigned *bits = (const unsigned *)src;
+   for(;i<n;i++)
+      dest[i] = float2half(bits[i]);
+}
+
+static void halfToFloat(float *dest, const unsigned short *src, int n)
+{
+   int i = 0;
+   #ifdef NX_NEON_FP16
+   for(;i+4<=n;i+=4)
+      vst1q_f32(dest+i, vcvt_f32_f16( vreinterpret_f16_u16( vld1_u16(src+i) ) ) );
+   #endif
+   unsigned *bits = (unsigned *)dest;
+   for(;i<n;i++)
+      bits[i] = half2float(src[i]);
+}
+
 void floattofp16(unsigned char *dst, const float *src, unsigned nelem)
 {
-	unsigned i;
-	unsigned short *_dst = (unsigned short *)dst;
-	const unsigned *_src = (const unsigned *)src;
-	
-	for(i = 0; i < nelem; i++)
-		_dst[i] = float2half(_src[i]);
+   GetKernels().floatToHalf((unsigned short *)dst, src, nelem);
 }
 
 void fp16tofloat(float *dst, const unsigned char *src, unsigned nelem)
 {
-	unsigned i;
-	unsigned *_dst = (unsigned *)dst;
-	const unsigned short *_src = (const unsigned short *)src;
-	
-	for(i = 0; i < nelem; i++)
-		_dst[i] = half2float(_src[i]);
+   GetKernels().halfToFloat(dst, (const unsigned short *)src, nelem);
 }
 
 
@@ -0,0 +1,652 @@
+#include "Ops.h"
+#include <string.h>
+
+/*
+ AVX2+FMA and AVX-512 versions of the kernels in Ops.h.
+
+ Each function is compiled for its own instruction set, so the rest of the library can keep
+ the baseline flags and one binary still runs on older cpus - Ops.cpp only hands these out
+ once cpuid (and the os, via xgetbv) say the registers are usable.
+*/
+
+#if defined(NUMERIX_SIMD) && !defined(NUMERIX_NEON) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+   #define NX_X86_KERNELS
+   #include <immintrin.h>
+   #ifdef _MSC_VER
+      #include <intrin.h>
+      #define NX_TARGET(isa)
+   #else
+      #include <cpuid.h>
+      #define NX_TARGET(isa) __attribute__((target(isa)))
+   #endif
+   #define NX_AVX2 NX_TARGET("avx2,fma,f16c")
+   #define NX_AVX512 NX_TARGET("avx512f,avx2,fma,f16c")
+   #define NX_AVX512_VNNI NX_TARGET("avx512vnni,avx512vl,avx512bw,avx512f,avx2,fma,f16c")
+#endif
+
+
+namespace numerix
+{
+
+#ifdef NX_X86_KERNELS
+
+static void cpuid(unsigned inLeaf, unsigned inSub, unsigned outRegs[4])
+{
+   #ifdef _MSC_VER
+   __cpuidex((int *)outRegs, inLeaf, inSub);
+   #else
+   __cpuid_count(inLeaf, inSub, outRegs[0], outRegs[1], outRegs[2], outRegs[3]);
+   #endif
+}
+
+static unsigned long long xgetbv0()
+{
+   #ifdef _MSC_VER
+   return _xgetbv(0);
+   #else
+   unsigned eax, edx;
+   __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+   return ((unsigned long long)edx<<32) | eax;
+   #endif
+}
+
+enum { featAvx2 = 0x01, featAvx512 = 0x02, featVnni = 0x04 };
+
+static int getFeatures()
+{
+   unsigned r[4];
+   cpuid(0,0,r);
+   if (r[0]<7)
+      return 0;
+
+   cpuid(1,0,r);
+   bool osxsave = r[2] & (1<<27);
+   bool avx = r[2] & (1<<28);
+   bool fma = r[2] & (1<<12);
+   // Every avx2 cpu so far has f16c too, so it is just part of the avx2 set
+   bool f16c = r[2] & (1<<29);
+   if (!osxsave || !avx || !fma || !f16c)
+      return 0;
+
+   // The os must save the xmm+ymm state ...
+   unsigned long long xcr0 = xgetbv0();
+   if ( (xcr0 & 0x06) != 0x06 )
+      return 0;
+
+   int result = 0;
+   cpuid(7,0,r);
+   if (r[1] & (1<<5))
+   {
+      result |= featAvx2;
+      // ... and opmask + zmm state for avx512
+      if ( (r[1] & (1<<16)) && (xcr0 & 0xe6)==0xe6 )
+      {
+         result |= featAvx512;
+         // avx512vl + avx512bw + avx512_vnni, for the 256-bit int8 dot products
+         if ( (r[1] & (1u<<31)) && (r[1] & (1<<30)) && (r[2] & (1<<11)) )
+            result |= featVnni;
+      }
+   }
+   return result;
+}
+
+static int features()
+{
+   static int sFeatures = -1;
+   if (sFeatures<0)
+      sFeatures = getFeatures();
+   return sFeatures;
+}
+
+
+// 8 and 16 floats, for the Winograd transforms shared with Ops.h.  The gcc/clang vector
+//  extensions are not tied to an instruction set, so the inlined templates become ymm or zmm
+//  code in the kernels below - msvc allows the intrinsics anywhere instead.
+#ifdef _MSC_VER
+struct f32x8
+{
+   __m256 v;
+   NX_INLINE f32x8() { }
+   NX_INLINE f32x8(__m256 inV) : v(inV) { }
+   NX_INLINE f32x8(const float *inPtr) : v(_mm256_loadu_ps(inPtr)) { }
+   NX_INLINE f32x8 operator+(const f32x8 &o) const { return _mm256_add_ps(v,o.v); }
+   NX_INLINE f32x8 operator-(const f32x8 &o) const { return _mm256_sub_ps(v,o.v); }
+   NX_INLINE f32x8 operator*(const f32x8 &o) const { return _mm256_mul_ps(v,o.v); }
+   NX_INLINE f32x8 &operator+=(const f32x8 &o) { v = _mm256_add_ps(v,o.v); return *this; }
+   NX_INLINE f32x8 &operator-=(const f32x8 &o) { v = _mm256_sub_ps(v,o.v); return *this; }
+   NX_INLINE f32x8 &operator*=(const f32x8 &o) { v = _mm256_mul_ps(v,o.v); return *this; }
+   static NX_INLINE f32x8 splat(float c) { return _mm256_set1_ps(c); }
+   NX_INLINE void store(float *outPtr) const { _mm256_storeu_ps(outPtr, v); }
+};
+
+struct f32x16
+{
+   __m512 v;
+   NX_INLINE f32x16() { }
+   NX_INLINE f32x16(__m512 inV) : v(inV) { }
+   NX_INLINE f32x16(const float *inPtr) : v(_mm512_loadu_ps(inPtr)) { }
+   NX_INLINE f32x16 operator+(const f32x16 &o) const { return _mm512_add_ps(v,o.v); }
+   NX_INLINE f32x16 operator-(const f32x16 &o) const { return _mm512_sub_ps(v,o.v); }
+   NX_INLINE f32x16 operator*(const f32x16 &o) const { return _mm512_mul_ps(v,o.v); }
+   NX_INLINE f32x16 &operator+=(const f32x16 &o) { v = _mm512_add_ps(v,o.v); return *this; }
+   NX_INLINE f32x16 &operator-=(const f32x16 &o) { v = _mm512_sub_ps(v,o.v); return *this; }
+   NX_INLINE f32x16 &operator*=(const f32x16 &o) { v = _mm512_mul_ps(v,o.v); return *this; }
+   static NX_INLINE f32x16 splat(float c) { return _mm512_set1_ps(c); }
+   NX_INLINE void store(float *outPtr) const { _mm512_storeu_ps(outPtr, v); }
+};
+#else
+template<int N>
+struct VecF32
+{
+   typedef float Vec __attribute__((vector_size(N*4)));
+   Vec v;
+   NX_INLINE VecF32() { }
+   NX_INLINE VecF32(const float *inPtr) { memcpy(&v, inPtr, sizeof(v)); }
+   NX_INLINE VecF32 operator+(const VecF32 &o) const { VecF32 r; r.v = v + o.v; return r; }
+   NX_INLINE VecF32 operator-(const VecF32 &o) const { VecF32 r; r.v = v - o.v; return r; }
+   NX_INLINE VecF32 operator*(const VecF32 &o) const { VecF32 r; r.v = v * o.v; return r; }
+   NX_INLINE VecF32 &operator+=(const VecF32 &o) { v += o.v; return *this; }
+   NX_INLINE VecF32 &operator-=(const VecF32 &o) { v -= o.v; return *this; }
+   NX_INLINE VecF32 &operator*=(const VecF32 &o) { v *= o.v; return *this; }
+   static NX_INLINE VecF32 splat(float c) { VecF32 r; r.v = Vec() + c; return r; }
+   NX_INLINE void store(float *outPtr) const { memcpy(outPtr, &v, sizeof(v)); }
+};
+typedef VecF32<8> f32x8;
+typedef VecF32<16> f32x16;
+#endif
+
+
+// --- AVX2 + FMA -----------------------------------
+
+NX_AVX2
+static inline __m128 activate4Avx2(__m128 v, Activation activation)
+{
+   if (activation==actRelu)
+      return _mm_max_ps(v, _mm_setzero_ps());
+   if (activation==actLeaky)
+      return _mm_max_ps(v, _mm_mul_ps(v, _mm_set1_ps(0.1f)));
+   return v;
+}
+
+NX_AVX2
+static inline __m256 activate8Avx2(__m256 v, Activation activation)
+{
+   if (activation==actRelu)
+      return _mm256_max_ps(v, _mm256_setzero_ps());
+   if (activation==actLeaky)
+      return _mm256_max_ps(v, _mm256_mul_ps(v, _mm256_set1_ps(0.1f)));
+   return v;
+}
+
+NX_AVX2
+static float dotAvx2(float s0,const float *w, const float *s, int n, Activation activation)
+{
+   __m256 a0 = _mm256_setzero_ps();
+   __m256 a1 = a0;
+   __m256 a2 = a0;
+   __m256 a3 = a0;
+
+   int i=0;
+   for(;i+32<=n;i+=32)
+   {
+      a0 = _mm256_fmadd_ps(_mm256_loadu_ps(s+i   ), _mm256_loadu_ps(w+i   ), a0);
+      a1 = _mm256_fmadd_ps(_mm256_loadu_ps(s+i+8 ), _mm256_loadu_ps(w+i+8 ), a1);
+      a2 = _mm256_fmadd_ps(_mm256_loadu_ps(s+i+16), _mm256_loadu_ps(w+i+16), a2);
+      a3 = _mm256_fmadd_ps(_mm256_loadu_ps(s+i+24), _mm256_loadu_ps(w+i+24), a3);
+   }
+   for(;i+8<=n;i+=8)
+      a0 = _mm256_fmadd_ps(_mm256_loadu_ps(s+i), _mm256_loadu_ps(w+i), a0);
+
+   __m256 a = _mm256_add_ps( _mm256_add_ps(a0,a1), _mm256_add_ps(a2,a3) );
+   __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a,1));
+   sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4,sum4));
+   sum4 = _mm_add_ss(sum4, _mm_movehdup_ps(sum4));
+
+   float sum = s0 + _mm_cvtss_f32(sum4);
+   for(;i<n;i++)
+      sum += s[i]*w[i];
+
+   return activate(sum, activation);
+}
+
+NX_AVX2
+static inline __m256 loadPanelAvx2(const float *w) { return _mm256_loadu_ps(w); }
+
+NX_AVX2
+static inline __m256 loadPanelAvx2(const unsigned short *w) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)w)); }
+
+// Same 4x8 tile as gemmKernel, with a ymm per row.  Odd and even k go to separate
+//  accumulators to keep enough fmas in flight.
+// A row of 8 fp16 weights is one 128-bit load and a vcvtph2ps.
+template<typename PANEL>
+NX_AVX2
+static void gemmKernelAvx2T(float *dest, int destStride, const float *const *src, const PANEL *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols)
+{
+   bool full = rows==GEMM_MR && cols==GEMM_NR;
+
+   float tile[GEMM_MR*GEMM_NR];
+   float *d = full ? dest : tile;
+   int dStride = full ? destStride : GEMM_NR;
+   if (!full && accumulate)
+      for(int r=0;r<rows;r++)
+         memcpy(tile + r*GEMM_NR, dest + r*destStride, cols*sizeof(float));
+
+   const float *s0 = src[0];
+   const float *s1 = src[1];
+   const float *s2 = src[2];
+   const float *s3 = src[3];
+
+   __m256 a0, b0, c0, d0;
+   if (accumulate)
+   {
+      a0 = _mm256_loadu_ps(d);
+      b0 = _mm256_loadu_ps(d+dStride);
+      c0 = _mm256_loadu_ps(d+dStride*2);
+      d0 = _mm256_loadu_ps(d+dStride*3);
+   }
+   else
+   {
+      a0 = bias ? _mm256_loadu_ps(bias) : _mm256_setzero_ps();
+      b0 = c0 = d0 = a0;
+   }
+   __m256 a1 = _mm256_setzero_ps();
+   __m256 b1 = a1, c1 = a1, d1 = a1;
+
+   const PANEL *w = panel;
+   int i=0;
+   for(;i+2<=k;i+=2)
+   {
+      __m256 w0 = loadPanelAvx2(w);
+      __m256 w1 = loadPanelAvx2(w+GEMM_NR);
+      w += GEMM_NR*2;
+
+      a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s0+i), w0, a0);
+      b0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s1+i), w0, b0);
+      c0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s2+i), w0, c0);
+      d0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s3+i), w0, d0);
+      a1 = _mm256_fmadd_ps(_mm256_broadcast_ss(s0+i+1), w1, a1);
+      b1 = _mm256_fmadd_ps(_mm256_broadcast_ss(s1+i+1), w1, b1);
+      c1 = _mm256_fmadd_ps(_mm256_broadcast_ss(s2+i+1), w1, c1);
+      d1 = _mm256_fmadd_ps(_mm256_broadcast_ss(s3+i+1), w1, d1);
+   }
+   if (i<k)
+   {
+      __m256 w0 = loadPanelAvx2(w);
+      a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s0+i), w0, a0);
+      b0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s1+i), w0, b0);
+      c0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s2+i), w0, c0);
+      d0 = _mm256_fmadd_ps(_mm256_broadcast_ss(s3+i), w0, d0);
+   }
+
+   _mm256_storeu_ps(d,           activate8Avx2(_mm256_add_ps(a0,a1), activation));
+   _mm256_storeu_ps(d+dStride,   activate8Avx2(_mm256_add_ps(b0,b1), activation));
+   _mm256_storeu_ps(d+dStride*2, activate8Avx2(_mm256_add_ps(c0,c1), activation));
+   _mm256_storeu_ps(d+dStride*3, activate8Avx2(_mm256_add_ps(d0,d1), activation));
+
+   if (activation==actSigmoid)
+      for(int r=0;r<GEMM_MR;r++)
+         for(int c=0;c<GEMM_NR;c++)
+            d[r*dStride+c] = activate(d[r*dStride+c], actSigmoid);
+
+   if (!full)
+      for(int r=0;r<rows;r++)
+         memcpy(dest + r*destStride, tile + r*GEMM_NR, cols*sizeof(float));
+}
+
+NX_AVX2
+static void gemmKernelAvx2(float *dest, int destStride, const float *const *src, const float *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols)
+{
+   gemmKernelAvx2T(dest, destStride, src, panel, k, bias, accumulate, activation, rows, cols);
+}
+
+NX_AVX2
+static void gemmKernelF16Avx2(float *dest, int destStride, const float *const *src, const unsigned short *panel, int k,
+                const float *bias, bool accumulate, Activation activation, int rows, int cols)
+{
+   gemmKernelAvx2T(dest, destStride, src, panel, k, bias, accumulate, activation, rows, cols);
+}
+
+// The tails go through a zero-padded block, so they round the same way
+NX_AVX2
+static void floatToHalfF16c(unsigned short *dest, const float *src, int n)
+{
+   int i=0;
+   for(;i+8<=n;i+=8)
+      _mm_storeu_si128((__m128i *)(dest+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT));
+   if (i<n)
+   {
+      float in[8] = { 0 };
+      unsigned short out[8];
+      memcpy(in, src+i, (n-i)*sizeof(float));
+      _mm_storeu_si128((__m128i *)out, _mm256_cvtps_ph(_mm256_loadu_ps(in), _MM_FROUND_TO_NEAREST_INT));
+      memcpy(dest+i, out, (n-i)*sizeof(unsigned short));
+   }
+}
+
+NX_AVX2
+static void halfToFloatF16c(float *dest, const unsigned short *src, int n)
+{
+   int i=0;
+   for(;i+8<=n;i+=8)
+      _mm256_storeu_ps(dest+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src+i))));
+   if (i<n)
+   {
+      unsigned short in[8] = { 0 };
+      float out[8];
+      memcpy(in, src+i, (n-i)*sizeof(unsigned short));
+      _mm256_storeu_ps(out, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)in)));
+      memcpy(dest+i, out, (n-i)*sizeof(float));
+   }
+}
+
+// Scales the int32 sums of an int8 tile to float, and stores the rows x cols part
+NX_AVX2
+static inline void storeInt8TileAvx2(float *dest, int destStride, __m256i a, __m256i b, __m256i c, __m256i d,
+                const float *scale, const float *bias, Activation activation, int rows, int cols)
+{
+   __m256 sc = _mm256_loadu_ps(scale);
+   __m256 bi = _mm256_loadu_ps(bias);
+   __m256 out[GEMM_MR];
+   out[0] = activate8Avx2(_mm256_fmadd_ps(_mm256_cvtepi32_ps(a), sc, bi), activation);
+   out[1] = activate8Avx2(_mm256_fmadd_ps(_mm256_cvtepi32_ps(b), sc, bi), activation);
+   out[2] = activate8Avx2(_mm256_fmadd_ps(_mm256_cvtepi32_ps(c), sc, bi), activation);
+   out[3] = activate8Avx2(_mm256_fmadd_ps(_mm256_cvtepi32_ps(d), sc, bi), activation);
+
+   for(int r=0;r<rows;r++)
+   {
+      float *dr = dest + r*destStride;
+      if (cols==GEMM_NR)
+         _mm256_storeu_ps(dr, out[r]);
+      else
+      {
+         float tile[GEMM_NR];
+         _mm256_storeu_ps(tile, out[r]);
+         memcpy(dr, tile, cols*sizeof(float));
+      }
+      if (activation==actSigmoid)
+         for(int c=0;c<cols;c++)
+            dr[c] = activate(dr[c], actSigmoid);
+   }
+}
+
+// Int8 tile.  maddubs needs one unsigned operand, so the source is made positive and its
+//  sign moved to the weights - with both in [-127,127] the 16-bit pair sums can not saturate.
+NX_AVX2
+static void gemmKernelInt8Avx2(float *dest, int destStride, const signed char *const *src, const signed char *panel, int k,
+                const float *scale, const float *bias, Activation activation, int rows, int cols)
+{
+   const signed char *s0 = src[0];
+   const signed char *s1 = src[1];
+   const signed char *s2 = src[2];
+   const signed char *s3 = src[3];
+   const __m256i ones = _mm256_set1_epi16(1);
+
+   __m256i a = _mm256_setzero_si256();
+   __m256i b = a, c = a, d = a;
+   const signed char *w = panel;
+   for(int i=0;i<k;i+=4)
+   {
+      __m256i w0 = _mm256_loadu_si256((const __m256i *)w);
+      w += GEMM_NR*4;
+
+      __m256i s = _mm256_set1_epi32(*(const int *)(s0+i));
+      a = _mm256_add_epi32(a, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(s,s), _mm256_sign_epi8(w0,s)), ones));
+      s = _mm256_set1_epi32(*(const int *)(s1+i));
+      b = _mm256_add_epi32(b, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(s,s), _mm256_sign_epi8(w0,s)), ones));
+      s = _mm256_set1_epi32(*(const int *)(s2+i));
+      c = _mm256_add_epi32(c, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(s,s), _mm256_sign_epi8(w0,s)), ones));
+      s = _mm256_set1_epi32(*(const int *)(s3+i));
+      d = _mm256_add_epi32(d, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(s,s), _mm256_sign_epi8(w0,s)), ones));
+   }
+
+   storeInt8TileAvx2(dest, destStride, a, b, c, d, scale, bias, activation, rows, cols);
+}
+
+NX_AVX2
+static void depthwiseAvx2(float *dest, const float *const *src, const float *const *w, int taps, int n)
+{
+   int d = 0;
+   for(;d+32<=n;d+=32)
+   {
+      __m256 a0 = _mm256_setzero_ps();
+      __m256 a1 = a0, a2 = a0, a3 = a0;
+      for(int t=0;t<taps;t++)
+      {
+         const float *s = src[t]+d;
+         const float *wt = w[t]+d;
+         a0 = _mm256_fmadd_ps(_mm256_loadu_ps(s   ), _mm256_loadu_ps(wt   ), a0);
+         a1 = _mm256_fmadd_ps(_mm256_loadu_ps(s+8 ), _mm256_loadu_ps(wt+8 ), a1);
+         a2 = _mm256_fmadd_ps(_mm256_loadu_ps(s+16), _mm256_loadu_ps(wt+16), a2);
+         a3 = _mm256_fmadd_ps(_mm256_loadu_ps(s+24), _mm256_loadu_ps(wt+24), a3);
+      }
+      _mm256_storeu_ps(dest+d   , a0);
+      _mm256_storeu_ps(dest+d+8 , a1);
+      _mm256_storeu_ps(dest+d+16, a2);
+      _mm256_storeu_ps(dest+d+24, a3);
+   }
+   for(;d+8<=n;d+=8)
+   {
+      __m256 a0 = _mm256_setzero_ps();
+      for(int t=0;t<taps;t++)
+         a0 = _mm256_fmadd_ps(_mm256_loadu_ps(src[t]+d), _mm256_loadu_ps(w[t]+d), a0);
+      _mm256_storeu_ps(dest+d, a0);
+   }
+   for(;d<n;d++)
+   {
+      float sum = 0;
+      for(int t=0;t<taps;t++)
+         sum += src[t][d] * w[t][d];
+      dest[d] = sum;
+   }
+}
+
+// A ymm of channels at a time, and the 4 left over (n is a multiple of 4) as in Ops.cpp
+template<int M>
+NX_AVX2
+static void winoInputAvx2(const float *in, int is, float *out, int os, int n)
+{
+   int c = 0;
+   for(;c+8<=n;c+=8)
+      WinoTransform<M>::template input<f32x8>(in+c, is, out+c, os);
+   if (c<n)
+      WinoTransform<M>::template input<psimd_f32>(in+c, is, out+c, os);
+}
+
+template<int M>
+NX_AVX2
+static void winoOutputAvx2(const float *in, int is, float *out, int os, int n)
+{
+   int c = 0;
+   for(;c+8<=n;c+=8)
+      WinoTransform<M>::template output<f32x8>(in+c, is, out+c, os);
+   if (c<n)
+      WinoTransform<M>::template output<psimd_f32>(in+c, is, out+c, os);
+}
+
+
+// --- AVX-512 -----------------------------------
+
+NX_AVX512
+static float dotAvx512(float s0,const float *w, const float *s, int n, Activation activation)
+{
+   __m512 a0 = _mm512_setzero_ps();
+   __m512 a1 = a0;
+   __m512 a2 = a0;
+   __m512 a3 = a0;
+
+   int i=0;
+   for(;i+64<=n;i+=64)
+   {
+      a0 = _mm512_fmadd_ps(_mm512_loadu_ps(s+i   ), _mm512_loadu_ps(w+i   ), a0);
+      a1 = _mm512_fmadd_ps(_mm512_loadu_ps(s+i+16), _mm512_loadu_ps(w+i+16), a1);
+      a2 = _mm512_fmadd_ps(_mm512_loadu_ps(s+i+32), _mm512_loadu_ps(w+i+32), a2);
+      a3 = _mm512_fmadd_ps(_mm512_loadu_ps(s+i+48), _mm512_loadu_ps(w+i+48), a3);
+   }
+   for(;i+16<=n;i+=16)
+      a0 = _mm512_fmadd_ps(_mm512_loadu_ps(s+i), _mm512_loadu_ps(w+i), a0);
+   if (i<n)
+   {
+      __mmask16 tail = (__mmask16)((1<<(n-i))-1);
+      a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail,s+i), _mm512_maskz_loadu_ps(tail,w+i), a1);
+   }
+
+   float sum = s0 + _mm512_reduce_add_ps( _mm512_add_ps( _mm512_add_ps(a0,a1), _mm512_add_ps(a2,a3) ) );
+   return activate(sum, activation);
+}
+
+// With VNNI the sign trick stays (dpbusd also wants unsigned x signed), but the multiply,
+//  pair and accumulate are one instruction
+NX_AVX512_VNNI
+static void gemmKernelInt8Vnni(float *dest, int destStride, const signed char *const *src, const signed char *panel, int k,
+                const float *scale, const float *bias, Activation activation, int rows, int cols)
+{
+   const signed char *s0 = src[0];
+   const signed char *s1 = src[1];
+   const signed char *s2 = src[2];
+   const signed char *s3 = src[3];
+
+   __m256i a = _mm256_setzero_si256();
+   __m256i b = a, c = a, d = a;
+   const signed char *w = panel;
+   for(int i=0;i<k;i+=4)
+   {
+      __m256i w0 = _mm256_loadu_si256((const __m256i *)w);
+      w += GEMM_NR*4;
+
+      __m256i s = _mm256_set1_epi32(*(const int *)(s0+i));
+      a = _mm256_dpbusd_epi32(a, _mm256_abs_epi8(s), _mm256_sign_epi8(w0,s));
+      s = _mm256_set1_epi32(*(const int *)(s1+i));
+      b = _mm256_dpbusd_epi32(b, _mm256_abs_epi8(s), _mm256_sign_epi8(w0,s));
+      s = _mm256_set1_epi32(*(const int *)(s2+i));
+      c = _mm256_dpbusd_epi32(c, _mm256_abs_epi8(s), _mm256_sign_epi8(w0,s));
+      s = _mm256_set1_epi32(*(const int *)(s3+i));
+      d = _mm256_dpbusd_epi32(d, _mm256_abs_epi8(s), _mm256_sign_epi8(w0,s));
+   }
+
+   storeInt8TileAvx2(dest, destStride, a, b, c, d, scale, bias, activation, rows, cols);
+}
+
+NX_AVX512
+static void depthwiseAvx512(float *dest, const float *const *src, const float *const *w, int taps, int n)
+{
+   int d = 0;
+   for(;d+32<=n;d+=32)
+   {
+      __m512 a0 = _mm512_setzero_ps();
+      __m512 a1 = a0;
+      for(int t=0;t<taps;t++)
+      {
+         a0 = _mm512_fmadd_ps(_mm512_loadu_ps(src[t]+d   ), _mm512_loadu_ps(w[t]+d   ), a0);
+         a1 = _mm512_fmadd_ps(_mm512_loadu_ps(src[t]+d+16), _mm512_loadu_ps(w[t]+d+16), a1);
+      }
+      _mm512_storeu_ps(dest+d   , a0);
+      _mm512_storeu_ps(dest+d+16, a1);
+   }
+   for(;d<n;d+=16)
+   {
+      __mmask16 mask = n-d>=16 ? (__mmask16)0xffff : (__mmask16)((1<<(n-d))-1);
+      __m512 a0 = _mm512_setzero_ps();
+      for(int t=0;t<taps;t++)
+         a0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask,src[t]+d), _mm512_maskz_loadu_ps(mask,w[t]+d), a0);
+      _mm512_mask_storeu_ps(dest+d, mask, a0);
+   }
+}
+
+template<int M>
+NX_AVX512
+static void winoInputAvx512(const float *in, int is, float *out, int os, int n)
+{
+   int c = 0;
+   for(;c+16<=n;c+=16)
+      WinoTransform<M>::template input<f32x16>(in+c, is, out+c, os);
+   if (c+8<=n)
+   {
+      WinoTransform<M>::template input<f32x8>(in+c, is, out+c, os);
+      c+=8;
+   }
+   if (c<n)
+      WinoTransform<M>::template input<psimd_f32>(in+c, is, out+c, os);
+}
+
+template<int M>
+NX_AVX512
+static void winoOutputAvx512(const float *in, int is, float *out, int os, int n)
+{
+   int c = 0;
+   for(;c+16<=n;c+=16)
+      WinoTransform<M>::template output<f32x16>(in+c, is, out+c, os);
+   if (c+8<=n)
+   {
+      WinoTransform<M>::template output<f32x8>(in+c, is, out+c, os);
+      c+=8;
+   }
+   if (c<n)
+      WinoTransform<M>::template output<psimd_f32>(in+c, is, out+c, os);
+}
+
+
+#define WINO_KERNELS(isa) \
+   { winoInput##isa<2>, winoInput##isa<4>, winoInput##isa<6> }, \
+   { winoOutput##isa<2>, winoOutput##isa<4>, winoOutput##isa<6> }
+
+static OpKernels sAvx2Kernels = { "avx2", dotAvx2, gemmKernelAvx2, gemmKernelInt8Avx2,
+   gemmKernelF16Avx2, depthwiseAvx2, floatToHalfF16c, halfToFloatF16c, WINO_KERNELS(Avx2) };
+// The GEMM panels are GEMM_NR=8 wide, which is one ymm, so those kernels are shared
+static OpKernels sAvx512Kernels = { "avx512", dotAvx512, gemmKernelAvx2, gemmKernelInt8Avx2,
+   gemmKernelF16Avx2, depthwiseAvx512, floatToHalfF16c, halfToFloatF16c, WINO_KERNELS(Avx512) };
+static OpKernels sAvx512VnniKernels = { "avx512", dotAvx512, gemmKernelAvx2, gemmKernelInt8Vnni,
+   gemmKernelF16Avx2, depthwiseAvx512, floatToHalfF16c, halfToFloatF16c, WINO_KERNELS(Avx512) };
+
+const OpKernels *GetAvx2Kernels()
+{
+   return (features() & featAvx2) ? &sAvx2Kernels : 0;
+}
+
+const OpKernels *GetAvx512Kernels()
+{
+   if (!(features() & featAvx512))
+      return 0;
+   return (features() & featVnni) ? &sAvx512VnniKernels : &sAvx512Kernels;
+}
+
+const char *GetX86CpuName()
+{
+   static char name[49] = { 0 };
+   if (!name[0])
+   {
+      unsigned r[4];
+      cpuid(0x80000000,0,r);
+      if (r[0]>=0x80000004)
+      {
+         char brand[49];
+         for(int i=0;i<3;i++)
+         {
+            cpuid(0x80000002+i,0,r);
+            memcpy(brand+i*16, r, 16);
+         }
+         brand[48] = '\0';
+         const char *start = brand;
+         while(*start==' ')
+            start++;
+         strcpy(name, start);
+         for(int len=strlen(name); len>0 && name[len-1]==' '; len--)
+            name[len-1] = '\0';
+      }
+      else
+         strcpy(name, "x86");
+   }
+   return name;
+}
+
+#else
+
+const OpKernels *GetAvx2Kernels() { return 0; }
+const OpKernels *GetAvx512Kernels() { return 0; }
+const char *GetX86CpuName() { return 0; }
+
+#endif
+
+} // end namespace numerix
@@ -0,0 +1,284 @@
+#include <Tensor.h>
+#include <Layer.h>
+#include <Graph.h>
+#include <Pipeline.h>
+#include <string.h>
+#include <algorithm>
+
+namespace numerix
+{
+
+
+Pipeline::Pipeline(Graph *inGraph, int inStages, int inDepth)
+{
+   graph = inGraph;
+   int steps = graph->getStepCount();
+   if (steps<1 || !graph->getOutputLayer())
+      TensorThrow("Pipeline - graph has no output layer");
+
+   // Layers driving a device must run from one thread, so all go in one stage
+   int deviceFirst = steps;
+   int deviceLast = -1;
+   for(int s=0;s<steps;s++)
+      if (!graph->getStepLayer(s)->runsOnCpu())
+      {
+         deviceFirst = std::min(deviceFirst, s);
+         deviceLast = s;
+      }
+   int cuts = steps-1 - std::max(deviceLast-deviceFirst, 0);
+
+   stageCount = inStages>0 ? inStages : std::max(2, std::min(4, GetWorkerCount()/2));
+   stageCount = std::min(stageCount, cuts+1);
+   running = true;
+   nextId = 0;
+   frameCount = errorCount = 0;
+   stageTime.assign(stageCount, 0.0);
+
+   std::vector<double> times(steps);
+   double total = 0;
+   for(int s=0;s<steps;s++)
+      total += times[s] = graph->getStepLayer(s)->getRunTime();
+   // Not run yet - split by step count
+   if (total<=0)
+      std::fill(times.begin(), times.end(), 1.0);
+   split(times, deviceFirst, deviceLast);
+
+   frames.resize(inDepth>0 ? inDepth : stageCount+1);
+   for(int f=0;f<frames.size();f++)
+   {
+      Frame &frame = frames[f];
+      frame.id = -1;
+      frame.busy = false;
+      frame.failed = false;
+      frame.input = 0;
+      frame.result = 0;
+      frame.pushed = frame.finished = 0;
+      graph->copySlots(frame.slots);
+   }
+
+   queues.resize(stageCount+1);
+   signals = new HxSemaphore[stageCount+2];
+}
+
+
+Pipeline::~Pipeline()
+{
+   stop();
+   for(int f=0;f<frames.size();f++)
+   {
+      Frame &frame = frames[f];
+      frame.slots[Graph::InputSlot] = 0;
+      for(int i=0;i<frame.slots.size();i++)
+         if (frame.slots[i])
+            frame.slots[i]->decRef();
+      if (frame.input)
+         frame.input->decRef();
+      if (frame.result)
+         frame.result->decRef();
+   }
+   delete [] signals;
+}
+
+
+// Contiguous ranges minimising the slowest, with no stage starting in (inKeepFirst,inKeepLast]
+void Pipeline::split(const std::vector<double> &inTimes, int inKeepFirst, int inKeepLast)
+{
+   int n = inTimes.size();
+   int k = stageCount;
+   std::vector<double> before(n+1, 0.0);
+   for(int s=0;s<n;s++)
+      before[s+1] = before[s] + inTimes[s];
+
+   // cost[j][i] - the slowest stage running the first i steps as j+1 stages
+   std::vector< std::vector<double> > cost(k, std::vector<double>(n+1, 1e30));
+   std::vector< std::vector<int> > from(k, std::vector<int>(n+1, 0));
+   for(int i=1;i<=n;i++)
+      cost[0][i] = before[i];
+   for(int j=1;j<k;j++)
+      for(int i=j+1;i<=n;i++)
+         for(int p=j;p<i;p++)
+         {
+            if (p>inKeepFirst && p<=inKeepLast)
+               continue;
+            double c = std::max(cost[j-1][p], before[i]-before[p]);
+            if (c<cost[j][i])
+            {
+               cost[j][i] = c;
+               from[j][i] = p;
+            }
+         }
+
+   stageFirst.resize(k+1);
+   stageFirst[k] = n;
+   for(int j=k-1;j>0;j--)
+      stageFirst[j] = from[j][ stageFirst[j+1] ];
+   stageFirst[0] = 0;
+}
+
+
+int Pipeline::push(Tensor *inInput)
+{
+   if (!inInput || !inInput->isContiguous())
+      TensorThrow("Pipeline - invalid input");
+
+   Frame *frame = 0;
+   lock.Lock();
+   while(running && !frame)
+   {
+      for(int f=0;f<frames.size() && !frame;f++)
+         if (!frames[f].busy)
+            frame = &frames[f];
+      if (!frame)
+      {
+         lock.Unlock();
+         signals[stageCount+1].Wait();
+         lock.Lock();
+      }
+   }
+   if (frame)
+      frame->busy = true;
+   lock.Unlock();
+   if (!frame)
+      return -1;
+
+   // Copied, so the caller can refill its tensor straight away
+   Tensor *input = frame->input;
+   if (!input || input->type!=inInput->type || input->shape!=inInput->shape)
+   {
+      if (input)
+         input->decRef();
+      input = frame->input = new Tensor(inInput->type, inInput->shape);
+   }
+   memcpy(input->cpuWrite(), inInput->cpuRead(), inInput->elementCount*inInput->elementSize);
+
+   frame->slots[Graph::InputSlot] = input;
+   frame->failed = false;
+   frame->pushed = GetTimeStamp();
+
+   lock.Lock();
+   frame->id = nextId++;
+   int id = frame->id;
+   queues[0].push_back(frame);
+   lock.Unlock();
+   signals[0].Set();
+   return id;
+}
+
+
+Pipeline::Frame *Pipeline::nextFrame(int inStage)
+{
+   NxAutoMutex l(lock);
+   while(running)
+   {
+      std::deque<Frame *> &queue = queues[inStage];
+      if (!queue.empty())
+      {
+         Frame *frame = queue.front();
+         queue.pop_front();
+         return frame;
+      }
+      lock.Unlock();
+      signals[inStage].Wait();
+      lock.Lock();
+   }
+   return 0;
+}
+
+
+void Pipeline::runFrame(int inStage, Frame *inFrame)
+{
+   double t0 = GetTimeStamp();
+   if (!inFrame->failed)
+   {
+      try
+      {
+         graph->runSteps(stageFirst[inStage], stageFirst[inStage+1], inFrame->slots);
+      }
+      catch(...)
+      {
+         inFrame->failed = true;
+      }
+   }
+
+   bool last = inStage==stageCount-1;
+   if (last)
+   {
+      // The result leaves with the frame, and the output layer makes a new one next time
+      int output = graph->getOutput();
+      inFrame->result = inFrame->failed ? 0 : inFrame->slots[output];
+      if (!inFrame->failed)
+         inFrame->slots[output] = 0;
+      inFrame->boxes.clear();
+      if (!inFrame->failed)
+         graph->getOutputLayer()->getBoxes(inFrame->boxes);
+      inFrame->finished = GetTimeStamp();
+   }
+
+   lock.Lock();
+   stageTime[inStage] += GetTimeStamp() - t0;
+   if (last)
+   {
+      frameCount++;
+      if (inFrame->failed)
+         errorCount++;
+   }
+   queues[inStage+1].push_back(inFrame);
+   lock.Unlock();
+   signals[inStage+1].Set();
+}
+
+
+void Pipeline::serve(int inStage)
+{
+   while(Frame *frame = nextFrame(inStage))
+      runFrame(inStage, frame);
+}
+
+
+Pipeline::Frame *Pipeline::pop(bool inWait)
+{
+   NxAutoMutex l(lock);
+   std::deque<Frame *> &done = queues[stageCount];
+   while(running)
+   {
+      if (!done.empty())
+      {
+         Frame *frame = done.front();
+         done.pop_front();
+         return frame;
+      }
+      if (!inWait)
+         break;
+      lock.Unlock();
+      signals[stageCount].Wait();
+      lock.Lock();
+   }
+   return 0;
+}
+
+
+void Pipeline::release(Pipeline::Frame *inFrame)
+{
+   lock.Lock();
+   if (inFrame->result)
+   {
+      inFrame->result->decRef();
+      inFrame->result = 0;
+   }
+   inFrame->boxes.clear();
+   inFrame->busy = false;
+   lock.Unlock();
+   signals[stageCount+1].Set();
+}
+
+
+void Pipeline::stop()
+{
+   lock.Lock();
+   running = false;
+   lock.Unlock();
+   for(int s=0;s<stageCount+2;s++)
+      signals[s].Set();
+}
+
+}
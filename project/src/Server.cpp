@@ -0,0 +1,484 @@
+#include <Tensor.h>
+#include <Layer.h>
+#include <Graph.h>
+#include <Server.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef NX_PTHREADS
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+namespace numerix
+{
+
+enum { RequestMagic = 0x5152584e /* NXRQ */, ReplyMagic = 0x5352584e /* NXRS */ };
+enum { RequestHeader = 5, ReplyHeader = 7 };
+
+// A connection is closed once the io thread has finished with it and every queued request
+//  from it has been answered
+struct Server::Connection
+{
+   int                 fd;
+   int                 refs;
+   // Replies stop once set - guarded by writeLock, like the writes
+   bool                closed;
+   NxMutex             writeLock;
+
+   void markClosed()
+   {
+      NxAutoMutex l(writeLock);
+      closed = true;
+   }
+   std::vector<unsigned char> input;
+};
+
+struct Server::Request
+{
+   Connection *connection;
+   unsigned   id;
+   Tensor     *image;
+   double     arrived;
+};
+
+
+Server::Server(const std::string &inPath, int inMaxBatch, double inMaxDelay)
+{
+   path = inPath;
+   maxBatch = std::max(inMaxBatch,1);
+   maxDelay = std::max(inMaxDelay,0.0);
+   running = false;
+   listenFd = -1;
+   wakeFd[0] = wakeFd[1] = -1;
+   requestCount = batchCount = errorCount = 0;
+   queueTime = runTime = 0;
+   #ifdef NX_PTHREADS
+   pthread_cond_init(&queued,0);
+   #endif
+}
+
+
+Server::~Server()
+{
+   stop();
+   #ifdef NX_PTHREADS
+   pthread_cond_destroy(&queued);
+   #endif
+}
+
+
+#ifdef NX_PTHREADS
+
+void *SServerIoLoop(void *inServer)
+{
+   ((Server *)inServer)->ioLoop();
+   return 0;
+}
+
+
+void Server::start()
+{
+   if (running)
+      return;
+
+   sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (path.size()>=sizeof(addr.sun_path))
+      TensorThrow("Server - socket path is too long");
+   strcpy(addr.sun_path, path.c_str());
+
+   listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listenFd<0)
+      TensorThrow("Server - could not create socket");
+
+   // A stale socket file from an earlier run would stop the bind
+   unlink(path.c_str());
+   if (bind(listenFd, (sockaddr *)&addr, sizeof(addr))<0 || listen(listenFd, 64)<0)
+   {
+      close(listenFd);
+      listenFd = -1;
+      TensorThrow("Server - could not bind socket");
+   }
+   fcntl(listenFd, F_SETFL, O_NONBLOCK);
+
+   if (pipe(wakeFd)<0)
+   {
+      close(listenFd);
+      listenFd = -1;
+      TensorThrow("Server - could not create pipe");
+   }
+
+   running = true;
+   if (pthread_create(&ioThread, 0, SServerIoLoop, this))
+   {
+      running = false;
+      close(listenFd);
+      close(wakeFd[0]);
+      close(wakeFd[1]);
+      listenFd = wakeFd[0] = wakeFd[1] = -1;
+      TensorThrow("Server - could not create io thread");
+   }
+}
+
+
+void Server::stop()
+{
+   if (!running)
+      return;
+
+   {
+   NxAutoMutex l(lock);
+   running = false;
+   pthread_cond_broadcast(&queued);
+   }
+
+   char wake = 0;
+   if (write(wakeFd[1], &wake, 1)<0) { }
+   pthread_join(ioThread, 0);
+
+   close(wakeFd[0]);
+   close(wakeFd[1]);
+   close(listenFd);
+   wakeFd[0] = wakeFd[1] = listenFd = -1;
+   unlink(path.c_str());
+
+   NxAutoMutex l(lock);
+   while(queue.size())
+   {
+      Request *request = queue.front();
+      queue.pop_front();
+      request->image->decRef();
+      release(request->connection);
+      delete request;
+   }
+}
+
+
+void Server::release(Connection *inConnection)
+{
+   // Called with the lock held
+   if (--inConnection->refs==0)
+   {
+      close(inConnection->fd);
+      delete inConnection;
+   }
+}
+
+
+void Server::ioLoop()
+{
+   std::vector<pollfd> fds;
+   std::vector<Connection *> polled;
+
+   // stop() sets running under the lock, then wakes the poll below
+   for(;;)
+   {
+      fds.resize(2);
+      fds[0].fd = wakeFd[0];
+      fds[0].events = POLLIN;
+      fds[1].fd = listenFd;
+      fds[1].events = POLLIN;
+      polled = connections;
+      for(int c=0;c<(int)polled.size();c++)
+      {
+         pollfd p;
+         p.fd = polled[c]->fd;
+         p.events = POLLIN;
+         fds.push_back(p);
+      }
+      for(int i=0;i<(int)fds.size();i++)
+         fds[i].revents = 0;
+
+      if (poll(&fds[0], fds.size(), -1)<0)
+      {
+         if (errno==EINTR)
+            continue;
+         break;
+      }
+      {
+      NxAutoMutex l(lock);
+      if (!running)
+         break;
+      }
+
+      if (fds[1].revents & POLLIN)
+      {
+         int fd = accept(listenFd, 0, 0);
+         if (fd>=0)
+         {
+            Connection *connection = new Connection();
+            connection->fd = fd;
+            connection->refs = 1;
+            connection->closed = false;
+            connections.push_back(connection);
+         }
+      }
+
+      for(int c=0;c<(int)polled.size();c++)
+         if (fds[c+2].revents && !readRequests(polled[c]))
+         {
+            connections.erase( std::find(connections.begin(), connections.end(), polled[c]) );
+            NxAutoMutex l(lock);
+            polled[c]->markClosed();
+            release(polled[c]);
+         }
+   }
+
+   NxAutoMutex l(lock);
+   for(int c=0;c<(int)connections.size();c++)
+   {
+      connections[c]->markClosed();
+      release(connections[c]);
+   }
+   connections.clear();
+}
+
+
+// Reads what is available, and queues each complete request.  False when the connection
+//  should be closed.
+bool Server::readRequests(Connection *inConnection)
+{
+   std::vector<unsigned char> &input = inConnection->input;
+   int have = input.size();
+   input.resize(have + 65536);
+   int got = read(inConnection->fd, &input[have], 65536);
+   if (got<=0)
+      return false;
+   input.resize(have + got);
+
+   double now = GetTimeStamp();
+   int used = 0;
+   while(input.size()-used >= RequestHeader*4)
+   {
+      unsigned int header[RequestHeader];
+      memcpy(header, &input[used], sizeof(header));
+      if (header[0]!=RequestMagic)
+         return false;
+      int h = header[2];
+      int w = header[3];
+      int c = header[4];
+      if (h<1 || w<1 || c<1 || (double)h*w*c > (1<<26))
+         return false;
+      int bytes = h*w*c*sizeof(float);
+      if (input.size()-used < sizeof(header) + bytes)
+         break;
+
+      Request *request = new Request();
+      request->id = header[1];
+      request->image = new Tensor(Float32, Shape3(h,w,c));
+      memcpy(request->image->cpuWrite(), &input[used + sizeof(header)], bytes);
+      request->arrived = now;
+      request->connection = inConnection;
+      used += sizeof(header) + bytes;
+
+      NxAutoMutex l(lock);
+      inConnection->refs++;
+      queue.push_back(request);
+      pthread_cond_signal(&queued);
+   }
+   input.erase(input.begin(), input.begin()+used);
+   return true;
+}
+
+
+Server::Batch *Server::nextBatch()
+{
+   NxAutoMutex l(lock);
+   while(running)
+   {
+      if (queue.empty())
+      {
+         pthread_cond_wait(&queued, &lock.mMutex);
+         continue;
+      }
+
+      // Gather from the oldest request's size
+      CShape shape = queue.front()->image->shape;
+      int count = 0;
+      for(int i=0;i<(int)queue.size() && count<maxBatch;i++)
+         if (queue[i]->image->shape==shape)
+            count++;
+
+      double now = GetTimeStamp();
+      double due = queue.front()->arrived + maxDelay;
+      if (count<maxBatch && now<due)
+      {
+         // Wait for more, or for the delay to run out
+         timeval tv;
+         gettimeofday(&tv,0);
+         double until = tv.tv_sec + tv.tv_usec*1e-6 + (due-now);
+         timespec ts;
+         ts.tv_sec = (time_t)until;
+         ts.tv_nsec = (long)((until - ts.tv_sec)*1e9);
+         pthread_cond_timedwait(&queued, &lock.mMutex, &ts);
+         continue;
+      }
+
+      Batch *batch = new Batch();
+      batch->started = now;
+      for(int i=0;i<(int)queue.size() && (int)batch->requests.size()<count; )
+         if (queue[i]->image->shape==shape)
+         {
+            batch->requests.push_back(queue[i]);
+            queue.erase(queue.begin()+i);
+         }
+         else
+            i++;
+
+      // Others may be waiting on a different size
+      if (queue.size())
+         pthread_cond_signal(&queued);
+      return batch;
+   }
+   return 0;
+}
+
+
+void Server::reply(Request *inRequest, int inStatus, const Batch *inBatch, double inFinished, Tensor *inResult, int inImage)
+{
+   Connection *connection = inRequest->connection;
+
+   std::vector<unsigned int> header(ReplyHeader);
+   header[0] = ReplyMagic;
+   header[1] = inRequest->id;
+   header[2] = inStatus;
+   header[3] = inBatch->requests.size();
+   header[4] = (unsigned int)( (inBatch->started - inRequest->arrived)*1e6 );
+   header[5] = (unsigned int)( (inFinished - inBatch->started)*1e6 );
+   header[6] = 0;
+
+   const unsigned char *data = 0;
+   int bytes = 0;
+   if (inResult)
+   {
+      // Drop the batch dimension
+      CShape shape = inResult->shape;
+      header[6] = shape.size()-1;
+      for(int d=1;d<(int)shape.size();d++)
+         header.push_back(shape[d]);
+      bytes = inResult->getByteCount()/shape[0];
+      data = inResult->cpuRead() + inImage*bytes;
+   }
+
+   NxAutoMutex l(connection->writeLock);
+   if (connection->closed)
+      return;
+
+   const unsigned char *parts[2] = { (const unsigned char *)&header[0], data };
+   int sizes[2] = { (int)(header.size()*sizeof(unsigned int)), bytes };
+   for(int p=0;p<2;p++)
+   {
+      const unsigned char *ptr = parts[p];
+      int left = sizes[p];
+      while(left>0)
+      {
+         int sent = send(connection->fd, ptr, left, MSG_NOSIGNAL);
+         if (sent<0 && errno==EINTR)
+            continue;
+         if (sent<=0)
+         {
+            // The reader has gone - the io thread will close it
+            connection->closed = true;
+            return;
+         }
+         ptr += sent;
+         left -= sent;
+      }
+   }
+}
+
+
+void Server::runBatch(Batch *inBatch, Graph *inGraph, int inWidth, int inHeight)
+{
+   std::vector<Request *> &requests = inBatch->requests;
+   int n = requests.size();
+
+   // A graph with a single-image layer (eg, Yolo) gets the batch one request at a time
+   int per = n;
+   for(int s=0;s<inGraph->getStepCount() && per>1;s++)
+      if (!inGraph->getStepLayer(s)->canBatch())
+         per = 1;
+
+   int failed = 0;
+   double finished = 0;
+   for(int i0=0;i0<n;i0+=per)
+   {
+      Tensor *input = 0;
+      Tensor *result = 0;
+      try
+      {
+         Tensor *first = requests[i0]->image;
+         int h = inHeight>0 ? inHeight : first->shape[0];
+         int w = inWidth>0 ? inWidth : first->shape[1];
+         int c = first->shape[2];
+         input = new Tensor(Float32, Shape4(per,h,w,c));
+         int bytes = h*w*c*sizeof(float);
+         for(int i=0;i<per;i++)
+         {
+            Tensor *image = requests[i0+i]->image;
+            if (image->shape[0]!=h || image->shape[1]!=w)
+            {
+               Tensor *scaled = image->cropAndScale(w, h);
+               image->decRef();
+               image = requests[i0+i]->image = scaled;
+            }
+            memcpy(input->cpuWrite() + i*bytes, image->cpuRead(), bytes);
+         }
+
+         result = inGraph->run(input);
+         if (!result || result->shape.size()<1 || result->shape[0]!=per || result->type!=Float32)
+            result = 0;
+      }
+      catch(...)
+      {
+         result = 0;
+      }
+
+      finished = GetTimeStamp();
+      for(int i=0;i<per;i++)
+         reply(requests[i0+i], result ? 0 : 1, inBatch, finished, result, i);
+      if (!result)
+         failed += per;
+      if (input)
+         input->decRef();
+   }
+
+   NxAutoMutex l(lock);
+   batchCount++;
+   requestCount += n;
+   errorCount += failed;
+   runTime += finished - inBatch->started;
+   for(int i=0;i<n;i++)
+   {
+      Request *request = requests[i];
+      queueTime += inBatch->started - request->arrived;
+      request->image->decRef();
+      release(request->connection);
+      delete request;
+   }
+   delete inBatch;
+}
+
+
+#else
+
+void Server::start()
+{
+   TensorThrow("Server - unix sockets are not supported on this platform");
+}
+
+void Server::stop() { }
+Server::Batch *Server::nextBatch() { return 0; }
+void Server::runBatch(Batch *inBatch, Graph *inGraph, int inWidth, int inHeight) { delete inBatch; }
+
+#endif
+
+}
@@ -14,7 +14,7 @@ namespace numerix
 
 
 Tensor::Tensor( int inType, const Shape &inShape )
-   : data(0), type(inType), shape(inShape)
+   : data(0), type(inType), shape(inShape), offset(0), contiguous(true)
 {
    refCount = 1;
    elementCount = 1;
@@ -39,6 +39,73 @@ Tensor::Tensor( int inType, const Shape &inShape )
       throw std::logic_error("bad tensor type");
 }
 
+Tensor::Tensor( int inType, const Shape &inShape, Tensor *inStorage )
+   : data(0), type(inType), shape(inShape), offset(0), contiguous(true)
+{
+   refCount = 1;
+   elementCount = 1;
+   if (shape.size()==0)
+   {
+      shape.push_back(1);
+      strides.push_back(1);
+   }
+   else
+   {
+      updateStrides();
+   }
+
+   int nType = inType & NumberMask;
+   if (nType!=SignedInteger && nType!=UnsignedInteger && nType!=Floating)
+      throw std::logic_error("bad tensor type");
+
+   elementSize = (inType & BitsMask)>>3;
+   if (elementCount*elementSize > inStorage->data->getSize())
+      TensorThrow("Tensor view - storage is too small");
+
+   data = inStorage->data->incRef();
+}
+
+Tensor::Tensor( int inType, const Shape &inShape, MappedFile *inFile, size_t inOffset )
+   : data(0), type(inType), shape(inShape), offset(0), contiguous(true)
+{
+   refCount = 1;
+   elementCount = 1;
+   if (shape.size()==0)
+   {
+      shape.push_back(1);
+      strides.push_back(1);
+   }
+   else
+   {
+      updateStrides();
+   }
+
+   int nType = inType & NumberMask;
+   if (nType!=SignedInteger && nType!=UnsignedInteger && nType!=Floating)
+      throw std::logic_error("bad tensor type");
+
+   elementSize = (inType & BitsMask)>>3;
+   if (inOffset + (size_t)elementCount*elementSize > inFile->getSize())
+      TensorThrow("Tensor - data is past the end of the file");
+
+   data = new TensorData(inFile, inOffset, elementCount*elementSize);
+}
+
+Tensor *Tensor::sliceChannels(int inChannel, int inChannels)
+{
+   if (!isImage() || !contiguous)
+      TensorThrow("sliceChannels - only H*W*C or N*H*W*C tensors can be sliced");
+   if (inChannel<0 || inChannels<1 || inChannel+inChannels>imageChannels())
+      TensorThrow("sliceChannels - channels out of range");
+
+   Tensor *result = new Tensor(type, shape, this);
+   result->shape[shape.size()-1] = inChannels;
+   result->elementCount = elementCount/imageChannels()*inChannels;
+   result->offset = inChannel;
+   result->contiguous = inChannels==imageChannels();
+   return result;
+}
+
 void Tensor::updateStrides()
 {
    elementCount = 1;
@@ -52,8 +119,7 @@ void Tensor::updateStrides()
 
 Tensor *Tensor::makeBuffer(Tensor *inBuffer, int inW, int inH, int inChannels, int inType)
 {
-   bool match = false;
-   if (inBuffer && inBuffer->shape.size()==3 && inBuffer->type==inType)
+   if (inBuffer && inBuffer->shape.size()==3 && inBuffer->type==inType && inBuffer->contiguous)
    {
       CShape s = inBuffer->shape;
       if (s[0]==inH && s[1]==inW && s[2]==inChannels)
@@ -69,6 +135,23 @@ Tensor *Tensor::makeBuffer(Tensor *inBuffer, int inW, int inH, int inChannels, i
 
 
 
+Tensor *Tensor::makeBuffer(Tensor *inBuffer, int inBatch, int inW, int inH, int inChannels, int inType)
+{
+   if (!inBatch)
+      return makeBuffer(inBuffer, inW, inH, inChannels, inType);
+
+   if (inBuffer && inBuffer->shape.size()==4 && inBuffer->type==inType && inBuffer->contiguous)
+   {
+      CShape s = inBuffer->shape;
+      if (s[0]==inBatch && s[1]==inH && s[2]==inW && s[3]==inChannels)
+         return inBuffer;
+   }
+
+   return new Tensor( inType, Shape4(inBatch, inH, inW, inChannels) );
+}
+
+
+
 void Tensor::printSub(const std::string &indent, int offset, int dim, int inMaxElems)
 {
    int elems = inMaxElems - (shape.size() - dim - 1) * 4;
@@ -387,7 +470,18 @@ void Tensor::zero(int inOffsetElem, unsigned int inCount)
 
 void Tensor::zero()
 {
-   zero(0,elementCount);
+   if (contiguous)
+      zero(0,elementCount);
+   else
+   {
+      // A slice - the pixels are apart
+      int channels = imageChannels();
+      int pixelStride = imageStrides()[1];
+      int pixels = elementCount/channels;
+      u8 *d = cpuWritePart();
+      for(int p=0;p<pixels;p++)
+         memset(d + p*pixelStride*elementSize, 0, channels*elementSize);
+   }
 }
 
 
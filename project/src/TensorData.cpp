@@ -1,7 +1,15 @@
 #include <Tensor.h>
-#include <hx/Thread.h>
+#include <NxThread.h>
 
 #include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#ifndef HX_WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define LOW_SENTINEL  67
 #define HIGH_SENTINEL 68
@@ -13,9 +21,33 @@ namespace numerix
 
 
 
+TensorData::TensorData(MappedFile *inFile, size_t inOffset, int inSize) :
+    size(inSize), cpu(0), mapping(inFile->incRef()), refCount(1)
+{
+   #ifdef NX_GPU
+   gpu = 0;
+   gpuValid = false;
+   gpuNchw = false;
+   #endif
+
+   #ifdef NX_OPENCL
+   oclValid = false;
+   ocl = 0;
+   #endif
+
+   #ifdef NX_EXTERN_BUFFERS
+   cpuValid = true;
+   cpuNchw = false;
+   #endif
+
+   cpu = inFile->getData() + inOffset;
+}
+
 TensorData::~TensorData()
 {
-   if (cpu)
+   if (mapping)
+      mapping->decRef();
+   else if (cpu)
       freeCpuAligned(cpu);
 }
 
@@ -37,22 +69,179 @@ void TensorData::decRef()
 
 
 
+// Cpu buffer pool
+//
+// Each buffer has a 64 byte header before it, so the data stays 64-byte aligned, with a
+//  guard byte either side.  Sizes are rounded up to one of four classes per power of two, and
+//  each class keeps a list of freed blocks.  Very large buffers are not pooled.
+
+enum { BlockHeader = 64, MinClassBits = 8, MaxClassBits = 30 };
+enum { ClassCount = (MaxClassBits-MinClassBits)*4 + 1 };
+enum { HugePageSize = 2<<20 };
+
+struct CpuBlock
+{
+   void     *base;
+   size_t   bytes;
+   unsigned size;
+   int      sizeClass;
+   bool     mapped;
+};
+
+static NxMutex &poolLock()
+{
+   static NxMutex lock;
+   return lock;
+}
+static bool   sPoolInit = false;
+static double sMaxCached = 256.0*1024*1024;
+static bool   sHugePages = false;
+#ifdef HXCPP_DEBUG
+static bool   sCheckSentinels = true;
+#else
+static bool   sCheckSentinels = false;
+#endif
+static std::vector<CpuBlock *> sFreeBlocks[ClassCount];
+static CpuMemoryStats sStats;
+
+static void initPool()
+{
+   sPoolInit = true;
+   memset(&sStats, 0, sizeof(sStats));
+   const char *env = getenv("NX_POOL_MB");
+   if (env)
+      sMaxCached = atof(env)*1024*1024;
+   env = getenv("NX_HUGE_PAGES");
+   if (env)
+      sHugePages = atoi(env)!=0;
+   env = getenv("NX_CHECK_MEMORY");
+   if (env)
+      sCheckSentinels = atoi(env)!=0;
+}
+
+// The class holding inBytes (header included), or -1 if too big to pool
+static int getSizeClass(size_t inBytes, size_t &outClassBytes)
+{
+   if (inBytes <= ((size_t)1<<MinClassBits))
+   {
+      outClassBytes = (size_t)1<<MinClassBits;
+      return 0;
+   }
+   int bits = MinClassBits;
+   while( ((size_t)2<<bits) < inBytes )
+      bits++;
+   if (bits>=MaxClassBits)
+   {
+      outClassBytes = (inBytes + 63) & ~(size_t)63;
+      return -1;
+   }
+   size_t base = (size_t)1<<bits;
+   size_t step = base>>2;
+   int sub = (int)((inBytes - base + step - 1)/step);
+   outClassBytes = base + sub*step;
+   return (bits-MinClassBits)*4 + sub;
+}
+
+static CpuBlock *systemAlloc(size_t inBytes, int inClass)
+{
+   CpuBlock *block = 0;
+   #if !defined(HX_WINDOWS) && defined(MADV_HUGEPAGE)
+   if (sHugePages && inBytes>=HugePageSize)
+   {
+      size_t mapBytes = (inBytes + HugePageSize-1) & ~(size_t)(HugePageSize-1);
+      void *base = mmap(0, mapBytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (base!=MAP_FAILED)
+      {
+         madvise(base, mapBytes, MADV_HUGEPAGE);
+         block = (CpuBlock *)base;
+         block->base = base;
+         block->bytes = mapBytes;
+         block->mapped = true;
+      }
+   }
+   #endif
+   if (!block)
+   {
+      void *base = malloc(inBytes + BlockHeader);
+      if (!base)
+         throw std::bad_alloc();
+      block = (CpuBlock *)( ((size_t)base + BlockHeader-1) & ~(size_t)(BlockHeader-1) );
+      block->base = base;
+      block->bytes = inBytes;
+      block->mapped = false;
+   }
+   block->sizeClass = inClass;
+   return block;
+}
+
+static void systemFree(CpuBlock *inBlock)
+{
+   #if !defined(HX_WINDOWS) && defined(MADV_HUGEPAGE)
+   if (inBlock->mapped)
+   {
+      munmap(inBlock->base, inBlock->bytes);
+      return;
+   }
+   #endif
+   free(inBlock->base);
+}
+
+// Cached blocks go back to the system, largest first, until under inLimit
+static void trimPool(double inLimit, std::vector<CpuBlock *> &outRelease)
+{
+   for(int c=ClassCount-1; c>=0 && sStats.cached>inLimit; c--)
+   {
+      std::vector<CpuBlock *> &blocks = sFreeBlocks[c];
+      while(!blocks.empty() && sStats.cached>inLimit)
+      {
+         CpuBlock *block = blocks.back();
+         blocks.pop_back();
+         sStats.cached -= block->bytes;
+         sStats.reserved -= block->bytes;
+         outRelease.push_back(block);
+      }
+   }
+}
+
+
 u8 *TensorData::allocCpuAligned(int size)
 {
-   // Allocate 6 bytes at beginning, plus up to and extra 12 to ensure 16-byte alignment, and
-   //  1 at the end
-   // Add 3 and trunc to ensure multiple of 4
-   u8 *alloc = new u8[ (size+6+12+1+3) & ~3];
-   int offset16 = 16 - (((int)(size_t)alloc) & 0xf);
-   if (offset16<6)
-      offset16 += 16;
+   // Header, data and the high guard byte
+   size_t classBytes = 0;
+   int sizeClass = getSizeClass( (size_t)size + BlockHeader + 1, classBytes );
 
-   u8 *cpu = alloc + offset16;
+   CpuBlock *block = 0;
+   {
+      NxAutoMutex lock(poolLock());
+      if (!sPoolInit)
+         initPool();
+      if (sizeClass>=0 && !sFreeBlocks[sizeClass].empty())
+      {
+         block = sFreeBlocks[sizeClass].back();
+         sFreeBlocks[sizeClass].pop_back();
+         sStats.cached -= block->bytes;
+         sStats.poolHits++;
+      }
+   }
+
+   bool fresh = !block;
+   if (fresh)
+      block = systemAlloc(classBytes, sizeClass);
+
+   block->size = size;
+   u8 *cpu = (u8 *)block + BlockHeader;
    cpu[-1] = LOW_SENTINEL;
    cpu[size] = HIGH_SENTINEL;
 
-   cpu[-2] = offset16;
-   *(unsigned int *)(cpu-6) = size;
+   NxAutoMutex lock(poolLock());
+   if (fresh)
+   {
+      sStats.systemAllocs++;
+      sStats.reserved += block->bytes;
+   }
+   sStats.inUse += size;
+   if (sStats.inUse>sStats.peak)
+      sStats.peak = sStats.inUse;
    return cpu;
 }
 
@@ -62,16 +251,131 @@ void TensorData::freeCpuAligned(void *inData)
       throw std::logic_error("freeCpuAligned - null pointer");
 
    u8 *cpu = (u8 *)inData;
-   if (cpu[-1]!=LOW_SENTINEL)
-      throw std::logic_error("TensorData underwrite");
+   CpuBlock *block = (CpuBlock *)(cpu - BlockHeader);
+   if (sCheckSentinels)
+   {
+      if (cpu[-1]!=LOW_SENTINEL)
+         throw std::logic_error("TensorData underwrite");
+      if (cpu[block->size] != HIGH_SENTINEL)
+         throw std::logic_error("TensorData overwrite");
+   }
+
+   {
+      NxAutoMutex lock(poolLock());
+      sStats.inUse -= block->size;
+      if (block->sizeClass>=0 && sStats.cached + block->bytes <= sMaxCached)
+      {
+         sFreeBlocks[block->sizeClass].push_back(block);
+         sStats.cached += block->bytes;
+         return;
+      }
+      sStats.reserved -= block->bytes;
+   }
+   systemFree(block);
+}
+
+void TensorData::setCpuPool(double inMaxCached, bool inHugePages, bool inCheckSentinels)
+{
+   std::vector<CpuBlock *> release;
+   {
+      NxAutoMutex lock(poolLock());
+      if (!sPoolInit)
+         initPool();
+      sMaxCached = std::max(inMaxCached, 0.0);
+      sHugePages = inHugePages;
+      sCheckSentinels = inCheckSentinels;
+      trimPool(sMaxCached, release);
+   }
+   for(int i=0;i<release.size();i++)
+      systemFree(release[i]);
+}
+
+void TensorData::getCpuMemoryStats(CpuMemoryStats &outStats)
+{
+   NxAutoMutex lock(poolLock());
+   if (!sPoolInit)
+      initPool();
+   outStats = sStats;
+}
+
+
+// MappedFile
+
+MappedFile *MappedFile::open(const char *inFilename)
+{
+   u8 *data = 0;
+   size_t size = 0;
+   void *mapHandle = 0;
+
+   #ifdef HX_WINDOWS
+   HANDLE file = CreateFileA(inFilename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file==INVALID_HANDLE_VALUE)
+      return 0;
+   LARGE_INTEGER fileSize;
+   if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart>0)
+   {
+      size = (size_t)fileSize.QuadPart;
+      // Copy-on-write pages are private to this process once written
+      mapHandle = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+      if (mapHandle)
+      {
+         data = (u8 *)MapViewOfFile(mapHandle, FILE_MAP_COPY, 0, 0, 0);
+         if (!data)
+         {
+            CloseHandle(mapHandle);
+            mapHandle = 0;
+         }
+      }
+   }
+   CloseHandle(file);
+   #else
+   int fd = ::open(inFilename, O_RDONLY);
+   if (fd<0)
+      return 0;
+   struct stat info;
+   if (fstat(fd, &info)==0 && info.st_size>0)
+   {
+      size = info.st_size;
+      // Writable but private, so layers may update the weights in place
+      void *mapped = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (mapped!=MAP_FAILED)
+         data = (u8 *)mapped;
+   }
+   close(fd);
+   #endif
 
-   unsigned int length = *(int *)(cpu-6);
-   if (cpu[length] != HIGH_SENTINEL)
-      throw std::logic_error("TensorData overwrite");
+   if (!data)
+      return 0;
 
-   int align16 = cpu[-2];
-   u8 *ptr = cpu - align16;
-   delete [] ptr;
+   MappedFile *result = new MappedFile();
+   result->data = data;
+   result->size = size;
+   result->refCount = 1;
+   result->mapHandle = mapHandle;
+   return result;
+}
+
+MappedFile::~MappedFile()
+{
+   #ifdef HX_WINDOWS
+   UnmapViewOfFile(data);
+   CloseHandle(mapHandle);
+   #else
+   munmap(data, size);
+   #endif
+}
+
+MappedFile *MappedFile::incRef()
+{
+   HxAtomicInc(&refCount);
+   return this;
+}
+
+void MappedFile::decRef()
+{
+   int now = HxAtomicDec(&refCount) - 1;
+   if (now<=0)
+      delete this;
 }
 
 
@@ -0,0 +1,164 @@
+#include <Tensor.h>
+#include <Layer.h>
+#include <Ops.h>
+#include <NxThread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+
+#ifdef HX_WINDOWS
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace numerix
+{
+
+/*
+ Autotune results, as lines of
+
+   cpu name <tab> kernel isa <tab> worker count <tab> layer key <tab> choice
+
+ A result only applies on the same cpu model, with the same kernels and the same
+ number of workers.  The file is rewritten whenever a new result is added - written beside
+ it and renamed over it, so another process reading it never sees half a file.
+*/
+
+typedef std::map<std::string, std::string> TuneMap;
+
+static NxMutex     sTuneMutex;
+static TuneMap     sTuneResults;
+static std::string sTuneFile;
+static int         sAutotune = -1;
+
+
+static std::string tunePrefix()
+{
+   char buf[32];
+   sprintf(buf,"%d", GetWorkerCount());
+   return std::string(GetCpuName()) + "\t" + GetKernels().isa + "\t" + buf + "\t";
+}
+
+
+static void loadTuneFile()
+{
+   sTuneResults.clear();
+   if (sTuneFile.empty())
+      return;
+
+   FILE *file = fopen(sTuneFile.c_str(),"rb");
+   if (!file)
+      return;
+
+   char line[1024];
+   while(fgets(line, sizeof(line), file))
+   {
+      int len = strlen(line);
+      while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r'))
+         line[--len] = '\0';
+
+      // The choice follows the last tab
+      char *tab = strrchr(line,'\t');
+      if (tab)
+      {
+         *tab = '\0';
+         sTuneResults[line] = tab+1;
+      }
+   }
+   fclose(file);
+}
+
+
+static void saveTuneFile()
+{
+   if (sTuneFile.empty())
+      return;
+
+   // Per process, in case several are tuning into the same file
+   char suffix[32];
+   #ifdef HX_WINDOWS
+   sprintf(suffix,".%d.tmp", (int)GetCurrentProcessId());
+   #else
+   sprintf(suffix,".%d.tmp", (int)getpid());
+   #endif
+   std::string tmpName = sTuneFile + suffix;
+
+   FILE *file = fopen(tmpName.c_str(),"wb");
+   if (!file)
+   {
+      fprintf(stderr,"Could not write tuning file %s\n", tmpName.c_str());
+      return;
+   }
+   for(TuneMap::iterator i=sTuneResults.begin(); i!=sTuneResults.end(); ++i)
+      fprintf(file,"%s\t%s\n", i->first.c_str(), i->second.c_str());
+   bool ok = !ferror(file);
+   ok = fclose(file)==0 && ok;
+
+   #ifdef HX_WINDOWS
+   ok = ok && MoveFileExA(tmpName.c_str(), sTuneFile.c_str(), MOVEFILE_REPLACE_EXISTING);
+   #else
+   ok = ok && rename(tmpName.c_str(), sTuneFile.c_str())==0;
+   #endif
+   if (!ok)
+   {
+      fprintf(stderr,"Could not write tuning file %s\n", sTuneFile.c_str());
+      remove(tmpName.c_str());
+   }
+}
+
+
+void SetConvAutotune(bool inAutotune, const std::string &inCacheFile)
+{
+   NxAutoMutex lock(sTuneMutex);
+   sAutotune = inAutotune;
+   if (inCacheFile!=sTuneFile)
+   {
+      sTuneFile = inCacheFile;
+      loadTuneFile();
+   }
+}
+
+
+// Also enabled with NX_AUTOTUNE=1, or NX_AUTOTUNE=<cache file>
+bool GetConvAutotune()
+{
+   if (sAutotune<0)
+   {
+      NxAutoMutex lock(sTuneMutex);
+      if (sAutotune<0)
+      {
+         const char *env = getenv("NX_AUTOTUNE");
+         sAutotune = env && env[0] && strcmp(env,"0");
+         if (sAutotune && strcmp(env,"1"))
+         {
+            sTuneFile = env;
+            loadTuneFile();
+         }
+      }
+   }
+   return sAutotune;
+}
+
+
+bool FindTuning(const std::string &inKey, std::string &outChoice)
+{
+   NxAutoMutex lock(sTuneMutex);
+   TuneMap::iterator i = sTuneResults.find(tunePrefix() + inKey);
+   if (i==sTuneResults.end())
+      return false;
+   outChoice = i->second;
+   return true;
+}
+
+
+void StoreTuning(const std::string &inKey, const std::string &inChoice)
+{
+   NxAutoMutex lock(sTuneMutex);
+   sTuneResults[tunePrefix() + inKey] = inChoice;
+   saveTuneFile();
+}
+
+
+} // end namespace numerix
@@ -10,67 +10,174 @@ namespace numerix
 
 class Concat : public Layer
 {
+   int batch;
    int srcW;
    int srcH;
    int c0;
    int c1;
    int channels;
 
+   // Fused producers run from the concat inputs, and write into their channels of the result
+   //  (see Layer::runInto).  Those that can not leave their result in 'produced' to be copied.
+   Layer  *producer[2];
+   Tensor *produced[2];
+   // Two producers run as branches (see RunBranches), once they have both written their slices
+   //  for these input shapes on the calling thread
+   Shape  warmShape[2];
+   Tensor *branchSrc[2];
+   Tensor *branchSlice[2];
+
 public:
    Concat( )
    {
+      producer[0] = producer[1] = 0;
+      produced[0] = produced[1] = 0;
+   }
+   ~Concat()
+   {
+      for(int i=0;i<2;i++)
+         if (produced[i])
+            produced[i]->decRef();
+   }
+
+   bool setFusedInput(int inIndex, Layer *inProducer)
+   {
+      if (inIndex<0 || inIndex>1)
+         return false;
+      producer[inIndex] = inProducer;
+      return true;
+   }
+
+   Tensor *runProducer(int inIndex, Tensor *inSrc)
+   {
+      Tensor *result = producer[inIndex]->run(inSrc, produced[inIndex]);
+      if (result!=produced[inIndex])
+      {
+         if (produced[inIndex])
+            produced[inIndex]->decRef();
+         produced[inIndex] = result;
+      }
+      return result;
    }
 
 
    virtual Tensor *run(Tensor *inSrc0, Tensor *inSrc1, Tensor *inBuffer)
    {
-      if (inSrc0->type != inSrc1->type)
+      // The inputs to copy, and the producers still to run into the result
+      Tensor *src[2] = { inSrc0, inSrc1 };
+      Tensor *input[2] = { 0, 0 };
+      int w[2], h[2], c[2];
+      for(int i=0;i<2;i++)
+      {
+         if (!producer[i])
+            input[i] = src[i];
+         else if (!producer[i]->getOutputSize(src[i], w[i], h[i], c[i]))
+            input[i] = runProducer(i, src[i]);
+         if (input[i])
+         {
+            if (!input[i]->isImage())
+               TensorThrow("Concat only supports matching H*W*C or N*H*W*C tensors");
+            w[i] = input[i]->imageWidth();
+            h[i] = input[i]->imageHeight();
+            c[i] = input[i]->imageChannels();
+         }
+      }
+      if (input[0] && input[1] && input[0]->type != input[1]->type)
          TensorThrow("Concat - input types must match");
+      int type = input[0] ? input[0]->type : input[1] ? input[1]->type : Float32;
 
-      CShape sin0 = inSrc0->shape;
-      CShape sin1 = inSrc1->shape;
-      if (sin0.size()!=3 || sin1.size()!=3)
-         TensorThrow("Concat only supports H*W*C tensors");
+      if (src[0]->shape.size()!=src[1]->shape.size())
+         TensorThrow("Concat only supports matching H*W*C or N*H*W*C tensors");
 
-      if (sin0[0]!=sin1[0] || sin0[1]!=sin1[1])
+      int n = src[0]->imageBatch();
+      if (n!=src[1]->imageBatch() || h[0]!=h[1] || w[0]!=w[1])
       {
          char buf[1000];
-         sprintf(buf, "Concat - mismatch image sizes %dx%dx%d + %dx%dx%d",
-                 sin0[0], sin0[1],sin0[2], sin1[0], sin1[1], sin1[2] );
+         sprintf(buf, "Concat - mismatch image sizes %dx%dx%dx%d + %dx%dx%dx%d",
+                 n, h[0], w[0], c[0], src[1]->imageBatch(), h[1], w[1], c[1] );
          TensorThrow(buf);
       }
 
-      srcH = sin0[0];
-      srcW = sin0[1];
-      c0 = sin0[2];
-      c1 = sin1[2];
+      batch = std::max(n,1);
+      srcH = h[0];
+      srcW = w[0];
+      c0 = c[0];
+      c1 = c[1];
       channels = c0 + c1;
       //printf("Concat -> %d %d %d\n", srcW, srcH, channels);
 
       startRun();
-      Tensor *result = Tensor::makeBuffer(inBuffer, srcW, srcH, channels, inSrc0->type);
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, srcW, srcH, channels, type);
 
-      bool nchw = inSrc0->isGpuNchw();
+      // The producers write through views of their channels, so the concat itself is a no-op
+      bool warm = !input[0] && !input[1] && src[0]->shape==warmShape[0] && src[1]->shape==warmShape[1];
+      warmShape[0].clear();
+      warmShape[1].clear();
+      for(int i=0;i<2;i++)
+      {
+         branchSrc[i] = src[i];
+         branchSlice[i] = input[i] ? 0 : result->sliceChannels(i==0 ? 0 : c0, c[i]);
+      }
+      if (!warm || !RunBranches(2, SRunBranch, this))
+      {
+         bool sliced = true;
+         for(int i=0;i<2;i++)
+            if (!input[i] && !producer[i]->runInto(src[i], branchSlice[i]))
+            {
+               input[i] = runProducer(i, src[i]);
+               sliced = false;
+            }
+         if (sliced && !input[0] && !input[1])
+         {
+            warmShape[0] = src[0]->shape;
+            warmShape[1] = src[1]->shape;
+         }
+      }
+      else
+      {
+         warmShape[0] = src[0]->shape;
+         warmShape[1] = src[1]->shape;
+      }
+      for(int i=0;i<2;i++)
+         if (branchSlice[i])
+            branchSlice[i]->decRef();
+
+      bool nchw = input[0] && input[1] && input[0]->isGpuNchw();
       if (nchw)
       {
+         // Channel-major, so the inputs follow each other within each image
+         int bytes0 = input[0]->getByteCount()/batch;
+         int bytes1 = input[1]->getByteCount()/batch;
          u8 *d = result->cpuWrite(nchw);
-         memcpy(d, inSrc0->cpuRead(nchw), inSrc0->getByteCount() );
-         d += inSrc0->getByteCount();
-         memcpy(d, inSrc1->cpuRead(nchw), inSrc1->getByteCount() );
+         const u8 *s0 = input[0]->cpuRead(nchw);
+         const u8 *s1 = input[1]->cpuRead(nchw);
+         for(int i=0;i<batch;i++)
+         {
+            memcpy(d, s0 + i*bytes0, bytes0 );
+            d += bytes0;
+            memcpy(d, s1 + i*bytes1, bytes1 );
+            d += bytes1;
+         }
       }
-      else
+      else if (input[0] || input[1])
       {
-         src0 = inSrc0;
-         src1 = inSrc1;
+         src0 = input[0];
+         src1 = input[1];
          destTensor = result;
 
          // Prep in single-thread mode
-         src0->cpuRead(nchw);
-         src1->cpuRead(nchw);
-         destTensor->cpuWrite(nchw);
+         if (src0)
+            src0->cpuRead();
+         if (src1)
+            src1->cpuRead();
+         if (src0 && src1)
+            destTensor->cpuWrite();
+         else
+            destTensor->cpuWritePart();
 
          runThreaded();
          src0 = 0;
+         src1 = 0;
          destTensor = 0;
       }
       endRun();
@@ -78,6 +185,12 @@ public:
       return result;
    }
 
+   static void SRunBranch(int inBranch, void *inThis)
+   {
+      Concat *concat = (Concat *)inThis;
+      concat->producer[inBranch]->runInto(concat->branchSrc[inBranch], concat->branchSlice[inBranch]);
+   }
+
    Tensor *destTensor;
    Tensor *src0;
    Tensor *src1;
@@ -87,34 +200,39 @@ public:
       runThreadMulti(threadId);
    }
 
+   // Either input may be missing, when a producer has written it already
    void runThreadMulti(int threadId)
    {
-      int typeSize = src0->elementSize;
-      const int *src0Stride = &src0->strides[0];
-      const int *src1Stride = &src1->strides[0];
-      const int *destStride = &destTensor->strides[0];
-      int ds0x = src0Stride[1] * typeSize;
-      int ds1x = src1Stride[1] * typeSize;
+      int typeSize = destTensor->elementSize;
+      const int *destStride = destTensor->imageStrides();
+      int ds0x = c0 * typeSize;
+      int ds1x = c1 * typeSize;
       int ddx = destStride[1] * typeSize;
 
+      // The rows of a batch follow on, so they can be treated as one tall image
       while(true)
       {
          int y = getNextJob();
-         if (y>=srcH)
+         if (y>=batch*srcH)
             break;
 
-         const u8 *s0 = src0->cpuRead() + src0Stride[0] * y * typeSize;
-         const u8 *s1 = src1->cpuRead() + src1Stride[0] * y * typeSize;
-         u8 *d = destTensor->cpuWrite() + destStride[0] * y * typeSize;
+         const u8 *s0 = src0 ? src0->cpuRead() + src0->imageStrides()[0] * y * typeSize : 0;
+         const u8 *s1 = src1 ? src1->cpuRead() + src1->imageStrides()[0] * y * typeSize : 0;
+         u8 *d = destTensor->cpuWritePart() + destStride[0] * y * typeSize;
 
          for(int x=0;x<srcW;x++)
          {
-            memcpy(d, s0, ds0x);
-            s0 += ds0x;
-            d += ds0x;
-            memcpy(d, s1, ds1x);
-            s1 += ds1x;
-            d += ds1x;
+            if (s0)
+            {
+               memcpy(d, s0, ds0x);
+               s0 += ds0x;
+            }
+            if (s1)
+            {
+               memcpy(d+ds0x, s1, ds1x);
+               s1 += ds1x;
+            }
+            d += ddx;
          }
       }
    }
@@ -8,6 +8,86 @@
 namespace numerix
 {
 
+// ----- Fused epilogue ---------------
+
+// d = activation(d + r) for a block of pixels, over channels [c0,c1)
+static void addResidual(float *d, int dStride, const float *r, int rStride, int pixels,
+                        int c0, int c1, Activation activation)
+{
+   for(int p=0;p<pixels;p++)
+   {
+      float *dp = d + p*dStride;
+      const float *rp = r + p*rStride;
+      for(int c=c0;c<c1;c++)
+         dp[c] = activate(dp[c] + rp[c], activation);
+   }
+}
+
+// One output row of a 2x2 stride-2 max pool, from one or two rows of inW pixels.
+// The pool is not padded on the left, so the last column or row just falls off for odd sizes.
+static void poolRow(float *dest, int destStride, const float *row0, const float *row1, int inStride,
+                    int inW, int outW, int c0, int c1)
+{
+   for(int x=0;x<outW;x++)
+   {
+      int dx = 2*x+1<inW ? inStride : 0;
+      const float *s0 = row0 + 2*x*inStride;
+      const float *s1 = row1 + 2*x*inStride;
+      float *d = dest + x*destStride;
+      for(int c=c0;c<c1;c++)
+         d[c] = std::max( std::max(s0[c], s0[c+dx]), std::max(s1[c], s1[c+dx]) );
+   }
+}
+
+// The epilogue as a pass of its own, for the algorithms that do not fuse it.
+// A job is an output row.  The residual is added in place, into rows only that job reads.
+class ConvEpilogue : public Layer
+{
+public:
+   float       *conv;
+   const float *residual;
+   float       *dest;
+   int         rows;
+   int         destW;
+   int         destH;
+   int         channels;
+   int         outStride;
+   bool        pool;
+   int         poolW;
+   int         poolH;
+   Activation  sumActivation;
+
+   void runThread(int threadId)
+   {
+      int outW = pool ? poolW : destW;
+      int outH = pool ? poolH : destH;
+      int imageSize = destW*destH*channels;
+      while(true)
+      {
+         int row = getNextJob();
+         if (row>=rows)
+            break;
+
+         int image = row/outH;
+         int y = row - image*outH;
+         int r0 = pool ? 2*y : y;
+         int r1 = pool ? std::min(2*y+1, destH-1) : y;
+         int offset = image*imageSize + r0*destW*channels;
+         float *c0 = conv + offset;
+         if (residual)
+            addResidual(c0, channels, residual + offset, channels, (r1-r0+1)*destW, 0, channels, sumActivation);
+
+         float *d = dest + row*outW*outStride;
+         if (pool)
+            poolRow(d, outStride, c0, c0 + (r1-r0)*destW*channels, channels, destW, outW, 0, channels);
+         else if (d!=c0)
+            for(int x=0;x<destW;x++)
+               memcpy(d + x*outStride, c0 + x*channels, channels*sizeof(float));
+      }
+   }
+};
+
+
 // ----- Conv2DBase ---------------
 
 Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
@@ -20,6 +100,7 @@ Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
    padding = inPadding;
    isDeconvolution = inIsDeconvolution;
    diSize = 0;
+   depthMultiplier = 1;
    padInputsWithZero = false;
    weightsOriginal = 0;
    filterX = filterY = 0;
@@ -29,9 +110,25 @@ Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
    padOx = padOy = 0;
    weights = 0;
    pweights = 0;
-   is1x1Aligned = false;
    is1x1 = false;
-
+   blockLimit = 0;
+   batch = 1;
+   calibrating = false;
+   inputRange = 0;
+   quantRange = 0;
+   halfWeights = false;
+   fusePool = false;
+   fuseSum = false;
+   sumActivation = actLinear;
+   residual = 0;
+   intoSlice = false;
+   outStride = 0;
+   poolW = poolH = 0;
+   unfused = 0;
+   epilogue = 0;
+   weightsChanged = false;
+   weightsInFile = false;
+   heldScales = heldMeans = heldVars = 0;
 
 
    strideShiftX = 1;
@@ -51,7 +148,8 @@ Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
    CShape s = inWeights->shape;
    if (!inPWeights && s.size()!=4)
       TensorThrow("Invalid Conv2D weight shape");
-   if (inPWeights && s.size()!=3)
+   // Depthwise is [inputs][fy][fx], or [inputs][multiplier][fy][fx]
+   if (inPWeights && s.size()!=3 && s.size()!=4)
       TensorThrow("Invalid SeparableConv2D depthwise shape");
 
    if (inPWeights)
@@ -59,16 +157,15 @@ Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
       CShape p = inPWeights->shape;
       if (p.size()!=2)
          TensorThrow("Invalid SeparableConv2D pointwise shape");
-      if (s[0]!=p[1])
-         TensorThrow("SeparableConv2D mismatched weights");
       diSize = p[1];
+      depthMultiplier = s.size()==4 ? s[1] : 1;
 
       outputs = p[0];
       inputs =  s[0];
-      filterY = s[1];
-      filterX = s[2];
-      if (filterX==1 && filterY==1)
-         TensorThrow("SeparableConv2D 1x1 not supported");
+      filterY = s[s.size()-2];
+      filterX = s[s.size()-1];
+      if (inputs*depthMultiplier!=diSize)
+         TensorThrow("SeparableConv2D mismatched weights");
    }
    else
    {
@@ -94,7 +191,6 @@ Conv2DBase::Conv2DBase(int inStrideY, int inStrideX, bool inIsDeconvolution,
    bias = inBias ? inBias->incRef() : 0;
 
    is1x1 = filterX*filterY==1;
-   is1x1Aligned = is1x1 && (inputs & 0x3) == 0;
 
 }
 
@@ -108,11 +204,130 @@ Conv2DBase::~Conv2DBase()
       pweights->decRef();
    if (bias)
       bias->decRef();
+   if (unfused)
+      unfused->decRef();
+   delete epilogue;
+   releaseCompiled();
+   releaseHeldNormalization();
+}
+
+
+void Conv2DBase::holdCompiled(const CompiledWeights &inWeights)
+{
+   releaseCompiled();
+   for(int i=0;i<inWeights.packed.size();i++)
+      compiledTensors.push_back( inWeights.packed[i]->incRef() );
+}
+
+
+// The weights they were compiled from should be the ones this layer has
+bool Conv2DBase::fitsCompiled(const CompiledWeights &inWeights)
+{
+   return inWeights.weights && inWeights.weights->shape==weights->shape &&
+          (inWeights.bias!=0) == (bias!=0);
+}
+
+
+void Conv2DBase::releaseCompiled()
+{
+   for(int i=0;i<compiledTensors.size();i++)
+      compiledTensors[i]->decRef();
+   compiledTensors.resize(0);
+}
+
+
+struct FileReorder
+{
+   const float *src;
+   float       *dest;
+   int         inputs;
+   int         filters;
+};
+
+// Each output's [i][f] block becomes [f][i]
+static void SReorderFileWeights(int inThreadId, int inBegin, int inEnd, void *inData)
+{
+   FileReorder *job = (FileReorder *)inData;
+   int block = job->inputs*job->filters;
+   for(int o=inBegin;o<inEnd;o++)
+   {
+      const float *src = job->src + (size_t)o*block;
+      float *dest = job->dest + (size_t)o*block;
+      for(int i=0;i<job->inputs;i++)
+         for(int f=0;f<job->filters;f++)
+            dest[f*job->inputs + i] = src[i*job->filters + f];
+   }
+}
+
+void ReorderFileWeights(float *outDest, const float *inSrc, int inOutputs, int inInputs, int inFilters)
+{
+   // 1x1 is already in order
+   if (inFilters==1)
+   {
+      memcpy(outDest, inSrc, (size_t)inOutputs*inInputs*sizeof(float));
+      return;
+   }
+   FileReorder job;
+   job.src = inSrc;
+   job.dest = outDest;
+   job.inputs = inInputs;
+   job.filters = inFilters;
+   ParallelFor(inOutputs, std::max(1, 65536/(inInputs*inFilters)), SReorderFileWeights, &job);
+}
+
+
+void Conv2DBase::loadWeights()
+{
+   Tensor *loaded = new Tensor(Float32, weights->shape);
+   ReorderFileWeights((float *)loaded->cpuWrite(), (const float *)weights->cpuRead(),
+                      outputs, weights->shape[3], filterX*filterY);
+   weights->decRef();
+   weights = loaded;
+
+   // A mapped bias is only float aligned, and normalization would write to the file's pages
+   if (bias)
+   {
+      Tensor *copy = new Tensor(Float32, bias->shape);
+      memcpy(copy->cpuWrite(), bias->cpuRead(), outputs*sizeof(float));
+      bias->decRef();
+      bias = copy;
+   }
+   weightsInFile = false;
+
+   if (heldScales)
+   {
+      setNormalization(heldScales, heldMeans, heldVars);
+      releaseHeldNormalization();
+   }
+   weightsChanged = true;
+}
+
+
+void Conv2DBase::releaseHeldNormalization()
+{
+   if (heldScales)
+   {
+      heldScales->decRef();
+      heldMeans->decRef();
+      heldVars->decRef();
+      heldScales = heldMeans = heldVars = 0;
+   }
 }
 
 
 void Conv2DBase::setNormalization(Tensor *inScales, Tensor *inMeans, Tensor *inVars)
 {
+   // Applied to the weights once they are loaded - a second one applies on top, so loads now
+   if (weightsInFile && heldScales)
+      loadWeights();
+   if (weightsInFile)
+   {
+      heldScales = inScales->incRef();
+      heldMeans = inMeans->incRef();
+      heldVars = inVars->incRef();
+      return;
+   }
+
    // a set of output features are first "normalized":
    //
    // O'i = (Oi - Mean_i)/(sqrt(Vars_i) +  .000001f)
@@ -139,9 +354,11 @@ void Conv2DBase::setNormalization(Tensor *inScales, Tensor *inMeans, Tensor *inV
       bias->zero(0,outputs);
    }
    float *b = (float *)bias->cpuWritePart();
-   float *w = (float *)weights->cpuWritePart();
+   // For separable convolutions, the pointwise weights make the outputs
+   Tensor *outWeights = pweights ? pweights : weights;
+   float *w = (float *)outWeights->cpuWritePart();
 
-   int wCount = weights->strides[0];
+   int wCount = outWeights->strides[0];
    for(int i=0;i<outputs;i++)
    {
       float Ki = scale[i]/(sqrt(var[i])+.000001f);
@@ -150,12 +367,22 @@ void Conv2DBase::setNormalization(Tensor *inScales, Tensor *inMeans, Tensor *inV
       b[i] -= mean[i]*Ki;
    }
 
-   rebuildWeights();
+   weightsChanged = true;
+}
+
+
+void Conv2DBase::setCalibrate(bool inCalibrate)
+{
+   if (inCalibrate && !calibrating)
+      inputRange = 0;
+   calibrating = inCalibrate;
 }
 
 
 void Conv2DBase::reduceInputs(int inCount)
 {
+   if (weightsInFile)
+      loadWeights();
    if (!weightsOriginal)
       weightsOriginal = weights;
    else
@@ -165,7 +392,7 @@ void Conv2DBase::reduceInputs(int inCount)
    int skip = weightsOriginal->shape[3] - inCount;
    weights = weightsOriginal->resizeAxis(3,inCount,skip);
    inputs = inCount;
-   rebuildWeights();
+   weightsChanged = true;
 }
 
 
@@ -173,6 +400,8 @@ void Conv2DBase::removeMean( const std::vector<float> &inMean )
 {
    if (inMean.size() != inputs)
       TensorThrow("Conv2D invalid mean length");
+   if (weightsInFile)
+      loadWeights();
 
    // O = output[o] = Sum W[o][fy][fx][i] * I[i] + B[o]
    //                   fx,fy,i
@@ -188,44 +417,68 @@ void Conv2DBase::removeMean( const std::vector<float> &inMean )
                delta += inMean[i] * weights->getFloat(o,fy,fx,i);
       b[o] -= delta;
    }
-   rebuildWeights();
+   weightsChanged = true;
 
 }
 
 
-Tensor *Conv2DBase::run(Tensor *inSrc0, Tensor *inBuffer)
+bool Conv2DBase::setFusedPool(bool inFuse, Padding inPadding)
+{
+   if (inPadding.type==Padding::padCustom)
+      return false;
+   fusePool = inFuse;
+   poolPadding = inPadding;
+   return true;
+}
+
+
+bool Conv2DBase::setFusedSum(bool inFuse, Activation inActivation)
+{
+   fuseSum = inFuse;
+   sumActivation = inActivation;
+   return true;
+}
+
+
+void Conv2DBase::setSizes(Tensor *inSrc0)
 {
    if (inSrc0->type != Float32)
       TensorThrow("Conv2D only supports Float32 tensors");
 
    CShape sin = inSrc0->shape;
-   if (sin.size()!=3)
+   if (!inSrc0->isImage())
    {
       printf("Conv2D %dx%dx%dx%d\n", outputs, filterY, filterX, inputs);
       printf("Src dimension %d :", (int)sin.size());
       for(int i=0;i<sin.size();i++)
          printf(" %d", sin[i]);
       printf("\n");
-      TensorThrow("Conv2D only supports H*W*C tensors");
+      TensorThrow("Conv2D only supports H*W*C or N*H*W*C tensors");
    }
 
-   if (sin[2]!=inputs && padInputsWithZero)
+   int srcC = inSrc0->imageChannels();
+   if (srcC!=inputs && padInputsWithZero)
    {
       int maxIn = weightsOriginal ? weightsOriginal->shape[3] : inputs;
-      if (sin[2]>maxIn)
+      if (srcC>maxIn)
          TensorThrow("Conv2D - too many inputs for the number of weights");
-      reduceInputs(sin[2]);
+      reduceInputs(srcC);
    }
 
-   if (sin[2]!=inputs)
+   if (srcC!=inputs)
    {
-      printf("sin : %d %d %d\n", sin[0], sin[1], sin[2]);
+      printf("sin : %d %d %d\n", inSrc0->imageHeight(), inSrc0->imageWidth(), srcC);
       printf("weights : %d %dx%d %d\n", outputs, filterY, filterX, inputs );
       TensorThrow("Conv2D - weights do not match the number of input channels");
    }
 
-   srcH = sin[0];
-   srcW = sin[1];
+   int n = inSrc0->imageBatch();
+   if (n<1 && sin.size()==4)
+      TensorThrow("Conv2D - empty batch");
+
+   batch = std::max(n,1);
+   srcH = inSrc0->imageHeight();
+   srcW = inSrc0->imageWidth();
 
    destH = 0;
    destW = 0;
@@ -243,25 +496,145 @@ Tensor *Conv2DBase::run(Tensor *inSrc0, Tensor *inBuffer)
       padding.get(srcH, strideY, filterY, destH, padOy);
    }
 
+   poolW = destW;
+   poolH = destH;
+   if (fusePool)
+   {
+      // As MaxPool, which is not padded on the left for 2x2
+      if (poolPadding.type==Padding::padSame)
+      {
+         poolW = (destW+1)/2;
+         poolH = (destH+1)/2;
+      }
+      else
+      {
+         poolW = destW/2;
+         poolH = destH/2;
+      }
+   }
+}
+
+
+bool Conv2DBase::getOutputSize(Tensor *inSrc0, int &outW, int &outH, int &outChannels)
+{
+   setSizes(inSrc0);
+   outW = poolW;
+   outH = poolH;
+   outChannels = outputs;
+   return true;
+}
+
+
+Tensor *Conv2DBase::run(Tensor *inSrc0, Tensor *inBuffer)
+{
+   if (fuseSum)
+      TensorThrow("Conv2D - fused sum needs a second input");
+   return runFused(inSrc0, 0, inBuffer, false);
+}
+
+
+Tensor *Conv2DBase::run(Tensor *inSrc0, Tensor *inSrc1, Tensor *inBuffer)
+{
+   if (!fuseSum)
+      TensorThrow("Conv2D - second input without a fused sum");
+   return runFused(inSrc0, inSrc1, inBuffer, false);
+}
+
+
+bool Conv2DBase::runInto(Tensor *inSrc0, Tensor *inSlice)
+{
+   if (fuseSum)
+      return false;
+   runFused(inSrc0, 0, inSlice, true);
+   return true;
+}
+
+
+Tensor *Conv2DBase::runFused(Tensor *inSrc0, Tensor *inResidual, Tensor *inBuffer, bool inSlice)
+{
+   setSizes(inSrc0);
+   if (weightsChanged)
+   {
+      if (weightsInFile)
+         loadWeights();
+      releaseCompiled();
+      rebuildWeights();
+      weightsChanged = false;
+   }
+
+   int n = inSrc0->imageBatch();
+   if (calibrating)
+   {
+      const float *f = (const float *)inSrc0->cpuRead();
+      float range = inputRange;
+      for(int i=0;i<inSrc0->elementCount;i++)
+         range = std::max(range, fabsf(f[i]));
+      inputRange = range;
+   }
+
+   if (inResidual)
+   {
+      if (inResidual->type!=Float32 || inResidual->imageBatch()!=n || inResidual->imageWidth()!=destW ||
+            inResidual->imageHeight()!=destH || inResidual->imageChannels()!=outputs)
+         TensorThrow("Conv2D - fused sum input does not match the result");
+      inResidual->cpuRead();
+   }
 
-   bool match = false;
-   if (inBuffer && inBuffer->shape.size()==3 && inBuffer->type==Float32)
+   Tensor *result = 0;
+   if (inSlice)
    {
-      CShape s = inBuffer->shape;
-      match = s[0]==destH && s[1]==destW && s[2]==outputs;
+      if (!inBuffer || inBuffer->type!=Float32 || inBuffer->imageBatch()!=n || inBuffer->imageWidth()!=poolW ||
+            inBuffer->imageHeight()!=poolH || inBuffer->imageChannels()!=outputs)
+         TensorThrow("Conv2D - destination slice does not match the result");
+      result = inBuffer;
    }
-   Tensor *result = inBuffer;
-   if (!match)
+   else
    {
-      Shape s(3);
-      s[0] = destH;
-      s[1] = destW;
-      s[2] = outputs;
-      result = new Tensor( Float32, s );
+      // The result has a batch dimension if the input does
+      result = Tensor::makeBuffer(inBuffer, n, poolW, poolH, outputs, Float32);
    }
+   outStride = result->imageStrides()[1];
    //printf("Cov2d -> %d %d %d\n", destW, destH, outputs);
 
-   doRun(inSrc0, result);
+   residual = inResidual;
+   intoSlice = inSlice;
+   if (!fusePool && !residual && !inSlice)
+      doRun(inSrc0, result);
+   else if (!doRunFused(inSrc0, result))
+   {
+      // A sum alone can go in place, otherwise the plain result needs somewhere to go
+      Tensor *conv = result;
+      if (fusePool || inSlice)
+      {
+         Tensor *buffer = Tensor::makeBuffer(unfused, n, destW, destH, outputs, Float32);
+         if (buffer!=unfused)
+         {
+            if (unfused)
+               unfused->decRef();
+            unfused = buffer;
+         }
+         conv = unfused;
+      }
+      doRun(inSrc0, conv);
+
+      if (!epilogue)
+         epilogue = new ConvEpilogue();
+      epilogue->conv = (float *)conv->cpuWritePart();
+      epilogue->residual = residual ? (const float *)residual->cpuRead() : 0;
+      epilogue->dest = (float *)result->cpuWritePart();
+      epilogue->rows = batch*poolH;
+      epilogue->destW = destW;
+      epilogue->destH = destH;
+      epilogue->channels = outputs;
+      epilogue->outStride = outStride;
+      epilogue->pool = fusePool;
+      epilogue->poolW = poolW;
+      epilogue->poolH = poolH;
+      epilogue->sumActivation = sumActivation;
+      epilogue->runThreaded();
+   }
+   residual = 0;
+   intoSlice = false;
 
    return result;
 }
@@ -272,13 +645,45 @@ Tensor *Conv2DBase::run(Tensor *inSrc0, Tensor *inBuffer)
 
 #define FLAT_WEIGHTS
 
+// Per-thread im2col rows for the packed gemm are kept to about this many bytes
+#define GEMM_ROW_BUDGET (256*1024)
+#define GEMM_MAX_ROWS 128
+// Longer sums are split into blocks of this many k, so a weight panel block stays in
+//  L1 and the im2col rows for it in L2
+#define GEMM_KC 256
+// The int8 gemm sums all of k in int32, which is safe up to 2^31/(127*127)
+#define GEMM_INT8_MAX_K 131072
+
 class Conv2D : public Conv2DBase
 {
-   bool       interlacedWeights;
-   int        interlacedCount;
+   bool       gemmWeights;
+   float      *packedWeights;
+   float      *packedBias;
+   int        gemmK;
+   int        gemmKStride;
+   int        gemmKc;
+   int        gemmMaxRows;
+   int        gemmRows;
+   int        gemmGroups;
+   float      *gemmZeros;
    std::vector <float *> srcBuffers;
-   std::vector <float *> diBuffers;
-   std::vector <float *> weightBuffers;
+   // fp16 weights replace packedWeights.  Kernels with no fp16 gemm convert a panel block at a
+   //  time into panelBuffers.
+   unsigned short *packedHalf;
+   std::vector <float *> panelBuffers;
+   // Result rows for a fused pool, sized on demand
+   std::vector <float *> poolBuffers;
+   int        poolBufferSize;
+
+   // Int8: weights are quantized per output, and the input is quantized to inputInt8 (with the
+   //  channels padded to 4) before the gemm.  The output stays Float32.
+   Tensor     *weightsInt8;
+   Tensor     *inputInt8;
+   signed char *packedInt8;
+   float      *packedScale;
+   float      inputScale;
+   int        inputsInt8;
+   bool       quantizing;
 
    float      *alignedWeightsBuffer;
    float      *alignedWeights;
@@ -292,19 +697,36 @@ public:
           Tensor *inWeights, Tensor *inPWeights, Tensor *inBias)
       : Conv2DBase(inStrideY, inStrideX, inIsDeconvolution, inActivation, inPadding,  inWeights, inPWeights, inBias)
    {
-      interlacedWeights = false;
-      interlacedCount = 0;
       alignedBias = 0;
       alignedWeights = 0;
       alignedWeightSize = 0;
       alignedWeightsBuffer = 0;
+      packedWeights = 0;
+      packedBias = 0;
+      gemmK = gemmKStride = gemmKc = 0;
+      gemmMaxRows = gemmRows = gemmGroups = 0;
+      gemmZeros = 0;
+      packedHalf = 0;
+      poolBufferSize = 0;
+      weightsInt8 = 0;
+      inputInt8 = 0;
+      packedInt8 = 0;
+      packedScale = 0;
+      inputScale = 0;
+      inputsInt8 = 0;
+      quantizing = false;
+
+      gemmWeights = !pweights && !isDeconvolution;
+
+      weightsChanged = true;
+   }
 
-
-      #ifdef NUMERIX_SIMD
-      interlacedWeights = (outputs & 0x3)==0  && !pweights && (!is1x1 || is1x1Aligned) && !isDeconvolution;
-      #endif
-
-      rebuildWeights();
+   ~Conv2D()
+   {
+      if (weightsInt8)
+         weightsInt8->decRef();
+      if (inputInt8)
+         inputInt8->decRef();
    }
 
 
@@ -313,14 +735,47 @@ public:
       padInputsWithZero = true;
    }
 
+   // Only the gemm path has an int8 version
+   bool setQuantize(float inRange)
+   {
+      if (!gemmWeights || filterX*filterY*((inputs+3)&~3) > GEMM_INT8_MAX_K)
+         return false;
+      quantRange = std::max(inRange, 0.0f);
+      weightsChanged = true;
+      return true;
+   }
+
+   bool setHalfWeights(bool inHalf)
+   {
+      if (!gemmWeights)
+         return false;
+      halfWeights = inHalf;
+      weightsChanged = true;
+      return true;
+   }
+
 
-   void rebuildWeights()
+   void releaseWeights()
    {
       releaseFloats();
       srcBuffers.resize(0);
-      diBuffers.resize(0);
-      weightBuffers.resize(0);
+      panelBuffers.resize(0);
+      poolBuffers.resize(0);
+      poolBufferSize = 0;
+      packedWeights = 0;
+      packedHalf = 0;
+      packedInt8 = 0;
+      gemmZeros = 0;
+      if (weightsInt8)
+      {
+         weightsInt8->decRef();
+         weightsInt8 = 0;
+      }
+   }
 
+   void rebuildWeights()
+   {
+      releaseWeights();
 
       alignedBias = bias ? (float *)bias->cpuRead() : 0;
 
@@ -328,53 +783,213 @@ public:
       alignedWeights = (float *)weights->cpuRead();
       alignedWeightSize = filterX*filterY*inputs;
 
-      if ( !pweights && (alignedWeightSize & 0x3) && outputs>1 )
+      if (gemmWeights)
       {
-         alignedWeightSize = (alignedWeightSize + 3) & ~3;
-         alignedWeightsBuffer = allocFloats(alignedWeightSize*outputs);
-         int wSize = filterX*filterY*inputs;
-         for(int o=0;o<outputs;o++)
-         {
-            memcpy(alignedWeightsBuffer + o*alignedWeightSize, alignedWeights + o*wSize, wSize*sizeof(float));
-         }
-         alignedWeights = alignedWeightsBuffer;
+         if (quantRange>0)
+            createInt8Weights();
+         else
+            createGemmWeights();
+         return;
+      }
+
+      int FX = isDeconvolution ? filterX/strideX : filterX;
+      int FY = isDeconvolution ? filterY/strideY : filterY;
+      int paddedSize = (FX*FY*inputs + 3) & ~0x3;
+      allocWorkerFloats(srcBuffers, paddedSize);
+
+      #ifdef FLAT_WEIGHTS
+      if (isDeconvolution)
+         createDeconvWeights();
+      #endif
+   }
+
+   void createGemmWeights()
+   {
+      setGemmSizes();
+
+      int panels = gemmPanelCount(outputs);
+      int packedCount = panels*GEMM_NR*gemmK;
+      if (halfWeights)
+      {
+         std::vector<float> packed(packedCount);
+         packGemmWeights(&packed[0], alignedWeights, outputs, gemmK, gemmK);
+         packedHalf = (unsigned short *)allocFloats( (packedCount+1)/2 );
+         floattofp16((unsigned char *)packedHalf, &packed[0], packedCount);
+      }
+      else
+      {
+         packedWeights = allocFloats(packedCount);
+         packGemmWeights(packedWeights, alignedWeights, outputs, gemmK, gemmK);
+      }
+
+      packedBias = allocFloats(panels*GEMM_NR, true);
+      if (alignedBias)
+         memcpy(packedBias, alignedBias, outputs*sizeof(float));
+
+      allocGemmBuffers();
+   }
+
+   void setGemmSizes()
+   {
+      if (quantRange>0)
+      {
+         inputsInt8 = (inputs + 3) & ~3;
+         inputScale = 127.0f/quantRange;
+         gemmK = filterX*filterY*inputsInt8;
+         gemmMaxRows = GEMM_ROW_BUDGET/gemmK;
       }
+      else
+      {
+         gemmK = filterX*filterY*inputs;
+         gemmKc = gemmK <= GEMM_KC*3/2 ? gemmK : GEMM_KC;
+         gemmKStride = (gemmKc + 3) & ~3;
+         gemmMaxRows = GEMM_ROW_BUDGET/(gemmKStride*sizeof(float));
+      }
+      gemmMaxRows = std::max(GEMM_MR, std::min(GEMM_MAX_ROWS, gemmMaxRows)) & ~(GEMM_MR-1);
+   }
 
+   // Per-worker rows for the im2col copy, or for 1x1 (where rows are read straight from the
+   //  input) the zeros the padding points at
+   void allocGemmBuffers()
+   {
+      int rowSize = quantRange>0 ? gemmK/4 : gemmKStride;
       if (is1x1)
+         gemmZeros = allocFloats(quantRange>0 ? gemmK/4 : gemmK, true);
+      else
+         allocWorkerFloats(srcBuffers, gemmMaxRows*rowSize);
+      if (packedHalf)
+         allocWorkerFloats(panelBuffers, gemmKc*GEMM_NR);
+   }
+
+   // Each output gets its own weight scale, from its largest weight.  The weights are laid
+   //  out over the padded inputs, to match inputInt8.
+   void createInt8Weights()
+   {
+      setGemmSizes();
+      int filters = filterX*filterY;
+
+      weightsInt8 = new Tensor(Int8, Shape4(outputs, filterY, filterX, inputsInt8));
+      signed char *q = (signed char *)weightsInt8->cpuWrite();
+      memset(q, 0, weightsInt8->getByteCount());
+
+      int panels = gemmPanelCount(outputs);
+      packedScale = allocFloats(panels*GEMM_NR, true);
+      packedBias = allocFloats(panels*GEMM_NR, true);
+      if (alignedBias)
+         memcpy(packedBias, alignedBias, outputs*sizeof(float));
+
+      for(int o=0;o<outputs;o++)
       {
-         if (!is1x1Aligned)
-         {
-            int wBytes = weights->elementCount * sizeof(float);
+         const float *w = alignedWeights + o*filters*inputs;
+         float maxW = 0;
+         for(int i=0;i<filters*inputs;i++)
+            maxW = std::max(maxW, fabsf(w[i]));
+         float weightScale = maxW>0 ? 127.0f/maxW : 1.0f;
+         for(int f=0;f<filters;f++)
+            quantizeInt8(q + (o*filters + f)*inputsInt8, w + f*inputs, inputs, weightScale);
+         packedScale[o] = 1.0f/(inputScale*weightScale);
+      }
 
-            for(int i=1;i<4;i++)
-            {
-               float *buffer = allocFloats( weights->elementCount - i);
-               memcpy(buffer, weights->cpuRead() + sizeof(float)*i, wBytes - sizeof(float)*i);
-               srcBuffers.push_back(buffer);
-            }
-         }
+      packedInt8 = (signed char *)allocFloats(panels*GEMM_NR*gemmK/4);
+      packGemmWeightsInt8(packedInt8, q, outputs, gemmK, gemmK);
+
+      allocGemmBuffers();
+   }
+
+   bool getCompiled(CompiledWeights &outWeights)
+   {
+      if (!gemmWeights || weightsChanged)
+         return false;
+
+      int padded = gemmPanelCount(outputs)*GEMM_NR;
+      outWeights.setWeights(weights, bias);
+      if (quantRange>0)
+      {
+         outWeights.algo = "int8";
+         outWeights.range = quantRange;
+         outWeights.addPacked(Int8, padded*gemmK, packedInt8);
+         outWeights.addPacked(Float32, padded, packedScale);
+      }
+      else if (packedHalf)
+      {
+         outWeights.algo = "gemm16";
+         outWeights.addPacked(UInt16, padded*gemmK, packedHalf);
       }
       else
       {
-         int threads = GetWorkerCount();
-         int FX = isDeconvolution ? filterX/strideX : filterX;
-         int FY = isDeconvolution ? filterY/strideY : filterY;
-         int paddedSize = (FX*FY*inputs + 3) & ~0x3;
-         for(int i=0;i<threads;i++)
-         {
-            srcBuffers.push_back( allocFloats(paddedSize,true) );
-            if (diSize)
-               diBuffers.push_back( (float *)allocFloats(diSize) );
-         }
+         outWeights.algo = "gemm";
+         outWeights.addPacked(Float32, padded*gemmK, packedWeights);
       }
+      outWeights.addPacked(Float32, padded, packedBias);
+      return true;
+   }
 
-      #ifdef FLAT_WEIGHTS
-      if (isDeconvolution)
-         createDeconvWeights();
-      #endif
+   // The packed weights point into the compiled tensors, so only the work buffers are made
+   bool setCompiled(const CompiledWeights &inWeights)
+   {
+      bool int8 = inWeights.algo=="int8";
+      bool half = inWeights.algo=="gemm16";
+      if (!gemmWeights || !fitsCompiled(inWeights) || !(int8 || half || inWeights.algo=="gemm") ||
+            inWeights.packed.size()!=(int8 ? 3 : 2))
+         return false;
+      if (int8 && (inWeights.range<=0 || filterX*filterY*((inputs+3)&~3) > GEMM_INT8_MAX_K))
+         return false;
+
+      float oldRange = quantRange;
+      quantRange = int8 ? inWeights.range : 0;
+      setGemmSizes();
+
+      int padded = gemmPanelCount(outputs)*GEMM_NR;
+      const void *w = inWeights.getPacked(0, int8 ? Int8 : half ? UInt16 : Float32, padded*gemmK);
+      const void *scale = int8 ? inWeights.getPacked(1, Float32, padded) : 0;
+      const void *b = inWeights.getPacked(int8 ? 2 : 1, Float32, padded);
+      if (!w || !b || (int8 && !scale))
+      {
+         quantRange = oldRange;
+         return false;
+      }
+
+      releaseWeights();
+      holdCompiled(inWeights);
+      halfWeights = half;
+      packedInt8 = int8 ? (signed char *)w : 0;
+      packedHalf = half ? (unsigned short *)w : 0;
+      packedWeights = !int8 && !half ? (float *)w : 0;
+      packedScale = (float *)scale;
+      packedBias = (float *)b;
+      allocGemmBuffers();
+      weightsChanged = false;
+      return true;
+   }
 
-      if (interlacedWeights)
-         createInterlacedWeights();
+   // Split the output into jobs of gemmRows pixels x (outputs/gemmGroups) channels.
+   // Small images get fewer pixels per job, then the channels are split too, so
+   //  all the workers get something to do.
+   void setGemmJobs()
+   {
+      int pixels = batch*destW*destH;
+      int workers = GetWorkerCount();
+      int rows = ((pixels + workers*2-1)/(workers*2) + GEMM_MR-1) & ~(GEMM_MR-1);
+      int maxRows = gemmMaxRows;
+      if (blockLimit)
+         maxRows = std::max(GEMM_MR, std::min(maxRows, blockLimit & ~(GEMM_MR-1)));
+      gemmRows = std::max(GEMM_MR*4, std::min(maxRows, rows));
+      gemmRows = std::min(gemmRows, maxRows);
+
+      int chunks = (pixels + gemmRows-1)/gemmRows;
+      // A fused pool job is a pooled row, done in blocks of gemmRows
+      if (fusePool)
+      {
+         gemmRows = maxRows;
+         chunks = batch*poolH;
+      }
+      int panels = gemmPanelCount(outputs);
+      gemmGroups = 1;
+      // Keep at least 2 panels per group, so the im2col copy is shared.
+      // 1x1 has no copy, so can go down to single panels.
+      int minPanels = is1x1 ? 1 : 2;
+      while(chunks*gemmGroups < workers*2 && gemmGroups*2 <= panels/minPanels)
+         gemmGroups *= 2;
    }
 
    void createDeconvWeights()
@@ -421,78 +1036,10 @@ public:
    }
 
 
-   void createInterlacedWeights()
-   {
-      if (!alignedBias)
-      {
-         alignedBias = allocFloats(outputs);
-         memset(alignedBias,0,outputs*sizeof(float));
-      }
-      int count = weights->strides[0];
-      int paddedSize = (count + 3) & ~0x3;
-      int odd = count & 0x3;
-      interlacedCount = paddedSize>>2;
-      const float *wSrc = (float *)weights->cpuRead();
-      for(int o=0; o<outputs; o+=4)
-      {
-         float *interlacedBuf = allocFloats( paddedSize * 4, true );
-         float *b = interlacedBuf;
-         const float *w0 = wSrc; wSrc+=count;
-         const float *w1 = wSrc; wSrc+=count;
-         const float *w2 = wSrc; wSrc+=count;
-         const float *w3 = wSrc; wSrc+=count;
-         int fours = count>>2;
-         for(int i=0;i<fours;i++)
-         {
-            *b++ = *w0++;
-            *b++ = *w0++;
-            *b++ = *w0++;
-            *b++ = *w0++;
-
-            *b++ = *w1++;
-            *b++ = *w1++;
-            *b++ = *w1++;
-            *b++ = *w1++;
-
-            *b++ = *w2++;
-            *b++ = *w2++;
-            *b++ = *w2++;
-            *b++ = *w2++;
-
-            *b++ = *w3++;
-            *b++ = *w3++;
-            *b++ = *w3++;
-            *b++ = *w3++;
-         }
-         if (odd)
-         {
-            *b++ = *w0++;
-            *b++ = odd<2 ? 0 : *w0++;
-            *b++ = odd<3 ? 0 : *w0;
-            *b++ = 0;
-
-            *b++ = *w1++;
-            *b++ = odd<2 ? 0 : *w1++;
-            *b++ = odd<3 ? 0 : *w1;
-            *b++ = 0;
-
-            *b++ = *w2++;
-            *b++ = odd<2 ? 0 : *w2++;
-            *b++ = odd<3 ? 0 : *w2;
-            *b++ = 0;
-
-            *b++ = *w3++;
-            *b++ = odd<2 ? 0 : *w3++;
-            *b++ = odd<3 ? 0 : *w3;
-            *b++ = 0;
-         }
-
-         weightBuffers.push_back(interlacedBuf);
-      }
-   }
-
    Tensor *src0;
    Tensor *destTensor;
+   // Image of the batch being run by the per-image paths
+   int    image;
 
    virtual void doRun(Tensor *input, Tensor *output)
    {
@@ -512,7 +1059,30 @@ public:
       */
 
 
-      runThreaded(isDeconvolution);
+      // The gemm treats the batch as one long list of pixels
+      if (gemmWeights)
+      {
+         if (quantRange>0)
+         {
+            Tensor *buffer = Tensor::makeBuffer(inputInt8, src0->imageBatch(), srcW, srcH, inputsInt8, Int8);
+            if (buffer!=inputInt8)
+            {
+               if (inputInt8)
+                  inputInt8->decRef();
+               inputInt8 = buffer;
+            }
+            inputInt8->cpuWrite();
+            quantizing = true;
+            runThreaded();
+            quantizing = false;
+         }
+         setGemmJobs();
+         runThreaded();
+      }
+      else
+         for(image=0; image<batch; image++)
+            runThreaded(isDeconvolution);
+
       src0 = 0;
       destTensor = 0;
       endRun();
@@ -520,123 +1090,49 @@ public:
 
 
 
-   void runThread(int threadId)
-   {
-      if (is1x1)
-         runThread1x1(threadId);
-      else if (isDeconvolution)
-         runThreadMultiDeconv(threadId);
-      else
-         runThreadMulti(threadId);
-   }
-
-   void runThread1x1(int threadId)
+   // The float gemm writes through the epilogue - int8 and the other paths use the separate pass
+   bool doRunFused(Tensor *input, Tensor *output)
    {
-      const float *b = alignedBias;
+      if (!gemmWeights || quantRange>0)
+         return false;
 
-      const float *w0 = alignedWeights;
-      const float *w1 = is1x1Aligned ? w0 : srcBuffers[0];
-      const float *w2 = is1x1Aligned ? w0 : srcBuffers[1];
-      const float *w3 = is1x1Aligned ? w0 : srcBuffers[2];
+      startRun();
+      src0 = input;
+      destTensor = output;
+      src0->cpuRead();
+      destTensor->cpuWritePart();
 
-      while(true)
+      if (fusePool && poolBufferSize < 2*destW*outputs)
       {
-         int y = getNextJob();
-         if (y>=destH)
-            break;
-
-         float *dest = (float *)destTensor->cpuWrite() + destW*outputs*y;
-         if (y<padOy||y-padOy>=srcH)
-         {
-            memset(dest, 0, destW*outputs*sizeof(float));
-            continue;
-         }
-
-         if (padOx)
-         {
-            memset(dest, 0, padOx*outputs*sizeof(float));
-            dest += padOx*outputs;
-            memset(dest + srcW*outputs, 0, (destW-srcW-padOx)*outputs*sizeof(float));
-         }
-
-         const float *src = (const float *)src0->cpuRead() + srcW*inputs*(y-padOy)*strideY;
-
-         for(int x=0;x<srcW;x++)
-         {
-            if (interlacedWeights)
-            {
-               int bid = 0;
-               for(int o=0;o<outputs;o+=4)
-               {
-                  dot4Interlaced(dest, alignedBias+bid*4, weightBuffers[bid], src, interlacedCount, activation);
-                  bid++;
-                  dest+=4;
-               }
-            }
-            else
-            {
-               const float *w;
-               switch( (size_t)src & 0x3 )
-               {
-                  case 0:
-                     w = w0;
-                     for(int o=0;o<outputs;o++)
-                     {
-                        float sum = dot(b?b[o] : 0.0f, w, src, inputs, activation);
-                        *dest++ = sum;
-                        w+=alignedWeightSize;
-                     }
-                     break;
-                  case 1:
-                     w = w3;
-                     for(int o=0;o<outputs;o++)
-                     {
-                        float sum = b?b[o] : 0.0f;
-                        sum += w0[0]*src[0] + w0[1]*src[1] + w0[2]*src[2];
-                        sum = dot(sum, w, src+3, inputs-3, activation);
-                        *dest++ = sum;
-                        w+=alignedWeightSize;
-                     }
-                     break;
-                  case 2:
-                     w = w2;
-                     for(int o=0;o<outputs;o++)
-                     {
-                        float sum = b?b[o] : 0.0f;
-                        sum += w0[0]*src[0] + w0[1]*src[1];
-                        sum = dot(sum, w, src+2, inputs-2, activation);
-                        *dest++ = sum;
-                        w+=alignedWeightSize;
-                     }
-                     break;
-                  case 3:
-                     w = w1;
-                     for(int o=0;o<outputs;o++)
-                     {
-                        float sum = b?b[o] : 0.0f;
-                        sum += w0[0]*src[0];
-                        sum = dot(sum, w, src+1, inputs-1, activation);
-                        *dest++ = sum;
-                        w+=alignedWeightSize;
-                     }
-                     break;
-
-               }
-            }
-            src+=inputs*strideX;
-         }
+         poolBufferSize = 2*destW*outputs;
+         allocWorkerFloats(poolBuffers, poolBufferSize);
       }
-   }
-
-
+      setGemmJobs();
+      runThreaded();
 
+      src0 = 0;
+      destTensor = 0;
+      endRun();
+      return true;
+   }
 
+   void runThread(int threadId)
+   {
+      if (isDeconvolution)
+         runThreadMultiDeconv(threadId);
+      else if (quantizing)
+         runThreadQuantize(threadId);
+      else if (quantRange>0)
+         runThreadGemmInt8(threadId);
+      else
+         runThreadGemm(threadId);
+   }
 
    void runThreadMultiDeconv(int threadId)
    {
+      const OpKernels &kernels = GetKernels();
       const float *b = bias ? (const float *)bias->cpuRead() : 0;
-      const int *srcStride = &src0->strides[0];
-      const int *destStride = &destTensor->strides[0];
+      const int *srcStride = src0->imageStrides();
 
       int FX = filterX/strideX;
       int FY = filterY/strideY;
@@ -647,7 +1143,7 @@ public:
       float *srcPtr = &srcBuffers[threadId][0];
       int filterRow = filterW*sizeof(float);
 
-      const float *sIn = (float *)src0->cpuRead();
+      const float *sIn = (float *)src0->cpuRead() + image*srcH*srcW*inputs;
 
       /*
         
@@ -676,7 +1172,7 @@ public:
 
       //printf("%d...%d , %d...%d\n", srcX0, srcX1, srcY0, srcY1);
 
-      float *dest0 = (float *)destTensor->cpuWrite();
+      float *dest0 = (float *)destTensor->cpuWrite() + image*destH*destW*outputs;
 
       while(true)
       {
@@ -779,7 +1275,7 @@ public:
 
                   for(int o=0;o<outputs;o++)
                   {
-                     float sum = dot(b?b[o]:0.0f, w, srcPtr, featureSize, activation);
+                     float sum = kernels.dot(b?b[o]:0.0f, w, srcPtr, featureSize, activation);
                      *dest++ = sum;
                      w+=alignedWeightSize;
                   }
@@ -824,348 +1320,711 @@ public:
 
 
 
-   void runThreadMulti(int threadId)
+   // Fill 'count' im2col rows, starting at output pixel p0, with the part of
+   //  the filter from k0 to k0+kc.  Pixels run on from one image of the batch to the next.
+   // The source is the float input, or its int8 copy, with 'channels' per pixel.
+   template<typename T>
+   void im2col(T *outRows, int outStride, const T *inSrc, const int *srcStride, int channels,
+               int p0, int count, int k0, int kc)
    {
-      const float *b = bias ? (const float *)bias->cpuRead() : 0;
-      const int *srcStride = &src0->strides[0];
-      const int *destStride = &destTensor->strides[0];
-      float *di = pweights ? &diBuffers[threadId][0] : 0;
-
-      int filters = filterX*filterY;
-      int featureSize = filters*inputs;
-
-      int filterW = filterX*inputs;
-      int filterFours = filterW>>2;
-      int filterSixteens = filterW>>4;
-      float *srcPtr = &srcBuffers[threadId][0];
-      int filterRow = filterW*sizeof(float);
-
-      const float *sIn = (float *)src0->cpuRead();
-
-      while(true)
+      int imageSize = srcH*srcW*channels;
+      int filterW = filterX*channels;
+      int k1 = k0+kc;
+      int fyStart = k0/filterW;
+      int fyEnd = (k1 + filterW-1)/filterW;
+
+      int n = p0/(destW*destH);
+      int y = p0/destW - n*destH;
+      int x = p0 % destW;
+      const T *sIn = inSrc + n*imageSize;
+      for(int r=0;r<count;r++)
       {
-         int y = getNextJob();
-         if (y>=destH)
-            break;
-
+         T *row = outRows + r*outStride - k0;
+         int srcFy0 = y*strideY-padOy;
+         int srcFx0 = x*strideX-padOx;
 
-         float *dest = (float *)destTensor->cpuWrite() + destW*outputs*y;
+         // Valid filter positions, as offsets into a filter row
+         int valid0 = std::max(-srcFx0,0)*channels;
+         int valid1 = (std::min(srcW,srcFx0+filterX)-srcFx0)*channels;
+         const T *srcRow = sIn + srcFy0*srcStride[0] + srcFx0*srcStride[1];
 
-         // Unclipped filter position
-            // Use bit shift to preserve sign
-         int srcFy0 = y*strideY-padOy;
+         for(int fy=fyStart;fy<fyEnd;fy++)
+         {
+            int rowK = fy*filterW;
+            int a = std::max(k0,rowK) - rowK;
+            int b = std::min(k1,rowK+filterW) - rowK;
+            int sy = srcFy0 + fy;
+
+            int va = std::max(a,valid0);
+            int vb = std::min(b,valid1);
+            if (sy<0 || sy>=srcH || va>=vb)
+               va = vb = b;
+
+            T *fill = row + rowK;
+            if (va>a)
+               memset(fill+a, 0, (va-a)*sizeof(T));
+            if (vb>va)
+               memcpy(fill+va, srcRow + fy*srcStride[0] + va, (vb-va)*sizeof(T));
+            if (b>vb)
+               memset(fill+vb, 0, (b-vb)*sizeof(T));
+         }
 
-         // First valid filter position
-         int fy0 = std::max(-srcFy0,0);
-         // Last valid filter position
-         int fy1 = std::min(srcH,srcFy0+filterY)-srcFy0;
+         if (++x==destW)
+         {
+            x = 0;
+            if (++y==destH)
+            {
+               y = 0;
+               sIn += imageSize;
+            }
+         }
+      }
+   }
 
-         if (fy0>0)
-            memset(srcPtr,0,fy0*filterRow);
 
-         if (fy1<filterY)
-            memset(srcPtr+fy1*filterW,0,filterRow*(filterY-fy1) );
+   // A 1x1 filter needs no im2col - the rows are the input pixels, and padding reads zeros
+   template<typename T>
+   void pixelRows(const T **outRows, const T *inSrc, const int *srcStride, int channels, int p0, int count)
+   {
+      int imageSize = srcH*srcW*channels;
 
+      int n = p0/(destW*destH);
+      int y = p0/destW - n*destH;
+      int x = p0 % destW;
+      const T *sIn = inSrc + n*imageSize;
+      for(int r=0;r<count;r++)
+      {
+         int sy = y*strideY-padOy;
+         int sx = x*strideX-padOx;
+         if (sy<0 || sy>=srcH || sx<0 || sx>=srcW)
+            outRows[r] = (const T *)gemmZeros;
+         else
+            outRows[r] = sIn + sy*srcStride[0] + sx*srcStride[1];
 
-         for(int x=0;x<destW;x++)
+         if (++x==destW)
          {
-            // Unclipped filter position
-            // Use bit shift to preserve sign
-            int srcFx0 = x*strideX-padOx;
-            //if (y==0) printf(" fx0(%d) %d : %d\n", padOx, x, srcFx0);
+            x = 0;
+            if (++y==destH)
+            {
+               y = 0;
+               sIn += imageSize;
+            }
+         }
+      }
+   }
 
-            // First valid filter position
-            int fx0 = std::max(-srcFx0,0);
-            // Last valid filter position
-            int fx1 = std::min(srcW,srcFx0+filterX)-srcFx0;
 
-            int xElems = (fx1-fx0)*inputs;
+   // Rows of the input to int8, with zeros in the padding channels
+   void runThreadQuantize(int threadId)
+   {
+      const int *srcStride = src0->imageStrides();
+      const float *sIn = (const float *)src0->cpuRead();
+      signed char *qOut = (signed char *)inputInt8->cpuWrite();
+      int rows = batch*srcH;
 
-            const float *copySrcFrom = sIn + (srcFy0+fy0)*srcStride[0] + (srcFx0+fx0)*srcStride[1];
+      while(true)
+      {
+         int row = getNextJob();
+         if (row>=rows)
+            break;
 
-            for(int fy=fy0;fy<fy1;fy++)
+         int n = row/srcH;
+         const float *s = sIn + n*srcH*srcW*inputs + (row - n*srcH)*srcStride[0];
+         signed char *q = qOut + row*srcW*inputsInt8;
+         if (inputsInt8==inputs && srcStride[1]==inputs)
+            quantizeInt8(q, s, srcW*inputs, inputScale);
+         else
+            for(int x=0;x<srcW;x++)
             {
-               float *srcBuffFill = srcPtr + fy*filterW;
+               quantizeInt8(q, s + x*srcStride[1], inputs, inputScale);
+               memset(q+inputs, 0, inputsInt8-inputs);
+               q += inputsInt8;
+            }
+      }
+   }
 
-               if (fx0>0)
-               {
-                  memset(srcBuffFill, 0, fx0*inputs*sizeof(float));
-                  srcBuffFill +=fx0*inputs;
-               }
 
-               memcpy(srcBuffFill, copySrcFrom, xElems*sizeof(float));
-               //if (x==1 && y==1)
-               //   printf(" -> %f %f\n", srcBuffFill[0], srcBuffFill[1]);
-               copySrcFrom+= srcStride[0];
+   // The gemm for pixels [p0,p0+count) and panels [panel0,panel1), into pixels destStride apart
+   void gemmBlock(int threadId, int p0, int count, int panel0, int panel1, float *dest, int destStride)
+   {
+      const OpKernels &kernels = GetKernels();
+      float *rows = is1x1 ? 0 : srcBuffers[threadId];
+      const float *pixels1x1[GEMM_MAX_ROWS];
+      const float *sIn = (const float *)src0->cpuRead();
+      const int *srcStride = src0->imageStrides();
+      const float *rowPtr[GEMM_MR];
 
-               if (fx1<filterX)
-                  memset(srcBuffFill + xElems, 0, (filterX-fx1)*inputs*sizeof(float));
-            }
+      if (is1x1)
+         pixelRows(pixels1x1, sIn, srcStride, inputs, p0, count);
 
-            if (pweights)
-            {
-               const float *dw = alignedWeights;
-               for(int d=0;d<diSize;d++)
-               {
-                  int srcOff = d; // todo - depth_multiplier > 1
-                  di[d] = dotSkip(dw, srcPtr+srcOff, filters, inputs);
-                  dw+=filters;
-               }
+      for(int k0=0; k0<gemmK; k0+=gemmKc)
+      {
+         int kc = std::min(gemmKc, gemmK-k0);
+         Activation act = k0+kc>=gemmK ? activation : actLinear;
 
-               const float *w = (const float *)pweights->cpuRead();
-               for(int o=0;o<outputs;o++)
+         if (!is1x1)
+            im2col(rows, gemmKStride, sIn, srcStride, inputs, p0, count, k0, kc);
+
+         for(int p=panel0;p<panel1;p++)
+         {
+            const float *panel = 0;
+            const unsigned short *halfPanel = 0;
+            if (packedHalf)
+            {
+               halfPanel = packedHalf + p*GEMM_NR*gemmK + k0*GEMM_NR;
+               if (!kernels.gemmF16)
                {
-                  float sum = dot(b?b[o]:0.0f, w, di, diSize, activation);
-                  *dest++ = sum;
-                  w+=diSize;
+                  kernels.halfToFloat(panelBuffers[threadId], halfPanel, kc*GEMM_NR);
+                  panel = panelBuffers[threadId];
+                  halfPanel = 0;
                }
             }
             else
+               panel = packedWeights + p*GEMM_NR*gemmK + k0*GEMM_NR;
+            int cols = std::min(GEMM_NR, outputs-p*GEMM_NR);
+
+            for(int m=0;m<count;m+=GEMM_MR)
             {
-               const float *w = alignedWeights;
-               if (interlacedWeights)
-               {
-                  int bid = 0;
-                  for(int o=0;o<outputs;o+=4)
-                  {
-                     dot4Interlaced(dest, alignedBias+bid*4, weightBuffers[bid], srcPtr, interlacedCount, activation);
-                     bid++;
-                     dest+=4;
-                  }
-               }
+               int mr = std::min(GEMM_MR, count-m);
+               if (is1x1)
+                  for(int r=0;r<GEMM_MR;r++)
+                     rowPtr[r] = pixels1x1[m + (r<mr ? r : 0)] + k0;
                else
-               {
-                  for(int o=0;o<outputs;o++)
-                  {
-                     float sum = dot(b?b[o]:0.0f, w, srcPtr, featureSize, activation);
-                     *dest++ = sum;
-                     w+=alignedWeightSize;
-                  }
-               }
+                  for(int r=0;r<GEMM_MR;r++)
+                     rowPtr[r] = rows + (m + (r<mr ? r : 0))*gemmKStride;
+
+               if (halfPanel)
+                  kernels.gemmF16(dest + m*destStride + p*GEMM_NR, destStride, rowPtr, halfPanel, kc,
+                                  packedBias + p*GEMM_NR, k0>0, act, mr, cols);
+               else
+                  kernels.gemm(dest + m*destStride + p*GEMM_NR, destStride, rowPtr, panel, kc,
+                               packedBias + p*GEMM_NR, k0>0, act, mr, cols);
             }
          }
       }
    }
-};
 
+   void runThreadGemm(int threadId)
+   {
+      float *dOut = (float *)destTensor->cpuWritePart();
+      const float *res = residual ? (const float *)residual->cpuRead() : 0;
 
-#define NUMERIX_WINOGRAD
-#ifdef NUMERIX_WINOGRAD
+      int pixels = batch*destW*destH;
+      int chunks = fusePool ? batch*poolH : (pixels + gemmRows-1)/gemmRows;
+      int panels = gemmPanelCount(outputs);
+      int groupPanels = (panels + gemmGroups-1)/gemmGroups;
 
-/*
- 
- Winograd transform taken from 'nnpack':
-
-Copyright (c) 2017 Facebook Inc.
-Copyright (c) 2015-2017, Georgia Institute of Technology
-All rights reserved.
-
-Redistribution and use in source and binary forms, with or without
-modification, are permitted provided that the following conditions are met:
-
-* Redistributions of source code must retain the above copyright notice, this
-  list of conditions and the following disclaimer.
-
-* Redistributions in binary form must reproduce the above copyright notice,
-  this list of conditions and the following disclaimer in the documentation
-  and/or other materials provided with the distribution.
-
-THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
-AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
-IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
-DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
-FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
-DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
-SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
-CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
-OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
-OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-*/
+      while(true)
+      {
+         int job = getNextJob();
+         if (job>=chunks*gemmGroups)
+            break;
 
+         int chunk = job/gemmGroups;
+         int group = job - chunk*gemmGroups;
+         int panel0 = group*groupPanels;
+         int panel1 = std::min(panels, panel0+groupPanels);
+         int c0 = panel0*GEMM_NR;
+         int c1 = std::min(outputs, panel1*GEMM_NR);
 
-class Conv2DWinograd : public Conv2DBase
-{
-   std::vector <float *> srcBuffers;
-   std::vector <float *> scratchBuffer;
-   float *transformWeights;
-   float *biasPtr;
+         if (fusePool)
+         {
+            // One pooled row, from the one or two result rows kept in poolBuffers
+            int image = chunk/poolH;
+            int y = chunk - image*poolH;
+            int r0 = 2*y;
+            int r1 = std::min(2*y+1, destH-1);
+            int p0 = (image*destH + r0)*destW;
+            int count = (r1-r0+1)*destW;
+            float *rows = poolBuffers[threadId];
+            for(int s=0;s<count;s+=gemmRows)
+               gemmBlock(threadId, p0+s, std::min(gemmRows,count-s), panel0, panel1, rows + s*outputs, outputs);
+            if (res)
+               addResidual(rows, outputs, res + p0*outputs, outputs, count, c0, c1, sumActivation);
+            poolRow(dOut + chunk*poolW*outStride, outStride, rows, rows + (r1-r0)*destW*outputs, outputs,
+                    destW, poolW, c0, c1);
+         }
+         else
+         {
+            int p0 = chunk*gemmRows;
+            int count = std::min(gemmRows, pixels-p0);
+            float *dest = dOut + p0*outStride;
+            gemmBlock(threadId, p0, count, panel0, panel1, dest, outStride);
+            if (res)
+               addResidual(dest, outStride, res + p0*outputs, outputs, count, c0, c1, sumActivation);
+         }
+      }
+   }
 
 
-public:
-   Conv2DWinograd(int inStrideY, int inStrideX,
-          Activation inActivation, Padding inPadding,
-          Tensor *inWeights, Tensor *inBias)
-      : Conv2DBase(inStrideY, inStrideX, false,inActivation, inPadding,  inWeights, 0, inBias)
+   // As runThreadGemm, from inputInt8, with all of k in one pass
+   void runThreadGemmInt8(int threadId)
    {
-      //printf("winograd!\n");
-      rebuildWeights();
-   }
+      const OpKernels &kernels = GetKernels();
+      signed char *rows = is1x1 ? 0 : (signed char *)srcBuffers[threadId];
+      const signed char *pixels1x1[GEMM_MAX_ROWS];
+      float *dOut = (float *)destTensor->cpuWrite();
+      const signed char *sIn = (const signed char *)inputInt8->cpuRead();
+      int srcStride[2] = { srcW*inputsInt8, inputsInt8 };
+
+      int pixels = batch*destW*destH;
+      int chunks = (pixels + gemmRows-1)/gemmRows;
+      int panels = gemmPanelCount(outputs);
+      int groupPanels = (panels + gemmGroups-1)/gemmGroups;
+      const signed char *rowPtr[GEMM_MR];
 
-   static void TransKernel(const float *src0, const float *src1, const float *src2,
-      float *t0,
-      float *t1,
-      float *t2,
-      float *t3,
-      float *t4,
-      float *t5,
-      float *t6,
-      float *t7,
-      bool rescale_coefficients)
-   {
-      const psimd_f32 g0(src0);
-      const psimd_f32 g1(src1);
-      const psimd_f32 g2(src2);
-      /*
-       * w0 = g0
-       * w1 = ((g0 + g2) + g1) * (-2.0 / 9)
-       * w2 = ((g0 + g2) - g1) * (-2.0 / 9)
-       * w3 = ((g0 + 4 * g2) + 2 * g1) * (1.0 / 90)
-       * w4 = ((g0 + 4 * g2) - 2 * g1) * (1.0 / 90)
-       * w5 = ((g2 + 4 * g0) + 2 * g1) * (1.0 / 180)
-       * w6 = ((g2 + 4 * g0) - 2 * g1) * (1.0 / 180)
-       * w7 = g2
-       */
+      while(true)
+      {
+         int job = getNextJob();
+         if (job>=chunks*gemmGroups)
+            break;
 
-      /*
-       * Compute
-       *   w2 := g0 + g2
-       *   w4 := g0 + 4 * g2
-       *   w6 := g2 + 4 * g0
-       */
-      const psimd_f32 const_4 = psimd_splat_f32(4.0f);
-      psimd_f32 w2 = g0 + g2;
-      psimd_f32 w4 = g0 + const_4 * g2;
-      psimd_f32 w6 = g2 + const_4 * g0;
+         int chunk = job/gemmGroups;
+         int group = job - chunk*gemmGroups;
+         int p0 = chunk*gemmRows;
+         int count = std::min(gemmRows, pixels-p0);
+         int panel0 = group*groupPanels;
+         int panel1 = std::min(panels, panel0+groupPanels);
 
-      /*
-       * Compute
-       *   w1 = (g0 + g2) + g1
-       *   w2 = (g0 + g2) - g1
-       *   w3 = (g0 + 4 * g2) + 2 * g1
-       *   w4 = (g0 + 4 * g2) - 2 * g1
-       *   w5 = (g2 + 4 * g0) + 2 * g1
-       *   w6 = (g2 + 4 * g0) - 2 * g1
-       */
-      const psimd_f32 two_g1 = g1 * psimd_splat_f32(2.0f);
-      psimd_f32 w1 = w2 + g1;
-      w2 = w2 - g1;
-      psimd_f32 w3 = w4 + two_g1;
-      w4 = w4 - two_g1;
-      psimd_f32 w5 = w6 + two_g1;
-      w6 = w6 - two_g1;
-
-      if (rescale_coefficients) {
-         //const psimd_f32 minus_2_over_9 = psimd_splat_f32(-0x1.C71C72p-3f);
-         const psimd_f32 minus_2_over_9 = psimd_splat_f32(-0.2222222222222222f);
-         w1 *= minus_2_over_9;
-         w2 *= minus_2_over_9;
-
-         //const psimd_f32 rcp_90 = psimd_splat_f32( 0x1.6C16C2p-7f);
-         const psimd_f32 rcp_90 = psimd_splat_f32( 0.01111111111111f );
-         w3 *= rcp_90;
-         w4 *= rcp_90;
-
-         //const psimd_f32 rcp_180 = psimd_splat_f32( 0x1.6C16C2p-8f);
-         const psimd_f32 rcp_180 = psimd_splat_f32( 0.00555555555556f);
-         w5 *= rcp_180;
-         w6 *= rcp_180;
-      }
+         float *dest = dOut + p0*outputs;
+         if (is1x1)
+            pixelRows(pixels1x1, sIn, srcStride, inputsInt8, p0, count);
+         else
+            im2col(rows, gemmK, sIn, srcStride, inputsInt8, p0, count, 0, gemmK);
+
+         for(int p=panel0;p<panel1;p++)
+         {
+            const signed char *panel = packedInt8 + p*GEMM_NR*gemmK;
+            int cols = std::min(GEMM_NR, outputs-p*GEMM_NR);
+
+            for(int m=0;m<count;m+=GEMM_MR)
+            {
+               int mr = std::min(GEMM_MR, count-m);
+               for(int r=0;r<GEMM_MR;r++)
+                  rowPtr[r] = is1x1 ? pixels1x1[m + (r<mr ? r : 0)] : rows + (m + (r<mr ? r : 0))*gemmK;
 
-      psimd_f32_store(t0, g0);
-      psimd_f32_store(t1, w1);
-      psimd_f32_store(t2, w2);
-      psimd_f32_store(t3, w3);
-      psimd_f32_store(t4, w4);
-      psimd_f32_store(t5, w5);
-      psimd_f32_store(t6, w6);
-      psimd_f32_store(t7, g2);
+               kernels.gemmInt8(dest + m*outputs + p*GEMM_NR, outputs, rowPtr, panel, gemmK,
+                                packedScale + p*GEMM_NR, packedBias + p*GEMM_NR, activation, mr, cols);
+            }
+         }
+      }
    }
+};
+
 
 
+// -- Conv2DSeparable -----------------------
+//
+// The depthwise filter reads the NHWC input directly, one vector of channels per filter tap,
+//  into a block of rows which the packed gemm then multiplies by the pointwise weights.
+
+class Conv2DSeparable : public Conv2DBase
+{
+   // [fy][fx][diSize]
+   float      *depthWeights;
+   float      *packedWeights;
+   float      *packedBias;
+   int        gemmKc;
+   int        rowStride;
+   int        maxRows;
+   int        jobRows;
+   std::vector <float *> rowBuffers;
+
+public:
+   Conv2DSeparable(int inStrideY, int inStrideX,
+          Activation inActivation, Padding inPadding,
+          Tensor *inWeights, Tensor *inPWeights, Tensor *inBias)
+      : Conv2DBase(inStrideY, inStrideX, false, inActivation, inPadding, inWeights, inPWeights, inBias)
+   {
+      depthWeights = 0;
+      packedWeights = 0;
+      packedBias = 0;
+      gemmKc = rowStride = maxRows = jobRows = 0;
+      weightsChanged = true;
+   }
 
    void rebuildWeights()
    {
       releaseFloats();
+      rowBuffers.resize(0);
 
-      srcBuffers.resize(0);
-      scratchBuffer.resize(0);
+      // [d][fy][fx] -> [fy][fx][d]
+      int filters = filterX*filterY;
+      const float *dw = (const float *)weights->cpuRead();
+      depthWeights = allocFloats(filters*diSize);
+      for(int d=0;d<diSize;d++)
+         for(int f=0;f<filters;f++)
+            depthWeights[f*diSize + d] = dw[d*filters + f];
 
-      int threads = GetWorkerCount();
+      int panels = gemmPanelCount(outputs);
+      packedWeights = allocFloats(panels*GEMM_NR*diSize);
+      packGemmWeights(packedWeights, (const float *)pweights->cpuRead(), outputs, diSize, diSize);
 
-      for(int i=0;i<threads;i++)
-      {
-         srcBuffers.push_back( allocFloats(8*8*inputs,false) );
-         scratchBuffer.push_back( allocFloats(8*8*4,false) );
-      }
+      packedBias = allocFloats(panels*GEMM_NR, true);
+      if (bias)
+         memcpy(packedBias, bias->cpuRead(), outputs*sizeof(float));
 
+      gemmKc = diSize <= GEMM_KC*3/2 ? diSize : GEMM_KC;
+      rowStride = (diSize + 3) & ~3;
+      maxRows = GEMM_ROW_BUDGET/(rowStride*sizeof(float));
+      maxRows = std::max(GEMM_MR, std::min(GEMM_MAX_ROWS, maxRows)) & ~(GEMM_MR-1);
+      allocWorkerFloats(rowBuffers, maxRows*rowStride);
+   }
 
-      // Transform O*3*3*I weights into
-      //
-      // (O/4)*8*8*I4o winograd coeffs...
+   Tensor *src0;
+   Tensor *destTensor;
 
-      // Interlace 4 outputs ...
-      /*
-       W 0:3   0,0                     0,1                 ...  7,7
-       w0: i0 i1 i2 i3             w0: i4 i5 i6 i7
-          w1: i0 i1 i2 i3           w1: i4 i5 i6 i7
-             w2: i0 i1 i2 i3          w2: i4 i5 i6 i7
-                w3: i0 i1 i2 i3         w3: i4 i5 i6 i7
+   virtual void doRun(Tensor *input, Tensor *output)
+   {
+      startRun();
+      src0 = input;
+      destTensor = output;
+      src0->cpuRead();
+      destTensor->cpuWrite();
 
-       W 4:7   0,0                     0,1                 ...  7,7
+      // The depthwise rows are not shared between jobs, so only split over pixels
+      int pixels = batch*destW*destH;
+      int workers = GetWorkerCount();
+      int rows = ((pixels + workers*2-1)/(workers*2) + GEMM_MR-1) & ~(GEMM_MR-1);
+      jobRows = std::max(GEMM_MR, std::min(maxRows, rows));
 
-       ...
-      */
+      runThreaded();
+      src0 = 0;
+      destTensor = 0;
+      endRun();
+   }
 
+   // Each input channel feeds depthMultiplier consecutive row entries
+   void depthwiseMultiplier(float *dest, const float *const *src, const float *const *w, int taps)
+   {
+      memset(dest, 0, diSize*sizeof(float));
+      for(int t=0;t<taps;t++)
+      {
+         const float *s = src[t];
+         const float *wt = w[t];
+         float *d = dest;
+         for(int c=0;c<inputs;c++)
+         {
+            float val = s[c];
+            for(int m=0;m<depthMultiplier;m++)
+               *d++ += val * *wt++;
+         }
+      }
+   }
 
-      const float *weightIn = (const float *)weights->cpuRead();
-      transformWeights = allocFloats( 8*8*inputs*outputs, true );
+   void runThread(int threadId)
+   {
+      const OpKernels &kernels = GetKernels();
+      float *rows = rowBuffers[threadId];
+      float *dOut = (float *)destTensor->cpuWrite();
+      const int *srcStride = src0->imageStrides();
+      int imageSize = srcH*srcW*inputs;
+
+      int pixels = batch*destW*destH;
+      int chunks = (pixels + jobRows-1)/jobRows;
+      int panels = gemmPanelCount(outputs);
+      std::vector<const float *> tapSrc(filterX*filterY);
+      std::vector<const float *> tapW(filterX*filterY);
+      const float *rowPtr[GEMM_MR];
 
-      // Transform inputs, to (O/4)WHi4o
-      // output stride between pixel
-      int os = inputs*4;
-      for(int o=0;o<outputs;o++)
+      while(true)
       {
-         int baseBlock = (o>>2)*8*8*4*inputs;
-         int baseOffset = o&3;
-         for(int inputIdx=0;inputIdx<inputs;inputIdx+=4)
+         int chunk = getNextJob();
+         if (chunk>=chunks)
+            break;
+
+         int p0 = chunk*jobRows;
+         int count = std::min(jobRows, pixels-p0);
+
+         // Depthwise, over the filter taps that land inside the input
+         int n = p0/(destW*destH);
+         int y = p0/destW - n*destH;
+         int x = p0 % destW;
+         const float *sIn = (const float *)src0->cpuRead() + n*imageSize;
+         for(int r=0;r<count;r++)
          {
-            const float *w0 = weightIn + o*3*3*inputs + inputIdx;
-            float *t = scratchBuffer[0];
+            int srcFy0 = y*strideY-padOy;
+            int srcFx0 = x*strideX-padOx;
+            int taps = 0;
+            for(int fy=0;fy<filterY;fy++)
+            {
+               int sy = srcFy0 + fy;
+               if (sy<0 || sy>=srcH)
+                  continue;
+               for(int fx=0;fx<filterX;fx++)
+               {
+                  int sx = srcFx0 + fx;
+                  if (sx<0 || sx>=srcW)
+                     continue;
+                  tapSrc[taps] = sIn + sy*srcStride[0] + sx*srcStride[1];
+                  tapW[taps] = depthWeights + (fy*filterX+fx)*diSize;
+                  taps++;
+               }
+            }
+
+            float *row = rows + r*rowStride;
+            if (depthMultiplier==1)
+               kernels.depthwise(row, &tapSrc[0], &tapW[0], taps, diSize);
+            else
+               depthwiseMultiplier(row, &tapSrc[0], &tapW[0], taps);
 
-            // Trans kernel columns of 4 inputs into scratch buffer
-            for(int col=0;col<3;col++)
+            if (++x==destW)
             {
-               TransKernel(w0, w0+inputs*3, w0+inputs*6, \
-                        t, t+3*4, t+3*4*2, t+3*4*3, t+3*4*4, t+3*4*5, t+3*4*6, t+3*4*7, true);
-               w0 += inputs;
-               t+=4;
+               x = 0;
+               if (++y==destH)
+               {
+                  y = 0;
+                  sIn += imageSize;
+               }
             }
-            // Trans scratch buffer rows to 8*8 lots of 4 inputs and write to interlaced-weights buffer
-            float *w = scratchBuffer[0];
+         }
+
+         // Pointwise
+         float *dest = dOut + p0*outputs;
+         for(int k0=0; k0<diSize; k0+=gemmKc)
+         {
+            int kc = std::min(gemmKc, diSize-k0);
+            Activation act = k0+kc>=diSize ? activation : actLinear;
 
-            float *out = transformWeights + baseBlock + inputIdx*4 + baseOffset*4;
-            for(int row=0;row<8;row++)
+            for(int p=0;p<panels;p++)
             {
-               TransKernel(w, w+4, w+8,
-                           out, out+os, out+os*2, out+os*3, out+os*4, out+os*5, out+os*6, out+os*7, true );
-               w+=3*4;
-               out += os*8;
+               const float *panel = packedWeights + p*GEMM_NR*diSize + k0*GEMM_NR;
+               int cols = std::min(GEMM_NR, outputs-p*GEMM_NR);
+
+               for(int m=0;m<count;m+=GEMM_MR)
+               {
+                  int mr = std::min(GEMM_MR, count-m);
+                  for(int r=0;r<GEMM_MR;r++)
+                     rowPtr[r] = rows + (m + (r<mr ? r : 0))*rowStride + k0;
+
+                  kernels.gemm(dest + m*outputs + p*GEMM_NR, outputs, rowPtr, panel, kc,
+                               packedBias + p*GEMM_NR, k0>0, act, mr, cols);
+               }
             }
          }
       }
+   }
+};
+
+
+#ifdef NUMERIX_SIMD
+#define NUMERIX_WINOGRAD
+#endif
+
+#ifdef NUMERIX_WINOGRAD
+
+
+/*
+ Winograd F(m x m, 3x3).  Each (m+2)x(m+2) tile of input pixels is transformed (B' d B), multiplied
+ by the transformed kernels (G g G') separately at each of the (m+2)^2 tile positions - summing over
+ the inputs, which is a gemm - then transformed back (A' M A) to m x m output pixels.
+
+ Larger tiles need fewer multiplies per output, but have larger coefficients and lose more precision.
+
+ The input and output transforms are kernels (WinoTransform, in Ops.h), run over a block of
+  channels at a time.  G is applied once to the weights, in double precision.
+*/
+template<int M> struct Wino { };
+
+template<> struct Wino<2>
+{
+   static const double G[4*3];
+};
+const double Wino<2>::G[4*3] = {
+     1.0,  0.0, 0.0,
+     0.5,  0.5, 0.5,
+     0.5, -0.5, 0.5,
+     0.0,  0.0, 1.0 };
 
 
+template<> struct Wino<4>
+{
+   static const double G[6*3];
+};
+const double Wino<4>::G[6*3] = {
+     1.0/4,      0.0,      0.0,
+    -1.0/6,  -1.0/6,   -1.0/6,
+    -1.0/6,   1.0/6,   -1.0/6,
+     1.0/24,  1.0/12,   1.0/6,
+     1.0/24, -1.0/12,   1.0/6,
+     0.0,        0.0,      1.0 };
+
+
+// From nnpack, with the kernel coefficients rescaled to keep the inverse simple
+template<> struct Wino<6>
+{
+   static const double G[8*3];
+};
+/*
+ * w0 = g0
+ * w1 = ((g0 + g2) + g1) * (-2.0 / 9)
+ * w2 = ((g0 + g2) - g1) * (-2.0 / 9)
+ * w3 = ((g0 + 4 * g2) + 2 * g1) * (1.0 / 90)
+ * w4 = ((g0 + 4 * g2) - 2 * g1) * (1.0 / 90)
+ * w5 = ((g2 + 4 * g0) + 2 * g1) * (1.0 / 180)
+ * w6 = ((g2 + 4 * g0) - 2 * g1) * (1.0 / 180)
+ * w7 = g2
+ */
+const double Wino<6>::G[8*3] = {
+     1.0,        0.0,        0.0,
+    -2.0/9,     -2.0/9,     -2.0/9,
+    -2.0/9,      2.0/9,     -2.0/9,
+     1.0/90,     2.0/90,     4.0/90,
+     1.0/90,    -2.0/90,     4.0/90,
+     4.0/180,    2.0/180,    1.0/180,
+     4.0/180,   -2.0/180,    1.0/180,
+     0.0,        0.0,        1.0 };
+
+
+
+// Per-thread transformed inputs, and gemm results, for a block of tiles are kept to about this
+#define WINO_INPUT_BUDGET  (1024*1024)
+#define WINO_OUTPUT_BUDGET (512*1024)
+#define WINO_MAX_TILES 64
+// Channels per pass of the tile transforms, so a tile's scratch stays in L1
+#define WINO_CHANNELS 64
+
+static int winogradMaxTiles(int inA, int inInputsPad)
+{
+   int tiles = WINO_INPUT_BUDGET/(inA*inA*inInputsPad*sizeof(float));
+   return std::max(GEMM_MR, std::min(WINO_MAX_TILES, tiles)) & ~(GEMM_MR-1);
+}
+
+/*
+ The transformed weights are (m+2)^2 sets of packed gemm panels, one set per tile position.
+ A job transforms a block of tiles into
+     V[position][tile][inputs]
+ multiplies each position by its weights, for a group of output panels, into
+     M[position][tile][outputs]
+ then inverse-transforms each tile into the destination.
+
+ Input channels are padded to a multiple of 4 in V, and outputs to a whole panel in M, so any
+ channel count works.
+*/
+template<int TILE>
+class Conv2DWinograd : public Conv2DBase
+{
+   static const int A = TILE+2;
+   static const int A2 = A*A;
+
+   int        inputsPad;
+   int        panels;
+   int        gemmKc;
+   int        maxTiles;
+   int        maxGroupPanels;
+   int        tilesX;
+   int        tilesY;
+   int        blockTiles;
+   int        groupPanels;
+   int        groups;
+   float      *transformWeights;
+   float      *biasPad;
+   std::vector <float *> workBuffers;
+
+public:
+   Conv2DWinograd(Activation inActivation, Padding inPadding, Tensor *inWeights, Tensor *inBias)
+      : Conv2DBase(1, 1, false, inActivation, inPadding,  inWeights, 0, inBias)
+   {
+      transformWeights = 0;
+      biasPad = 0;
+      tilesX = tilesY = 0;
+      blockTiles = groupPanels = groups = 0;
+      weightsChanged = true;
+   }
+
+   void rebuildWeights()
+   {
+      releaseFloats();
+      workBuffers.resize(0);
+
+      inputsPad = (inputs + 3) & ~3;
+      panels = gemmPanelCount(outputs);
+      gemmKc = inputs <= GEMM_KC*3/2 ? inputs : GEMM_KC;
+
+      // U = G g G' for each output and input, scattered into the packed panels
+      const float *weightIn = (const float *)weights->cpuRead();
+      const double *G = Wino<TILE>::G;
+      int positionSize = panels*GEMM_NR*inputs;
+      transformWeights = allocFloats( A2*positionSize, true );
+      for(int o=0;o<outputs;o++)
+      {
+         float *panelBase = transformWeights + (o/GEMM_NR)*GEMM_NR*inputs + (o%GEMM_NR);
+         for(int i=0;i<inputs;i++)
+         {
+            const float *g = weightIn + o*9*inputs + i;
+            double gGt[3][A];
+            for(int fy=0;fy<3;fy++)
+               for(int a=0;a<A;a++)
+                  gGt[fy][a] = g[(fy*3)*inputs]*G[a*3] + g[(fy*3+1)*inputs]*G[a*3+1] + g[(fy*3+2)*inputs]*G[a*3+2];
+
+            float *u = panelBase + i*GEMM_NR;
+            for(int ay=0;ay<A;ay++)
+               for(int ax=0;ax<A;ax++)
+                  u[(ay*A+ax)*positionSize] = G[ay*3]*gGt[0][ax] + G[ay*3+1]*gGt[1][ax] + G[ay*3+2]*gGt[2][ax];
+         }
+      }
+
+      biasPad = allocFloats(panels*GEMM_NR, true);
       if (bias)
-         biasPtr = (float *)bias->cpuRead();
-      else
-         biasPtr = allocFloats(outputs,true);
+         memcpy(biasPad, bias->cpuRead(), outputs*sizeof(float));
+
+      allocWorkBuffers();
    }
 
+   void allocWorkBuffers()
+   {
+      maxTiles = winogradMaxTiles(A, inputsPad);
+      maxGroupPanels = WINO_OUTPUT_BUDGET/(A2*maxTiles*GEMM_NR*sizeof(float));
+      maxGroupPanels = std::max(1, std::min(panels, maxGroupPanels));
+
+      // tile gather + V + M + transform scratch
+      allocWorkerFloats(workBuffers, A2*inputsPad + A2*maxTiles*inputsPad + A2*maxTiles*maxGroupPanels*GEMM_NR + A2*WINO_CHANNELS*2);
+   }
+
+   static std::string algoName()
+   {
+      char name[16];
+      sprintf(name, "wino%d", TILE);
+      return name;
+   }
+
+   bool getCompiled(CompiledWeights &outWeights)
+   {
+      if (weightsChanged)
+         return false;
+      outWeights.setWeights(weights, bias);
+      outWeights.algo = algoName();
+      outWeights.addPacked(Float32, A2*panels*GEMM_NR*inputs, transformWeights);
+      outWeights.addPacked(Float32, panels*GEMM_NR, biasPad);
+      return true;
+   }
+
+   bool setCompiled(const CompiledWeights &inWeights)
+   {
+      if (inWeights.algo!=algoName() || !fitsCompiled(inWeights) || inWeights.packed.size()!=2)
+         return false;
+      int count = gemmPanelCount(outputs)*GEMM_NR;
+      const void *u = inWeights.getPacked(0, Float32, A2*count*inputs);
+      const void *b = inWeights.getPacked(1, Float32, count);
+      if (!u || !b)
+         return false;
+
+      releaseFloats();
+      workBuffers.resize(0);
+      holdCompiled(inWeights);
+      inputsPad = (inputs + 3) & ~3;
+      panels = gemmPanelCount(outputs);
+      gemmKc = inputs <= GEMM_KC*3/2 ? inputs : GEMM_KC;
+      transformWeights = (float *)u;
+      biasPad = (float *)b;
+      allocWorkBuffers();
+      weightsChanged = false;
+      return true;
+   }
 
    Tensor *src0;
    Tensor *destTensor;
 
-   // Winograd
    virtual void doRun(Tensor *input, Tensor *output)
    {
       startRun();
@@ -1174,6 +2033,26 @@ public:
       src0->cpuRead();
       destTensor->cpuWrite();
 
+      tilesX = (destW + TILE-1)/TILE;
+      tilesY = (destH + TILE-1)/TILE;
+      int tiles = batch*tilesX*tilesY;
+
+      // Smaller blocks, then output groups, until all the workers have something to do
+      int workers = GetWorkerCount();
+      int perWorker = ((tiles + workers*2-1)/(workers*2) + GEMM_MR-1) & ~(GEMM_MR-1);
+      int limit = maxTiles;
+      if (blockLimit)
+         limit = std::max(GEMM_MR, std::min(limit, blockLimit & ~(GEMM_MR-1)));
+      blockTiles = std::max(GEMM_MR, std::min(limit, perWorker));
+      int blocks = (tiles + blockTiles-1)/blockTiles;
+      groupPanels = maxGroupPanels;
+      groups = (panels + groupPanels-1)/groupPanels;
+      while(blocks*groups < workers*2 && groupPanels>1)
+      {
+         groupPanels = (groupPanels+1)/2;
+         groups = (panels + groupPanels-1)/groupPanels;
+      }
+
       runThreaded();
 
       src0 = 0;
@@ -1181,433 +2060,584 @@ public:
       endRun();
    }
 
-   inline void runTile( float *src, float *dest,
-                        int xCount, int yCount, 
-                        float *scratch)
-   {
-
-      #define TRANS_WINO(i0, i1, i2, i3, i4, i5, i6, i7, \
-                         o0, o1, o2, o3, o4, o5, o6, o7 ) { \
-         psimd_f32 d0(i0); \
-         psimd_f32 d1(i1); \
-         psimd_f32 d2(i2); \
-         psimd_f32 d3(i3); \
-         psimd_f32 d4(i4); \
-         psimd_f32 d5(i5); \
-         psimd_f32 d6(i6); \
-         psimd_f32 d7(i7); \
-         /*  Compute wd0 := d0 - d6  */ \
-         psimd_f32 wd0 = d0 - d6; \
-         const psimd_f32 d4_sub_d2 = d4 - d2; \
-         /*  Compute wd7 := d7 - d1  */ \
-         psimd_f32 wd7 = d7 - d1; \
-         const psimd_f32 d3_sub_d5 = d3 - d5; \
-         /*  Compute wd1 := d2 + d6  */ \
-         psimd_f32 wd1 = d2 + d6; \
-         /*  Compute wd2 := d1 + d5  */ \
-         psimd_f32 wd2 = d1 + d5; \
-         /*  Compute wd4 := d5 + 0.25 * d1  */ \
-         const psimd_f32 const_0_25 = psimd_splat_f32(0.25f); \
-         psimd_f32 wd4 = d5 + const_0_25 * d1; \
-         /*  Compute wd5 := d6 - 5.0 * d4  */ \
-         psimd_f32 wd5 = d6 - psimd_splat_f32(5.0f) * d4; \
-         /*  Compute wd3 := d6 + 0.25 * d2  */ \
-         psimd_f32 wd3 = d6 + const_0_25 * d2; \
-         /*  Compute wd6 := d1 + 0.25 * d5  */ \
-         psimd_f32 wd6 = d1 + const_0_25 * d5; \
- \
-         const psimd_f32 const_5_25 = psimd_splat_f32(5.25f); \
-         /*  Compute wd0 := (d0 - d6) + 5.25 * (d4 - d2)  */ \
-         wd0 += const_5_25 * d4_sub_d2; \
-         /*  Compute wd7 := (d7 - d1) + 5.25 * (d3 - d5)  */ \
-         wd7 += const_5_25 * d3_sub_d5; \
- \
-         const psimd_f32 const_4_25 = psimd_splat_f32(4.25f); \
-         /*  Compute  */ \
-         /*    wd1 := (d6 + d2) - 4.25 * d4  */ \
-         /*    wd2 := (d1 + d5) - 4.25 * d3  */ \
-         wd1 -= const_4_25 * d4; \
-         wd2 -= const_4_25 * d3; \
- \
-         const psimd_f32 const_1_25 = psimd_splat_f32(1.25f); \
-         /*  Compute  */ \
-         /*    wd3 := (d6 + 0.25 * d2) - 1.25 * d4  */ \
-         /*    wd4 := (d5 + 0.25 * d1) - 1.25 * d3  */ \
-         /*    wd6 := (d1 + 0.25 * d5) - 1.25 * d3  */ \
-         /*    wd5 := (d6 - 5.0 * d4) + 4.0 * d2  */ \
-         wd3 -= const_1_25 * d4; \
-         const psimd_f32 d3_times_1_25 = d3 * const_1_25; \
-         wd5 += psimd_splat_f32(4.0f) * d2; \
-         wd4 -= d3_times_1_25; \
-         wd6 -= d3_times_1_25; \
- \
-         const psimd_f32 const_2 = psimd_splat_f32(2.0f); \
-         wd4 *= const_2; \
-         wd6 *= const_2; \
-         psimd_f32_store( o0, wd0 ); \
-         psimd_f32_store( o1, wd1 + wd2 ); \
-         psimd_f32_store( o2, wd1 - wd2 ); \
-         psimd_f32_store( o3, wd3 + wd4 ); \
-         psimd_f32_store( o4, wd3 - wd4 ); \
-         psimd_f32_store( o5, wd5 + wd6 ); \
-         psimd_f32_store( o6, wd5 - wd6 ); \
-         psimd_f32_store( o7, wd7 ); \
+   // Gather a tile of input pixels (zero outside the image, and in the padded channels),
+   //  and transform it into V, a block of channels at a time
+   void transformTile(const OpKernels &kernels, int inTile, float *tile, float *outV, int inPositionStride, float *scratch)
+   {
+      int n = inTile/(tilesX*tilesY);
+      int ty = inTile/tilesX - n*tilesY;
+      int tx = inTile % tilesX;
+      const float *sIn = (const float *)src0->cpuRead() + n*srcH*srcW*inputs;
+      int sy0 = ty*TILE - padOy;
+      int sx0 = tx*TILE - padOx;
+      int x0 = std::max(0,-sx0);
+      int x1 = std::min(srcW-sx0, (int)A);
+
+      for(int y=0;y<A;y++)
+      {
+         float *row = tile + y*A*inputsPad;
+         int sy = sy0 + y;
+         if (sy<0 || sy>=srcH || x0>=x1)
+         {
+            memset(row, 0, A*inputsPad*sizeof(float));
+            continue;
+         }
+         if (x0>0)
+            memset(row, 0, x0*inputsPad*sizeof(float));
+         const float *src = sIn + (sy*srcW + sx0)*inputs;
+         if (inputsPad==inputs)
+            memcpy(row + x0*inputs, src + x0*inputs, (x1-x0)*inputs*sizeof(float));
+         else
+            for(int x=x0;x<x1;x++)
+            {
+               memcpy(row + x*inputsPad, src + x*inputs, inputs*sizeof(float));
+               memset(row + x*inputsPad + inputs, 0, (inputsPad-inputs)*sizeof(float));
+            }
+         if (x1<A)
+            memset(row + x1*inputsPad, 0, (A-x1)*inputsPad*sizeof(float));
       }
 
+      WinoFunc input = kernels.winoInput[TILE/2-1];
+      for(int c=0;c<inputsPad;c+=WINO_CHANNELS)
+      {
+         int channels = std::min(WINO_CHANNELS, inputsPad-c);
+         // Rows, into scratch[y][x][channels]
+         for(int y=0;y<A;y++)
+            input(tile + y*A*inputsPad + c, inputsPad, scratch + y*A*channels, channels, channels);
+         // Columns, into position y*A+x
+         for(int x=0;x<A;x++)
+            input(scratch + x*channels, A*channels, outV + x*inPositionStride + c, A*inPositionStride, channels);
+      }
+   }
 
-      /*
-       * s0 = m0 + (m1 + m2) +      (m3 + m4) + 32 * (m5 + m6)
-       * s1 =      (m1 - m2) +  2 * (m3 - m4) + 16 * (m5 - m6)
-       * s2 =      (m1 + m2) +  4 * (m3 + m4) +  8 * (m5 + m6)
-       * s3 =      (m1 - m2) +  8 * (m3 - m4) +  4 * (m5 - m6)
-       * s4 =      (m1 + m2) + 16 * (m3 + m4) +  2 * (m5 + m6)
-       * s5 =      (m1 - m2) + 32 * (m3 - m4) +      (m5 - m6) + m7
-       */
-      #define TRANS_WINO_INV(i0, i1, i2, i3, i4, i5, i6, i7, \
-                             o0, o1, o2, o3, o4, o5 ) { \
- \
-      psimd_f32 m0(i0); \
-      psimd_f32 m1(i1); \
-      psimd_f32 m2(i2); \
-      psimd_f32 m3(i3); \
-      psimd_f32 m4(i4); \
-      psimd_f32 m5(i5); \
-      psimd_f32 m6(i6); \
-      psimd_f32 m7(i7); \
- \
-      const psimd_f32 m1_add_m2 = m1 + m2; \
-      const psimd_f32 m1_sub_m2 = m1 - m2; \
-      const psimd_f32 m3_add_m4 = m3 + m4; \
-      const psimd_f32 m3_sub_m4 = m3 - m4; \
-      const psimd_f32 m5_add_m6 = m5 + m6; \
-      const psimd_f32 m5_sub_m6 = m5 - m6; \
- \
-      psimd_f32 s0 = m0 + m1_add_m2; \
-      psimd_f32 s5 = m7 + m1_sub_m2; \
- \
-      const psimd_f32 const_16 = psimd_splat_f32(16.0f); \
-      psimd_f32 s1 = m1_sub_m2 + const_16 * m5_sub_m6; \
-      psimd_f32 s4 = m1_add_m2 + const_16 * m3_add_m4; \
- \
-      const psimd_f32 const_8 = psimd_splat_f32(8.0f); \
-      psimd_f32 s2 = m1_add_m2 + const_8 * m5_add_m6; \
-      psimd_f32 s3 = m1_sub_m2 + const_8 * m3_sub_m4; \
- \
-      const psimd_f32 const_32 = psimd_splat_f32(32.0f); \
-      s0 += const_32 * m5_add_m6; \
-      s5 += const_32 * m3_sub_m4; \
- \
-      s0 += m3_add_m4; \
-      s5 += m5_sub_m6; \
- \
-      const psimd_f32 const_2 = psimd_splat_f32(2.0f); \
-      s1 += m3_sub_m4 * const_2; \
-      s4 += m5_add_m6 * const_2; \
- \
-      const psimd_f32 const_4 = psimd_splat_f32(4.0f); \
-      s2 += m3_add_m4 * const_4; \
-      s3 += m5_sub_m6 * const_4; \
-\
-      psimd_f32_store( o0, s0 ); \
-      psimd_f32_store( o1, s1 ); \
-      psimd_f32_store( o2, s2 ); \
-      psimd_f32_store( o3, s3 ); \
-      psimd_f32_store( o4, s4 ); \
-      psimd_f32_store( o5, s5 ); \
+   // Inverse transform the gemm results for a tile, add the bias, activate and store
+   void outputTile(const OpKernels &kernels, int inTile, const float *inM, int inPositionStride, int inO0, int inOCount, float *scratch)
+   {
+      int n = inTile/(tilesX*tilesY);
+      int ty = inTile/tilesX - n*tilesY;
+      int tx = inTile % tilesX;
+      int oy0 = ty*TILE;
+      int ox0 = tx*TILE;
+      int yCount = std::min(TILE, destH-oy0);
+      int xCount = std::min(TILE, destW-ox0);
+      float *dOut = (float *)destTensor->cpuWrite() + ((n*destH + oy0)*destW + ox0)*outputs + inO0;
+
+      WinoFunc output = kernels.winoOutput[TILE/2-1];
+      float *rows = scratch;
+      float *result = scratch + A2*WINO_CHANNELS;
+      // M has whole panels, so the channels can go up to a multiple of 4
+      int oPad = (inOCount + 3) & ~3;
+      for(int c=0;c<oPad;c+=WINO_CHANNELS)
+      {
+         int channels = std::min(WINO_CHANNELS, oPad-c);
+         // Rows into rows[y][TILE][channels], then columns into result[TILE][TILE][channels]
+         for(int y=0;y<A;y++)
+            output(inM + y*A*inPositionStride + c, inPositionStride, rows + y*TILE*channels, channels, channels);
+         for(int x=0;x<TILE;x++)
+            output(rows + x*channels, TILE*channels, result + x*channels, TILE*channels, channels);
+
+         for(int o=c;o<c+channels;o+=4)
+         {
+            float32x4_t biasVal = Load4f32(biasPad + inO0 + o);
+            int count = std::min(4, inOCount-o);
+            for(int y=0;y<yCount;y++)
+            {
+               float *d = dOut + y*destW*outputs + o;
+               const float *r = result + y*TILE*channels + o-c;
+               for(int x=0;x<xCount;x++)
+               {
+                  float32x4_t val = Add4f32( Load4f32(r+x*channels), biasVal );
+                  if (activation==actRelu)
+                     val = Max4f32(val, Zero4f32);
+                  else if (activation==actLeaky)
+                     val = Max4f32(val, Mul4f32(val, Const4f32(0.1f)));
+
+                  if (count==4)
+                     StoreU4f32(d + x*outputs, val);
+                  else
+                  {
+                     float lanes[4];
+                     StoreU4f32(lanes, val);
+                     for(int l=0;l<count;l++)
+                        d[x*outputs+l] = lanes[l];
+                  }
+                  if (activation==actSigmoid)
+                     for(int l=0;l<count;l++)
+                        d[x*outputs+l] = activate(d[x*outputs+l], actSigmoid);
+               }
+            }
+         }
+      }
    }
 
+   void runThread(int threadId)
+   {
+      const OpKernels &kernels = GetKernels();
+      float *tile = workBuffers[threadId];
+      float *V = tile + A2*inputsPad;
+      float *M = V + A2*maxTiles*inputsPad;
+      float *scratch = M + A2*maxTiles*maxGroupPanels*GEMM_NR;
+      const float *rowPtr[GEMM_MR];
+
+      int tiles = batch*tilesX*tilesY;
+      int blocks = (tiles + blockTiles-1)/blockTiles;
+      int vStride = blockTiles*inputsPad;
+      int positionSize = panels*GEMM_NR*inputs;
 
-      /*
-        src is HWC format, 8 x 8 x inputs float32
+      while(true)
+      {
+         int job = getNextJob();
+         if (job>=blocks*groups)
+            break;
 
-        dest is HWC format wanting the central 6 x 6 x outputs float32
-      */
+         int block = job/groups;
+         int group = job - block*groups;
+         int t0 = block*blockTiles;
+         int count = std::min(blockTiles, tiles-t0);
+         int p0 = group*groupPanels;
+         int p1 = std::min(panels, p0+groupPanels);
+         int mStride = (p1-p0)*GEMM_NR;
+         int mPositionStride = blockTiles*mStride;
 
-      // Loop over source channels, four at a time
-      // Src is in linear input components (features) per pixel, like:
-      //  src = 
-      //     i0 i1 i2 i3 i4 i5 i6 i7 i8 ... i0 i1 i2 i3 i4 i5 i6 i7 i8 ... i0 i1 i2 i3 i4 i5 i6 i7 i8 ...
-      //
-      //  source stride (pixel width) to get from one set of 4 inputs to the next
-      int ss = inputs;
-      // Transform into input coefficients per pixel
-      //    c0 c1 c2 c3 c4 c5 c6 c7 c8 ... c0 c1 c2 c3 c4 c5 c6 c7 c8 ... c0 c1 c2 c3 c4 c5 c6 c7 c8 ...
-      //
-      // Do this by gathering 4 components at a time for all pixels, transforming to rows in scrach buffer,
-      //  then transforming the cols of the scratch buffer over the top of the original source
-      //
-      for(int inputIdx=0; inputIdx<inputs; inputIdx+=4)
-      {
-         const float *src0 = src + inputIdx;
-         float *out0 = scratch;
+         for(int t=0;t<count;t++)
+            transformTile(kernels, t0+t, tile, V + t*inputsPad, vStride, scratch);
 
-         // Transorm 4 channels to 4 channels of wonigrad coeffs
-         // Tranform rows to buffer
-         for(int i=0;i<8;i++)
+         for(int pos=0;pos<A2;pos++)
          {
-            TRANS_WINO( src0+0, src0+ss, src0+2*ss, src0+3*ss, src0+4*ss, src0+5*ss, src0+6*ss, src0+7*ss, \
-                        out0+0, out0+4,  out0+8,    out0+12,   out0+16,   out0+20,   out0+24,   out0+28 );
-            // Next input row
-            src0 += inputs*8;
-            // Next output row
-            out0 += 32;
-         }
+            const float *vPos = V + pos*vStride;
+            float *mPos = M + pos*mPositionStride;
+            for(int k0=0; k0<inputs; k0+=gemmKc)
+            {
+               int kc = std::min(gemmKc, inputs-k0);
+               for(int p=p0;p<p1;p++)
+               {
+                  const float *panel = transformWeights + pos*positionSize + p*GEMM_NR*inputs + k0*GEMM_NR;
+                  for(int m=0;m<count;m+=GEMM_MR)
+                  {
+                     int mr = std::min(GEMM_MR, count-m);
+                     for(int r=0;r<GEMM_MR;r++)
+                        rowPtr[r] = vPos + (m + (r<mr ? r : 0))*inputsPad + k0;
 
-         // Transform scratch buffer columns and store result over the original source
-         const float *col0 = scratch;
-         float *dest0 = src + inputIdx;
-         int sy = inputs*8; // step to next input row
-         for(int i=0;i<8;i++)
-         {
-            TRANS_WINO( col0+0, col0+32,  col0+64, col0+96, col0+128, col0+160, col0+192, col0+224,
-                        dest0+0, dest0+sy, dest0+2*sy, dest0+3*sy, dest0+4*sy, dest0+5*sy, dest0+6*sy, dest0+7*sy );
-            // Next column of 4 coeffs
-            col0+=4;
-            // Next destination row
-            dest0 += inputs;
+                     kernels.gemm(mPos + m*mStride + (p-p0)*GEMM_NR, mStride, rowPtr, panel, kc,
+                                  0, k0>0, actLinear, mr, GEMM_NR);
+                  }
+               }
+            }
          }
-      }
 
-      /*
-      const float *dbg = src;
-      for(int o=0;o<4;o+=4)
-      {
-         printf("out %d\n",o);
-         for(int px=0;px<64;px++)
-         {
-            printf(" t %d:", px);
-            for(int i=0;i<inputs;i++)
-               printf(" %g", *dbg++);
-            printf("\n");
-         }
+         int oCount = std::min(outputs, p1*GEMM_NR) - p0*GEMM_NR;
+         for(int t=0;t<count;t++)
+            outputTile(kernels, t0+t, M + t*mStride, mPositionStride, p0*GEMM_NR, oCount, scratch);
       }
-      */
+   }
+};
 
-      // Src values have now been converted to winograd coeffs in-situ
-      //   src: c0 c1 c2 c3 c4 c5 c6 c7 c8 ... c0 c1 c2 c3 c4 c5 c6 c7 c8 ... c0 c1 c2 c3 c4 c5 c6 c7 c8 ...
+#endif
 
-      // For each output, o, we want transformed To = Sum_i w_oi ci
-      //
-      // Perform this sum for each pixel, 4 outputs at a time and store the result in the 8*8*4  scratch buffer
-      //  then inverse-transform into the destination buffer.
-      //
 
 
-      float *w = (float *)transformWeights;
-      int sixteens = inputs>>4;
-      int fours = (inputs - (sixteens<<4))>>2;
-      for(int o=0; o<outputs;o+=4)
-      {
-         float *out = scratch;
-         const float *s = src;
+// -- Conv2DSelect -----------------------
 
-         for(int pixel=0;pixel<64;pixel++)
-         {
-            float32x4_t sumO0 = Zero4f32;
-            float32x4_t sumO1 = sumO0;
-            float32x4_t sumO2 = sumO0;
-            float32x4_t sumO3 = sumO0;
+enum ConvAlgo { algoDirect, algoWinograd2, algoWinograd4, algoWinograd6, algoCount };
 
+static const char *sConvAlgoNames[] = { "direct", "wino2", "wino4", "wino6" };
 
-            for(int i=0;i<fours;i++)
-            {
-               float32x4_t src = Load4f32(s);
-               s+=4;
-               sumO0 = Add4f32( Mul4f32(src, Load4f32(w   ) ), sumO0 );
-               sumO1 = Add4f32( Mul4f32(src, Load4f32(w+4 ) ), sumO1 );
-               sumO2 = Add4f32( Mul4f32(src, Load4f32(w+8 ) ), sumO2 );
-               sumO3 = Add4f32( Mul4f32(src, Load4f32(w+12) ), sumO3 );
-               w+=16;
-            }
+static int FindConvAlgo(const char *inName)
+{
+   for(int a=0;a<algoCount;a++)
+      if (!strcmp(inName,sConvAlgoNames[a]))
+         return a;
+   return -1;
+}
 
-            for(int i=0;i<sixteens;i++)
-            {
-               float32x4_t src0 = Load4f32(s);
-               sumO0 = Add4f32( Mul4f32(src0, Load4f32(w   ) ), sumO0 );
-               sumO1 = Add4f32( Mul4f32(src0, Load4f32(w+4 ) ), sumO1 );
-               sumO2 = Add4f32( Mul4f32(src0, Load4f32(w+8 ) ), sumO2 );
-               sumO3 = Add4f32( Mul4f32(src0, Load4f32(w+12) ), sumO3 );
-
-               float32x4_t src1 = Load4f32(s+4);
-               sumO0 = Add4f32( Mul4f32(src1, Load4f32(w+16) ), sumO0 );
-               sumO1 = Add4f32( Mul4f32(src1, Load4f32(w+20) ), sumO1 );
-               sumO2 = Add4f32( Mul4f32(src1, Load4f32(w+24) ), sumO2 );
-               sumO3 = Add4f32( Mul4f32(src1, Load4f32(w+28) ), sumO3 );
-
-               float32x4_t src2 = Load4f32(s+8);
-               sumO0 = Add4f32( Mul4f32(src2, Load4f32(w+32) ), sumO0 );
-               sumO1 = Add4f32( Mul4f32(src2, Load4f32(w+36) ), sumO1 );
-               sumO2 = Add4f32( Mul4f32(src2, Load4f32(w+40) ), sumO2 );
-               sumO3 = Add4f32( Mul4f32(src2, Load4f32(w+44) ), sumO3 );
-
-               float32x4_t src3 = Load4f32(s+12);
-               s+=16;
-               sumO0 = Add4f32( Mul4f32(src3, Load4f32(w+48) ), sumO0 );
-               sumO1 = Add4f32( Mul4f32(src3, Load4f32(w+52) ), sumO1 );
-               sumO2 = Add4f32( Mul4f32(src3, Load4f32(w+56) ), sumO2 );
-               sumO3 = Add4f32( Mul4f32(src3, Load4f32(w+60) ), sumO3 );
-               w+=64;
-            }
+// NX_CONV_ALGO=direct|wino2|wino4|wino6, or SetConvAlgo, forces the choice
+static volatile int sForcedConvAlgo = -2;
 
+static int GetForcedConvAlgo()
+{
+   if (sForcedConvAlgo==-2)
+   {
+      int forced = -1;
+      const char *env = getenv("NX_CONV_ALGO");
+      if (env && env[0])
+      {
+         forced = FindConvAlgo(env);
+         if (forced<0)
+            fprintf(stderr,"NX_CONV_ALGO '%s' not recognised\n", env);
+      }
+      NxAtomicSet(&sForcedConvAlgo, forced);
+   }
+   return sForcedConvAlgo;
+}
 
-            SumRows4x4f32(sumO0, sumO1, sumO2, sumO3);
-            Store4f32( out, sumO0 );
-            out += 4;
-         }
+bool SetConvAlgo(const char *inAlgo)
+{
+   int algo = -1;
+   if (inAlgo && inAlgo[0])
+   {
+      algo = FindConvAlgo(inAlgo);
+      if (algo<0)
+         return false;
+   }
+   NxAtomicSet(&sForcedConvAlgo, algo);
+   return true;
+}
 
-         // Inverse-winograd 4-coeffs into scratch buffer
+// Job sizes tried when autotuning - 0 is the cache-budget default
+static const int sTuneBlockLimits[] = { 0, 64, 32, 16 };
 
-         float *rowSrc = scratch;
-         float *rowDest = scratch;
-         // compact rows in-situ
-         for(int i=0;i<8;i++)
-         {
-            TRANS_WINO_INV(rowSrc+0, rowSrc+4,  rowSrc+8,    rowSrc+12,   rowSrc+16,   rowSrc+20,   rowSrc+24,   rowSrc+28, \
-                           rowDest+0, rowDest+4,  rowDest+8,    rowDest+12,   rowDest+16,   rowDest+20 );
-            rowSrc+= 32;
-            rowDest+=24;
-         }
 
-         // compact cols 
-         float *c = scratch;
-         for(int i=0;i<xCount;i++)
-         {
-            TRANS_WINO_INV(c, c+24, c+48, c+72, c+96, c+120, c+144, c+168, \
-                           c, c+24, c+48, c+72, c+96, c+120 );
-            c+=4;
-         }
+/*
+ Chooses the implementation once the input size is known, and again if it changes.
 
-         // Activate and bias from scratch buffer to output
-         float32x4_t zero = Zero4f32;
-         float32x4_t biasVal = Load4f32(biasPtr + o);
+ 3x3, stride 1 convolutions can run directly or as one of the Winograd transforms.
+ Which is faster depends on the image size (partial tiles at the edges, and the transforms
+ are per tile) and the channels (the gemm dominates when there are many), so normally a cost
+ model decides.  When autotuning, every eligible algorithm and job size is timed instead,
+ and the result kept in the tuning cache.
 
-         float *unactive = scratch;
-         float *d = dest + o;
+ The layer keeps the weights, and the normalization/mean/activation changes apply to them;
+ the implementation is rebuilt from them when needed.
+*/
+class Conv2DSelect : public Conv2DBase
+{
+   Conv2DBase *impl;
+   bool       allowTransform;
+   int        algo;
+   int        algoBlock;
+   int        algoW;
+   int        algoH;
+   int        algoBatch;
 
-         if (activation==actRelu)
-         {
-            for(int oy=0; oy<yCount; oy++)
-            {
-               for(int ox=0; ox<xCount;ox++)
-                  Store4f32( d + ox*outputs, Max4f32( Add4f32( Load4f32( unactive+ox*4 ), biasVal), zero ) );
-               unactive += 24;
-               d += outputs*destW;
-            }
-         }
-         else if (activation==actLeaky)
-         {
-            float32x4_t alpha = Const4f32(0.1f);
-            for(int oy=0; oy<yCount; oy++)
-            {
-               for(int ox=0; ox<xCount;ox++)
-               {
-                  float32x4_t val = Add4f32( Load4f32( unactive+ox*4 ), biasVal);
-                  Store4f32( d + ox*outputs, Max4f32( val, Mul4f32(val,alpha) ) );
-               }
-               unactive += 24;
-               d += outputs*destW;
-            }
-         }
-         else
-         {
-            for(int oy=0; oy<yCount; oy++)
-            {
-               for(int ox=0; ox<xCount;ox++)
-                  Store4f32( d + ox*outputs, Add4f32( Load4f32( unactive+ox*4 ), biasVal ) );
-               unactive += 24;
-               d += outputs*destW;
-            }
-         }
-      }
+public:
+   Conv2DSelect(int inStrideY, int inStrideX, Activation inActivation, Padding inPadding,
+                Tensor *inWeights, Tensor *inBias, bool inAllowTransform)
+      : Conv2DBase(inStrideY, inStrideX, false, inActivation, inPadding,  inWeights, 0, inBias)
+   {
+      impl = 0;
+      allowTransform = inAllowTransform;
+      algo = algoDirect;
+      algoBlock = 0;
+      algoW = algoH = algoBatch = 0;
+   }
+   ~Conv2DSelect()
+   {
+      delete impl;
    }
 
-   void runThread(int threadId)
+   void setPadInput() { padInputsWithZero = true; }
+
+   void setActivation(Activation inActivation)
    {
-      const int *srcStride = &src0->strides[0];
-      const int *destStride = &destTensor->strides[0];
+      activation = inActivation;
+      if (impl)
+         impl->setActivation(activation);
+   }
 
-      int tilesX = (srcW + 5)/6;
-      int tilesY = (srcH + 5)/6;
-      int tileCount = tilesX * tilesY;
+   // weights, bias or inputs have changed
+   void rebuildWeights()
+   {
+      delete impl;
+      impl = 0;
+   }
 
-      const float *sIn = (float *)src0->cpuRead();
-      float *sOut = (float *)destTensor->cpuRead();
+   // The Winograd transforms stay in Float32, so int8 always runs direct
+   bool setQuantize(float inRange)
+   {
+      if (filterX*filterY*((inputs+3)&~3) > GEMM_INT8_MAX_K)
+         return false;
+      quantRange = std::max(inRange, 0.0f);
+      weightsChanged = true;
+      return true;
+   }
 
-      while(true)
-      {
-         int tileId = getNextJob();
-         if (tileId>=tileCount)
-            break;
+   // Only the direct gemm has fp16 panels - the Winograd weights stay Float32
+   bool setHalfWeights(bool inHalf)
+   {
+      halfWeights = inHalf;
+      weightsChanged = true;
+      return true;
+   }
 
-         int ty = tileId/tilesX;
-         int tx = tileId-ty*tilesX;
+   bool setFusedPool(bool inFuse, Padding inPadding)
+   {
+      if (!Conv2DBase::setFusedPool(inFuse, inPadding))
+         return false;
+      if (impl)
+         impl->setFusedPool(fusePool, poolPadding);
+      return true;
+   }
 
-         float *buf = srcBuffers[threadId];
-         int outY = ty*6;
-         int outX = tx*6;
-         int sy0 = outY - 1;
-         int sy1 = std::min(sy0+8,srcH);
-         int sx0 = outX - 1;
-         int sxEnd = sx0+8;
-         int sx1 = std::min(sxEnd,srcW);
-         int syEnd = sy0+8;
+   bool setFusedSum(bool inFuse, Activation inActivation)
+   {
+      Conv2DBase::setFusedSum(inFuse, inActivation);
+      if (impl)
+         impl->setFusedSum(fuseSum, sumActivation);
+      return true;
+   }
 
-         memset(buf,0xff,8*8*inputs*sizeof(float));
+   bool canUse(int inAlgo)
+   {
+      if (inAlgo==algoDirect)
+         return true;
+      if (quantRange>0)
+         return false;
+      #ifdef NUMERIX_WINOGRAD
+      return inAlgo<algoCount && allowTransform && filterX==3 && filterY==3 && strideX==1 && strideY==1;
+      #else
+      return false;
+      #endif
+   }
+
+   Conv2DBase *createImpl(int inAlgo, int inBlockLimit)
+   {
+      Conv2DBase *result = 0;
+      switch(inAlgo)
+      {
+         #ifdef NUMERIX_WINOGRAD
+         case algoWinograd2:
+            result = new Conv2DWinograd<2>(activation, padding, weights, bias); break;
+         case algoWinograd4:
+            result = new Conv2DWinograd<4>(activation, padding, weights, bias); break;
+         case algoWinograd6:
+            result = new Conv2DWinograd<6>(activation, padding, weights, bias); break;
+         #endif
+         default:
+            result = new Conv2D(strideY, strideX, false, activation, padding, weights, 0, bias);
+      }
+      result->setBlockLimit(inBlockLimit);
+      if (quantRange>0)
+         result->setQuantize(quantRange);
+      if (halfWeights)
+         result->setHalfWeights(true);
+      result->setFusedPool(fusePool, poolPadding);
+      result->setFusedSum(fuseSum, sumActivation);
+      return result;
+   }
 
-         if (ty==0)
+   /*
+    Relative cost, in multiply-adds, with the constants measured on the gemm kernels.
+    The direct gemm has a per-pixel overhead that matters when there are few channels.
+    The Winograd gemm does (m+2)^2 MACs for every tile, with channels padded to 4 in and 8 out,
+    and gathering + transforming each tile point costs about 40 MACs per channel.  When there are
+    few tiles, the transformed weights (streamed once per block of tiles) dominate.
+    The larger tiles lose some precision too, so F6 is given a small handicap.
+   */
+   double estimateCost(int inAlgo)
+   {
+      if (inAlgo==algoDirect)
+         return (double)batch*destW*destH*(9.0*inputs*outputs + 12.0*(9*inputs+outputs));
+
+      #ifdef NUMERIX_WINOGRAD
+      int m = inAlgo==algoWinograd2 ? 2 : inAlgo==algoWinograd4 ? 4 : 6;
+      int a = m+2;
+      int inPad = (inputs+3) & ~3;
+      double outPad = (outputs+GEMM_NR-1) & ~(GEMM_NR-1);
+      int tiles = batch*((destW+m-1)/m) * ((destH+m-1)/m);
+      int maxTiles = winogradMaxTiles(a, inPad);
+      double blocks = (tiles + maxTiles-1)/maxTiles;
+
+      double cost = (double)tiles*a*a*inPad*outPad +
+                    40.0*tiles*a*a*(inPad+outPad) +
+                    12.0*blocks*a*a*inPad*outPad;
+      return inAlgo==algoWinograd6 ? cost*1.1 : cost;
+      #else
+      return 0;
+      #endif
+   }
+
+   int chooseAlgo()
+   {
+      int forced = GetForcedConvAlgo();
+      if (forced>=0 && canUse(forced))
+         return forced;
+
+      int best = algoDirect;
+      double bestCost = estimateCost(algoDirect);
+      for(int a=algoDirect+1;a<algoCount;a++)
+         if (canUse(a))
          {
-            memset(buf,0,inputs*8*sizeof(float)); 
-            sy0++;
-            buf += inputs*8;
+            double cost = estimateCost(a);
+            if (cost<bestCost)
+            {
+               best = a;
+               bestCost = cost;
+            }
          }
+      return best;
+   }
+
+   std::string tuneKey()
+   {
+      char buf[256];
+      sprintf(buf,"conv %dx%dx%d>%d f%dx%d s%dx%d p%d,%d t%d", srcH, srcW, inputs, outputs,
+              filterY, filterX, strideY, strideX, padOy, padOx, (int)allowTransform);
+      // Single images keep their original keys
+      if (batch>1)
+         sprintf(buf+strlen(buf)," n%d", batch);
+      if (quantRange>0)
+         strcat(buf," int8");
+      else if (halfWeights)
+         strcat(buf," f16");
+      // The algorithms without a fused epilogue pay for a separate pass
+      if (fusePool)
+         strcat(buf," pool");
+      if (fuseSum)
+         strcat(buf," sum");
+      return buf;
+   }
 
-         for(int y=sy0;y<sy1;y++)
+   // Time each candidate on the real input, leaving the fastest in impl
+   void autotune(Tensor *input, Tensor *output)
+   {
+      std::string key = tuneKey();
+      std::string choice;
+      if (FindTuning(key, choice))
+      {
+         char name[32];
+         int block = 0;
+         if (sscanf(choice.c_str(),"%31s %d", name, &block)==2)
          {
-            if (sx0<0)
+            int a = FindConvAlgo(name);
+            if (a>=0 && canUse(a))
             {
-               memset(buf,0,inputs*sizeof(float)); 
-               memcpy(buf+inputs, sIn + (y*srcW)*inputs,sx1*inputs*sizeof(float)); 
-               buf += inputs*(sx1+1);
+               if (!impl || a!=algo || block!=algoBlock)
+               {
+                  delete impl;
+                  impl = createImpl(a, block);
+                  algo = a;
+                  algoBlock = block;
+               }
+               return;
             }
-            else
+         }
+      }
+
+      delete impl;
+      impl = 0;
+      double bestTime = 0;
+      for(int a=0;a<algoCount;a++)
+      {
+         if (!canUse(a))
+            continue;
+         for(int b=0;b<sizeof(sTuneBlockLimits)/sizeof(int);b++)
+         {
+            Conv2DBase *trial = createImpl(a, sTuneBlockLimits[b]);
+            // First run touches the buffers
+            trial->runFused(input, residual, output, intoSlice);
+            double t = 0;
+            for(int rep=0;rep<2;rep++)
             {
-               memcpy(buf, sIn + (y*srcW + sx0)*inputs,(sx1-sx0)*inputs*sizeof(float)); 
-               buf += inputs*(sx1-sx0);
+               double t0 = GetTimeStamp();
+               trial->runFused(input, residual, output, intoSlice);
+               double dt = GetTimeStamp()-t0;
+               if (rep==0 || dt<t)
+                  t = dt;
             }
-            if (sx1 < sxEnd)
+
+            if (!impl || t<bestTime)
             {
-               memset(buf, 0, (sxEnd-sx1)*inputs*sizeof(float));
-               buf += (sxEnd-sx1)*inputs;
+               delete impl;
+               impl = trial;
+               algo = a;
+               algoBlock = sTuneBlockLimits[b];
+               bestTime = t;
             }
+            else
+               delete trial;
          }
-         if (sy1<syEnd)
-         {
-            memset(buf, 0, (syEnd-sy1)*inputs*8*sizeof(float));
-         }
+      }
+
+      char buf[64];
+      sprintf(buf,"%s %d", sConvAlgoNames[algo], algoBlock);
+      StoreTuning(key, buf);
+   }
 
-         /*
-         const float *s = srcBuffers[threadId];
-         for(int y=0;y<8;y++)
+   void selectImpl(Tensor *input, Tensor *output)
+   {
+      if (!impl || algoW!=srcW || algoH!=srcH || algoBatch!=batch)
+      {
+         if (GetConvAutotune() && GetForcedConvAlgo()<0)
+            autotune(input, output);
+         else
          {
-            printf("%d ]",y);
-            for(int x=0;x<8;x++)
+            int want = chooseAlgo();
+            if (!impl || want!=algo || algoBlock!=0)
             {
-               printf("(%g,%g,%g,%g) ", s[0],s[1],s[2],s[3]);
-               s+=4;
+               delete impl;
+               impl = createImpl(want, 0);
+               algo = want;
+               algoBlock = 0;
             }
-            printf("\n");
          }
-         */
+         algoW = srcW;
+         algoH = srcH;
+         algoBatch = batch;
+      }
+   }
+
+   // The implementation's weights, with the choice and the size it was made for
+   bool getCompiled(CompiledWeights &outWeights)
+   {
+      if (!impl || weightsChanged || !impl->getCompiled(outWeights))
+         return false;
+      outWeights.block = algoBlock;
+      outWeights.srcW = algoW;
+      outWeights.srcH = algoH;
+      outWeights.batch = algoBatch;
+      return true;
+   }
 
-         runTile( srcBuffers[threadId], sOut + (outY*destW + outX)*outputs,
-                    std::min(outX+6,destW)-outX, std::min(outY+6,destH)-outY,
-                    scratchBuffer[threadId]);
+   // The implementation is kept for inputs of the recorded size, without choosing or tuning again
+   bool setCompiled(const CompiledWeights &inWeights)
+   {
+      int a = inWeights.algo.substr(0,4)=="gemm" || inWeights.algo=="int8" ?
+                 (int)algoDirect : FindConvAlgo(inWeights.algo.c_str());
+      if (a<0)
+         return false;
+
+      float oldRange = quantRange;
+      bool oldHalf = halfWeights;
+      quantRange = inWeights.algo=="int8" ? inWeights.range : 0;
+      halfWeights = inWeights.algo=="gemm16";
+      Conv2DBase *compiled = canUse(a) ? createImpl(a, inWeights.block) : 0;
+      if (!compiled || !compiled->setCompiled(inWeights))
+      {
+         delete compiled;
+         quantRange = oldRange;
+         halfWeights = oldHalf;
+         return false;
       }
+
+      delete impl;
+      impl = compiled;
+      algo = a;
+      algoBlock = inWeights.block;
+      algoW = inWeights.srcW;
+      algoH = inWeights.srcH;
+      algoBatch = inWeights.batch;
+      weightsChanged = false;
+      return true;
    }
 
+   void doRun(Tensor *input, Tensor *output)
+   {
+      selectImpl(input, output);
+      startRun();
+      impl->run(input, output);
+      endRun();
+   }
 
+   // The chosen algorithm does the whole fused run, with its own epilogue pass if it needs one
+   bool doRunFused(Tensor *input, Tensor *output)
+   {
+      selectImpl(input, output);
+      startRun();
+      impl->runFused(input, residual, output, intoSlice);
+      endRun();
+      return true;
+   }
 };
-#endif
 
 
 
@@ -1620,13 +2650,51 @@ Layer *Layer::createConv2D(int strideY, int strideX, bool inIsDeconvolution,
 {
    CShape filter = weights->shape;
 
+   if (pweights)
+   {
+      if (inIsDeconvolution)
+         TensorThrow("SeparableConv2D deconvolution not supported");
+      return new Conv2DSeparable(strideY, strideX, activation, padding, weights, pweights, bias);
+   }
+
+   if (inIsDeconvolution)
+      return new Conv2D(strideY, strideX, inIsDeconvolution, activation, padding, weights, pweights, bias);
+
+   bool transform = false;
    #ifdef NUMERIX_WINOGRAD
-   if (inAllowTransform && filter.size()==4 && (filter[0]&3)==0 && filter[1]==3 && filter[2]==3 && (filter[3]&3)==0 &&
-       pweights==0 && strideX==1 &&  strideY==1 && !inIsDeconvolution)
-      return new Conv2DWinograd(strideY, strideX, activation, padding, weights, bias);
+   transform = inAllowTransform && filter.size()==4 && filter[1]==3 && filter[2]==3 && strideX==1 && strideY==1;
    #endif
 
+   if (transform || GetConvAutotune())
+      return new Conv2DSelect(strideY, strideX, activation, padding, weights, bias, inAllowTransform);
+
    return new Conv2D(strideY, strideX, inIsDeconvolution, activation, padding, weights, pweights, bias);
 }
 
+
+Layer *Layer::createConv2DLazy(int strideY, int strideX,
+                    Activation activation, Padding padding,
+                    Tensor *fileWeights, Tensor *bias, bool inAllowTransform)
+{
+   CShape s = fileWeights->shape;
+   if (s.size()!=4 || fileWeights->type!=Float32 || !fileWeights->isContiguous())
+      TensorThrow("Conv2D - invalid file weights");
+
+   // The same data, seen as [outputs][fy][fx][inputs] until loadWeights reorders it
+   Tensor *view = new Tensor(Float32, Shape4(s[0], s[2], s[3], s[1]), fileWeights);
+   Layer *result = 0;
+   try
+   {
+      result = createConv2D(strideY, strideX, false, activation, padding, view, 0, bias, inAllowTransform);
+   }
+   catch(...)
+   {
+      view->decRef();
+      throw;
+   }
+   view->decRef();
+   ((Conv2DBase *)result)->setWeightsInFile();
+   return result;
+}
+
 } // end namespace numerix
@@ -10,6 +10,7 @@ namespace numerix
 
 class Crop : public Layer
 {
+   int batch;
    int destW;
    int destH;
    int srcW;
@@ -29,12 +30,14 @@ public:
 
    virtual Tensor *run(Tensor *inSrc0, Tensor *inSrc1, Tensor *inBuffer)
    {
-      CShape sin0 = inSrc0->shape;
-      CShape sin1 = inSrc1->shape;
-      if (sin0.size()!=3 || sin1.size()!=3)
-         TensorThrow("Crop only supports H*W*C tensors");
+      if (!inSrc0->isImage() || inSrc0->shape.size()!=inSrc1->shape.size())
+         TensorThrow("Crop only supports matching H*W*C or N*H*W*C tensors");
 
-      if (sin0[2]!=sin1[2])
+      int n = inSrc0->imageBatch();
+      Shape sin0 = Shape3(inSrc0->imageHeight(), inSrc0->imageWidth(), inSrc0->imageChannels());
+      Shape sin1 = Shape3(inSrc1->imageHeight(), inSrc1->imageWidth(), inSrc1->imageChannels());
+
+      if (sin0[2]!=sin1[2] || n!=inSrc1->imageBatch())
       {
          char buf[1000];
          sprintf(buf, "Crop - mismatch channel sizes %dx%dx%d + %dx%dx%d",
@@ -47,6 +50,7 @@ public:
       destH = sin1[0];
       destW = sin1[1];
       channels = sin0[2];
+      batch = std::max(n,1);
 
       if (offsetX<0 || offsetY<0 || destW+offsetX>srcW || destH+offsetY>srcH)
       {
@@ -57,7 +61,7 @@ public:
       }
 
       startRun();
-      Tensor *result = Tensor::makeBuffer(inBuffer, destW, destH, channels, inSrc0->type);
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, destW, destH, channels, inSrc0->type);
 
       nchw = inSrc0->isGpuNchw();
 
@@ -92,19 +96,21 @@ public:
    void runThreadNhwc(int threadId)
    {
       const int typeSize = src0->elementSize;
-      const int srcStride = src0->strides[0]*typeSize;
-      const int xOff = src0->strides[1]*typeSize * offsetX;
+      const int srcStride = src0->imageStrides()[0]*typeSize;
+      const int xOff = src0->imageStrides()[1]*typeSize * offsetX;
       const u8 *s0 =  src0->cpuRead() + offsetY*srcStride + xOff;
       u8 *d0 =  destTensor->cpuWrite();
-      const int destStride = destTensor->strides[0] * typeSize;
+      const int destStride = destTensor->imageStrides()[0] * typeSize;
 
       while(true)
       {
-         int y = getNextJob();
-         if (y>=destH)
+         int row = getNextJob();
+         if (row>=batch*destH)
             break;
 
-         memcpy(d0+y*destStride,  s0+y*srcStride, destStride );
+         int image = row/destH;
+         int y = row - image*destH;
+         memcpy(d0+row*destStride,  s0+(image*srcH + y)*srcStride, destStride );
       }
    }
 
@@ -115,18 +121,19 @@ public:
       const u8 *s0 =  src0->cpuRead() + offsetY*srcStride + xOff;
       const u8 *d0 =  destTensor->cpuRead() + xOff;
       */
-      const int destStride = destTensor->strides[1] * typeSize;
-      const int srcStride = src0->strides[1]*typeSize;
+      // Channel-major, so rows are W long and planes are H*W
+      const int destStride = destW * typeSize;
+      const int srcStride = srcW * typeSize;
 
       while(true)
       {
-         int chan = getNextJob();
-         if (chan>=channels)
+         int plane = getNextJob();
+         if (plane>=batch*channels)
             break;
 
 
-         const u8 *s0 =  src0->cpuRead() + src0->strides[0]*chan*typeSize + offsetY*srcStride + offsetX*typeSize;
-         u8 *d0 =  destTensor->cpuWrite() + destTensor->strides[0]*chan*typeSize;
+         const u8 *s0 =  src0->cpuRead() + srcH*srcStride*plane + offsetY*srcStride + offsetX*typeSize;
+         u8 *d0 =  destTensor->cpuWrite() + destH*destStride*plane;
          for(int y=0;y<destH;y++)
          {
             memcpy(d0+y*destStride,  s0+y*srcStride, destStride );
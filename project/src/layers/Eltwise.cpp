@@ -11,12 +11,14 @@ namespace numerix
 template<EltwiseOp OP>
 class Eltwise : public Layer
 {
+   int batch;
    int destW;
    int destH;
    int channels;
    int cropIndex;
    int cropX;
    int cropY;
+   Activation activation;
 
 public:
    Eltwise( )
@@ -24,8 +26,11 @@ public:
       cropIndex = -1;
       cropX = 0;
       cropY = 0;
+      activation = actLinear;
    }
 
+   void setActivation(Activation inActivation) { activation = inActivation; }
+
    void setCropIndex(int inIndex, int inDx, int inDy)
    {
       cropIndex = inIndex;
@@ -41,12 +46,15 @@ public:
       if (inSrc0->type != inSrc1->type)
          TensorThrow("Eltwise - input types must match");
 
-      CShape sin0 = inSrc0->shape;
-      CShape sin1 = inSrc1->shape;
-      if (sin0.size()!=3 || sin1.size()!=3)
-         TensorThrow("Eltwise only supports H*W*C tensors");
+      if (!inSrc0->isImage() || inSrc0->shape.size()!=inSrc1->shape.size())
+         TensorThrow("Eltwise only supports matching H*W*C or N*H*W*C tensors");
+
+      // Compare the images, and the batch sizes separately
+      int n = inSrc0->imageBatch();
+      Shape sin0 = Shape3(inSrc0->imageHeight(), inSrc0->imageWidth(), inSrc0->imageChannels());
+      Shape sin1 = Shape3(inSrc1->imageHeight(), inSrc1->imageWidth(), inSrc1->imageChannels());
 
-      bool sizeMismatch = sin0[2]!=sin1[2];
+      bool sizeMismatch = sin0[2]!=sin1[2] || n!=inSrc1->imageBatch();
       if (cropIndex>=0)
       {
          CShape dest = cropIndex==0 ? sin0 : sin1;
@@ -83,9 +91,10 @@ public:
       }
 
       channels = sin0[2];
+      batch = std::max(n,1);
 
       startRun();
-      Tensor *result = Tensor::makeBuffer(inBuffer, destW, destH, channels, inSrc0->type);
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, destW, destH, channels, inSrc0->type);
 
       src0 = inSrc0;
       src1 = inSrc1;
@@ -119,9 +128,12 @@ public:
    void runThreadMulti(int threadId)
    {
       int typeSize = src0->elementSize;
-      const int *src0Stride = &src0->strides[0];
-      const int *src1Stride = &src1->strides[0];
-      const int *destStride = &destTensor->strides[0];
+      const int *src0Stride = src0->imageStrides();
+      const int *src1Stride = src1->imageStrides();
+      const int *destStride = destTensor->imageStrides();
+      // The inputs may be different sizes when cropping
+      int image0 = src0->elementCount/batch;
+      int image1 = src1->elementCount/batch;
       int nElems = destW * channels;
       int dx0 = 0;
       int dy0 = 0;
@@ -140,13 +152,15 @@ public:
 
       while(true)
       {
-         int y = getNextJob();
-         if (y>=destH)
+         int row = getNextJob();
+         if (row>=batch*destH)
             break;
 
-         const float *s0 = (const float *)src0->cpuRead() + src0Stride[0] * (y+dy0) + dx0;
-         const float *s1 = (const float *)src1->cpuRead() + src1Stride[0] * (y+dy1) + dx1;
-         float        *d = (float *)destTensor->cpuWrite() + destStride[0] * y;
+         int image = row/destH;
+         int y = row - image*destH;
+         const float *s0 = (const float *)src0->cpuRead() + image*image0 + src0Stride[0] * (y+dy0) + dx0;
+         const float *s1 = (const float *)src1->cpuRead() + image*image1 + src1Stride[0] * (y+dy1) + dx1;
+         float        *d = (float *)destTensor->cpuWrite() + destStride[0] * row;
 
          for(int x=0;x<nElems;x++)
          {
@@ -157,6 +171,9 @@ public:
             else if (OP==EltMax)
                d[x] = std::max(s0[x],s1[x]);
          }
+         if (activation!=actLinear)
+            for(int x=0;x<nElems;x++)
+               d[x] = activate(d[x], activation);
       }
    }
 };
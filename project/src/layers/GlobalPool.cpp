@@ -10,6 +10,7 @@ namespace numerix
 
 class GlobalPool : public Layer
 {
+   int batch;
    int srcW;
    int srcH;
    int channels;
@@ -23,36 +24,44 @@ public:
 
    virtual Tensor *run(Tensor *inSrc0, Tensor *inBuffer)
    {
-      CShape sin0 = inSrc0->shape;
-      if (sin0.size()!=3)
-         TensorThrow("GlobalPool only supports H*W*C tensors");
+      if (!inSrc0->isImage())
+         TensorThrow("GlobalPool only supports H*W*C or N*H*W*C tensors");
 
-      srcH = sin0[0];
-      srcW = sin0[1];
-      channels = sin0[2];
+      int n = inSrc0->imageBatch();
+      batch = std::max(n,1);
+      srcH = inSrc0->imageHeight();
+      srcW = inSrc0->imageWidth();
+      channels = inSrc0->imageChannels();
 
       startRun();
-      Tensor *result = Tensor::makeBuffer(inBuffer, 1, 1, channels, inSrc0->type);
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, 1, 1, channels, inSrc0->type);
 
       nchw = inSrc0->isGpuNchw();
 
       float *dest = (float *)result->cpuWrite(nchw);
       const float *src = (const float *)inSrc0->cpuRead(nchw);
 
+      float scale = 1.0/(srcW*srcH);
       std::vector<float> sum(channels);
-      for(int y=0;y<srcH;y++)
+      for(int i=0;i<batch;i++)
       {
-         const float *s = src + y*srcW*channels;
-         for(int x=0;x<srcW;x++)
+         std::fill(sum.begin(), sum.end(), 0.0f);
+         for(int y=0;y<srcH;y++)
          {
-            for(int c=0;c<channels;c++)
-               sum[c] += *s++;
+            const float *s = src + y*srcW*channels;
+            for(int x=0;x<srcW;x++)
+            {
+               for(int c=0;c<channels;c++)
+                  sum[c] += *s++;
+            }
          }
-      }
 
-      float scale = 1.0/(srcW*srcH);
-      for(int c=0;c<channels;c++)
-         dest[c] = sum[c] * scale;
+         for(int c=0;c<channels;c++)
+            dest[c] = sum[c] * scale;
+
+         src += srcH*srcW*channels;
+         dest += channels;
+      }
 
       endRun();
       return result;
@@ -130,6 +130,31 @@ double Layer::getRunTime()
 
 
 
+struct WorkerFloats
+{
+   std::vector<float *> *buffers;
+   int count;
+};
+
+static void SAllocWorkerFloats(int inThreadId, void *inData)
+{
+   WorkerFloats *info = (WorkerFloats *)inData;
+   unsigned char *buffer = TensorData::allocCpuAligned( info->count*sizeof(float) );
+   // The first write places the pages on this worker's numa node
+   memset(buffer, 0, info->count*sizeof(float));
+   (*info->buffers)[inThreadId] = (float *)buffer;
+}
+
+void Layer::allocWorkerFloats(std::vector<float *> &outBuffers, int count)
+{
+   outBuffers.resize( GetWorkerCount() );
+   WorkerFloats info = { &outBuffers, count };
+   RunOnEachWorker( SAllocWorkerFloats, &info );
+   for(int i=0;i<outBuffers.size();i++)
+      buffers.push_back( (unsigned char *)outBuffers[i] );
+}
+
+
 void Layer::releaseFloats()
 {
    for(int i=0;i<buffers.size();i++)
@@ -181,4 +206,58 @@ void SortBoxes(Boxes &ioBoxes)
 
 
 
+CompiledWeights::CompiledWeights()
+{
+   block = 0;
+   srcW = srcH = 0;
+   batch = 0;
+   range = 0;
+   weights = 0;
+   bias = 0;
+}
+
+CompiledWeights::~CompiledWeights()
+{
+   setWeights(0,0);
+   for(int i=0;i<packed.size();i++)
+      packed[i]->decRef();
+}
+
+void CompiledWeights::setWeights(Tensor *inWeights, Tensor *inBias)
+{
+   if (inWeights)
+      inWeights->incRef();
+   if (inBias)
+      inBias->incRef();
+   if (weights)
+      weights->decRef();
+   if (bias)
+      bias->decRef();
+   weights = inWeights;
+   bias = inBias;
+}
+
+void CompiledWeights::addPacked(DataType inType, int inCount, const void *inData)
+{
+   Tensor *tensor = new Tensor(inType, Shape1(inCount));
+   memcpy(tensor->cpuWrite(), inData, tensor->getByteCount());
+   packed.push_back(tensor);
+}
+
+const void *CompiledWeights::getPacked(int inIndex, DataType inType, int inCount) const
+{
+   if (inIndex<0 || inIndex>=packed.size())
+      return 0;
+   Tensor *tensor = packed[inIndex];
+   if (tensor->type!=inType || tensor->elementCount!=inCount || !tensor->isContiguous())
+      return 0;
+   const u8 *data = tensor->cpuRead();
+   // As allocFloats - mapped blocks are 64 byte aligned in the file
+   if ( ((size_t)data) & 63 )
+      return 0;
+   return data;
+}
+
+
+
 } // namespace numerix
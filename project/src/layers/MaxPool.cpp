@@ -15,6 +15,7 @@ class MaxPool : public Layer
    int        strideX;
    int        strideY;
 
+   int        batch;
    int        srcW;
    int        srcH;
    int        channels;
@@ -43,13 +44,14 @@ public:
       if (inSrc0->type != Float32)
          TensorThrow("MaxPool only supports Float32 tensors");
 
-      CShape sin = inSrc0->shape;
-      if (sin.size()!=3)
-         TensorThrow("MaxPool only supports H*W*C tensors");
+      if (!inSrc0->isImage())
+         TensorThrow("MaxPool only supports H*W*C or N*H*W*C tensors");
 
-      srcH = sin[0];
-      srcW = sin[1];
-      channels = sin[2];
+      int n = inSrc0->imageBatch();
+      batch = std::max(n,1);
+      srcH = inSrc0->imageHeight();
+      srcW = inSrc0->imageWidth();
+      channels = inSrc0->imageChannels();
 
       destH = 0;
       destW = 0;
@@ -75,21 +77,7 @@ public:
       //printf("MaxPool %dx%d + (%d,%d) %d,%d\n", destW, destW,  filterX, filterY, padOx,padOy);
 
       startRun();
-      bool match = false;
-      if (inBuffer && inBuffer->shape.size()==3 && inBuffer->type==Float32)
-      {
-         CShape s = inBuffer->shape;
-         match = s[0]==destH && s[1]==destW && s[2]==channels;
-      }
-      Tensor *result = inBuffer;
-      if (!match)
-      {
-         Shape s(3);
-         s[0] = destH;
-         s[1] = destW;
-         s[2] = channels;
-         result = new Tensor( Float32, s );
-      }
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, destW, destH, channels, Float32);
 
       src0 = inSrc0;
       destTensor = result;
@@ -116,18 +104,19 @@ public:
 
    void runThreadMulti(int threadId)
    {
-      const int *srcStride = &src0->strides[0];
-      const int *destStride = &destTensor->strides[0];
-      const float *sIn = (const float *)src0->cpuRead();
+      const int *srcStride = src0->imageStrides();
 
+      // A job is an output row of one image in the batch
       while(true)
       {
-         int y = getNextJob();
-         if (y>=destH)
+         int row = getNextJob();
+         if (row>=batch*destH)
             break;
 
-
-         float *dest = (float *)destTensor->cpuWrite() + destW*channels*y;
+         int image = row/destH;
+         int y = row - image*destH;
+         const float *sIn = (const float *)src0->cpuRead() + image*srcH*srcW*channels;
+         float *dest = (float *)destTensor->cpuWrite() + destW*channels*row;
          int srcY = y*strideY;
 
          int dyMin = std::max(padOy-srcY,0);
@@ -17,6 +17,8 @@ class Movidius : public Layer
    std::vector<short> f16buf;
 
 public:
+   bool runsOnCpu() { return false; }
+
    Movidius(const std::string &inDeviceName, const unsigned char *graphData, size_t dataLength, CShape inOutputSize)
    {
       outputShape = inOutputSize;
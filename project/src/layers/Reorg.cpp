@@ -15,6 +15,7 @@ class Reorg : public Layer
    std::vector<int> fromNhwc;
    std::vector<int> fromNchw;
 
+   int batch;
    int srcW;
    int srcH;
    int srcChannels;
@@ -30,52 +31,73 @@ public:
    }
 
 
-   virtual Tensor *run(Tensor *inSrc0, Tensor *inBuffer)
+   void setSizes(Tensor *inSrc0)
    {
-      CShape sin0 = inSrc0->shape;
-      if (sin0.size()!=3)
-         TensorThrow("Reorg - only supports H*W*C tensors");
+      if (!inSrc0->isImage())
+         TensorThrow("Reorg - only supports H*W*C or N*H*W*C tensors");
       if (inSrc0->elementSize!=4)
          TensorThrow("Reorg - only types of size4 supported");
 
+      int h = inSrc0->imageHeight();
+      int w = inSrc0->imageWidth();
+      int c = inSrc0->imageChannels();
+      bool changed = srcH!=h || srcW!=w || srcChannels!=c;
 
-      bool changed = srcH!=sin0[0] || srcW!=sin0[1] || srcChannels!=sin0[2];
-
-      srcH = sin0[0];
-      srcW = sin0[1];
-      srcChannels = sin0[2];
+      // The transform is per image, and applied to each image of a batch
+      batch = std::max(inSrc0->imageBatch(),1);
+      srcH = h;
+      srcW = w;
+      srcChannels = c;
       destW = srcW/stride;
       destH = srcH/stride;
       destChannels = srcChannels * stride * stride;
 
-      Tensor *result = Tensor::makeBuffer(inBuffer, destW, destH, destChannels, inSrc0->type);
-
       if (changed)
          calcTransform();
+   }
+
+   bool getOutputSize(Tensor *inSrc0, int &outW, int &outH, int &outChannels)
+   {
+      setSizes(inSrc0);
+      outW = destW;
+      outH = destH;
+      outChannels = destChannels;
+      return true;
+   }
+
+   virtual Tensor *run(Tensor *inSrc0, Tensor *inBuffer)
+   {
+      setSizes(inSrc0);
+
+      Tensor *result = Tensor::makeBuffer(inBuffer, inSrc0->imageBatch(), destW, destH, destChannels, inSrc0->type);
+      write(inSrc0, result);
+
+      return result;
+   }
 
+   bool runInto(Tensor *inSrc0, Tensor *inSlice)
+   {
+      setSizes(inSrc0);
+      if (inSlice->isGpuNchw() || inSlice->type!=inSrc0->type || inSlice->imageBatch()!=inSrc0->imageBatch() ||
+           inSlice->imageWidth()!=destW || inSlice->imageHeight()!=destH || inSlice->imageChannels()!=destChannels)
+         TensorThrow("Reorg - destination slice does not match the result");
+      write(inSrc0, inSlice);
+      return true;
+   }
+
+   void write(Tensor *inSrc0, Tensor *result)
+   {
       src0 = inSrc0;
       destTensor = result;
 
+      // Perform conversion while single-threaded
       bool nchw = src0->isGpuNchw();
-      if (true)
-      {
-         result->zero();
-      }
-      else if (nchw && false)
-      {
-         reorg_cpu((int *)src0->cpuRead(nchw),  srcW, srcH, srcChannels, stride, (int *)destTensor->cpuWrite(nchw) );
-      }
-      else
-      {
-         // Perform conversion while single-threaded
-         src0->cpuRead(nchw);
-         destTensor->cpuWrite(nchw);
-         runThreaded(true);
-         src0 = 0;
-         destTensor = 0;
-      }
+      src0->cpuRead(nchw);
+      destTensor->cpuWrite(nchw);
+      runThreaded(true);
 
-      return result;
+      src0 = 0;
+      destTensor = 0;
    }
 
    void reorg_cpu(const int *x, int smallW, int smallH, int smallChannels, int stride, int *out)
@@ -156,19 +178,22 @@ public:
    {
       bool nchw = src0->isGpuNchw();
 
-      const int *srcP = (const int *)src0->cpuRead(nchw);
-      int srcRow = src0->strides[0];
-      int *destP = (int *)destTensor->cpuWrite(nchw);
+      int srcRow = src0->imageStrides()[0];
       int rowLen = destW*destChannels;
+      // More than destChannels when writing into a slice
+      int pixelStride = destTensor->imageStrides()[1];
 
       while(true)
       {
-         int y = getNextJob();
-         if (y>=destH)
+         int row = getNextJob();
+         if (row>=batch*destH)
             break;
 
+         int image = row/destH;
+         int y = row - image*destH;
+         const int *srcP = (const int *)src0->cpuRead(nchw) + image*srcH*srcW*srcChannels;
          int offset = y*rowLen;
-         int *d = destP + offset;
+         int *d = (int *)destTensor->cpuWritePart(nchw) + row*destW*pixelStride;
 
          if (false && !nchw)
          {
@@ -194,8 +219,13 @@ public:
          else
          {
             const int *f = nchw ? &fromNchw[offset] : &fromNhwc[offset];
-            for(int i=0;i<rowLen;i++)
-               d[i] = srcP[f[i]];
+            for(int x=0;x<destW;x++)
+            {
+               for(int c=0;c<destChannels;c++)
+                  d[c] = srcP[f[c]];
+               d += pixelStride;
+               f += destChannels;
+            }
          }
       }
    }
@@ -22,17 +22,18 @@ public:
 
    virtual Tensor *run(Tensor *inSrc0, Tensor *inBuffer)
    {
-      CShape sin0 = inSrc0->shape;
-      if (sin0.size()!=3)
-         TensorThrow("Softmax only supports H*W*C tensors");
+      if (!inSrc0->isImage())
+         TensorThrow("Softmax only supports H*W*C or N*H*W*C tensors");
 
-      srcH = sin0[0];
-      srcW = sin0[1];
-      channels = sin0[2];
+      // Each pixel is normalised on its own, so a batch is just more rows
+      int n = inSrc0->imageBatch();
+      srcH = inSrc0->imageHeight()*std::max(n,1);
+      srcW = inSrc0->imageWidth();
+      channels = inSrc0->imageChannels();
 
       startRun();
 
-      Tensor *result = Tensor::makeBuffer(inBuffer, srcW, srcH, channels, inSrc0->type);
+      Tensor *result = Tensor::makeBuffer(inBuffer, n, srcW, inSrc0->imageHeight(), channels, inSrc0->type);
 
       float *dest = (float *)result->cpuWrite(false);
       const float *src = (const float *)inSrc0->cpuRead(false);
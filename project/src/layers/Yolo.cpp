@@ -55,13 +55,19 @@ public:
       dummy->decRef();
    }
 
+   bool canBatch() { return false; }
+
    Tensor *run(Tensor *inSrc0, Tensor *inBuffer)
    {
+      // The boxes are for a single image
+      if (!inSrc0->isImage() || inSrc0->imageBatch()>1)
+         TensorThrow("Yolo only supports H*W*C tensors");
+
       startRun();
       boxes.resize(0);
-      int h = inSrc0->shape[0];
-      int w = inSrc0->shape[1];
-      int channels = inSrc0->shape[2];
+      int h = inSrc0->imageHeight();
+      int w = inSrc0->imageWidth();
+      int channels = inSrc0->imageChannels();
       const float *src = (const float *)inSrc0->cpuRead();
       std::vector<float> softmaxBuf(classCount);
 
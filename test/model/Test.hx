@@ -15,6 +15,8 @@ class Test
       var allowResize = !args.remove("-noresize");
       var showResults = args.remove("-showresults");
       var loop = args.remove("-loop");
+      var int8 = args.remove("-int8");
+      var fp16 = args.remove("-fp16");
 
       for(a in args)
       {
@@ -116,6 +118,17 @@ class Test
          var t0 = haxe.Timer.stamp();
          var result = model.run(val,allowResize);
          println("Warmup Time : " + Std.int((haxe.Timer.stamp()-t0)*1000) + "ms");
+         if (fp16)
+         {
+            println("fp16 weights in " + model.setHalfWeights(true) + " layers");
+            result = model.run(val,allowResize);
+         }
+         if (int8)
+         {
+            // Calibrated on the test image alone - a real deployment would use a sample set
+            println("Quantized " + model.quantizeInt8([val]) + " layers to int8");
+            result = model.run(val,allowResize);
+         }
          if (doTime)
          {
             if (!loop)
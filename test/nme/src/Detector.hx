@@ -2,22 +2,42 @@ import numerix.*;
 import nme.display.BitmapData;
 
 import cpp.vm.Thread;
+import cpp.vm.Deque;
+
+typedef FrameCallbacks = { onImage:BitmapData->Float->Void, onBoxes:Array<Box>->Float->Void };
 
 class Detector
 {
    public var error:String;
+   // Frames handed to runModelAsync and not yet reported - only changed on the main thread
+   public var inFlight(default,null):Int;
+   public var maxInFlight(default,null):Int;
+   // Frames run directly by the work thread - the pipeline must wait for these to finish
+   var directRuns:Int;
    var owner:Main;
    var mainThread:Thread;
    var workThread:Thread;
    var model:Model;
+   var usePipeline:Bool;
+   var pipeline:Pipeline;
+   var pending:Deque<FrameCallbacks>;
 
-   public function new(inOwner:Main, modelname:String)
+   // With inPipeline, async frames go through a numerix.Pipeline once the first has run,
+   //  so several are in flight across the layers at once
+   public function new(inOwner:Main, modelname:String, inPipeline=false)
    {
       owner = inOwner;
+      usePipeline = inPipeline;
+      inFlight = 0;
+      maxInFlight = 1;
+      directRuns = 0;
+      pending = new Deque<FrameCallbacks>();
       mainThread = Thread.current();
       workThread = Thread.create( function() threadLoop(modelname) );
    }
 
+   public function canTakeFrame() return directRuns==0 && inFlight<maxInFlight;
+
    public function run( job:Void->Void )
    {
       workThread.sendMessage(job);
@@ -45,35 +65,95 @@ class Detector
       return null;
    }
 
+   // Call from the main thread when canTakeFrame.  Once pipelined, src is copied straight
+   //  away, otherwise it must not change until a callback arrives.
    public function runModelAsync(src:Tensor, ?onImage:BitmapData->Float->Void, ?onBoxes:Array<Box>->Float->Void )
    {
+      inFlight++;
+      if (pipeline!=null)
+      {
+         pending.add( { onImage:onImage, onBoxes:onBoxes } );
+         pipeline.push(src);
+         return;
+      }
+
+      directRuns++;
       run( function() {
          try
          {
             var t0 = haxe.Timer.stamp();
             var result = model.run(src);
             var t = haxe.Timer.stamp() - t0;
-            if (onBoxes!=null)
-            {
-               var boxes = model.outputLayer.getBoxes();
-               postMain( function() onBoxes(boxes,t) );
-            }
-            if (onImage!=null)
-            {
-               var bmp = getImage(result);
-               postMain( function() onImage(bmp,t) );
-            }
+            var boxes = onBoxes!=null ? model.outputLayer.getBoxes() : null;
+            var bmp = onImage!=null ? getImage(result) : null;
+            // Before the result, so no more frames are run here
+            if (usePipeline)
+               startPipeline(src);
+            postMain( function() {
+               inFlight--;
+               directRuns--;
+               if (onBoxes!=null)
+                  onBoxes(boxes,t);
+               if (onImage!=null)
+                  onImage(bmp,t);
+            } );
          }
          catch(e:Dynamic)
          {
             trace("Error " + haxe.CallStack.exceptionStack().join("\n") );
             error = e;
-            if (onImage!=null)
-               postMain( function() onImage(null,0) );
+            postMain( function() {
+               inFlight--;
+               directRuns--;
+               if (onImage!=null)
+                  onImage(null,0);
+            } );
          }
      } );
    }
 
+   // On the work thread - once the main thread has the pipeline it stops running frames here
+   function startPipeline(sample:Tensor)
+   {
+      usePipeline = false;
+      try
+      {
+         var p = new Pipeline(model, 0, 0, sample);
+         Thread.create( function() resultLoop(p) );
+         postMain( function() {
+            pipeline = p;
+            maxInFlight = p.depth;
+         } );
+      }
+      catch(e:Dynamic)
+      {
+         trace("Running without a pipeline : " + e);
+      }
+   }
+
+   // Frames come out in the order they went in, so match them to the queued callbacks
+   function resultLoop(p:Pipeline)
+   {
+      while(true)
+      {
+         var frame = p.pop(true);
+         if (frame==null)
+            break;
+         var callbacks = pending.pop(true);
+         var t = frame.latencyMs*0.001;
+         var bmp = (callbacks.onImage!=null && !frame.failed) ? getImage(frame.result) : null;
+         if (frame.failed)
+            error = "Pipeline frame " + frame.id + " failed";
+         postMain( function() {
+            inFlight--;
+            if (callbacks.onBoxes!=null && !frame.failed)
+               callbacks.onBoxes(frame.boxes,t);
+            if (callbacks.onImage!=null)
+               callbacks.onImage(bmp,t);
+         } );
+      }
+   }
+
    public function runModelSync(src:Tensor, ?onImage:BitmapData->Float->Void, ?onBoxes:Array<Box>->Float->Void )
    {
       if (error!=null && onImage!=null)
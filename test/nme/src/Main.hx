@@ -24,6 +24,7 @@ class Main extends Sprite
    var resultBmp:Bitmap;
    var mirror:Bool;
    var sync:Bool;
+   var pipeline:Bool;
    var cpu:Bool;
 
    public function new()
@@ -33,6 +34,7 @@ class Main extends Sprite
       var args = Sys.args();
       mirror = args.remove("-mirror") || args.remove("-m");
       sync = args.remove("-sync");
+      pipeline = !sync && args.remove("-pipeline");
       cpu = args.remove("-cpu");
       if (cpu)
          numerix.Model.enableGpu(false);
@@ -104,7 +106,7 @@ class Main extends Sprite
       labelFormat.bold = true;
       labelFormat.font = "_sans";
 
-      detector = new Detector(this,modelName);
+      detector = new Detector(this,modelName,pipeline);
 
       var r = 91131;
       colours = [for(i in 0...80) { r = r*78123 + 123; r & 0xffffff; }  ];
@@ -245,7 +247,7 @@ class Main extends Sprite
             addChild(timeField);
             setBmpSize();
          }
-         if (!detectorBusy)
+         if (!detectorBusy && detector.canTakeFrame())
          {
             if (bmpTensor==null)
             {
@@ -268,7 +270,6 @@ class Main extends Sprite
             }
 
 
-            detectorBusy = true;
             if (sync)
                detector.runModelSync(bmpTensor, onImage /*onBoxes*/ );
             else
@@ -0,0 +1,56 @@
+import numerix.*;
+import Sys.println;
+using StringTools;
+
+class Serve
+{
+   public static function main()
+   {
+      var args = Sys.args();
+
+      var socket = "/tmp/numerix.sock";
+      var maxBatch = 8;
+      var delayMs = 2.0;
+      var instances = 1;
+      for(a in args.copy())
+      {
+         var parts = a.split("=");
+         if (parts.length!=2)
+            continue;
+         switch(parts[0])
+         {
+            case "-socket" : socket = parts[1];
+            case "-batch" : maxBatch = Std.parseInt(parts[1]);
+            case "-delay" : delayMs = Std.parseFloat(parts[1]);
+            case "-instances" : instances = Std.parseInt(parts[1]);
+            default: continue;
+         }
+         args.remove(a);
+      }
+
+      var modelname = args.shift();
+      if (modelname==null)
+      {
+         println("Usage: Serve modelname [-socket=path] [-batch=8] [-delay=ms] [-instances=1]");
+         return;
+      }
+
+      var server = new Server(socket, maxBatch, delayMs);
+      for(i in 0...instances)
+         server.addModel( Model.load(modelname) );
+      server.start();
+      println('Serving $modelname on $socket, batch $maxBatch, delay ${delayMs}ms, $instances instance(s)');
+
+      var last = 0;
+      while(true)
+      {
+         Sys.sleep(5);
+         var stats = server.getStats();
+         if (stats.requests!=last)
+         {
+            last = stats.requests;
+            println(stats);
+         }
+      }
+   }
+}
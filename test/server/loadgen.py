@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+# Load generator for the numerix inference server (see project/include/Server.h)
+#
+#   python3 loadgen.py [-socket /tmp/numerix.sock] [-shape 416,416,3] [-clients 4] [-inflight 2] [-seconds 10]
+#
+# Each client keeps 'inflight' requests of random data outstanding, and the latencies
+#  are reported with the server's own queue/run split and batch sizes.
+
+import socket, struct, threading, time, random, sys, argparse
+
+REQUEST = 0x5152584e
+REPLY = 0x5352584e
+
+def recv_all(sock, n):
+    data = bytearray()
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("server closed the connection")
+        data += chunk
+    return bytes(data)
+
+def client(args, shape, results, stop):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(args.socket)
+    count = shape[0] * shape[1] * shape[2]
+    payload = struct.pack('<%df' % count, *[random.random() for i in range(count)])
+    sent = {}
+    next_id = 0
+
+    def send():
+        nonlocal next_id
+        sent[next_id] = time.time()
+        sock.sendall(struct.pack('<5I', REQUEST, next_id, shape[0], shape[1], shape[2]) + payload)
+        next_id += 1
+
+    for i in range(args.inflight):
+        send()
+    while sent:
+        magic, rid, status, batch, queue_us, run_us, dims = struct.unpack('<7I', recv_all(sock, 28))
+        if magic != REPLY:
+            raise RuntimeError("bad reply")
+        shape_out = struct.unpack('<%dI' % dims, recv_all(sock, 4 * dims)) if dims else ()
+        size = 4
+        for d in shape_out:
+            size *= d
+        # A successful reply always has data - one float for a scalar result
+        if status == 0:
+            recv_all(sock, size)
+        latency = time.time() - sent.pop(rid)
+        results.append((latency, status, batch, queue_us, run_us))
+        if not stop.is_set():
+            send()
+    sock.close()
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))]
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-socket', default='/tmp/numerix.sock')
+    parser.add_argument('-shape', default='416,416,3')
+    parser.add_argument('-clients', type=int, default=4)
+    parser.add_argument('-inflight', type=int, default=2)
+    parser.add_argument('-seconds', type=float, default=10)
+    args = parser.parse_args()
+    shape = [int(s) for s in args.shape.split(',')]
+
+    results = []
+    stop = threading.Event()
+    threads = [threading.Thread(target=client, args=(args, shape, results, stop)) for c in range(args.clients)]
+    t0 = time.time()
+    for t in threads:
+        t.start()
+    time.sleep(args.seconds)
+    stop.set()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - t0
+
+    if not results:
+        print("no replies")
+        return 1
+    latency = [r[0] * 1000 for r in results]
+    errors = sum(1 for r in results if r[1] != 0)
+    print("%d requests in %.1fs : %.1f/s, %d errors" % (len(results), elapsed, len(results) / elapsed, errors))
+    print("latency ms  mean %.2f  p50 %.2f  p90 %.2f  p99 %.2f" % (sum(latency) / len(latency),
+          percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99)))
+    print("server      batch %.2f  queue %.2fms  run %.2fms" % (sum(r[2] for r in results) / len(results),
+          sum(r[3] for r in results) / len(results) / 1000, sum(r[4] for r in results) / len(results) / 1000))
+    return 1 if errors else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -5,6 +5,13 @@ class Test
 {
    public static function main()
    {
+      testPlannedBranches();
+      testGemm();
+      testWinograd();
+      testBatch();
+      testInt8();
+      testFusion();
+      testConcatSlices();
       //testConv();
       //testOpenCl();
       testOpenCl_1x1();
@@ -41,6 +48,372 @@ class Test
 
 
 
+   // A ResNet projection block - conv1 -> conv2 beside proj, then the sum.  With memoryPlan,
+   //  proj reuses conv1's memory, while the graph runs the branches at the same time.
+   static function testPlannedBranches()
+   {
+      Model.enableGpu(false);
+      Model.setWorkerBranches(true);
+
+      var src = Nx.zeros([40,40,32]);
+      for(s in 0...src.elementCount)
+         src[s] = (s%37)*0.05 - 0.9;
+
+      var refResult:Array<Float> = null;
+      for(plan in [false,true])
+      {
+         var model = new Model();
+         model.planMemory = plan;
+         var inputLayer = model.makeInputLayer();
+
+         function conv(input:Layer, size:Int, seed:Int)
+         {
+            var cfg = { activation:'relu', kernelSize:[size,size], filters:32, padding:'same',
+                        strides:[1,1], allowTransform:false };
+            var weights = Nx.zeros([32,size,size,32]);
+            for(w in 0...weights.elementCount)
+               weights[w] = ((w*seed)%19)*0.01 - 0.09;
+            var conv2D = new Conv2D(cfg,input);
+            conv2D.setWeights( [weights,Nx.zeros([32])] );
+            model.addLayer(conv2D);
+            return conv2D;
+         }
+         var stem = conv(inputLayer, 1, 3);
+         var conv2 = conv( conv(stem, 3, 5), 3, 7 );
+         var proj = conv(stem, 1, 11);
+         var sum = new Eltwise({ }, conv2, proj);
+         model.addLayer(sum);
+
+         for(run in 0...6)
+         {
+            var result = model.run(src);
+            if (refResult==null)
+            {
+               refResult = [ for(i in 0...result.elementCount) result[i] ];
+               continue;
+            }
+            var errorCount = 0;
+            for(i in 0...refResult.length)
+               if (Math.abs(refResult[i]-result[i])>0.001)
+                  errorCount++;
+            if (errorCount==0)
+               Sys.println('Verified planMemory=$plan run $run');
+            else
+               Sys.println('Errors planMemory=$plan run $run ' + errorCount + "/" + refResult.length);
+         }
+      }
+   }
+
+
+
+   // Deterministic values in [-1,1)
+   static function fill(t:Tensor, seed:Int)
+   {
+      for(i in 0...t.elementCount)
+         t[i] = ((i*seed + 7)%41)*0.05 - 1.0;
+   }
+
+   static function convModel(weights:Tensor, bias:Tensor, stride:Int, leaky:Bool, allowTransform:Bool)
+   {
+      var model = new Model();
+      var inputLayer = model.makeInputLayer();
+      var cfg = { activation:leaky ? 'leaky' : 'linear', kernelSize:[weights.shape[1],weights.shape[2]],
+                  filters:weights.shape[0], padding:'same', strides:[stride,stride],
+                  allowTransform:allowTransform };
+      var conv2D = new Conv2D(cfg,inputLayer);
+      conv2D.setWeights( [weights,bias] );
+      model.addLayer(conv2D);
+      return model;
+   }
+
+   // The convolution the slow way, for an H*W*C image - 'same' padding puts (filter-1)/2 before
+   static function directConv(src:Tensor, weights:Tensor, bias:Tensor, stride:Int, leaky:Bool) : Array<Float>
+   {
+      var h = src.shape[0];
+      var w = src.shape[1];
+      var inputs = src.shape[2];
+      var outputs = weights.shape[0];
+      var fh = weights.shape[1];
+      var fw = weights.shape[2];
+      var destH = Std.int((h+stride-1)/stride);
+      var destW = Std.int((w+stride-1)/stride);
+      var padY = (fh-1)>>1;
+      var padX = (fw-1)>>1;
+
+      var s = [ for(i in 0...src.elementCount) src[i] ];
+      var wt = [ for(i in 0...weights.elementCount) weights[i] ];
+      var result = new Array<Float>();
+      for(y in 0...destH)
+         for(x in 0...destW)
+            for(o in 0...outputs)
+            {
+               var sum:Float = bias[o];
+               for(fy in 0...fh)
+               {
+                  var sy = y*stride - padY + fy;
+                  if (sy<0 || sy>=h)
+                     continue;
+                  for(fx in 0...fw)
+                  {
+                     var sx = x*stride - padX + fx;
+                     if (sx<0 || sx>=w)
+                        continue;
+                     var sIdx = (sy*w + sx)*inputs;
+                     var wIdx = ((o*fh + fy)*fw + fx)*inputs;
+                     for(i in 0...inputs)
+                        sum += s[sIdx+i] * wt[wIdx+i];
+                  }
+               }
+               result.push( leaky && sum<0 ? sum*0.1 : sum );
+            }
+      return result;
+   }
+
+   // As testOpenCl_1x1, with the tolerance relative to the largest reference value
+   static function checkResult(label:String, refResult:Array<Float>, result:Tensor, tolerance:Float)
+   {
+      var scale = 1.0;
+      for(r in refResult)
+         scale = Math.max(scale, Math.abs(r));
+
+      var errorCount = 0;
+      if (result.elementCount!=refResult.length)
+      {
+         Sys.println('Bad size ' + result.shape);
+         errorCount = refResult.length;
+      }
+      else
+         for(idx in 0...refResult.length)
+            if (Math.abs(refResult[idx]-result[idx])>tolerance*scale)
+            {
+               if (errorCount==0)
+                  Sys.println('Bad index $idx, ' + refResult[idx] + "!=" + result[idx] + " d=" + (refResult[idx]-result[idx]) );
+               else if (errorCount==1)
+                  Sys.println(" +..");
+               errorCount++;
+            }
+      if (errorCount==0)
+         Sys.println('Verified $label ' + result.shape);
+      else
+         Sys.println('Errors $label ' + errorCount + "/" + refResult.length);
+   }
+
+
+
+   // The packed gemm, which runs everything but Winograd, against directConv.  The channel
+   //  counts leave partial panels and partial blocks of k.
+   static function testGemm()
+   {
+      Model.enableGpu(false);
+
+      // size, stride, inputs, outputs
+      for(test in [ [1,1,37,29], [3,1,13,40], [3,2,64,17], [5,1,3,8], [1,2,300,7] ])
+      {
+         var size = test[0];
+         var stride = test[1];
+         var src = Nx.zeros([19,23,test[2]]);
+         var weights = Nx.zeros([test[3],size,size,test[2]]);
+         var bias = Nx.zeros([test[3]]);
+         fill(src,3);
+         fill(weights,5);
+         fill(bias,7);
+
+         var model = convModel(weights, bias, stride, true, false);
+         checkResult('gemm ${size}x$size/$stride ${test[2]}>${test[3]}',
+                     directConv(src, weights, bias, stride, true), model.run(src), 1e-4);
+      }
+   }
+
+
+
+   // Each Winograd transform against directConv, over images that end in partial tiles and
+   //  channel counts that are not a multiple of the vector width
+   static function testWinograd()
+   {
+      Model.enableGpu(false);
+
+      for(algo in ["wino2", "wino4", "wino6"])
+      {
+         Model.setConvAlgo(algo);
+         // height, width, inputs, outputs
+         for(test in [ [13,11,3,5], [20,17,70,33], [9,9,130,16] ])
+         {
+            var src = Nx.zeros([test[0],test[1],test[2]]);
+            var weights = Nx.zeros([test[3],3,3,test[2]]);
+            var bias = Nx.zeros([test[3]]);
+            fill(src,3);
+            fill(weights,5);
+            fill(bias,7);
+
+            var model = convModel(weights, bias, 1, true, true);
+            checkResult('$algo ${test[0]}x${test[1]} ${test[2]}>${test[3]}',
+                        directConv(src, weights, bias, 1, true), model.run(src), 1e-4);
+         }
+      }
+      Model.setConvAlgo(null);
+   }
+
+
+
+   // runBatch, which runs the images as one N*H*W*C tensor, against directConv on each image,
+   //  and against running them one at a time
+   static function testBatch()
+   {
+      Model.enableGpu(false);
+
+      // size, stride, inputs, outputs - the 3x3 may choose Winograd
+      for(test in [ [3,1,16,24], [1,2,37,29] ])
+      {
+         var size = test[0];
+         var stride = test[1];
+         var weights = Nx.zeros([test[3],size,size,test[2]]);
+         var bias = Nx.zeros([test[3]]);
+         fill(weights,5);
+         fill(bias,7);
+         var images = [ for(i in 0...3) Nx.zeros([13,11,test[2]]) ];
+         for(i in 0...images.length)
+            fill(images[i],3+i*2);
+         var refResults = [ for(image in images) directConv(image, weights, bias, stride, true) ];
+
+         var model = convModel(weights, bias, stride, true, true);
+         var label = '${size}x$size/$stride ${test[2]}>${test[3]}';
+         var results = model.runBatch(images);
+         for(i in 0...images.length)
+            checkResult('batch $label image $i', refResults[i], results[i], 1e-4);
+         for(i in 0...images.length)
+            checkResult('single $label image $i', refResults[i], model.run(images[i]), 1e-4);
+      }
+   }
+
+
+
+   // quantizeInt8 against the Float32 directConv - the int8 inputs and weights keep about 2
+   //  significant figures, so the tolerance is a few percent of the output range
+   static function testInt8()
+   {
+      Model.enableGpu(false);
+
+      // size, stride, inputs, outputs
+      for(test in [ [3,1,32,24], [1,1,64,40], [3,2,13,17] ])
+      {
+         var size = test[0];
+         var stride = test[1];
+         var src = Nx.zeros([17,19,test[2]]);
+         var weights = Nx.zeros([test[3],size,size,test[2]]);
+         var bias = Nx.zeros([test[3]]);
+         fill(src,3);
+         fill(weights,5);
+         fill(bias,7);
+
+         var model = convModel(weights, bias, stride, true, true);
+         var label = 'int8 ${size}x$size/$stride ${test[2]}>${test[3]}';
+         if (model.quantizeInt8([src])!=1)
+            Sys.println('Errors $label not quantized');
+         else
+            checkResult(label, directConv(src, weights, bias, stride, true), model.run(src), 0.03);
+      }
+   }
+
+
+
+   static function seededConv(input:Layer, size:Int, inputs:Int, outputs:Int, seed:Int, activation:String)
+   {
+      var weights = Nx.zeros([outputs,size,size,inputs]);
+      var bias = Nx.zeros([outputs]);
+      fill(weights,seed);
+      fill(bias,seed+2);
+      var cfg = { activation:activation, kernelSize:[size,size], filters:outputs, padding:'same',
+                  strides:[1,1], allowTransform:true };
+      var conv2D = new Conv2D(cfg,input);
+      conv2D.setWeights( [weights,bias] );
+      return conv2D;
+   }
+
+   // stem -> conv -> sum(conv,stem) + leaky -> 2x2 maxpool, which fuseConvolutions folds
+   //  into the second conv, against the same layers run one at a time
+   static function fusionModel(fuse:Bool)
+   {
+      var model = new Model();
+      model.fuseLayers = fuse;
+      var stem = seededConv(model.makeInputLayer(), 3, 8, 24, 5, 'leaky');
+      model.addLayer(stem);
+      var conv = seededConv(stem, 3, 24, 24, 11, 'linear');
+      model.addLayer(conv);
+      var sum = new Eltwise({}, conv, stem);
+      sum.setActivation(Layer.ACT_LEAKY);
+      model.addLayer(sum);
+      model.addLayer( new MaxPool({kernelSize:[2,2], strides:[2,2], padding:'same'}, sum) );
+      model.optimizeLayers();
+      return { model:model, conv:conv };
+   }
+
+   static function testFusion()
+   {
+      Model.enableGpu(false);
+
+      var unfused = fusionModel(false);
+      var fused = fusionModel(true);
+      if (!fused.conv.fusedSum || fused.conv.fusedPool==null || unfused.conv.fusedSum)
+         Sys.println("Errors fusion - sum and pool not folded into the convolution");
+
+      // Odd sizes exercise the padded last row and column of the pool
+      for(size in [ [13,11], [16,16] ])
+      {
+         var src = Nx.zeros([size[0],size[1],8]);
+         fill(src,3);
+         var ref = unfused.model.run(src);
+         var refResult = [ for(i in 0...ref.elementCount) ref[i] ];
+         checkResult('fused conv+sum+pool $size', refResult, fused.model.run(src), 1e-4);
+      }
+   }
+
+
+
+   // stem -> reorg, and stem -> conv -> 2x2 maxpool, concatenated then a 1x1 conv.  Fused, the
+   //  concat runs the reorg and the conv+pool itself, each writing into its channel slice
+   static function concatModel(fuse:Bool)
+   {
+      var model = new Model();
+      model.fuseLayers = fuse;
+      var stem = seededConv(model.makeInputLayer(), 3, 8, 16, 5, 'leaky');
+      model.addLayer(stem);
+      var reorg = new Reorg({stride:2}, stem);
+      model.addLayer(reorg);
+      var conv = seededConv(stem, 3, 16, 32, 11, 'leaky');
+      model.addLayer(conv);
+      var pool = new MaxPool({kernelSize:[2,2], strides:[2,2], padding:'same'}, conv);
+      model.addLayer(pool);
+      var concat = new Concat({}, reorg, pool);
+      model.addLayer(concat);
+      model.addLayer( seededConv(concat, 1, 96, 24, 13, 'linear') );
+      model.optimizeLayers();
+      return { model:model, concat:concat };
+   }
+
+   static function testConcatSlices()
+   {
+      Model.enableGpu(false);
+
+      var unfused = concatModel(false);
+      var fused = concatModel(true);
+      if (fused.concat.fusedInputs[0]==null || fused.concat.fusedInputs[1]==null ||
+             unfused.concat.fusedInputs[0]!=null)
+         Sys.println("Errors concat - reorg and conv not fused into the concat slices");
+
+      for(size in [ [26,26], [18,22] ])
+      {
+         var src = Nx.zeros([size[0],size[1],8]);
+         fill(src,3);
+         var ref = unfused.model.run(src);
+         var refResult = [ for(i in 0...ref.elementCount) ref[i] ];
+         // Run twice, so the second writes into the slices of an existing result
+         fused.model.run(src);
+         checkResult('fused concat slices $size', refResult, fused.model.run(src), 1e-4);
+      }
+   }
+
+
+
    static function testOpenCl_3x3()
    {
       Model.enableGpu(false);